@@ -0,0 +1,11 @@
+# FindLZ4.cmake
+# --
+# Find the LZ4 compression library
+#
+# This module defines:
+#   LZ4_INCLUDE_DIRS - where to find lz4.h
+#   LZ4_LIBRARIES    - the lz4 library
+#   LZ4_FOUND        - True if LZ4 was found
+
+Include(FindModule)
+FIND_MODULE(LZ4 lz4.h "" "" lz4 "" "")
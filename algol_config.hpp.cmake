@@ -11,6 +11,7 @@
 #cmakedefine ALGOL_LUA_BINDINGS
 #cmakedefine ALGOL_MESSAGING
 #cmakedefine ALGOL_ANALYTICS
+#cmakedefine ALGOL_LZ4
 #cmakedefine ALGOL_ADMIN
 
 #endif
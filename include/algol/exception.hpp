@@ -76,6 +76,22 @@ namespace algol {
 		{ }
 	};
 
+  /* thrown through the future of a messaging request that was not replied to in time */
+  class request_timeout : public std::runtime_error {
+  public:
+    inline request_timeout(const std::string& s)
+    : std::runtime_error(s)
+    { }
+  };
+
+  /* thrown through the future of a messaging request that could not be sent */
+  class request_failed : public std::runtime_error {
+  public:
+    inline request_failed(const std::string& s)
+    : std::runtime_error(s)
+    { }
+  };
+
   namespace analytics {
 
     /**
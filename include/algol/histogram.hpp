@@ -0,0 +1,91 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_HISTOGRAM_H
+#define H_ALGOL_HISTOGRAM_H
+
+#include "algol/algol.hpp"
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+namespace algol {
+
+  /**
+   * @class histogram
+   * @brief
+   * A distribution of non-negative integer values (e.g., latencies in
+   * microseconds) with a bounded relative error, in the manner of HdrHistogram.
+   *
+   * Values are counted in buckets that double in width every octave, each
+   * octave split into 2^precision_bits sub-buckets, so a value is reported
+   * within 1/2^precision_bits of itself however large it is. Values below
+   * 2^(precision_bits+1) are counted exactly, and values above max_value are
+   * counted as max_value.
+   *
+   * Recording is lock-free and can be done from any number of threads.
+   */
+  class histogram {
+  public:
+    /** the sub-buckets per octave are 2^precision_bits, for a ~3% error */
+    static const unsigned precision_bits = 5;
+
+    /** the largest value tracked, about 12 days in microseconds */
+    static const uint64_t max_value = (1ull << 40) - 1;
+
+    histogram();
+    histogram(const histogram&) = delete;
+    histogram& operator=(const histogram&) = delete;
+
+    void record(uint64_t value);
+
+    /** the number of values recorded */
+    uint64_t count() const;
+
+    uint64_t min() const;
+    uint64_t max() const;
+    double mean() const;
+
+    /**
+     * The value that the given percentage of the recorded values are less
+     * than or equal to; e.g., percentile(99.9).
+     *
+     * @return 0 if nothing was recorded
+     */
+    uint64_t percentile(double) const;
+
+    void reset();
+
+  private:
+    friend class histogram_test;
+
+    static size_t index_of(uint64_t value);
+
+    /** the largest value counted in the bucket */
+    static uint64_t highest_in(size_t index);
+
+    std::vector<std::atomic<uint64_t> > counts_;
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> min_;
+    std::atomic<uint64_t> max_;
+  };
+
+} // namespace algol
+
+#endif // H_ALGOL_HISTOGRAM_H
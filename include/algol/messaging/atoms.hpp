@@ -0,0 +1,66 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_MESSAGING_ATOMS_H
+#define H_ALGOL_MESSAGING_ATOMS_H
+
+#include "algol/algol.hpp"
+#include "algol/messaging/types.hpp"
+
+namespace algol {
+
+  /**
+   * \addtogroup Messaging
+   * @{
+   * @class atoms
+   * @brief
+   * The global table of interned channel and queue names.
+   *
+   * Every distinct name is given a small integer, its atom, the first time
+   * it's interned, and keeps it for the lifetime of the process. Routing
+   * deliveries and looking up subscribers then compares integers rather than
+   * strings. Looking an atom's name up never blocks.
+   */
+  class atoms {
+  public:
+    /** the atom of no name */
+    static const atom_t none = 0;
+
+    /** the most names that can be interned */
+    static const atom_t capacity = 1 << 22;
+
+    /**
+     * The atom of the name, interning it the first time it's seen.
+     *
+     * @throw std::length_error if the table is full
+     */
+    static atom_t intern(string_t const&);
+
+    /** The name interned as the atom; an empty string for atoms::none. */
+    static string_t const& name(atom_t);
+
+    /** The number of interned names. */
+    static size_t size();
+
+  private:
+    atoms() = delete;
+  };
+
+  /** @} */
+} // end of namespace algol
+
+#endif
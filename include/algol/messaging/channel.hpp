@@ -20,21 +20,36 @@
 
 #include "algol/algol.hpp"
 #include "algol/logger.hpp"
+#include "algol/monitor.hpp"
 #include "algol/messaging/types.hpp"
 
+#include "algol/messaging/message.hpp"
+#include "algol/messaging/envelope.hpp"
+#include "algol/messaging/spool.hpp"
+#include "algol/messaging/routing_trie.hpp"
+#include "algol/messaging/link.hpp"
+#include "algol/messaging/epochs.hpp"
+
 #include <list>
 #include <map>
+#include <deque>
+#include <set>
+#include <vector>
+#include <atomic>
 #include <stdint.h>
 
 #include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/interprocess_condition.hpp>
 #include <boost/interprocess/sync/scoped_lock.hpp>
 
 namespace algol {
 
   class communicator;
-  class message;
   class station;
+  class dedup_filter;
+  class message_pool;
 
   /**
    * \addtogroup Messaging
@@ -50,19 +65,56 @@ namespace algol {
    * Communicator instances can not send messages on their own, only through
    * channels. When an inbound message is queued within a channel, all
    * subscribers are notified.
+   *
+   * A channel and each of its queue consumers run on their own AMQP channel
+   * number over one of the station's shared broker connections (see link).
+   * When a connection is lost, or the broker closes one of them, a
+   * recoverer thread reopens them on another connection: the exchange and
+   * the queues are declared again, the consumers start over, and the spool
+   * replays what wasn't confirmed. It retries with a back-off while the
+   * broker can't be reached.
+   *
+   * The channel's exchange is declared with the type it's opened with, see
+   * exchange_t. Every subscribed queue is bound to it by its name, which on
+   * topic channels is a binding pattern (like "orders.*.eu") rather than a
+   * routing key; a message matching several of them is delivered once per
+   * queue.
+   *
+   * The subscriber table is an immutable snapshot: subscription changes
+   * build and publish a new one, while dispatching reads the current one
+   * without taking any lock. Replaced snapshots are reclaimed once no reader
+   * is left that could still be looking at them. On topic channels, each
+   * snapshot comes with the routing_trie of its queues, which routes the
+   * messages delivered in-process.
    */
-  class channel : public logger {
+  class channel : public logger, public link::handler {
   public:
-    typedef std::list<communicator*> queue_subscribers_t;
-    typedef std::map<queue_id_t, queue_subscribers_t> subscribers_t;
+    typedef std::vector<communicator*> queue_subscribers_t;
+
+    /** a queue's subscribers, and the histograms of its deliveries */
+    struct queue_t {
+      queue_t() : latency(nullptr), handling(nullptr) {}
+
+      queue_subscribers_t subscribers;
+      histogram*          latency;  /// publish to dispatch, in microseconds
+      histogram*          handling; /// the subscribers' handling time, in microseconds
+    };
 
-    channel(channel_id_t);
+    typedef std::map<atom_t, queue_t> subscribers_t; /// keyed by the queues' atoms
+
+    explicit channel(channel_id_t, exchange_t = exchange_t::direct);
     channel(const channel&) = delete;
     channel& operator=(const channel&) = delete;
     virtual ~channel();
 
     channel_id_t const& id() const;
 
+    /** The interned identifier, see atoms */
+    atom_t atom() const;
+
+    /** The type of the exchange the channel publishes to */
+    exchange_t exchange_type() const;
+
     /**
      * Adds a communicator instance to the party that will be notified
      * whenever a message is delivered to the specified queue.
@@ -71,18 +123,22 @@ namespace algol {
 
     /**
      * Removes the communicator subscription from a queue.
+     *
+     * Once it returns, the handlers dispatching with the old subscriptions
+     * are done and the communicator can be destroyed; unless it's called
+     * from a handler, which can't wait for the others as they might be
+     * waiting for it.
      */
     virtual bool unsubscribe(queue_id_t const&, communicator*);
 
     /**
-     * Removes the communicator instance from all queue subscriptions.
+     * Removes the communicator instance from all queue subscriptions; it
+     * waits for the handlers like unsubscribe() does.
      */
     virtual void unsubscribe_all(communicator*);
 
     virtual bool is_subscribed(queue_id_t const&, communicator*) const;
 
-    // virtual subscribers_t const& subscribers() const;
-
     /**
      * Is this channel open for publishing messages?
      */
@@ -90,61 +146,466 @@ namespace algol {
 
     /**
      * Publishes the given message to the destination queue in this channel.
+     *
+     * When batched or asynchronous publishing is enabled (see
+     * station::config_t::publish_batch_size and publish_async) the message is
+     * only queued here and the call returns comm_rc::queued; the sender is
+     * notified through communicator::on_message_sent() once the message is
+     * written, or confirmed (or rejected) by the broker when batching. A full
+     * queue is handled as station::config_t::outbound_overflow says.
+     *
+     * When spooling (see station::config_t::spool_dir) the message is written
+     * to the channel's spool instead, and the call returns comm_rc::spooled,
+     * comm_rc::queue_full if the spool is full, or comm_rc::spool_failed if
+     * it could not be written; the sender is notified either way.
+     *
+     * @return the outcome of the publishing, comm_rc::queued or comm_rc::spooled
+     */
+    comm_rc publish(communicator*, const message&, const string_t &queue);
+
+    /**
+     * Compresses the contents of the messages published on this channel that
+     * are at least threshold bytes large, see codec::compress(). The defaults
+     * are taken from station::config_t::compression.
+     *
+     * Consumers restore compressed contents before dispatching them.
+     *
+     * @return false if the codec is unknown or not built in
      */
-    void publish(const communicator*, const message&, const string_t &queue);
+    bool set_compression(string_t const& codec, int level, size_t threshold);
 
-    /** The underlying connection object */
+    /**
+     * Whether the deliveries of the queue are dispatched in the order of their
+     * priority (see message::set_priority()) rather than in the order they
+     * were received; off by default. It can be changed at any time, whether
+     * the queue is consumed yet or not.
+     *
+     * @note
+     * Priorities only reorder the deliveries waiting for the station's
+     * dispatcher, see executor; they have no effect without dispatch threads.
+     */
+    void set_dispatch_priorities(queue_id_t const& queue, bool);
+
+    /**
+     * The number of consumers the queue is consumed by, 1 by default. Each
+     * one runs on its own AMQP channel, on a connection of its own if the
+     * station's pool has room (see station::config_t::connections), and the
+     * broker spreads the queue's deliveries among them.
+     *
+     * If the queue is consumed already, the missing consumers are started;
+     * lowering the number only applies the next time it's consumed.
+     */
+    void set_shards(queue_id_t const& queue, size_t);
+
+    /**
+     * Declares the queue exclusive to its connection and deleted along with
+     * it, whatever the channel's durable and passive flags, so that a queue
+     * only this process consumes (like the replies to its requests, see
+     * communicator::request()) needs no declaring beforehand and doesn't
+     * outlive it on the broker. An exclusive queue has a single consumer.
+     *
+     * It only applies the next time the queue is consumed.
+     */
+    void set_exclusive(queue_id_t const& queue);
+
+    /**
+     * Drops any reference to the given communicator held by messages that are
+     * still queued or awaiting a confirm; their delivery reports are discarded.
+     */
+    void release(communicator*);
+
+    /** The underlying connection object, shared with other channels */
     amqp_connection_state_t& __connection();
 
-    /** The underlying socket fd */
+    /** The underlying socket fd, shared with other channels */
     int __socket();
 
+    /** handles the publisher confirms */
+    virtual void on_frame(amqp_frame_t const&);
+
+    /** fails every message still awaiting a confirm, and has the channel reopened, see recover() */
+    virtual void on_link_lost();
+
+    /** messages queued by all channels for asynchronous sending */
+    static monitor::stat_id stat_outbound_depth;
+
+    /** messages discarded because their outbound queue was full */
+    static monitor::stat_id stat_outbound_drops;
+
+    /** messages refused because their outbound queue was full */
+    static monitor::stat_id stat_outbound_refusals;
+
+    /** sends that had to wait for room in their outbound queue */
+    static monitor::stat_id stat_outbound_waits;
+
+    /** times channels were reopened, or had their consumers restarted, after losing them */
+    static monitor::stat_id stat_recoveries;
+
   protected:
     /** dispatches the received message to all subscribed communicators */
     void dispatch(const message&);
 
     friend class station;
+    friend class loopback;
 
-    /** establishes a connection with the broker and opens a publishing channel */
+    /** opens a publishing channel on one of the station's broker connections */
     void open(int durable = 1, int passive = 1);
 
     /**
-     * Launches a thread that will listen to the given queue for any messages
-     * and dispatch them to the subscribed party members.
+     * Starts the consumers of the given queue that aren't running yet, each
+     * on a channel of its own; deliveries are dispatched to the subscribed
+     * party members. See set_shards().
+     *
+     * @throw connection_error if the queue could not be declared or consumed
+     * by any consumer
      */
     void accept(string_t const& queue);
 
-    /** destroys all links with the broker and disconnects from the messaging platform */
+    /** microseconds since the epoch, the resolution of message::sent_header */
+    static uint64_t now_us();
+
+    /** stops all consumers and closes the publishing channel */
     void close();
 
+    /**
+     * declares the channel's exchange on the given AMQP channel, and turns
+     * publisher confirms on if they're needed
+     *
+     * @throw connection_error if any of the broker RPCs fails
+     */
+    void declare(link*, amqp_channel_t);
+
+    /** notifies the senders of every message awaiting a confirm that it's lost */
+    void fail_unconfirmed();
+
+    /** has the recoverer look for what was lost, starting it if it's not running */
+    void schedule_recovery();
+
+    /** the body of the recoverer thread, it retries recover() until it succeeds */
+    void recover_lost();
+
+    /**
+     * Reopens the publishing channel if it was lost, and starts the lost
+     * consumers over, each on a connection that's still open.
+     *
+     * @return false if any of it failed
+     */
+    bool recover();
+
+    /**
+     * moves the publishing channel to a new AMQP channel on an open
+     * connection, and has the spool replay what wasn't confirmed on it
+     *
+     * @throw connection_error if it could not be opened
+     */
+    void reopen();
+
+    /**
+     * Hands a copy of the message to the loopback transport for each queue
+     * the routing key routes it to that has subscribers in this process.
+     *
+     * @param queue the atom of the routing key on direct channels, unused otherwise
+     *
+     * @return true if the message was delivered locally
+     */
+    bool publish_locally(const message&, string_t const& routing_key, atom_t queue);
+
+    /** hands a copy of the message, routed to the given queue, to the loopback transport */
+    bool deliver_locally(const message&, string_t const& routing_key, atom_t queue);
+
+    /** the key that orders the dispatching of the message, see station::config_t::dispatch_ordering */
+    static size_t ordering_key(const message&);
+
+    /**
+     * serializes the message and writes it to the broker, must be called with publishing_mtx_ held
+     *
+     * @param sent_us the time the message was handed to us, stamped as its message::sent_header
+     */
+    comm_rc transmit(const message&, const string_t &queue, uint64_t sent_us);
+
+    /** the body of the flusher thread used in batched, asynchronous and enveloped publishing modes */
+    void flush_outbound();
+
+    /** the number of queued messages the flusher waits for before it writes them */
+    size_t flush_size() const;
+
+    /**
+     * transmits the message, or the envelope the given members were packed
+     * into, and tracks it for confirmation; must be called with publishing_mtx_ held
+     */
+    void write(const message&, const message* members, size_t nr_members);
+
+    /** packs the small messages of the batch into envelopes by queue, and writes everything */
+    void write_enveloped(std::vector<message> const& batch);
+
+    /** writes the envelope (or its sole member as it is) and empties it */
+    void write_envelope(envelope&);
+
+    /**
+     * Replaces the subscriber table with the given one, which the channel
+     * takes ownership of, and compiles its routes on topic channels; must be
+     * called with subscription_mtx_ held.
+     *
+     * @return the epoch the replaced table is retired at; the readers still
+     * holding it are done once readers_ has passed it
+     */
+    uint64_t publish_subscribers(subscribers_t*);
+
+    /** frees the retired tables no reader can hold anymore; must be called with subscription_mtx_ held */
+    void reclaim();
+
+    /** notifies the senders of every message up to (or exactly at) the given tag */
+    void confirm(uint64_t delivery_tag, bool multiple, comm_rc);
+
+    /**
+     * Queues the message for the flusher, making room for it as the overflow
+     * policy says if the queue is full.
+     *
+     * @return comm_rc::queued, comm_rc::queue_full if it was refused,
+     * comm_rc::dropped if it was discarded to make room, or
+     * comm_rc::link_unavailable if the channel was closed while waiting for
+     * room; the sender is notified of all three
+     */
+    comm_rc enqueue(communicator*, const message&, atom_t queue);
+
+
     int is_durable_;
     int is_passive_;
 
   private:
     channel_id_t  id_;
+    atom_t        atom_;
+    exchange_t    exchange_;
     bool          open_;
-    subscribers_t subscribers_;
+    bool          loopback_;      /// deliver to local subscribers in-process
+    bool          loopback_only_; /// and never to the broker
 
-    amqp_connection_state_t conn_;
-    int                     socket_;
+    codec::algorithm_t compression_;
+    int                compression_level_;
+    size_t             compression_threshold_;
 
-    boost::thread_group acceptors_;
-    boost::interprocess::interprocess_mutex subscription_mtx_;
+    spool              *spool_; /// the messages published to the broker go through it, if spooling
+
+    /**
+     * Pins the current subscriber table for as long as it's in scope; any
+     * number of readers can do that concurrently with writers.
+     */
+    class subscribers_snapshot {
+    public:
+      explicit subscribers_snapshot(channel const&);
+      ~subscribers_snapshot();
+
+      inline subscribers_t const* operator->() const { return table_; }
+      inline subscribers_t const& operator*() const { return *table_; }
+
+      /** the routes of the table, null unless the channel is a topic one */
+      inline routing_trie const* routes() const { return routes_; }
+    private:
+      epochs::guard        pin_;
+      subscribers_t const* table_;
+      routing_trie const*  routes_;
+    };
+
+    /** a replaced table and its routes, which might still be read */
+    struct retired_t {
+      uint64_t              epoch;
+      subscribers_t const*  table;
+      routing_trie const*   routes;
+    };
+
+    std::atomic<subscribers_t const*> subscribers_;
+    std::atomic<routing_trie const*>  routes_;   /// published along with the table on topic channels
+    epochs                            readers_;  /// the snapshots pinned at the moment
+    std::vector<retired_t>            retired_;  /// guarded by subscription_mtx_
+
+    link                    *link_;
+    amqp_channel_t          ch_;
+
+    boost::interprocess::interprocess_mutex subscription_mtx_; /// serializes the writers of the subscriber table
     boost::interprocess::interprocess_mutex publishing_mtx_;
 
+    typedef std::deque<message> outbound_t;
+    typedef std::multimap<uint64_t, message> unconfirmed_t;
+
+    enum class overflow_t : uint8_t {
+      block,
+      drop_oldest,
+      drop_newest,
+      fail
+    };
+
+    bool          flushing_;
+    bool          confirming_;    /// whether the broker confirms the messages the flusher writes
+    bool          enveloping_;    /// whether the flusher packs small messages into envelopes
+    size_t        envelope_threshold_;
+    size_t        envelope_max_bytes_;
+    size_t        outbound_capacity_;
+    overflow_t    overflow_;
+    boost::thread flusher_;
+    outbound_t    outbound_;
+    boost::posix_time::ptime outbound_since_; /// when the oldest queued message was queued
+    unconfirmed_t unconfirmed_;   /// messages written but not yet confirmed, by delivery tag; an envelope's members share its tag
+    uint64_t      publish_seq_;   /// the delivery tag the broker will assign to the next message
+
+    std::atomic<bool> publisher_lost_; /// the publishing channel must be reopened
+    boost::thread recoverer_;
+    bool          recovery_enabled_;   /// from opening until closing
+    bool          recovering_;         /// the recoverer is running
+    bool          has_lost_;           /// there's something to recover, the recoverer looks again
+    boost::interprocess::interprocess_mutex     recovery_mtx_;
+    boost::interprocess::interprocess_condition recovery_cnd_; /// cuts the recoverer's back-off short when closing
+
+    boost::interprocess::interprocess_mutex     outbound_mtx_;
+    boost::interprocess::interprocess_condition outbound_cnd_;
+    boost::interprocess::interprocess_condition outbound_space_cnd_; /// signalled when the flusher makes room
+    boost::interprocess::interprocess_mutex     confirm_mtx_;
+    boost::interprocess::interprocess_condition confirm_cnd_;
+
+    std::set<atom_t> prioritized_; /// the queues dispatched by priority, guarded by subscription_mtx_
+    std::map<atom_t, size_t> shards_; /// the queues consumed by more than one consumer, guarded by subscription_mtx_
+    std::set<atom_t> exclusive_; /// the queues declared exclusive, guarded by subscription_mtx_
+
+    boost::interprocess::interprocess_mutex accept_mtx_; /// serializes the starting of consumers
+
   private:
-    class consumer : public logger {
+    class consumer : public logger, public link::handler {
     public:
-      consumer(channel* c, string_t const& queue);
+      /** @param shard the consumer's index among those of the queue, see set_shards() */
+      consumer(channel* c, string_t const& queue, size_t shard = 0);
       virtual ~consumer();
 
-      void consume();
+      atom_t queue_atom() const;
+
+      size_t shard() const;
+
+      /** the connection the consumer runs on, null until it's consuming */
+      link* get_link() const;
+
+      /** see channel::set_dispatch_priorities() */
+      void set_prioritized(bool);
+
+      /** see channel::set_exclusive(), it must be set before consuming */
+      void set_exclusive(bool);
+
+      /**
+       * Opens the consumer's AMQP channel, declares and binds the queue, and
+       * starts consuming it.
+       *
+       * @param avoid connections to keep off if there's another, see station::acquire_link()
+       *
+       * @throw connection_error if any of the broker RPCs fails
+       */
+      void consume(std::vector<link*> const& avoid = std::vector<link*>());
       void stop();
+
+      /** whether its connection was lost, or the broker closed its channel; it must be started over */
+      bool is_lost() const;
+
+      /** has the channel start it over, see channel::recover() */
+      virtual void on_link_lost();
+
+      /** assembles the deliveries out of the method, header, and body frames */
+      virtual void on_frame(amqp_frame_t const&);
+
+      /** acknowledges the handled deliveries if the ack interval is up */
+      virtual void on_tick();
+
+      /** deliveries dropped because we published them */
+      static monitor::stat_id stat_self_drops;
+
+      /** deliveries dropped because they're directed at another application */
+      static monitor::stat_id stat_misdirected_drops;
     private:
-      amqp_connection_state_t conn_;
-      int                     socket_;
+      /**
+       * runs the handlers of the message's subscribers, on the station's
+       * dispatcher if it's running; compressed contents are restored there too.
+       * The message is released once they return.
+       */
+      void dispatch(message*);
+
+      /**
+       * restores the message and runs its handlers, then releases it; it's
+       * released even if a handler throws, and the exception is rethrown
+       */
+      void run(message*);
+
+      /**
+       * restores the message's content if it's compressed
+       *
+       * @return false if it's corrupt and the message must be dropped
+       */
+      bool restore(message&);
+
+      /** called once the handlers of a dispatched delivery have returned, or those of one of its enveloped members */
+      void handled(uint64_t delivery_tag);
+
+      /** called for every delivery once it's dispatched or rejected, acknowledges the batch if it's due */
+      void received(uint64_t delivery_tag);
+
+      /** acknowledges every delivery up to the first one still being handled */
+      void ack();
+
+      /** builds the message out of the assembled delivery and dispatches it, or drops it */
+      void deliver();
+
+      /**
+       * dispatches the members of a received envelope one by one, under the
+       * envelope's delivery tag; the members are filtered like deliveries are
+       */
+      void unpack(message&);
+
+      /**
+       * whether the decoded properties are those of a message we should
+       * dispatch, counts it if not; duplicates are rejected if the station's
+       * dedup is on
+       */
+      bool is_wanted(amqp_basic_properties_t const*);
+
+      enum class state_t : unsigned char {
+        awaiting_method,
+        awaiting_header,
+        awaiting_body
+      };
+
+      link                    *link_;
+      amqp_channel_t          ch_;
       channel                 *c_;
       string_t                queue_;
+      atom_t                  queue_atom_;
+      size_t                  shard_;
+      histogram               *turnaround_;   /// from receiving a delivery until its handlers return, in microseconds
+      std::atomic<bool>       prioritized_;
+      bool                    exclusive_;
+      dedup_filter            *dedup_;        /// null unless the station's dedup is on
+      std::atomic<bool>       lost_;
+
+      state_t                 state_;
+      uint64_t                delivery_tag_;  /// of the delivery being assembled
+      amqp_basic_properties_t *props_;        /// valid until the channel's buffers are released
+      bool                    wanted_;
+      size_t                  body_target_;
+      size_t                  body_received_;
+      message                 *current_;      /// the delivery being assembled, if it's wanted
+      amqp_bytes_t            routing_key_;   /// of the delivery being assembled, in its method frame
+
+      std::shared_ptr<message_pool> pool_;    /// the messages the deliveries are built into
+
+      bool                    manual_ack_;
+      uint16_t                ack_batch_size_;
+      uint64_t                last_tag_;  /// the last delivery received
+      uint64_t                acked_tag_; /// the last delivery acknowledged
+      boost::posix_time::ptime ack_since_; /// when acks were last sent, or started piling up
+
+      /** a delivery queued on the dispatcher, and the number of its messages not handled yet */
+      struct in_flight_t {
+        uint64_t delivery_tag;
+        size_t   pending;
+      };
+
+      std::deque<in_flight_t> in_flight_; /// in the order they were received
+      size_t                  nr_in_flight_; /// messages not handled yet, over all deliveries
+      boost::interprocess::interprocess_mutex     in_flight_mtx_;
+      boost::interprocess::interprocess_condition in_flight_cnd_;
     };
 
   private:
@@ -154,6 +615,32 @@ namespace algol {
     consumers_t consumers_;
   };
 
+  /**
+   * @class channel_handle
+   * @brief
+   * A channel resolved once through station::resolve(), which can be sent to
+   * without looking its identifier up again; see communicator::send().
+   *
+   * Channels live until the station is shut down, and so do their handles.
+   */
+  class channel_handle {
+  public:
+    inline channel_handle() : channel_(nullptr) {}
+
+    /** Does it refer to an open channel? */
+    inline bool is_valid() const { return channel_ && channel_->is_open(); }
+    inline explicit operator bool() const { return is_valid(); }
+
+    inline channel* get() const { return channel_; }
+    inline channel* operator->() const { return channel_; }
+
+  private:
+    friend class station;
+    inline explicit channel_handle(channel* c) : channel_(c) {}
+
+    channel* channel_;
+  };
+
   /** @} */
 } // end of namespace algol
 
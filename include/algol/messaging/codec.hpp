@@ -0,0 +1,109 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_MESSAGING_CODEC_H
+#define H_ALGOL_MESSAGING_CODEC_H
+
+#include "algol/algol.hpp"
+#include "algol/monitor.hpp"
+#include "algol/messaging/types.hpp"
+
+namespace algol {
+
+  /**
+   * \addtogroup Messaging
+   * @{
+   * @class codec
+   * @brief
+   * Compresses and restores message contents.
+   *
+   * A compressed content starts with the size of the original content as a
+   * 32-bit big-endian integer, followed by the compressed stream; the message's
+   * Content-Encoding names the codec that produced it ("zlib" or "lz4").
+   */
+  class codec {
+  public:
+    enum class algorithm_t : uint8_t {
+      none,
+      zlib,
+      lz4
+    };
+
+    /**
+     * Looks up the codec by its name: "off", "zlib", or "lz4".
+     *
+     * @return false if the name is unknown, or the codec is not built in
+     */
+    static bool parse(string_t const& name, algorithm_t&);
+
+    /** The Content-Encoding of contents compressed with the given codec */
+    static string_t const& encoding(algorithm_t);
+
+    /** Whether the Content-Encoding is one of ours */
+    static bool is_encoding(string_t const&);
+
+    /**
+     * Compresses the input into the output.
+     *
+     * @param level the zlib compression level [1-9], or the LZ4 acceleration
+     * factor; 0 picks the codec's default
+     *
+     * @return false if the codec failed, or it couldn't make the content any smaller
+     */
+    static bool compress(algorithm_t, int level, string_t const& in, string_t& out);
+
+    /**
+     * Restores the input compressed with the codec named by the given
+     * Content-Encoding into the output.
+     *
+     * The input is taken as corrupt if its prefix claims more than max_size
+     * bytes, or more than the codec could have made out of the input.
+     *
+     * @return false if the encoding is unknown or the input is corrupt
+     */
+    static bool decompress(string_t const& encoding, string_t const& in, string_t& out,
+      size_t max_size = max_content_size);
+
+    /** the largest content a codec will be asked to (de)compress */
+    static const uint32_t max_content_size = 0x7FFFFFFF;
+
+    /** contents compressed */
+    static monitor::stat_id stat_compressed;
+
+    /** contents not compressed because the codec couldn't make them any smaller */
+    static monitor::stat_id stat_incompressible;
+
+    /** bytes saved by compressing contents */
+    static monitor::stat_id stat_bytes_saved;
+
+    /** microseconds spent compressing contents */
+    static monitor::stat_id stat_compress_usecs;
+
+    /** contents decompressed */
+    static monitor::stat_id stat_decompressed;
+
+    /** microseconds spent decompressing contents */
+    static monitor::stat_id stat_decompress_usecs;
+
+    /** contents that could not be decompressed */
+    static monitor::stat_id stat_corrupt;
+  };
+
+  /** @} */
+} // end of namespace algol
+
+#endif
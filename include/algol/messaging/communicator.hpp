@@ -22,6 +22,7 @@
 #include "algol/logger.hpp"
 #include "algol/messaging/types.hpp"
 #include <map>
+#include <future>
 
 namespace algol {
 
@@ -41,6 +42,7 @@ namespace algol {
    * can freely communicate over the "slaughterhouse" channel.
    */
   class channel;
+  class channel_handle;
   class message;
   class communicator {
   public:
@@ -56,13 +58,50 @@ namespace algol {
      * @warn
      * Before sending, you should make sure the channel is open by calling
      * communicator::subscribe(channel_id_t).
+     *
+     * @return the outcome of the sending, or comm_rc::queued if the message
+     * will be sent asynchronously; see channel::publish()
      */
-    void send(const message&, const channel_id_t&, const string_t &queue);
+    comm_rc send(const message&, const channel_id_t&, const string_t &queue);
 
     /**
      * Sends a message over the specified channel and queue.
      */
-    void send(const message&, channel*, const string_t &queue);
+    comm_rc send(const message&, channel*, const string_t &queue);
+
+    /**
+     * Sends a message over a channel resolved beforehand, see station::resolve().
+     */
+    comm_rc send(const message&, channel_handle const&, const string_t &queue);
+
+    /**
+     * Sends a request over the specified channel and queue, and returns the
+     * future of its reply.
+     *
+     * The request is stamped with a message ID unless it has one, and the
+     * reply is recognized by carrying it as its correlation ID; see reply().
+     * Its outcome is reported through the future only, not on_message_sent().
+     *
+     * @param timeout_ms how long to wait for the reply before the future
+     * throws request_timeout; 0 waits forever
+     *
+     * @throw request_failed through the future if the request could not be sent
+     */
+    std::future<message> request(const message&, const channel_id_t&, const string_t &queue, uint32_t timeout_ms);
+
+    /**
+     * Sends a request over the specified channel and queue.
+     */
+    std::future<message> request(const message&, channel*, const string_t &queue, uint32_t timeout_ms);
+
+    /**
+     * Sends the response to a request received by on_message_received(), to
+     * the queue and application it came from.
+     *
+     * @return false if the message is not a request, or if the response
+     * could not be sent, queued, or spooled; see send()
+     */
+    bool reply(const message& request, const message& response);
 
     /**
      * Subscribe as a publisher to this channel. Note that this subscription
@@ -80,6 +119,36 @@ namespace algol {
      */
     virtual bool subscribe(channel_id_t, queue_id_t, int durable = 1, int passive = 1);
 
+    /**
+     * Subscribe as a publisher to this channel, opening it with the given
+     * exchange type if it's not open yet.
+     *
+     * @return false if the channel could not be opened, or is open with
+     * another exchange type
+     */
+    virtual bool subscribe(channel_id_t, exchange_t, int durable = 1, int passive = 1);
+
+    /**
+     * Subscribe as a listener to a queue in a channel, opening the channel
+     * with the given exchange type if it's not open yet. On topic channels
+     * the queue is a binding pattern, like "orders.*.eu" or "#"; see
+     * routing_trie.
+     *
+     * @return false if the channel could not be opened, or is open with
+     * another exchange type
+     */
+    virtual bool subscribe(channel_id_t, queue_id_t, exchange_t, int durable = 1, int passive = 1);
+
+    /**
+     * Subscribe as a listener to a queue in a channel that's consumed by the
+     * given number of consumers, each on an AMQP channel of its own, among
+     * which the broker spreads the deliveries; see channel::set_shards().
+     *
+     * Deliveries received by different shards are dispatched concurrently,
+     * so they're only ordered within each shard.
+     */
+    virtual bool subscribe(channel_id_t, queue_id_t, consumer_shards, int durable = 1, int passive = 1);
+
     /**
      * Will no longer receive messages over the specified channel & queue.
      */
@@ -101,6 +170,9 @@ namespace algol {
 
     /**
      * Invoked by a channel when a message is sent, contains the message and the communication result.
+     *
+     * In batched publishing mode this is called from the channel's flusher
+     * thread once the broker has confirmed or rejected the message.
      */
     inline virtual void on_message_sent(const message&, comm_rc) {};
 
@@ -0,0 +1,118 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_MESSAGING_DEDUP_FILTER_H
+#define H_ALGOL_MESSAGING_DEDUP_FILTER_H
+
+#include "algol/algol.hpp"
+#include "algol/monitor.hpp"
+#include "algol/messaging/types.hpp"
+
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <vector>
+
+namespace algol {
+
+  /**
+   * \addtogroup Messaging
+   * @{
+   * @class dedup_filter
+   * @brief
+   * Remembers the message IDs delivered to each queue over a sliding window
+   * of time, so that the consumers can drop the redeliveries and retries of
+   * messages they already dispatched.
+   *
+   * The IDs are kept as 16-bit fingerprints in two generations of cuckoo
+   * filters: inserts go to the current one, lookups check both, and the older
+   * one is emptied and becomes the current one once the window is up, or
+   * when the current one is full. The memory is allocated once, sized for
+   * the expected number of IDs per window, and never grows; an ID is thus
+   * remembered for one to two windows, or less if more IDs than expected come
+   * in.
+   *
+   * @note
+   * The filter is probabilistic: a fresh message is mistaken for a duplicate
+   * with a probability of about 1 in 8000.
+   */
+  class dedup_filter {
+  public:
+
+    /**
+     * @param window the time (in seconds) an ID is remembered for, at least
+     * @param capacity the number of IDs expected over a window
+     */
+    dedup_filter(uint32_t window, size_t capacity);
+    dedup_filter(const dedup_filter&) = delete;
+    dedup_filter& operator=(const dedup_filter&) = delete;
+    virtual ~dedup_filter();
+
+    /**
+     * Looks the message ID up among those delivered to the queue, and
+     * remembers it if it's not there.
+     *
+     * @return true if the ID was seen within the window
+     */
+    bool check(atom_t queue, const void* id, size_t length);
+
+    /** The memory the filters take, in bytes. */
+    size_t footprint() const;
+
+    /** message IDs looked up */
+    static monitor::stat_id stat_lookups;
+
+    /** message IDs found, their deliveries are dropped */
+    static monitor::stat_id stat_hits;
+
+    /** generations retired because they filled up before their window was up */
+    static monitor::stat_id stat_early_rotations;
+
+  private:
+    static const size_t bucket_size = 4;
+    static const size_t nr_shards = 16;
+    static const size_t max_kicks = 500;
+
+    typedef uint16_t fingerprint_t;
+
+    struct generation_t {
+      std::vector<fingerprint_t> slots; /// bucket_size slots per bucket, 0 marks an empty one
+    };
+
+    /** the filters are sharded by hash so that lookups rarely contend */
+    struct shard_t {
+      generation_t generations[2];
+      size_t current;
+      boost::posix_time::ptime since; /// when the current generation was started
+      boost::interprocess::interprocess_mutex mtx;
+    };
+
+    bool contains(generation_t const&, size_t bucket, fingerprint_t) const;
+    bool insert(generation_t&, size_t bucket, fingerprint_t, uint64_t hash);
+    size_t alternate(size_t bucket, fingerprint_t) const;
+    void rotate(shard_t&, boost::posix_time::ptime const& now);
+
+    boost::posix_time::time_duration window_;
+    size_t nr_buckets_; /// per generation of a shard, a power of 2
+    shard_t shards_[nr_shards];
+  };
+
+  /** @} */
+} // end of namespace algol
+
+#endif
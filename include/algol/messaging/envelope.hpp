@@ -0,0 +1,137 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_MESSAGING_ENVELOPE_H
+#define H_ALGOL_MESSAGING_ENVELOPE_H
+
+#include "algol/algol.hpp"
+#include "algol/monitor.hpp"
+#include "algol/messaging/types.hpp"
+#include "algol/messaging/message.hpp"
+
+#include <vector>
+
+namespace algol {
+
+  /**
+   * \addtogroup Messaging
+   * @{
+   * @class envelope
+   * @brief
+   * Packs many small messages bound to the same queue into a single one, so
+   * that they cost the broker (and the wire) a single publish.
+   *
+   * The envelope is a message of its own whose Content-Type is
+   * envelope::content_type; its content is the sequence of its members, each
+   * made of its encoded AMQP basic properties (headers included) and its
+   * content, both prefixed by their size as a 32-bit big-endian integer.
+   * Receiving consumers unpack the members and dispatch them one by one, see
+   * envelope::reader.
+   *
+   * @note
+   * The envelope is persistent if any of its members is, and carries the
+   * highest priority of theirs.
+   */
+  class envelope {
+  public:
+    static const string_t content_type;
+
+    envelope();
+    envelope(const envelope&) = delete;
+    envelope& operator=(const envelope&) = delete;
+    virtual ~envelope();
+
+    /**
+     * Packs the message, stamped with the time it was handed to its channel
+     * (see message::sent_header).
+     *
+     * @return false if its properties could not be encoded; the envelope is
+     * left as it was
+     */
+    bool add(const message&, uint64_t sent_us);
+
+    /** The messages packed so far, in order. */
+    std::vector<message> const& members() const;
+
+    /** The size of the packed content so far, in bytes. */
+    size_t size() const;
+
+    bool empty() const;
+
+    /**
+     * The envelope message carrying everything that was packed. The packed
+     * content is moved into it; the members are kept until clear() is called.
+     */
+    message seal();
+
+    /** Empties the envelope so that it can be reused. */
+    void clear();
+
+    /**
+     * Walks over the members of a received envelope without copying their
+     * contents.
+     */
+    class reader {
+    public:
+      /** the content must outlive the reader */
+      explicit reader(string_t const& content);
+      reader(const reader&) = delete;
+      reader& operator=(const reader&) = delete;
+      virtual ~reader();
+
+      /**
+       * Decodes the next member; its properties and content are valid until
+       * the next call.
+       *
+       * @return false once there are no more members, or the rest of the
+       * content is corrupt
+       */
+      bool next(amqp_basic_properties_t*&, amqp_bytes_t& content);
+
+      /** Did the reader stop at a corrupt member? */
+      bool is_corrupt() const;
+
+    private:
+      string_t const& content_;
+      size_t          offset_;
+      bool            corrupt_;
+      amqp_pool_t     pool_;
+    };
+
+    /** envelopes sealed */
+    static monitor::stat_id stat_sealed;
+
+    /** messages sent in envelopes */
+    static monitor::stat_id stat_packed;
+
+    /** messages received in envelopes */
+    static monitor::stat_id stat_unpacked;
+
+    /** envelopes received whose content is corrupt */
+    static monitor::stat_id stat_corrupt;
+
+  private:
+    std::vector<message> members_;
+    string_t             content_;
+    uint8_t              delivery_mode_;
+    uint8_t              priority_;
+  };
+
+  /** @} */
+} // end of namespace algol
+
+#endif
@@ -0,0 +1,110 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_MESSAGING_EPOCHS_H
+#define H_ALGOL_MESSAGING_EPOCHS_H
+
+#include "algol/algol.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace algol {
+
+  /**
+   * \addtogroup Messaging
+   * @{
+   * @class epochs
+   * @brief
+   * Tracks the readers of data that writers replace instead of modifying, so
+   * that a writer can tell when nobody can still be reading what it replaced.
+   *
+   * Every thread pins the epoch it started reading in on a slot of its own,
+   * on a cache line of its own, so readers never write to shared memory. A
+   * writer starts a new epoch after unpublishing something; once no pin is
+   * older than that epoch, what it unpublished is unreachable.
+   *
+   * Writers that need to wait for that sleep until a reader lets go of its
+   * pin; readers only take a lock to wake them up when there are any.
+   */
+  class epochs {
+    struct slot_t;
+
+  public:
+    /** Pins the current epoch on the calling thread while in scope; pins nest. */
+    class guard {
+    public:
+      explicit guard(epochs const&);
+      guard(const guard&) = delete;
+      guard& operator=(const guard&) = delete;
+      ~guard();
+
+    private:
+      epochs const& epochs_;
+      slot_t        *slot_;
+    };
+
+    epochs();
+    epochs(const epochs&) = delete;
+    epochs& operator=(const epochs&) = delete;
+    ~epochs();
+
+    /**
+     * Starts a new epoch; whatever was unpublished before the call can be
+     * reclaimed once has_passed() the returned one.
+     */
+    uint64_t advance();
+
+    /**
+     * Whether every reader that pinned an epoch older than the given one is
+     * done.
+     */
+    bool has_passed(uint64_t epoch) const;
+
+    /**
+     * Waits until has_passed(epoch).
+     *
+     * A thread that holds a pin can't wait on the others, as they might be
+     * waiting on it; it's refused right away, and whatever the epoch
+     * protects must be reclaimed later, once has_passed() it.
+     *
+     * @return false if the calling thread holds a pin, and nothing was waited for
+     */
+    bool synchronize(uint64_t epoch) const;
+
+  private:
+    /** the slots are allocated in chunks as threads show up, and never moved */
+    static const size_t slots_per_chunk = 64;
+    static const size_t max_chunks = 256;
+
+    /** the calling thread's slot, allocating its chunk if it's the first there */
+    slot_t* slot() const;
+
+    std::atomic<uint64_t>         epoch_;
+    mutable std::atomic<slot_t*>  chunks_[max_chunks];
+
+    mutable std::atomic<unsigned>           nr_waiting_; /// threads in synchronize()
+    mutable boost::mutex                    wait_mtx_;
+    mutable boost::condition_variable       released_cnd_; /// signalled when a pin is let go of while there are waiters
+  };
+
+  /** @} */
+} // end of namespace algol
+
+#endif
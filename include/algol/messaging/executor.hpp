@@ -0,0 +1,149 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_MESSAGING_EXECUTOR_H
+#define H_ALGOL_MESSAGING_EXECUTOR_H
+
+#include "algol/algol.hpp"
+#include "algol/logger.hpp"
+#include "algol/monitor.hpp"
+
+#include <deque>
+#include <vector>
+#include <functional>
+
+#include <boost/thread.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/interprocess_condition.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+namespace algol {
+
+  /**
+   * \addtogroup Messaging
+   * @{
+   * @class executor
+   * @brief
+   * A pool of worker threads that run message dispatching tasks off the
+   * consumers' socket-reading threads.
+   *
+   * Every task is submitted with an ordering key; tasks that share a key are
+   * run one at a time in the order they were submitted, while tasks with
+   * different keys run in parallel.
+   *
+   * Keys are hashed into a fixed number of lanes. A lane that has pending
+   * tasks is owned by a single worker at a time; idle workers steal ready
+   * lanes from the back of busy workers' queues.
+   *
+   * Tasks can be submitted with a priority (0 to 9, like the AMQP message
+   * priority): a lane runs its higher-priority tasks first, and those of the
+   * same priority in order. So that bulk tasks can't be starved, the oldest
+   * task of a lane is run once it has been bypassed max_bypasses times.
+   */
+  class executor : public logger {
+  public:
+    typedef std::function<void()> task_t;
+
+    /** priorities go from 0 (the lowest, and the default) to nr_priorities - 1 */
+    static const uint8_t nr_priorities = 10;
+
+    /** tasks run ahead of a lane's oldest task before it gets its turn */
+    static const size_t max_bypasses = 16;
+
+    executor();
+    executor(const executor&) = delete;
+    executor& operator=(const executor&) = delete;
+    virtual ~executor();
+
+    /** Launches the given number of worker threads. */
+    void start(size_t nr_workers);
+
+    /** Runs every pending task and joins the workers. */
+    void stop();
+
+    bool is_running() const;
+
+    /**
+     * Schedules the task to be run by one of the workers after every task
+     * previously submitted with the same key.
+     *
+     * If the executor isn't running, the task is run right away on the
+     * calling thread.
+     */
+    void submit(size_t key, task_t);
+
+    /**
+     * Schedules the task to be run before the tasks of lower priority that
+     * were submitted with the same key, see submit(size_t, task_t).
+     * Priorities above the highest count as the highest.
+     */
+    void submit(size_t key, uint8_t priority, task_t);
+
+    /** Schedules the task with a string key, see submit(size_t, task_t). */
+    void submit(string_t const& key, task_t);
+
+    /** tasks waiting to be run, one stat per priority */
+    static monitor::stat_id stat_depth[nr_priorities];
+
+  private:
+    typedef boost::interprocess::interprocess_mutex mutex_t;
+
+    struct entry_t {
+      task_t    task;
+      uint64_t  seq; /// the lane's submission counter, orders the tasks across priorities
+    };
+
+    struct lane_t {
+      mutex_t             mtx;
+      std::deque<entry_t> tasks[nr_priorities];
+      size_t              size;
+      uint64_t            seq;
+      size_t              bypasses; /// tasks run ahead of the oldest one
+      bool                scheduled; /// owned by a worker, or waiting in a ready queue
+    };
+
+    struct worker_t {
+      mutex_t             mtx;
+      std::deque<lane_t*> ready;
+    };
+
+    /** the body of a worker thread */
+    void work(size_t id);
+
+    /** queues a lane that has tasks in the given worker's ready queue */
+    void schedule(lane_t*, size_t worker);
+
+    /** pops a lane from the worker's own queue, or steals one from another */
+    lane_t* acquire(size_t worker);
+
+    /** pops the lane's next task, must be called with the lane's mutex held and tasks pending */
+    task_t next(lane_t*);
+
+    std::vector<lane_t*>    lanes_;
+    std::vector<worker_t*>  workers_;
+    boost::thread_group     threads_;
+
+    bool                    running_;
+    size_t                  nr_ready_; /// lanes waiting in ready queues
+    mutex_t                 idle_mtx_;
+    boost::interprocess::interprocess_condition idle_cnd_;
+  };
+
+  /** @} */
+} // end of namespace algol
+
+#endif
@@ -0,0 +1,143 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_MESSAGING_HEADER_TABLE_H
+#define H_ALGOL_MESSAGING_HEADER_TABLE_H
+
+#include "algol/algol.hpp"
+#include "algol/messaging/types.hpp"
+
+#include <vector>
+#include <ostream>
+
+namespace algol {
+
+  /**
+   * \addtogroup Messaging
+   * @{
+   * @class header_table
+   * A table of typed message headers that can be handed to (and taken from)
+   * the AMQP client library as-is.
+   *
+   * Keys and values are stored in an arena owned by the table: setting a
+   * header costs no allocation unless a block fills up, and the amqp_table_t
+   * produced for publishing points into the arena directly. Nested tables are
+   * copied into the arena when they are set and are read-only from then on.
+   *
+   * Setting a header that exists replaces its value.
+   */
+  class header_table {
+  public:
+    header_table();
+    header_table(const header_table&);
+    header_table& operator=(const header_table&);
+    virtual ~header_table();
+
+    /** A UTF-8 string value */
+    void set(string_t const& key, string_t const&);
+    void set(string_t const& key, const char*);
+
+    void set(string_t const& key, bool);
+    void set(string_t const& key, int32_t);
+    void set(string_t const& key, int64_t);
+    void set(string_t const& key, uint64_t);
+    void set(string_t const& key, double);
+
+    /** A nested table, copied into this one */
+    void set(string_t const& key, header_table const&);
+
+    /** A binary value */
+    void set_bytes(string_t const& key, const void*, size_t);
+
+    /** Copies an already decoded field value, see assign() */
+    void set(string_t const& key, amqp_field_value_t const&);
+
+    /** Removes all headers and recycles the arena. */
+    void clear();
+
+    /** Replaces the headers with copies of the decoded ones. */
+    void assign(amqp_table_t const&);
+
+    bool empty() const;
+    size_t size() const;
+
+    /** The decoded value of a header, or nullptr if it's not set. */
+    amqp_field_value_t const* find(string_t const& key) const;
+    amqp_field_value_t const* find(const char* key, size_t len) const;
+
+    bool has(string_t const& key) const;
+
+    /**
+     * Typed lookup; these return false if the header is not set or its value
+     * can not be represented as the requested type. Integers of any width
+     * convert to int64_t, and any number converts to double.
+     */
+    bool get(string_t const& key, bool&) const;
+    bool get(string_t const& key, int64_t&) const;
+    bool get(string_t const& key, double&) const;
+    bool get(string_t const& key, string_t&) const;
+
+    /** String or binary values, without copying them. Valid as long as the table is. */
+    bool get(string_t const& key, amqp_bytes_t&) const;
+
+    /** Copies a nested table out. */
+    bool get(string_t const& key, header_table&) const;
+
+    /** The table in the form expected by the client library, valid until the next change. */
+    amqp_table_t table() const;
+
+    /** Looks up a header of a decoded table, as received. */
+    static amqp_field_value_t const* find(amqp_table_t const&, const char* key, size_t len);
+
+    void dump(std::ostream&) const;
+
+  private:
+    /**
+     * Allocates memory that remains valid until the table is cleared or
+     * destroyed, aligned for any field value.
+     */
+    void* allocate(size_t);
+
+    amqp_bytes_t copy_bytes(const void*, size_t);
+
+    /** deep-copies the value into the arena, including nested tables and arrays */
+    amqp_field_value_t copy_value(amqp_field_value_t const&);
+
+    amqp_table_t copy_table(amqp_table_t const&);
+
+    /** the entry of the given key, a new one if it isn't set */
+    amqp_table_entry_t& entry(string_t const& key);
+
+    static void dump_value(std::ostream&, amqp_field_value_t const&);
+
+    struct block_t {
+      char    *data;
+      size_t  size;
+      size_t  used;
+    };
+
+    /** the first block is enough for a handful of short headers */
+    static const size_t block_size = 512;
+
+    std::vector<amqp_table_entry_t> entries_;
+    std::vector<block_t>            blocks_;
+  };
+
+  /** @} */
+} // end of namespace algol
+
+#endif
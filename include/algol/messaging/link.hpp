@@ -0,0 +1,171 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_MESSAGING_LINK_H
+#define H_ALGOL_MESSAGING_LINK_H
+
+#include "algol/algol.hpp"
+#include "algol/logger.hpp"
+#include "algol/monitor.hpp"
+#include "algol/messaging/types.hpp"
+#include "algol/messaging/reactor.hpp"
+
+#include <map>
+#include <set>
+
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/interprocess_recursive_mutex.hpp>
+
+namespace algol {
+
+  /**
+   * \addtogroup Messaging
+   * @{
+   * @class link
+   * @brief
+   * A connection with the broker that is shared by many publishers and
+   * consumers, each on its own AMQP channel number.
+   *
+   * A link does not own a thread; the station's reactor calls it when its
+   * socket is readable, and it then decodes the frames that are ready and
+   * routes them by their channel number to the handler that opened it.
+   * The reactor's ticks also keep the heartbeats negotiated with the broker
+   * going, see station::config_t::heartbeat_s.
+   *
+   * The connection state is not thread-safe; anything that writes to it or
+   * issues a synchronous RPC must hold the link's I/O mutex. Handlers are
+   * called without that mutex held.
+   */
+  class link : public logger, public reactor::handler {
+  public:
+    typedef boost::interprocess::interprocess_mutex mutex_t;
+
+    /** Receives the frames sent by the broker on an AMQP channel. */
+    class handler {
+    public:
+      inline virtual ~handler() {}
+
+      /**
+       * Called on a reactor thread for every frame on the handler's
+       * channel. The frame's memory remains valid until the handler calls
+       * link::release_buffers().
+       */
+      virtual void on_frame(amqp_frame_t const&) = 0;
+
+      /** Called periodically on a reactor thread, whether frames arrive or not. */
+      inline virtual void on_tick() {}
+
+      /** Called when the connection with the broker is lost. */
+      inline virtual void on_link_lost() {}
+    };
+
+    explicit link(int id);
+    link(const link&) = delete;
+    link& operator=(const link&) = delete;
+    virtual ~link();
+
+    /** connects and logs in to the broker, and starts watching the socket */
+    void open();
+
+    /** stops watching the socket and closes the connection */
+    void close();
+
+    /** whether the link is connected; false once the connection is lost */
+    bool is_open() const;
+
+    /**
+     * Opens a new AMQP channel on this connection whose frames will be routed
+     * to the given handler.
+     *
+     * @throw connection_error if the broker refuses to open the channel
+     */
+    amqp_channel_t open_channel(handler*);
+
+    /**
+     * Closes the AMQP channel; its handler will no longer be called once this
+     * returns. A channel the broker closed, or one on a lost connection, is
+     * only forgotten.
+     */
+    void close_channel(amqp_channel_t);
+
+    /** Releases the memory of the frames decoded so far on the given channel. */
+    void release_buffers(amqp_channel_t);
+
+    /** The number of AMQP channels open on this connection, counting those being closed. */
+    size_t nr_channels();
+
+    /** The connection state; it must only be used while holding the I/O mutex. */
+    amqp_connection_state_t& state();
+
+    /** The mutex guarding every write and RPC on the connection. */
+    mutex_t& io_mutex();
+
+    /** The underlying socket fd */
+    int socket() const;
+
+    /** @{ reactor::handler */
+    virtual int fd() const;
+    virtual bool on_readable();
+    virtual bool on_tick();
+    virtual bool has_buffered();
+    /** @} */
+
+  private:
+    /**
+     * Routes the frames that can be decoded without blocking.
+     *
+     * @return false if the connection was lost
+     */
+    bool drain();
+
+    /** hands the frame to the handler of its channel */
+    void route(amqp_frame_t const&);
+
+    /** notifies every handler that the connection is gone */
+    void lost();
+
+    /** connections dropped because the broker went silent */
+    static monitor::stat_id stat_heartbeat_timeouts;
+
+    typedef std::map<amqp_channel_t, handler*> handlers_t;
+
+    int                     id_;
+    bool                    open_;
+    bool                    lost_;
+    amqp_connection_state_t conn_;
+    int                     socket_;
+
+    handlers_t              handlers_;
+    std::set<amqp_channel_t> free_channels_; /// closed channel numbers that can be reused
+    std::set<amqp_channel_t> closed_by_broker_; /// channels the broker closed, whose handlers haven't closed them yet
+    amqp_channel_t          next_channel_;
+    size_t                  nr_closing_; /// channels in the middle of close_channel()
+
+    mutex_t                 io_mtx_;
+
+    /**
+     * Guards the handlers and is held while routing a frame to one, so that
+     * closing a channel waits for its handler to return. It's recursive because
+     * handlers may open channels (e.g., a subscriber subscribing to a queue).
+     */
+    boost::interprocess::interprocess_recursive_mutex handlers_mtx_;
+  };
+
+  /** @} */
+} // end of namespace algol
+
+#endif
@@ -0,0 +1,103 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_MESSAGING_LOOPBACK_H
+#define H_ALGOL_MESSAGING_LOOPBACK_H
+
+#include "algol/algol.hpp"
+#include "algol/logger.hpp"
+#include "algol/monitor.hpp"
+#include "algol/messaging/message.hpp"
+#include "algol/messaging/mpmc_ring.hpp"
+
+#include <atomic>
+#include <boost/thread.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/interprocess_condition.hpp>
+
+namespace algol {
+
+  class channel;
+
+  /**
+   * \addtogroup Messaging
+   * @{
+   * @class loopback
+   * @brief
+   * Hands messages published in this process to the subscribers in this
+   * process without going through the broker.
+   *
+   * Publishers push the messages into a lock-free ring that a pump thread
+   * drains into the channels' dispatching path (the station's dispatcher, if
+   * it's running). The pump sleeps when the ring is empty; publishers only
+   * wake it up when it does.
+   *
+   * @see station::config_t::loopback
+   */
+  class loopback : public logger {
+  public:
+    loopback();
+    loopback(const loopback&) = delete;
+    loopback& operator=(const loopback&) = delete;
+    virtual ~loopback();
+
+    /** Allocates a ring of the given capacity and launches the pump. */
+    void start(size_t capacity);
+
+    /** Delivers whatever is left in the ring and joins the pump. */
+    void stop();
+
+    bool is_running() const;
+
+    /**
+     * Queues the message for dispatching to the subscribers of its channel
+     * and queue. Blocks while the ring is full, unless it's called by a
+     * handler running on the pump thread, which would then wait for itself;
+     * the message is dispatched right away in that case, ahead of the ones
+     * in the ring.
+     *
+     * @return false if the loopback isn't running, or was stopped while
+     * waiting for room in the ring
+     */
+    bool deliver(const message&);
+
+    /** messages delivered in-process */
+    static monitor::stat_id stat_deliveries;
+
+    /** times a publisher had to wait for room in the ring */
+    static monitor::stat_id stat_ring_full;
+
+  private:
+    /** the body of the pump thread */
+    void pump();
+
+    /** hands the message to the dispatcher, or to its channel if it's not running */
+    void dispatch(message&);
+
+    mpmc_ring<message>  *ring_;
+    boost::thread       pump_;
+    std::atomic<bool>   running_;
+    std::atomic<bool>   sleeping_; /// the pump is waiting for a message
+
+    boost::interprocess::interprocess_mutex     wake_mtx_;
+    boost::interprocess::interprocess_condition wake_cnd_;
+  };
+
+  /** @} */
+} // end of namespace algol
+
+#endif
@@ -20,6 +20,12 @@
 
 #include "algol/algol.hpp"
 #include "algol/messaging/types.hpp"
+#include "algol/messaging/header_table.hpp"
+#include "algol/messaging/codec.hpp"
+
+#include <atomic>
+#include <memory>
+#include <vector>
 
 namespace algol {
 
@@ -29,11 +35,20 @@ namespace algol {
    * @{
    * @class message
    * A message object that's transmittable by communicators across the platform.
+   *
+   * The message content is kept in a reference-counted buffer that is shared
+   * between copies of the message; it is only duplicated when a copy is
+   * modified through the mutable interface (body(), add_to_body()). The same
+   * goes for the header table.
    */
   class channel;
   class messaging_test;
+  class messaging_bench;
   class communicator;
   class station;
+  class envelope;
+  class spool;
+  class message_pool;
   class message {
   public:
 
@@ -42,6 +57,37 @@ namespace algol {
       DELIVERY_MODE_PERSISTENT = 2
     };
 
+    /**
+     * The header carrying the time (in microseconds since the epoch) at which
+     * the message was handed to its channel for sending. Receiving channels
+     * use it to measure the publish-to-dispatch latency.
+     *
+     * @note
+     * The stamp is taken from the sender's clock; the latencies of messages
+     * sent from other hosts are only as accurate as the hosts' clock sync.
+     */
+    static const string_t sent_header;
+
+    /**
+     * The headers of a message as published, followed by the sent header in
+     * a slot of its own; see serialize(). Stamping this way leaves the
+     * message's header table alone and only allocates for messages that
+     * carry more than a few headers.
+     */
+    class sent_stamp {
+    public:
+      sent_stamp(uint64_t sent_us);
+
+    private:
+      friend class message;
+
+      static const size_t inline_slots = 16;
+
+      int64_t                         sent_us_;
+      amqp_table_entry_t              inline_[inline_slots];
+      std::vector<amqp_table_entry_t> spilled_;
+    };
+
     message();
     message(const string_t &body);
     message(const message&);
@@ -57,18 +103,55 @@ namespace algol {
     /** Convenience interface for appending content to the message */
     message& operator<<(const string_t&);
 
-    /** The message content */
+    /**
+     * The message content.
+     *
+     * @note
+     * If the content is shared with other copies of this message, it will be
+     * detached (duplicated) first. Use the const version when not modifying it.
+     */
     string_t& body();
 
     /** An immutable version of the content */
     string_t const& body() const;
 
+    /**
+     * Replaces the content with its compressed form and marks it with the
+     * codec's Content-Encoding, see codec::compress().
+     *
+     * Contents that already have a Content-Encoding are left alone.
+     *
+     * @return false if the content was left uncompressed
+     */
+    bool compress(codec::algorithm_t, int level = 0);
+
+    /**
+     * Restores a content compressed by compress() and clears the Content-Encoding.
+     *
+     * @param max_size the largest content it may restore to, see codec::decompress()
+     *
+     * @return false if the content is not compressed, or is corrupt
+     */
+    bool decompress(size_t max_size = codec::max_content_size);
+
+    /** Is the content compressed by one of the codecs? */
+    bool is_compressed() const;
+
     /** The channel through which this message was received */
     channel* get_channel();
 
-    /** The queue to/from which this message was routed */
+    /**
+     * The queue to/from which this message was routed; on topic channels,
+     * received messages carry the binding pattern they were routed by.
+     */
     string_t const& get_queue() const;
 
+    /**
+     * The routing key the message was published with, for received messages;
+     * on direct channels it's the queue itself.
+     */
+    string_t const& get_routing_key() const;
+
     /**
      * Assigns a Content-Type to the message to indicate its payload type.
      *
@@ -160,33 +243,74 @@ namespace algol {
     string_t const& get_message_id() const;
 
     /**
-     * Adds a meta-header to the message.
+     * Adds a meta-header to the message, or replaces its value.
      *
      * Headers are optional and can be used to filter or route at the application level.
-     *
-     * @note All headers are internally cast to strings and transported that way.
+     * They are transported with their native AMQP types.
      */
     void set_header(string_t const&key, string_t const&);
-
-    /** Helper for adding an integer-valued header. */
+    void set_header(string_t const&key, const char*);
     void set_header(string_t const&key, int);
+    void set_header(string_t const&key, int64_t);
+    void set_header(string_t const&key, bool);
+    void set_header(string_t const&key, double);
+    void set_header(string_t const&key, header_table const&);
+
+    /** Is the header set? */
+    bool has_header(string_t const&key) const;
+
+    /** The message headers, see header_table::get() for the typed lookups. */
+    header_table const& headers() const;
 
     void dump(std::ostream&) const;
     void dump(log4cpp::CategoryStream) const;
     string_t dump_str() const;
 
+    /**
+     * Holds on to the message beyond the handler it was passed to.
+     *
+     * Received messages are recycled once their handlers return (see
+     * message_pool), so a subscriber that needs one later must either copy
+     * it or retain it; retaining a pooled message keeps it, and its buffers,
+     * out of the pool until it's released. Messages that aren't pooled are
+     * copied.
+     *
+     * @return the retained message, to be handed back through release()
+     */
+    message const* retain() const;
+
+    /**
+     * Drops a reference obtained from retain() or message_pool::acquire();
+     * the message mustn't be used afterwards. The last release recycles it
+     * into its pool, or frees it.
+     */
+    void release() const;
+
   protected:
     friend class channel;
     friend class station;
+    friend class communicator;
+    friend class envelope;
+    friend class spool;
     friend class messaging_test;
+    friend class messaging_bench;
+    friend class messaging_recovery_test;
 
     channel       *channel_;
     communicator  *sender_; /// a transient field, used internally
 
     struct meta_t {
-      string_t  queue;
+      atom_t    queue; /// see atoms
+      uint64_t  sent_us; /// when the message was handed to its channel, 0 if it wasn't
+      uint64_t  delivery_tag; /// of the delivery that carried the message, 0 if it wasn't received
+      uint64_t  received_us; /// when the delivery was received, 0 if it wasn't
     } meta_;
 
+    typedef std::shared_ptr<string_t> body_t;
+
+    /** Adopts the given content buffer without copying it. */
+    explicit message(body_t);
+
     void set_timestamp(uint64_t);
 
     /**
@@ -200,14 +324,31 @@ namespace algol {
      */
     static void set_app_id(string_t const&);
     void serialize(amqp_bytes_t*, amqp_basic_properties_t*) const;
+
+    /**
+     * Serializes the message with the stamp appended to its headers, replacing
+     * any sent header it carries. The properties point into the stamp, which
+     * has to outlive them.
+     */
+    void serialize(amqp_bytes_t*, amqp_basic_properties_t*, sent_stamp&) const;
     void deserialize(amqp_basic_properties_t*);
 
   private:
+    friend class message_pool;
+
     void clone(const message&);
+    void reset();
+
+    /** blanks the message for reuse, keeping the buffers no copy shares */
+    void recycle();
+
+    /** the headers, detached from other copies of the message first */
+    header_table& mutable_headers();
 
   private:
     static string_t app_id__;
-    string_t        body_;
+    static body_t   empty_body__;
+    body_t          body_;
 
     struct properties_t {
       amqp_flags_t  flags;
@@ -223,13 +364,14 @@ namespace algol {
       string_t      app_id;
     } props_;
 
-    struct header_t {
-      string_t      key;
-      string_t      value;
-    };
+    string_t        routing_key_; /// see get_routing_key()
+
+    typedef std::shared_ptr<header_table> headers_t;
+    static header_table empty_headers__;
+    headers_t           headers_; /// null as long as no header is set
 
-    typedef std::vector<header_t> headers_t;
-    headers_t headers_;
+    mutable std::shared_ptr<message_pool> pool_; /// the pool the message goes back to, if it's pooled
+    mutable std::atomic<uint32_t>         refs_; /// 0 unless it's pooled or retained
   };
 
   /** @} */
@@ -0,0 +1,83 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_MESSAGING_MESSAGE_POOL_H
+#define H_ALGOL_MESSAGING_MESSAGE_POOL_H
+
+#include "algol/algol.hpp"
+#include "algol/monitor.hpp"
+#include "algol/messaging/message.hpp"
+#include "algol/messaging/mpmc_ring.hpp"
+
+#include <memory>
+
+namespace algol {
+
+  /**
+   * \addtogroup Messaging
+   * @{
+   * @class message_pool
+   * @brief
+   * Recycles the messages a consumer builds its deliveries into, so that
+   * receiving doesn't allocate once the pool is warm.
+   *
+   * A recycled message is blanked but keeps its buffers: its property strings
+   * keep their capacity, and so do its content and header table unless they
+   * are still shared with a copy of it.
+   *
+   * Messages taken from the pool go back to it when their last reference is
+   * released, see message::retain() and message::release(); they can be
+   * released from any thread. Messages still out when the pool's owner drops
+   * it keep the pool alive until they're released.
+   */
+  class message_pool : public std::enable_shared_from_this<message_pool> {
+  public:
+
+    /** @param capacity the number of idle messages kept; the others are freed */
+    explicit message_pool(size_t capacity);
+    message_pool(const message_pool&) = delete;
+    message_pool& operator=(const message_pool&) = delete;
+    virtual ~message_pool();
+
+    /**
+     * A blank message, recycled if there's an idle one. The caller holds its
+     * only reference and must release() it.
+     */
+    message* acquire();
+
+    /** A snapshot of the number of idle messages. */
+    size_t idle() const;
+
+    /** messages taken from the pools that had to be allocated */
+    static monitor::stat_id stat_allocated;
+
+    /** messages taken from the pools that were recycled */
+    static monitor::stat_id stat_recycled;
+
+  private:
+    friend class message;
+
+    /** takes a message whose last reference was released */
+    void recycle(message*);
+
+    mpmc_ring<message*> idle_;
+  };
+
+  /** @} */
+} // end of namespace algol
+
+#endif
@@ -0,0 +1,63 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_MESSAGING_MESSAGE_VIEW_H
+#define H_ALGOL_MESSAGING_MESSAGE_VIEW_H
+
+#include "algol/algol.hpp"
+#include "algol/messaging/types.hpp"
+#include "algol/messaging/header_table.hpp"
+
+namespace algol {
+
+  /**
+   * \addtogroup Messaging
+   * @{
+   * @class message_view
+   * A read-only view of the properties of a delivery as they were decoded off
+   * the wire, used to route it before paying for a full algol::message.
+   *
+   * The view does not copy anything; it must not outlive the frame it was
+   * built from.
+   */
+  class message_view {
+  public:
+    explicit message_view(amqp_basic_properties_t const*);
+
+    /** Was the message published by the application with the given ID? */
+    bool is_from(string_t const& app_id) const;
+
+    /** Does the message have no recipient, or is the given application the recipient? */
+    bool is_directed_at(string_t const& app_id) const;
+
+    /** The decoded value of a header, or nullptr if it's not set; see header_table::find() */
+    amqp_field_value_t const* header(string_t const& key) const;
+
+    /** The raw properties, valid as long as the frame is. */
+    amqp_basic_properties_t const* properties() const;
+
+  private:
+    /** true if the property is set and its value equals the string */
+    bool equals(amqp_flags_t flag, amqp_bytes_t const& prop, string_t const&) const;
+
+    amqp_basic_properties_t const* props_;
+  };
+
+  /** @} */
+} // end of namespace algol
+
+#endif
@@ -0,0 +1,156 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_MESSAGING_MPMC_RING_H
+#define H_ALGOL_MESSAGING_MPMC_RING_H
+
+#include "algol/algol.hpp"
+
+#include <atomic>
+#include <vector>
+
+namespace algol {
+
+  /**
+   * \addtogroup Messaging
+   * @{
+   * @class mpmc_ring
+   * @brief
+   * A bounded, lock-free queue that any number of threads can push to and pop
+   * from concurrently.
+   *
+   * Every slot carries a sequence number that tells producers and consumers
+   * whether it's theirs to fill or drain, so the only contended operations
+   * are the compare-and-swaps on the head and tail positions.
+   *
+   * @note The capacity is rounded up to a power of two.
+   */
+  template <typename T>
+  class mpmc_ring {
+  public:
+    explicit mpmc_ring(size_t capacity)
+    : mask_(round_up(capacity) - 1),
+      slots_(mask_ + 1),
+      head_(0),
+      tail_(0)
+    {
+      for (size_t i = 0; i < slots_.size(); ++i)
+        slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    mpmc_ring(const mpmc_ring&) = delete;
+    mpmc_ring& operator=(const mpmc_ring&) = delete;
+
+    /** @return false if the ring is full */
+    bool push(T const& value) {
+      slot_t *slot;
+      size_t pos = tail_.load(std::memory_order_relaxed);
+
+      for (;;) {
+        slot = &slots_[pos & mask_];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+          if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            break;
+        }
+        else if (diff < 0)
+          return false;
+        else
+          pos = tail_.load(std::memory_order_relaxed);
+      }
+
+      slot->value = value;
+      slot->seq.store(pos + 1, std::memory_order_release);
+
+      return true;
+    }
+
+    /** @return false if the ring is empty */
+    bool pop(T& value) {
+      slot_t *slot;
+      size_t pos = head_.load(std::memory_order_relaxed);
+
+      for (;;) {
+        slot = &slots_[pos & mask_];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+
+        if (diff == 0) {
+          if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            break;
+        }
+        else if (diff < 0)
+          return false;
+        else
+          pos = head_.load(std::memory_order_relaxed);
+      }
+
+      value = slot->value;
+      // don't hold on to whatever the value owns until the slot is reused
+      slot->value = T();
+      slot->seq.store(pos + mask_ + 1, std::memory_order_release);
+
+      return true;
+    }
+
+    size_t capacity() const {
+      return mask_ + 1;
+    }
+
+    /** A snapshot of the number of queued values; it may be stale by the time it returns. */
+    size_t size() const {
+      size_t tail = tail_.load(std::memory_order_relaxed);
+      size_t head = head_.load(std::memory_order_relaxed);
+
+      return tail > head ? tail - head : 0;
+    }
+
+  private:
+    static size_t round_up(size_t n) {
+      size_t p = 2;
+      while (p < n)
+        p <<= 1;
+
+      return p;
+    }
+
+    struct slot_t {
+      std::atomic<size_t> seq;
+      T                   value;
+
+      slot_t() : seq(0) {}
+      slot_t(const slot_t&) : seq(0) {}
+    };
+
+    /** keeps the producers' and consumers' positions on separate cache lines */
+    typedef char padding_t[64];
+
+    const size_t        mask_;
+    std::vector<slot_t> slots_;
+    padding_t           pad0_;
+    std::atomic<size_t> head_;
+    padding_t           pad1_;
+    std::atomic<size_t> tail_;
+    padding_t           pad2_;
+  };
+
+  /** @} */
+} // end of namespace algol
+
+#endif
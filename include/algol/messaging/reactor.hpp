@@ -0,0 +1,140 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_MESSAGING_REACTOR_H
+#define H_ALGOL_MESSAGING_REACTOR_H
+
+#include "algol/algol.hpp"
+#include "algol/logger.hpp"
+
+#include <set>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/interprocess_recursive_mutex.hpp>
+
+namespace algol {
+
+  /**
+   * \addtogroup Messaging
+   * @{
+   * @class reactor
+   * @brief
+   * A small, fixed pool of threads that wait on the sockets of every broker
+   * connection with epoll and let them decode and route whatever frames are
+   * ready, instead of having a thread block on each one.
+   *
+   * Every handler is assigned to a single thread for as long as it's watched,
+   * so its callbacks are never called concurrently. Handlers are also ticked
+   * periodically, readable or not.
+   */
+  class reactor : public logger {
+  public:
+    /** A socket watched by the reactor. */
+    class handler {
+    public:
+      inline virtual ~handler() {}
+
+      /** the file descriptor to watch */
+      virtual int fd() const = 0;
+
+      /**
+       * Called when the socket has data to read; it must not block.
+       *
+       * @return false to stop watching the socket, e.g. when it's closed
+       */
+      virtual bool on_readable() = 0;
+
+      /**
+       * Called every tick_ms.
+       *
+       * @return false to stop watching the socket
+       */
+      virtual bool on_tick() = 0;
+
+      /**
+       * Whether the handler has read more from its socket than it handled,
+       * e.g. because it stopped early to let the others run. The socket then
+       * won't become readable again, so it's called again right away instead.
+       */
+      inline virtual bool has_buffered() { return false; }
+    };
+
+    /** how often (in milliseconds) the handlers are ticked */
+    static const int tick_ms = 50;
+
+    reactor();
+    reactor(const reactor&) = delete;
+    reactor& operator=(const reactor&) = delete;
+    virtual ~reactor();
+
+    /**
+     * Launches the given number of threads.
+     *
+     * @param cpus the CPUs the threads are pinned to, one each in turn; they
+     * run wherever the scheduler puts them if it's empty
+     */
+    void start(size_t nr_threads, std::vector<int> const& cpus = std::vector<int>());
+
+    /** Stops watching every handler and joins the threads. */
+    void stop();
+
+    bool is_running() const;
+
+    /** Starts watching the handler's socket on the least busy thread. */
+    void add(handler*);
+
+    /**
+     * Stops watching the handler's socket; once this returns, the handler
+     * will not be called again.
+     */
+    void remove(handler*);
+
+  private:
+    struct worker_t {
+      int                 epoll_fd;
+      std::set<handler*>  handlers;
+      /** guards the handlers */
+      boost::interprocess::interprocess_mutex mtx;
+      /**
+       * Held while the handlers are called so that removing one waits for it
+       * to return; it's recursive so that a handler can remove itself.
+       */
+      boost::interprocess::interprocess_recursive_mutex dispatch_mtx;
+    };
+
+    /** the body of a reactor thread */
+    void run(worker_t*);
+
+    /** calls the handler's on_readable(), and queues it up again if it has more buffered */
+    void read(worker_t*, handler*, std::vector<handler*>& buffered);
+
+    /** whether the handler is still watched by the worker */
+    bool is_watched(worker_t*, handler*);
+
+    void unwatch(worker_t*, handler*);
+
+    std::vector<worker_t*>  workers_;
+    boost::thread_group     threads_;
+    bool                    running_;
+  };
+
+  /** @} */
+} // end of namespace algol
+
+#endif
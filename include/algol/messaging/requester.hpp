@@ -0,0 +1,162 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_MESSAGING_REQUESTER_H
+#define H_ALGOL_MESSAGING_REQUESTER_H
+
+#include "algol/algol.hpp"
+#include "algol/logger.hpp"
+#include "algol/monitor.hpp"
+#include "algol/messaging/types.hpp"
+#include "algol/messaging/communicator.hpp"
+#include "algol/messaging/message.hpp"
+
+#include <atomic>
+#include <future>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+
+namespace algol {
+
+  class channel;
+
+  /**
+   * \addtogroup Messaging
+   * @{
+   * @class requester
+   * @brief
+   * Sends requests on behalf of communicators and matches the replies to them,
+   * see communicator::request().
+   *
+   * Every request is stamped with a message ID that the reply carries back as
+   * its correlation ID, and with the name of the queue the replies to this
+   * process are sent to (see reply_queue_header). Any number of requests can
+   * be in flight over that single queue; they're kept in a table sharded by
+   * correlation ID, and their deadlines in a timer wheel that's advanced every
+   * tick_ms, so that expiring them costs nothing per tick but the requests
+   * that are actually due.
+   */
+  class requester : public logger, public communicator {
+  public:
+    /** the header that names the queue the reply must be sent to */
+    static const string_t reply_queue_header;
+
+    /** the resolution (in milliseconds) of the request timeouts */
+    static const int tick_ms = 10;
+
+    requester();
+    requester(const requester&) = delete;
+    requester& operator=(const requester&) = delete;
+    virtual ~requester();
+
+    /**
+     * Sends the request and returns the future of its reply.
+     *
+     * The future throws request_timeout if no reply arrives within timeout_ms
+     * (0 waits forever), or request_failed if the request could not be sent.
+     */
+    std::future<message> request(const message&, channel*, string_t const& queue, uint32_t timeout_ms);
+
+    /** Fails every pending request and stops keeping time. */
+    void stop();
+
+    /** The number of requests awaiting a reply. */
+    size_t nr_pending();
+
+    /** The name of the queue replies to this process are sent to. */
+    string_t const& reply_queue() const;
+
+    /** requests sent */
+    static monitor::stat_id stat_requests;
+
+    /** replies matched to their requests */
+    static monitor::stat_id stat_replies;
+
+    /** requests that timed out */
+    static monitor::stat_id stat_timeouts;
+
+    /** replies to requests that timed out, or that we never sent */
+    static monitor::stat_id stat_unmatched_replies;
+
+  protected:
+    /** matches the reply to its request */
+    virtual void on_message_received(const message&);
+
+    /** fails the request if the channel could not send it */
+    virtual void on_message_sent(const message&, comm_rc);
+
+  private:
+    typedef boost::interprocess::interprocess_mutex mutex_t;
+    typedef std::unordered_map<string_t, std::promise<message> > pending_t;
+
+    struct shard_t {
+      mutex_t   mtx;
+      pending_t pending;
+    };
+
+    struct deadline_t {
+      string_t  id;
+      uint64_t  due; /// the tick at which the request expires
+    };
+
+    typedef std::vector<deadline_t> slot_t;
+
+    /** the number of slots in the wheel; timeouts that span more ticks go around it more than once */
+    static const size_t nr_slots = 512;
+    static const size_t nr_shards = 16;
+
+    shard_t& shard_of(string_t const& id);
+
+    /**
+     * Removes the request from the pending table.
+     *
+     * @return false if it's no longer pending
+     */
+    bool take(string_t const& id, std::promise<message>&);
+
+    /** subscribes to the reply queue of the channel the first time it's used */
+    bool listen(channel*);
+
+    /** the body of the thread that advances the wheel */
+    void tick();
+
+    void expire(uint64_t tick);
+
+    shard_t             shards_[nr_shards];
+
+    std::vector<slot_t> wheel_;
+    uint64_t            tick_;  /// the last tick the wheel was advanced to
+    mutex_t             wheel_mtx_;
+
+    bool                running_;
+    boost::thread       ticker_;
+
+    std::set<channel*>  listening_;
+    mutex_t             listening_mtx_;
+
+    string_t              reply_queue_;
+    std::atomic<uint64_t> seq_;
+  };
+
+  /** @} */
+} // end of namespace algol
+
+#endif
@@ -0,0 +1,112 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_MESSAGING_ROUTING_TRIE_H
+#define H_ALGOL_MESSAGING_ROUTING_TRIE_H
+
+#include "algol/algol.hpp"
+#include "algol/messaging/types.hpp"
+
+#include <map>
+#include <vector>
+
+namespace algol {
+
+  /**
+   * \addtogroup Messaging
+   * @{
+   * @class routing_trie
+   * @brief
+   * Matches routing keys against the binding patterns of a topic exchange,
+   * the way the broker does, for the messages routed in-process.
+   *
+   * Keys and patterns are made of words separated by dots; in a pattern, "*"
+   * stands for exactly one word and "#" for zero or more. The patterns are
+   * laid out in a trie of their words which is then compiled into flat
+   * arrays, so that matching a key costs about as much as walking its words
+   * down the trie, whatever the number of bindings.
+   *
+   * A trie is built once and never changes after it's compiled; the channels
+   * compile a new one whenever their subscriptions change.
+   */
+  class routing_trie {
+  public:
+    routing_trie();
+    virtual ~routing_trie();
+
+    /** Adds a binding, reported by match() for the keys its pattern matches. */
+    void bind(string_t const& pattern, atom_t binding);
+
+    /** Lays the bindings out for matching; none can be added afterwards. */
+    void compile();
+
+    /** Appends the distinct bindings whose pattern matches the key. */
+    void match(string_t const& key, std::vector<atom_t>& bindings) const;
+
+    /** The number of bindings. */
+    size_t size() const;
+
+  private:
+    static const uint32_t npos = (uint32_t) -1;
+
+    /** a word of a key: its offset and length */
+    typedef std::pair<size_t, size_t> word_t;
+
+    struct builder_node_t {
+      builder_node_t() : star(npos), hash(npos) {}
+
+      std::map<string_t, uint32_t> children;
+      uint32_t            star;
+      uint32_t            hash;
+      std::vector<atom_t> bindings;
+    };
+
+    struct node_t {
+      uint32_t first_edge;
+      uint32_t nr_edges;
+      uint32_t star;  /// the child for "*", npos if there's none
+      uint32_t hash;  /// the child for "#", npos if there's none
+      uint32_t first_binding;
+      uint32_t nr_bindings;
+    };
+
+    /** an edge to a child for a literal word; a node's edges are sorted by word */
+    struct edge_t {
+      uint32_t offset; /// of the word in words_
+      uint32_t length;
+      uint32_t child;
+    };
+
+    void walk(uint32_t node, string_t const& key, std::vector<word_t> const& words, size_t i, std::vector<atom_t>& bindings) const;
+
+    /** the child of the node for the literal word, npos if there's none */
+    uint32_t child(node_t const&, const char* word, size_t length) const;
+
+    std::vector<builder_node_t> builder_; /// emptied by compile()
+    bool                        compiled_;
+    size_t                      size_;
+
+    std::vector<node_t>   nodes_;
+    std::vector<edge_t>   edges_;
+    std::vector<atom_t>   bindings_;
+    string_t              words_;
+  };
+
+  /** @} */
+} // end of namespace algol
+
+#endif
@@ -0,0 +1,287 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_MESSAGING_SPOOL_H
+#define H_ALGOL_MESSAGING_SPOOL_H
+
+#include "algol/algol.hpp"
+#include "algol/logger.hpp"
+#include "algol/monitor.hpp"
+#include "algol/messaging/types.hpp"
+#include "algol/messaging/message.hpp"
+
+#include <deque>
+#include <vector>
+#include <functional>
+#include <memory>
+
+#include <boost/thread.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/interprocess_condition.hpp>
+
+namespace algol {
+
+  /**
+   * \addtogroup Messaging
+   * @{
+   * @class spool
+   * @brief
+   * An append-only log of outbound messages kept on disk, which a drainer
+   * thread replays to the broker in the order they were written.
+   *
+   * The log is a sequence of segment files that are memory-mapped while
+   * they're written or replayed; appending a message is a copy into the
+   * mapping. A committer thread flushes the mappings to disk every
+   * station::config_t::spool_commit_ms, so that a single sync covers every
+   * message appended since the last one (a group commit). Segments are
+   * deleted once they're replayed.
+   *
+   * Every segment starts with a header that records how much of it was
+   * replayed, followed by the records: the size of the record and its CRC-32,
+   * both 32-bit integers, then the queue name and the message encoded as an
+   * envelope member (see envelope). The spool of a channel that's reopened,
+   * in this process or the next one, resumes where the last one stopped.
+   *
+   * The broker must confirm every replayed message (see confirm()); the
+   * spool only moves past a message once it's confirmed, and replays the
+   * unconfirmed ones again when the link is lost (see rewind()). No more
+   * than a window of messages await their confirm at a time.
+   *
+   * @note
+   * Messages are replayed at least once: those that were sent but whose
+   * confirm, or whose progress, wasn't committed before a crash are sent
+   * again. Spool files are only meant to be read on the host that wrote them.
+   *
+   * A spool holds an exclusive lock on a file of its directory while it's
+   * open (name.lock), so that no other spool of the same name, in this
+   * process or another one, appends to or replays its segments.
+   */
+  class spool : public logger {
+  public:
+    /**
+     * Sends a replayed message to the given queue, stamped with the given
+     * send time (see message::sent_header), and sets the delivery tag the
+     * broker will confirm it with.
+     *
+     * @return false if it couldn't be sent; it's retried after a back-off
+     */
+    typedef std::function<bool(const message&, string_t const& queue, uint64_t sent_us, uint64_t& tag)> sink_t;
+
+    /**
+     * @param directory where the segment files are kept, created if needed
+     * @param name the prefix of the segment files, usually the channel's ID
+     */
+    spool(string_t const& directory, string_t const& name);
+    spool(const spool&) = delete;
+    spool& operator=(const spool&) = delete;
+    virtual ~spool();
+
+    /**
+     * Recovers the segments left by a previous spool of the same name, and
+     * starts committing and replaying into the sink.
+     *
+     * @return false if the directory or the first segment couldn't be
+     * created, or another spool of the same name is open
+     */
+    bool open(sink_t);
+
+    /** Commits what's been appended and stops replaying; the rest is kept for the next run. */
+    void close();
+
+    bool is_open() const;
+
+    /**
+     * Appends the message to the log. When station::config_t::spool_durable
+     * is on, it returns only once the message is committed to disk.
+     *
+     * @return comm_rc::spooled, comm_rc::queue_full if the spool is full (see
+     * station::config_t::spool_max_bytes), or comm_rc::spool_failed if the
+     * message could not be encoded or the spool could not grow
+     */
+    comm_rc append(const message&, string_t const& queue, uint64_t sent_us);
+
+    /** The number of messages waiting to be replayed, or for their confirm. */
+    size_t backlog() const;
+
+    /**
+     * Settles the replayed messages the broker confirmed: the one with the
+     * given delivery tag, or every one up to it if multiple is set.
+     */
+    void confirm(uint64_t delivery_tag, bool multiple);
+
+    /**
+     * Gives up on the confirms of the messages awaiting one, e.g. when the
+     * link is lost or the broker rejects one; they're replayed again.
+     */
+    void rewind();
+
+    /**
+     * Cuts the drainer's back-off short, e.g. once the link it failed to
+     * send on is replaced.
+     */
+    void resume();
+
+    /** messages appended to spools */
+    static monitor::stat_id stat_spooled;
+
+    /** spooled messages confirmed by the broker */
+    static monitor::stat_id stat_replayed;
+
+    /** times the messages awaiting a confirm had to be replayed again */
+    static monitor::stat_id stat_rewinds;
+
+    /** messages waiting in spools */
+    static monitor::stat_id stat_backlog;
+
+    /** messages refused because their spool was full */
+    static monitor::stat_id stat_refusals;
+
+    /** spooled records that failed their checksum or could not be decoded */
+    static monitor::stat_id stat_corrupt;
+
+    /** the time (in microseconds) each group commit took */
+    static monitor::stat_id stat_commit_usecs;
+
+  private:
+    struct segment_t {
+      segment_t();
+      ~segment_t(); /// unmaps the segment
+
+      uint64_t  seq;
+      string_t  path;
+      char      *data;
+      size_t    size;
+      size_t    end;    /// where the next record goes
+      size_t    synced; /// how much of it was flushed to disk
+    };
+
+    typedef std::shared_ptr<segment_t> segment_ptr;
+
+    /** a replayed record awaiting its confirm */
+    struct in_flight_t {
+      segment_ptr segment;
+      uint64_t    end;       /// the offset past the record
+      size_t      bytes;
+      uint64_t    tag;
+      bool        confirmed; /// corrupt records are never sent, they're confirmed as they're read
+    };
+
+    /**
+     * takes the lock on the spool's files
+     *
+     * @return false if another spool holds it, or it couldn't be created
+     */
+    bool lock();
+
+    /** deletes the lock file and releases the lock */
+    void unlock();
+
+    /** creates and maps a new segment large enough for a record of the given size */
+    segment_ptr create_segment(size_t record_size);
+
+    /**
+     * maps a segment left by a previous run and finds the end of its records
+     *
+     * @return nullptr if it's not a spool segment
+     */
+    segment_ptr recover_segment(string_t const& path, uint64_t seq, size_t& nr_pending, size_t& pending_bytes);
+
+    /**
+     * the offset of the first record that's not confirmed yet, kept in the
+     * segment's header; it's guarded by replay_mtx_ while the spool is open
+     */
+    static uint64_t& replayed(segment_t&);
+
+    /** the bodies of the committer and drainer threads */
+    void commit();
+    void drain();
+
+    /** flushes everything that was appended, must be called from the committer */
+    void sync();
+
+    /** deletes the segment's file, it's unmapped once it's no longer referenced */
+    void discard(segment_t&);
+
+    /**
+     * decodes a record
+     *
+     * @return false if it's corrupt
+     */
+    bool decode(const char* record, size_t size, message&, string_t& queue, uint64_t& sent_us);
+
+    /**
+     * pops the confirmed records off the head of the window and moves the
+     * spool past them; must be called with replay_mtx_ held
+     *
+     * @param nr, bytes incremented by the records settled, which the caller
+     * takes off the backlog
+     */
+    void settle(size_t& nr, size_t& bytes);
+
+    /** takes the settled records off the backlog; must be called without replay_mtx_ held */
+    void settled(size_t nr, size_t bytes);
+
+    string_t                directory_;
+    string_t                name_;
+    int                     lock_fd_;   /// holds the lock on the spool's files while it's open
+    sink_t                  sink_;
+    bool                    running_;
+    bool                    closing_;   /// the drainer has a last chance to empty the spool
+    bool                    resumed_;   /// the drainer retries right away, see resume()
+
+    size_t                  segment_bytes_;
+    size_t                  max_bytes_;
+    uint32_t                commit_ms_;
+    bool                    durable_;
+
+    std::deque<segment_ptr> segments_;  /// from the one being replayed to the one being written
+    size_t                  backlog_;
+    size_t                  backlog_bytes_;
+    uint64_t                appended_;  /// records appended so far
+    uint64_t                committed_; /// of which were flushed to disk
+    uint64_t                next_seq_;  /// of the next segment created
+
+    boost::thread           committer_;
+    boost::thread           drainer_;
+
+    std::deque<in_flight_t> in_flight_; /// the records awaiting a confirm, in the order they were sent
+    segment_ptr             sending_;   /// the segment of the next record to send, null after a rewind
+    uint64_t                sending_offset_;
+    uint64_t                rewinds_;   /// tells the drainer whether the window was rewound while it was sending
+
+    bool                    is_sending_; /// the last record of the window is being sent, it has no tag yet
+    uint64_t                early_confirmed_upto_; /// confirmed with multiple set while it was being sent
+    std::vector<uint64_t>   early_confirmed_;      /// confirmed one by one while it was being sent
+
+    /**
+     * Guards the window and the replayed offsets. It's not held while a
+     * record is sent, as the broker's confirms are handled under it on the
+     * reactor; it's never held while taking mtx_.
+     */
+    boost::interprocess::interprocess_mutex         replay_mtx_;
+
+    mutable boost::interprocess::interprocess_mutex mtx_;
+    boost::interprocess::interprocess_condition     appended_cnd_;  /// wakes the drainer up
+    boost::interprocess::interprocess_condition     committed_cnd_; /// wakes up the durable appenders
+    boost::interprocess::interprocess_condition     commit_cnd_;    /// wakes the committer up early
+    boost::interprocess::interprocess_condition     drained_cnd_;   /// signalled when the backlog runs out
+  };
+
+  /** @} */
+} // end of namespace algol
+
+#endif
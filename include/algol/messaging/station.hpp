@@ -21,8 +21,18 @@
 #include "algol/algol.hpp"
 #include "algol/logger.hpp"
 #include "algol/messaging/channel.hpp"
+#include "algol/messaging/dedup_filter.hpp"
+#include "algol/messaging/executor.hpp"
+#include "algol/messaging/link.hpp"
+#include "algol/messaging/loopback.hpp"
+#include "algol/messaging/reactor.hpp"
+#include "algol/messaging/requester.hpp"
+
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/interprocess_condition.hpp>
 
 #include <map>
+#include <vector>
 
 namespace algol {
 
@@ -49,15 +59,245 @@ namespace algol {
       string_t vhost;
       string_t username;
       string_t password;
+
+      /**
+       * Number of messages a channel writes back-to-back before reading the
+       * broker's publisher confirms. A value of 0 (the default) disables
+       * batching; every message is then published by the caller, unless
+       * publish_async is on.
+       */
+      size_t   publish_batch_size;
+
+      /** Maximum time (in milliseconds) a message waits for its batch to fill up. */
+      uint32_t publish_linger_ms;
+
+      /**
+       * Whether messages are handed to a per-channel I/O thread rather than
+       * written to the broker on the sender's thread: "off" (the default) or
+       * "on". Batched publishing (see publish_batch_size) is always asynchronous.
+       */
+      bool     publish_async;
+
+      /**
+       * Maximum number of messages a channel queues for asynchronous sending;
+       * 0 (the default) does not bound the queue.
+       */
+      size_t   outbound_capacity;
+
+      /**
+       * What happens to a message sent while the outbound queue is full:
+       *  "block": the sender waits for room (the default); if the channel is
+       *  closed meanwhile, communicator::send() returns comm_rc::link_unavailable
+       *  "drop_oldest": the oldest queued message is discarded to make room
+       *  "drop_newest": the message is discarded, communicator::send() returns comm_rc::dropped
+       *  "fail": the message is refused, communicator::send() returns comm_rc::queue_full
+       *
+       * Discarded messages are reported as comm_rc::dropped through
+       * on_message_sent(), and refused ones as comm_rc::queue_full.
+       */
+      string_t outbound_overflow;
+
+      /**
+       * Whether small messages sent to the same queue are packed into
+       * envelopes, see envelope: "off" (the default) or "on". Enveloped
+       * publishing is always asynchronous.
+       */
+      bool     publish_envelopes;
+
+      /** Messages with larger contents (in bytes) are never enveloped. Defaults to 1 KB. */
+      size_t   envelope_threshold;
+
+      /** Maximum size (in bytes) of an envelope's packed content. Defaults to 64 KB. */
+      size_t   envelope_max_bytes;
+
+      /**
+       * Maximum time (in milliseconds) a message waits for others to share its
+       * envelope with; in batched publishing, publish_linger_ms applies instead.
+       */
+      uint32_t envelope_linger_ms;
+
+      /**
+       * The directory every channel keeps its spool in, see spool. When it's
+       * set, the messages published to the broker are written to the spool
+       * and sent from there, in order, whenever the broker takes them; the
+       * senders are told comm_rc::spooled. Spooled messages are kept until the
+       * broker confirms them, so spooling channels always publish in confirm
+       * mode, and bypass the outbound queue, batching, and envelopes.
+       * Empty (the default) disables spooling.
+       */
+      string_t spool_dir;
+
+      /** The size (in bytes) of a spool segment file. Defaults to 64 MB. */
+      size_t   spool_segment_bytes;
+
+      /**
+       * Maximum number of bytes a channel's spool holds before refusing
+       * messages with comm_rc::queue_full; 0 (the default) does not bound it.
+       */
+      size_t   spool_max_bytes;
+
+      /** The interval (in milliseconds) of the spool's group commits. Defaults to 5. */
+      uint32_t spool_commit_ms;
+
+      /**
+       * Whether publishing waits for the message to be committed to disk:
+       * "off" (the default) or "on".
+       */
+      bool     spool_durable;
+
+      /**
+       * Maximum number of unacknowledged deliveries the broker will push to
+       * each consumer. A value of 0 (the default) consumes in auto-ack mode
+       * with no prefetch limit.
+       */
+      uint16_t prefetch_count;
+
+      /**
+       * Whether the consumers drop the deliveries whose message ID was already
+       * delivered to the same queue, see dedup_filter: "off" (the default) or
+       * "on". Deliveries without an ID are always dispatched.
+       */
+      bool     dedup;
+
+      /** The time (in seconds) a delivered message ID is remembered for, at least. Defaults to 60. */
+      uint32_t dedup_window_s;
+
+      /**
+       * The number of message IDs expected over a window, which sizes the
+       * filter's memory (4 to 8 bytes per ID). Defaults to 1 million.
+       */
+      size_t   dedup_capacity;
+
+      /**
+       * Number of received messages each consumer keeps for reuse, see
+       * message_pool. Defaults to 256.
+       */
+      size_t   message_pool_size;
+
+      /** Deliveries acknowledged at once (with multiple=true) in manual-ack mode. */
+      uint16_t ack_batch_size;
+
+      /** Maximum time (in milliseconds) a handled delivery waits to be acknowledged. */
+      uint32_t ack_interval_ms;
+
+      /**
+       * Number of worker threads that run the subscribers' message handlers.
+       * Defaults to the number of CPUs.
+       *
+       * A value of 0 opts into running the handlers inline, on the reactor
+       * threads that read the deliveries. It saves a hand-off per message,
+       * but while a handler runs no other frame of its reactor's connections
+       * is read: their heartbeats and publisher confirms wait for it, and a
+       * handler that waits on a reply (like requester::request().get())
+       * deadlocks, since the reply can't be read until it returns.
+       */
+      size_t   dispatch_threads;
+
+      /**
+       * Number of threads that wait on the connections with the broker and
+       * decode what they receive, regardless of how many connections and
+       * consumers there are. Defaults to 1.
+       */
+      size_t   reactor_threads;
+
+      /**
+       * The CPUs the reactor threads are pinned to, one each in turn, as a
+       * list of numbers and ranges like "2,3" or "4-7". Empty (the default)
+       * leaves them to the scheduler.
+       */
+      string_t reactor_cpus;
+
+      /**
+       * What deliveries must be dispatched in the order they were received:
+       *  "queue": all deliveries to the same channel queue (the default)
+       *  "correlation_id": deliveries with the same correlation ID; those that
+       *  have none are ordered by their queue
+       */
+      string_t dispatch_ordering;
+
+      /**
+       * Maximum number of connections opened with the broker. Publishers and
+       * consumers are spread over them, each on its own AMQP channel; the
+       * shards of a queue get connections of their own while there's room,
+       * see communicator::subscribe().
+       */
+      size_t   connections;
+
+      /**
+       * The largest frame (in bytes) we ask the broker for when connecting;
+       * the broker may lower it. Contents larger than a frame are split into
+       * several body frames, so large messages go out in fewer writes with a
+       * larger value. Defaults to 128 KB, and can't be lower than 4 KB.
+       */
+      size_t   frame_max;
+
+      /**
+       * The heartbeat interval (in seconds) we ask the broker for; the broker
+       * may lower it. A connection that's been silent for two intervals is
+       * considered lost. 0 disables heartbeats. Defaults to 30.
+       */
+      int      heartbeat_s;
+
+      /**
+       * Whether messages are handed to subscribers in this process directly:
+       *  "off": every message goes through the broker (the default)
+       *  "on": messages are delivered to the local subscribers in-process.
+       *  On direct channels, a message delivered locally isn't published to
+       *  the broker at all; remote consumers of the same queue compete with
+       *  the local ones anyway. On fanout and topic channels it's still
+       *  published for the queues of other processes, so a queue consumed
+       *  both here and elsewhere gets it twice: once in-process, and once
+       *  from the broker by the remote consumer.
+       *  "only": messages never leave the process and no connection with the
+       *  broker is made; useful for running communicators without one
+       *
+       * @note The broker never delivers our own messages back to us, so
+       * local subscribers only see them with the loopback on.
+       */
+      string_t loopback;
+
+      /** Number of messages the loopback ring can hold before publishers wait. */
+      size_t   loopback_capacity;
+
+      /**
+       * The codec that compresses large message contents by default:
+       * "off" (the default), "zlib", or "lz4" if it's built in.
+       * Channels can override it, see channel::set_compression().
+       */
+      string_t compression;
+
+      /** The default compression level, see codec::compress(). */
+      int      compression_level;
+
+      /** Contents smaller than this (in bytes) are never compressed. Defaults to 16 KB. */
+      size_t   compression_threshold;
+
+      /**
+       * Compressed contents that claim to restore to more than this (in bytes)
+       * are dropped as corrupt before anything is allocated. Defaults to 64 MB.
+       */
+      size_t   max_decompressed_size;
     } config;
 
     /**
      * Opens a messaging channel with the requested identifier if it's not already opened
      * that can be used for both publishing and consuming.
      *
+     * It's safe to call from any thread; when several threads ask for a channel
+     * that's not open yet, one of them opens it while the others wait.
+     *
+     * The exchange type only applies when the channel is opened; a channel
+     * that's open already keeps its own, see channel::exchange_type().
+     *
      * nullptr will be returned if the channel could not be opened.
      */
-    channel* open_channel(channel_id_t const&, int durable = 1, int passive = 1);
+    channel* open_channel(channel_id_t const&, int durable = 1, int passive = 1, exchange_t = exchange_t::direct);
+
+    /**
+     * Opens the channel like open_channel() and returns a handle to it, which
+     * senders can hold on to instead of looking the channel up on every send.
+     */
+    channel_handle resolve(channel_id_t const&, int durable = 1, int passive = 1, exchange_t = exchange_t::direct);
 
     /**
      * Closes the messaging channel with the requested identifier.
@@ -78,6 +318,32 @@ namespace algol {
 
     std::list<channel*> channels();
 
+    /** The pool that runs the subscribers' handlers, see config_t::dispatch_threads */
+    executor& dispatcher();
+
+    /** The in-process transport, see config_t::loopback */
+    loopback& local_transport();
+
+    /** The threads that watch the connections, see config_t::reactor_threads */
+    reactor& io_reactor();
+
+    /** The tracker of the requests in flight, see communicator::request() */
+    requester& requests();
+
+    /** The message IDs delivered recently, see config_t::dedup */
+    dedup_filter& dedup();
+
+    /**
+     * Returns the least busy connection with the broker, opening a new one if
+     * the pool isn't full yet. Lost connections don't count toward the pool;
+     * they're replaced, and destroyed once their channels are closed.
+     *
+     * @param avoid connections to pass over unless they're all there is
+     *
+     * @throw connection_error if a new connection could not be established
+     */
+    link* acquire_link(std::vector<link*> const& avoid = std::vector<link*>());
+
     virtual void set_option(const string_t&, const string_t&);
 
   private:
@@ -86,8 +352,52 @@ namespace algol {
 
     channel* get_channel(channel_id_t const&);
 
+    /** starts the services the channels depend on if they're configured and not running yet */
+    void start_services();
+
+    /**
+     * A registered channel; it's null while one of the callers of
+     * open_channel() is opening it.
+     */
     typedef std::map<channel_id_t, channel*> channels_t;
-    channels_t channels_;
+
+    /** the registry is sharded by channel identifier so that lookups rarely contend */
+    struct registry_shard_t {
+      channels_t channels;
+      boost::interprocess::interprocess_mutex     mtx;
+      boost::interprocess::interprocess_condition opened_cnd; /// signalled when a channel is done opening
+    };
+
+    static const size_t nr_registry_shards = 16;
+
+    registry_shard_t& shard_of(channel_id_t const&);
+
+    typedef std::vector<link*> links_t;
+
+    /**
+     * Moves the lost links out of the pool, and hands back the ones that no
+     * channel is on anymore for the caller to destroy; requires links_mtx_.
+     */
+    links_t reap_links();
+
+    registry_shard_t registry_[nr_registry_shards];
+
+    boost::interprocess::interprocess_mutex services_mtx_;
+
+    executor dispatcher_;
+    loopback loopback_;
+    reactor  reactor_;
+
+    requester *requester_; /// created on the first request
+    boost::interprocess::interprocess_mutex requester_mtx_;
+
+    dedup_filter *dedup_; /// created when the first consumer asks for it
+    boost::interprocess::interprocess_mutex dedup_mtx_;
+
+    links_t links_;
+    links_t lost_links_; /// out of the pool, waiting for their channels to be closed
+    int     nr_links_opened_; /// names the links
+    boost::interprocess::interprocess_mutex links_mtx_;
   };
 
   /** @} */
@@ -27,16 +27,42 @@ namespace algol {
   typedef string_t channel_id_t;
   typedef string_t queue_id_t;
 
+  /** an interned channel or queue name, see atoms */
+  typedef uint32_t atom_t;
+
   enum class comm_rc : unsigned char {
     unassigned = 0, // don't add anything before this
 
     success, /** communication was successful */
     invalid_message, /** messages are invalid if they have no payload */
     link_unavailable, /** a connection error with the communication platform */
+    rejected, /** the broker refused to take responsibility of the message (negative confirm) */
+    queued, /** the message was queued to be sent asynchronously; the outcome is reported later */
+    dropped, /** the message was discarded because the outbound queue was full */
+    queue_full, /** the message was refused because the outbound queue was full */
+    spooled, /** the message was written to the channel's spool, it's sent to the broker from there */
+    spool_failed, /** the message could not be written to the channel's spool: it could not be encoded, or the spool could not grow */
 
     sanity_check // don't add anything after this
   };
 
+  /**
+   * The number of consumers that compete for the deliveries of a queue, see
+   * communicator::subscribe().
+   */
+  struct consumer_shards {
+    explicit consumer_shards(size_t n) : count(n) {}
+
+    size_t count;
+  };
+
+  /** how a channel's exchange routes the messages to the subscribed queues */
+  enum class exchange_t : unsigned char {
+    direct, /** to the queue named by the routing key */
+    topic, /** to the queues whose binding pattern matches the routing key, see routing_trie */
+    fanout /** to every queue, whatever the routing key */
+  };
+
 } // end of namespace algol
 
 #endif
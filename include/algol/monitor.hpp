@@ -20,9 +20,12 @@
 
 #include <map>
 
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+
 // dakapi
 #include "algol/algol.hpp"
 #include "algol/logger.hpp"
+#include "algol/histogram.hpp"
 
 namespace algol {
 
@@ -46,6 +49,7 @@ namespace algol {
 
     typedef std::map<stat_id, uint64_t> stats_t;
     typedef std::map<stat_id, std::vector<cavg_t*> > avg_stats_t;
+    typedef std::map<stat_id, histogram*> histograms_t;
 
     explicit monitor();
     virtual ~monitor();
@@ -55,6 +59,7 @@ namespace algol {
     /** Returns all the stats tracked by the monitor. */
     stats_t const& stats() const;
     avg_stats_t const& avg_stats() const;
+    histograms_t const& histograms() const;
 
     stat_val stat(stat_id);
     std::vector<cavg_t*> const& avg_stat(stat_id);
@@ -72,12 +77,34 @@ namespace algol {
 
     stat_id track_avg_stat(string_t const& name);
 
+    /**
+     * Registers a histogram stat, see histogram. Unlike the other stats, the
+     * histogram already registered under the name is returned if there's one,
+     * so that it can be shared by the objects that track the same thing.
+     */
+    stat_id track_hist_stat(string_t const& name);
+
+    /**
+     * The identified histogram; values can be recorded into it directly,
+     * without going through the monitor.
+     */
+    histogram& hist_stat(stat_id);
+
+    /** The value below which the given percentage of the histogram's entries fall */
+    stat_val percentile(stat_id, double percentage);
+
     /** increments the identified stat by 1 */
     void inc_stat(stat_id stat);
 
     /** decrements the identified stat by 1 */
     void dec_stat(stat_id stat);
 
+    /** increments the identified stat by the given amount */
+    void add_stat(stat_id stat, stat_val amount);
+
+    /** decrements the identified stat by the given amount */
+    void sub_stat(stat_id stat, stat_val amount);
+
     /**
      * adds the given entry to the cumulative average stat's population
      * and recalculates the average
@@ -95,8 +122,12 @@ namespace algol {
 
     stats_t       stats_;
     avg_stats_t   avg_stats_;
+    histograms_t  histograms_;
     stat_names_t  stat_names_;
 
+    /** stats are updated from the messaging threads */
+    boost::interprocess::interprocess_mutex mtx_;
+
     static monitor* __instance;
     static uint32_t __guid;
   };
@@ -108,7 +139,12 @@ namespace algol {
 
 #define INC_STAT(item) monitor::singleton().inc_stat(item);
 #define DEC_STAT(item) monitor::singleton().dec_stat(item);
+#define ADD_STAT(item, val) monitor::singleton().add_stat(item, val);
+#define SUB_STAT(item, val) monitor::singleton().sub_stat(item, val);
 #define AVG_STAT(item, val) monitor::singleton().avg_stat(item, val);
+#define TRACK_HIST_STAT(subject, item, item_string) \
+  monitor::stat_id subject::item = monitor::singleton().track_hist_stat(item_string);
+#define HIST_STAT(item, val) monitor::singleton().hist_stat(item).record(val);
 
 } // namespace algol
 
@@ -0,0 +1,135 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "algol/histogram.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace algol {
+
+  const unsigned histogram::precision_bits;
+  const uint64_t histogram::max_value;
+
+  /** the sub-buckets per octave */
+  static const uint64_t sub_buckets = 1ull << histogram::precision_bits;
+
+  /** the number of significant bits in the value */
+  static unsigned bits_of(uint64_t value) {
+    unsigned bits = 0;
+    while (value) {
+      ++bits;
+      value >>= 1;
+    }
+
+    return bits;
+  }
+
+  histogram::histogram()
+  : counts_(index_of(max_value) + 1),
+    count_(0),
+    sum_(0),
+    min_(UINT64_MAX),
+    max_(0)
+  {
+    for (auto& c : counts_)
+      c.store(0);
+  }
+
+  size_t histogram::index_of(uint64_t value) {
+    // the first two octaves are counted exactly
+    if (value < 2 * sub_buckets)
+      return value;
+
+    unsigned shift = bits_of(value) - histogram::precision_bits - 1;
+    uint64_t sub_bucket = (value >> shift) - sub_buckets;
+
+    return 2 * sub_buckets + (shift - 1) * sub_buckets + sub_bucket;
+  }
+
+  uint64_t histogram::highest_in(size_t index) {
+    if (index < 2 * sub_buckets)
+      return index;
+
+    unsigned shift = (index - 2 * sub_buckets) / sub_buckets + 1;
+    uint64_t sub_bucket = (index - 2 * sub_buckets) % sub_buckets;
+
+    return ((sub_buckets + sub_bucket + 1) << shift) - 1;
+  }
+
+  void histogram::record(uint64_t value) {
+    value = std::min(value, max_value);
+
+    counts_[index_of(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t current = min_.load(std::memory_order_relaxed);
+    while (value < current && !min_.compare_exchange_weak(current, value, std::memory_order_relaxed))
+      ;
+
+    current = max_.load(std::memory_order_relaxed);
+    while (value > current && !max_.compare_exchange_weak(current, value, std::memory_order_relaxed))
+      ;
+  }
+
+  uint64_t histogram::count() const {
+    return count_.load(std::memory_order_relaxed);
+  }
+
+  uint64_t histogram::min() const {
+    return count() ? min_.load(std::memory_order_relaxed) : 0;
+  }
+
+  uint64_t histogram::max() const {
+    return max_.load(std::memory_order_relaxed);
+  }
+
+  double histogram::mean() const {
+    uint64_t n = count();
+    return n ? (double) sum_.load(std::memory_order_relaxed) / n : 0;
+  }
+
+  uint64_t histogram::percentile(double percentage) const {
+    uint64_t n = count();
+    if (!n)
+      return 0;
+
+    percentage = std::max(0.0, std::min(percentage, 100.0));
+    uint64_t wanted = std::max<uint64_t>((uint64_t) std::ceil(percentage / 100.0 * n), 1);
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      seen += counts_[i].load(std::memory_order_relaxed);
+      if (seen >= wanted)
+        return std::min(highest_in(i), max());
+    }
+
+    return max();
+  }
+
+  void histogram::reset() {
+    for (auto& c : counts_)
+      c.store(0, std::memory_order_relaxed);
+
+    count_.store(0);
+    sum_.store(0);
+    min_.store(UINT64_MAX);
+    max_.store(0);
+  }
+
+} // namespace algol
@@ -0,0 +1,92 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "algol/messaging/atoms.hpp"
+
+#include <atomic>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+namespace algol {
+
+  const atom_t atoms::none;
+  const atom_t atoms::capacity;
+
+  /**
+   * The names are stored in chunks that are never moved once allocated, so
+   * that name() can read them without a lock: an atom is only handed out
+   * after its name is in place.
+   */
+  static const atom_t chunk_bits = 10;
+  static const atom_t chunk_size = 1 << chunk_bits;
+  static const atom_t nr_chunks = atoms::capacity / chunk_size;
+
+  static std::atomic<string_t*> chunks[nr_chunks];
+  static std::unordered_map<string_t, atom_t> by_name;
+  static std::atomic<atom_t> next_atom(atoms::none + 1);
+  static boost::shared_mutex by_name_mtx;
+
+  static const string_t no_name;
+
+  atom_t atoms::intern(string_t const& name) {
+    {
+      boost::shared_lock<boost::shared_mutex> lock(by_name_mtx);
+
+      std::unordered_map<string_t, atom_t>::const_iterator finder = by_name.find(name);
+      if (finder != by_name.end())
+        return finder->second;
+    }
+
+    boost::unique_lock<boost::shared_mutex> lock(by_name_mtx);
+
+    // another thread might have interned it in the meantime
+    std::unordered_map<string_t, atom_t>::const_iterator finder = by_name.find(name);
+    if (finder != by_name.end())
+      return finder->second;
+
+    atom_t atom = next_atom.load();
+    if (atom >= capacity)
+      throw std::length_error("the atom table is full");
+
+    string_t *chunk = chunks[atom >> chunk_bits].load();
+    if (!chunk) {
+      chunk = new string_t[chunk_size];
+      chunks[atom >> chunk_bits].store(chunk);
+    }
+
+    chunk[atom & (chunk_size - 1)] = name;
+    by_name.insert(std::make_pair(name, atom));
+    next_atom.store(atom + 1);
+
+    return atom;
+  }
+
+  string_t const& atoms::name(atom_t atom) {
+    if (atom == none || atom >= next_atom.load())
+      return no_name;
+
+    return chunks[atom >> chunk_bits].load()[atom & (chunk_size - 1)];
+  }
+
+  size_t atoms::size() {
+    return next_atom.load() - 1;
+  }
+
+} // end of namespace algol
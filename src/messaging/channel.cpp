@@ -19,53 +19,737 @@
 #include "algol/messaging/station.hpp"
 #include "algol/messaging/communicator.hpp"
 #include "algol/messaging/message.hpp"
+#include "algol/messaging/atoms.hpp"
 #include "algol/utility.hpp"
 
+#include <algorithm>
+#include <memory>
+
 namespace algol {
 
   typedef boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> scoped_lock;
+  using boost::posix_time::microsec_clock;
+  using boost::posix_time::milliseconds;
+
+  TRACK_STAT(channel, stat_outbound_depth, "messaging: outbound queue depth")
+  TRACK_STAT(channel, stat_outbound_drops, "messaging: outbound queue drops")
+  TRACK_STAT(channel, stat_outbound_refusals, "messaging: outbound queue refusals")
+  TRACK_STAT(channel, stat_outbound_waits, "messaging: outbound queue waits")
+  TRACK_STAT(channel, stat_recoveries, "messaging: channel recoveries")
+
+  /** the most messages the flusher writes per wakeup when it's not batching */
+  static const size_t max_async_batch = 256;
+
+  /** the bounds of the recoverer's back-off while the broker can't be reached */
+  static const uint32_t min_recovery_ms = 100;
+  static const uint32_t max_recovery_ms = 5000;
+
+  uint64_t channel::now_us() {
+    static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+    return (microsec_clock::universal_time() - epoch).total_microseconds();
+  }
 
-  channel::channel(channel_id_t id)
+  /** the name of the exchange type in AMQP */
+  static const char* exchange_type_name(exchange_t type) {
+    switch (type) {
+      case exchange_t::topic:  return "topic";
+      case exchange_t::fanout: return "fanout";
+      default:                 return "direct";
+    }
+  }
+
+  channel::channel(channel_id_t id, exchange_t exchange)
   : id_(id),
+    atom_(atoms::intern(id)),
+    exchange_(exchange),
     logger(("Channel[" + id + "]").c_str()),
     open_(false),
+    loopback_(false),
+    loopback_only_(false),
+    compression_(codec::algorithm_t::none),
+    compression_level_(station::singleton().config.compression_level),
+    compression_threshold_(station::singleton().config.compression_threshold),
+    spool_(nullptr),
+    link_(nullptr),
+    ch_(0),
     is_durable_(0),
-    is_passive_(0)
+    is_passive_(0),
+    flushing_(false),
+    confirming_(false),
+    enveloping_(false),
+    envelope_threshold_(0),
+    envelope_max_bytes_(0),
+    outbound_capacity_(0),
+    overflow_(overflow_t::block),
+    publish_seq_(1),
+    publisher_lost_(false),
+    recovery_enabled_(false),
+    recovering_(false),
+    has_lost_(false),
+    subscribers_(new subscribers_t()),
+    routes_(nullptr)
   {
+    codec::parse(station::singleton().config.compression, compression_);
+
+    if (exchange_ == exchange_t::topic) {
+      routing_trie *routes = new routing_trie();
+      routes->compile();
+      routes_ = routes;
+    }
   }
 
   channel::~channel() {
+    delete spool_;
+    delete subscribers_.load();
+    delete routes_.load();
+
+    for (auto const& retired : retired_) {
+      delete retired.table;
+      delete retired.routes;
+    }
   }
 
   channel_id_t const& channel::id() const {
     return id_;
   }
 
-  // channel::subscribers_t const& channel::subscribers() const {
-  //   return subscribers_;
-  // }
+  atom_t channel::atom() const {
+    return atom_;
+  }
 
-  void channel::publish(const communicator*, const message& m, const string_t &queue) {
-    scoped_lock lock(publishing_mtx_);
+  exchange_t channel::exchange_type() const {
+    return exchange_;
+  }
 
-    amqp_bytes_t bytes;
-    amqp_basic_properties_t props;
+  channel::subscribers_snapshot::subscribers_snapshot(channel const& c)
+  : pin_(c.readers_)
+  {
+    // pinning the epoch before loading the table guarantees that a writer
+    // who sees the pin has passed won't free the table we load
+    table_ = c.subscribers_.load();
+    routes_ = c.routes_.load();
+  }
+
+  channel::subscribers_snapshot::~subscribers_snapshot() {
+  }
+
+  comm_rc channel::publish(communicator* sender, const message& m, const string_t &queue) {
+    // only the paths that route the message locally by queue or queue it
+    // need its atom; the routing keys of topic channels aren't interned
+    const atom_t queue_atom = (loopback_ && exchange_ == exchange_t::direct) || flushing_
+      ? atoms::intern(queue)
+      : atoms::none;
+
+    if (loopback_) {
+      // the broker hands a direct queue's message to one of its consumers,
+      // a local one taking it is all the broker copy would have achieved
+      const bool is_delivered = publish_locally(m, queue, queue_atom);
+
+      if (loopback_only_ || (is_delivered && exchange_ == exchange_t::direct)) {
+        if (sender)
+          sender->on_message_sent(m, comm_rc::success);
+        return comm_rc::success;
+      }
+    }
+
+    if (spool_) {
+      comm_rc rc = spool_->append(m, queue, now_us());
+
+      if (sender)
+        sender->on_message_sent(m, rc);
+      return rc;
+    }
+
+    if (flushing_)
+      return enqueue(sender, m, queue_atom);
+
+    comm_rc rc;
+    {
+      scoped_lock lock(publishing_mtx_);
+      rc = transmit(m, queue, now_us());
+    }
+
+    if (sender)
+      sender->on_message_sent(m, rc);
+
+    return rc;
+  }
+
+  comm_rc channel::enqueue(communicator* sender, const message& m, atom_t queue) {
+    // the queued copy shares the body with the caller's message
     message msg(m);
-    msg.serialize(&bytes, &props);
     msg.channel_ = this;
+    msg.sender_ = sender;
     msg.meta_.queue = queue;
+    msg.meta_.sent_us = now_us();
+
+    message dropped;
+    bool is_dropped = false;
+    {
+      scoped_lock lock(outbound_mtx_);
+
+      if (outbound_capacity_ > 0 && outbound_.size() >= outbound_capacity_) {
+        switch (overflow_) {
+          case overflow_t::block:
+            INC_STAT(stat_outbound_waits)
+            while (flushing_ && outbound_.size() >= outbound_capacity_)
+              outbound_space_cnd_.wait(lock);
+
+            // woken up by close(), nobody would flush it anymore
+            if (!flushing_) {
+              lock.unlock();
+              if (sender)
+                sender->on_message_sent(m, comm_rc::link_unavailable);
+              return comm_rc::link_unavailable;
+            }
+            break;
+          case overflow_t::drop_oldest:
+            dropped = outbound_.front();
+            outbound_.pop_front();
+            is_dropped = true;
+            DEC_STAT(stat_outbound_depth)
+            break;
+          case overflow_t::drop_newest:
+            dropped = msg;
+            is_dropped = true;
+            break;
+          case overflow_t::fail:
+            INC_STAT(stat_outbound_refusals)
+            lock.unlock();
+            if (sender)
+              sender->on_message_sent(m, comm_rc::queue_full);
+            return comm_rc::queue_full;
+        }
+      }
+
+      if (!is_dropped || overflow_ == overflow_t::drop_oldest) {
+        if (outbound_.empty())
+          outbound_since_ = microsec_clock::universal_time();
+
+        outbound_.push_back(msg);
+        INC_STAT(stat_outbound_depth)
+
+        if (outbound_.size() >= flush_size())
+          outbound_cnd_.notify_one();
+      }
+    }
+
+    if (is_dropped) {
+      INC_STAT(stat_outbound_drops)
+      if (dropped.sender_)
+        dropped.sender_->on_message_sent(dropped, comm_rc::dropped);
+    }
+
+    // the caller's own message was the one discarded
+    if (is_dropped && overflow_ == overflow_t::drop_newest)
+      return comm_rc::dropped;
+
+    return comm_rc::queued;
+  }
+
+  bool channel::publish_locally(const message& m, string_t const& routing_key, atom_t queue) {
+    // the same rule the consumers apply to deliveries from the broker
+    if (!m.get_reply_to().empty() && m.get_reply_to() != algol_app().fqn)
+      return false;
+
+    if (exchange_ == exchange_t::direct) {
+      {
+        subscribers_snapshot table(*this);
+
+        subscribers_t::const_iterator finder = table->find(queue);
+        if (finder == table->end() || finder->second.subscribers.empty())
+          return false;
+      }
+
+      return deliver_locally(m, routing_key, queue);
+    }
+
+    std::vector<atom_t> queues;
+    {
+      subscribers_snapshot table(*this);
+
+      if (exchange_ == exchange_t::fanout) {
+        for (auto const& pair : *table)
+          if (!pair.second.subscribers.empty())
+            queues.push_back(pair.first);
+      } else {
+        table.routes()->match(routing_key, queues);
+
+        queues.erase(std::remove_if(queues.begin(), queues.end(), [&table](atom_t q) -> bool {
+          subscribers_t::const_iterator finder = table->find(q);
+          return finder == table->end() || finder->second.subscribers.empty();
+        }), queues.end());
+      }
+    }
+
+    bool delivered = false;
+    for (auto q : queues)
+      delivered = deliver_locally(m, routing_key, q) || delivered;
+
+    return delivered;
+  }
+
+  bool channel::deliver_locally(const message& m, string_t const& routing_key, atom_t queue) {
+    message msg(m);
+    msg.channel_ = this;
+    msg.sender_ = nullptr;
+    msg.meta_.queue = queue;
+    msg.meta_.sent_us = now_us();
+    msg.routing_key_ = routing_key;
+    msg.set_timestamp(time(NULL));
+
+    return station::singleton().local_transport().deliver(msg);
+  }
+
+  size_t channel::ordering_key(const message& msg) {
+    if (station::singleton().config.dispatch_ordering == "correlation_id" && !msg.get_correlation_id().empty())
+      return std::hash<string_t>()(msg.get_correlation_id());
+
+    // spreads the atoms of the channel over the high bits
+    return ((size_t) msg.channel_->atom_ * 0x9E3779B1u) ^ msg.meta_.queue;
+  }
+
+  bool channel::set_compression(string_t const& name, int level, size_t threshold) {
+    codec::algorithm_t algorithm;
+    if (!codec::parse(name, algorithm)) {
+      log_->warnStream() << "unknown or unavailable codec '" << name << "'";
+      return false;
+    }
+
+    compression_ = algorithm;
+    compression_level_ = level;
+    compression_threshold_ = threshold;
+    return true;
+  }
+
+  comm_rc channel::transmit(const message& m, const string_t& queue, uint64_t sent_us) {
+    // the copy shares the content with the caller's message until it's compressed
+    message msg(m);
+    if (compression_ != codec::algorithm_t::none && m.body().size() >= compression_threshold_)
+      msg.compress(compression_, compression_level_);
+
+    amqp_bytes_t bytes;
+    amqp_basic_properties_t props;
+    message::sent_stamp stamp(sent_us);
+    msg.serialize(&bytes, &props, stamp);
+
+    if (log_->isDebugEnabled()) {
+      log_->debugStream() << "publishing message to " << queue << ":";
+      msg.dump(log_->debugStream());
+    }
+
+    int rc;
+    {
+      scoped_lock lock(link_->io_mutex());
+      rc = amqp_basic_publish(link_->state(),
+        ch_,
+        amqp_cstring_bytes(id_.c_str()),
+        amqp_cstring_bytes(queue.c_str()),
+        0,
+        0,
+        &props,
+        bytes);
+    }
+
+    if (rc < 0) {
+      log_->errorStream() << "publishing to " << queue << " failed (" << rc << ")";
+      return comm_rc::link_unavailable;
+    }
+
+    return comm_rc::success;
+  }
+
+  size_t channel::flush_size() const {
+    // without batching or envelopes, every message is written as soon as it's queued
+    if (confirming_)
+      return std::max<size_t>(station::singleton().config.publish_batch_size, 1);
+
+    return enveloping_ ? max_async_batch : 1;
+  }
+
+  void channel::flush_outbound() {
+    const size_t batch_size = flush_size();
+    const size_t max_batch = confirming_ ? batch_size : max_async_batch;
+    const milliseconds linger(confirming_
+      ? station::singleton().config.publish_linger_ms
+      : station::singleton().config.envelope_linger_ms);
+
+    std::vector<message> batch;
+    batch.reserve(max_batch);
+
+    for (;;) {
+      {
+        scoped_lock lock(outbound_mtx_);
+
+        while (flushing_ && outbound_.size() < batch_size) {
+          if (outbound_.empty()) {
+            outbound_cnd_.wait(lock);
+            continue;
+          }
+
+          if (!outbound_cnd_.timed_wait(lock, outbound_since_ + linger))
+            break;
+        }
+
+        while (!outbound_.empty() && batch.size() < max_batch) {
+          batch.push_back(outbound_.front());
+          outbound_.pop_front();
+          DEC_STAT(stat_outbound_depth)
+        }
+
+        if (!batch.empty() && outbound_capacity_ > 0)
+          outbound_space_cnd_.notify_all();
+
+        if (!outbound_.empty())
+          outbound_since_ = microsec_clock::universal_time();
+        else if (!flushing_ && batch.empty())
+          break;
+      }
+
+      if (!batch.empty()) {
+        scoped_lock lock(publishing_mtx_);
+
+        if (enveloping_)
+          write_enveloped(batch);
+        else
+          for (auto const& msg : batch)
+            write(msg, &msg, 1);
+
+        log_->debugStream() << "flushed " << batch.size() << " messages";
+        batch.clear();
+      }
+    }
+
+    // give the broker a chance to confirm whatever is still in-flight
+    scoped_lock confirm_lock(confirm_mtx_);
+    boost::posix_time::ptime deadline = microsec_clock::universal_time() + milliseconds(1000);
+    while (!unconfirmed_.empty()) {
+      if (!confirm_cnd_.timed_wait(confirm_lock, deadline))
+        break;
+    }
+
+    for (auto pair : unconfirmed_) {
+      if (pair.second.sender_)
+        pair.second.sender_->on_message_sent(pair.second, comm_rc::link_unavailable);
+    }
+    unconfirmed_.clear();
+  }
+
+  void channel::write(const message& msg, const message* members, size_t nr_members) {
+    if (!confirming_) {
+      comm_rc rc = transmit(msg, msg.get_queue(), msg.meta_.sent_us);
+      for (size_t i = 0; i < nr_members; ++i)
+        if (members[i].sender_)
+          members[i].sender_->on_message_sent(members[i], rc);
+      return;
+    }
+
+    uint64_t tag = publish_seq_++;
+    {
+      // tracked before it's written, the confirm could beat us to it
+      scoped_lock confirm_lock(confirm_mtx_);
+      for (size_t i = 0; i < nr_members; ++i)
+        unconfirmed_.insert(std::make_pair(tag, members[i]));
+    }
+
+    comm_rc rc = transmit(msg, msg.get_queue(), msg.meta_.sent_us);
+
+    if (rc != comm_rc::success) {
+      {
+        scoped_lock confirm_lock(confirm_mtx_);
+        unconfirmed_.erase(tag);
+      }
+
+      for (size_t i = 0; i < nr_members; ++i)
+        if (members[i].sender_)
+          members[i].sender_->on_message_sent(members[i], rc);
+    }
+  }
+
+  void channel::write_enveloped(std::vector<message> const& batch) {
+    // a message that can't be enveloped has its queue's envelope written
+    // first, so that the messages of a queue are still written in order
+    std::map<atom_t, std::unique_ptr<envelope> > envelopes;
+
+    for (auto const& msg : batch) {
+      std::unique_ptr<envelope>& env = envelopes[msg.meta_.queue];
+
+      if (msg.body().size() > envelope_threshold_) {
+        if (env)
+          write_envelope(*env);
+
+        write(msg, &msg, 1);
+        continue;
+      }
+
+      if (!env)
+        env.reset(new envelope());
+      else if (env->size() + msg.body().size() > envelope_max_bytes_)
+        write_envelope(*env);
+
+      if (!env->add(msg, msg.meta_.sent_us)) {
+        log_->warnStream() << "unable to envelope a message to " << msg.get_queue() << ", sending it alone";
+        write_envelope(*env);
+        write(msg, &msg, 1);
+      }
+    }
+
+    for (auto& pair : envelopes)
+      if (pair.second)
+        write_envelope(*pair.second);
+  }
+
+  void channel::write_envelope(envelope& env) {
+    std::vector<message> const& members = env.members();
+
+    if (members.size() == 1)
+      write(members.front(), &members.front(), 1);
+    else if (!members.empty())
+      write(env.seal(), members.data(), members.size());
+
+    env.clear();
+  }
+
+  void channel::on_frame(amqp_frame_t const& frame) {
+    if (frame.frame_type != AMQP_FRAME_METHOD)
+      return;
+
+    if (frame.payload.method.id == AMQP_BASIC_ACK_METHOD) {
+      amqp_basic_ack_t *ack = (amqp_basic_ack_t*) frame.payload.method.decoded;
+      if (spool_)
+        spool_->confirm(ack->delivery_tag, ack->multiple);
+      else
+        confirm(ack->delivery_tag, ack->multiple, comm_rc::success);
+    }
+    else if (frame.payload.method.id == AMQP_BASIC_NACK_METHOD) {
+      amqp_basic_nack_t *nack = (amqp_basic_nack_t*) frame.payload.method.decoded;
+      if (spool_)
+        spool_->rewind();
+      else
+        confirm(nack->delivery_tag, nack->multiple, comm_rc::rejected);
+    }
+    else if (frame.payload.method.id == AMQP_CHANNEL_CLOSE_METHOD) {
+      log_->errorStream() << "publishing channel was closed by the broker";
+      on_link_lost();
+    }
+
+    link_->release_buffers(ch_);
+  }
+
+  void channel::on_link_lost() {
+    if (spool_)
+      spool_->rewind();
+
+    fail_unconfirmed();
+
+    publisher_lost_ = true;
+    schedule_recovery();
+  }
+
+  void channel::fail_unconfirmed() {
+    scoped_lock lock(confirm_mtx_);
+    for (auto pair : unconfirmed_) {
+      if (pair.second.sender_)
+        pair.second.sender_->on_message_sent(pair.second, comm_rc::link_unavailable);
+    }
+    unconfirmed_.clear();
+    confirm_cnd_.notify_all();
+  }
+
+  void channel::schedule_recovery() {
+    scoped_lock lock(recovery_mtx_);
+
+    if (!recovery_enabled_)
+      return;
+
+    // the recoverer looks again before it's done
+    has_lost_ = true;
+    if (recovering_)
+      return;
+
+    // it's done already if it's not recovering
+    if (recoverer_.joinable())
+      recoverer_.join();
+
+    recovering_ = true;
+    recoverer_ = boost::thread(boost::bind(&channel::recover_lost, this));
+  }
+
+  void channel::recover_lost() {
+    uint32_t retry_ms = 0;
 
-    log_->debugStream() << "publishing message:";
-    msg.dump(log_->debugStream());
+    for (;;) {
+      {
+        scoped_lock lock(recovery_mtx_);
+        if (!has_lost_ || !recovery_enabled_) {
+          recovering_ = false;
+          return;
+        }
 
-    amqp_basic_publish(conn_,
-      1,
-      amqp_cstring_bytes(id_.c_str()),
-      amqp_cstring_bytes(queue.c_str()),
-      0,
-      0,
-      &props,
-      bytes);
+        has_lost_ = false;
+      }
+
+      if (recover()) {
+        INC_STAT(stat_recoveries)
+        retry_ms = 0;
+        continue;
+      }
+
+      retry_ms = std::min(std::max(retry_ms * 2, min_recovery_ms), max_recovery_ms);
+      log_->warnStream() << "unable to recover from the loss of the broker's connection, retrying in " << retry_ms << "ms";
+
+      scoped_lock lock(recovery_mtx_);
+      has_lost_ = true;
+
+      boost::posix_time::ptime deadline = microsec_clock::universal_time() + milliseconds(retry_ms);
+      while (recovery_enabled_ && recovery_cnd_.timed_wait(lock, deadline))
+        ;
+    }
+  }
+
+  bool channel::recover() {
+    try {
+      if (publisher_lost_.exchange(false)) {
+        try {
+          reopen();
+        } catch (connection_error&) {
+          publisher_lost_ = true;
+          throw;
+        }
+      }
+
+      // the consumers are started over, the deliveries of the lost ones are
+      // redelivered by the broker
+      consumers_t lost;
+      {
+        scoped_lock lock(subscription_mtx_);
+        for (consumers_t::iterator it = consumers_.begin(); it != consumers_.end();) {
+          if (!(*it)->is_lost()) {
+            ++it;
+            continue;
+          }
+
+          lost.push_back(*it);
+          it = consumers_.erase(it);
+        }
+      }
+
+      for (auto c : lost) {
+        c->stop();
+        delete c;
+      }
+
+      // starting them over declares the queues again, which the broker
+      // might have lost along with the connection
+      std::vector<string_t> queues;
+      {
+        subscribers_snapshot table(*this);
+        for (auto const& pair : *table)
+          if (!pair.second.subscribers.empty())
+            queues.push_back(atoms::name(pair.first));
+      }
+
+      for (auto const& queue : queues)
+        accept(queue);
+
+      if (!lost.empty())
+        log_->infoStream() << "restarted the consumers of " << queues.size() << " queues";
+    } catch (connection_error &e) {
+      log_->errorStream() << "recovering failed; cause: " << e.what();
+      return false;
+    }
+
+    return true;
+  }
+
+  void channel::reopen() {
+    link *l = station::singleton().acquire_link();
+    amqp_channel_t ch = l->open_channel(this);
+
+    try {
+      declare(l, ch);
+    } catch (connection_error&) {
+      l->close_channel(ch);
+      throw;
+    }
+
+    link *lost_link;
+    amqp_channel_t lost_ch;
+    {
+      scoped_lock lock(publishing_mtx_);
+      lost_link = link_;
+      lost_ch = ch_;
+      link_ = l;
+      ch_ = ch;
+
+      // the broker numbers the messages of a new channel from 1 again; the
+      // tags of what was sent on the lost one could be mistaken for theirs
+      publish_seq_ = 1;
+      fail_unconfirmed();
+      if (spool_)
+        spool_->rewind();
+    }
+
+    // the link can be reaped once it has no channels left
+    lost_link->close_channel(lost_ch);
+
+    if (spool_)
+      spool_->resume();
+
+    log_->infoStream() << "reopened on channel #" << ch;
+  }
+
+  void channel::declare(link* l, amqp_channel_t ch) {
+    scoped_lock lock(l->io_mutex());
+
+    amqp_exchange_declare(l->state(), ch, amqp_cstring_bytes(id_.c_str()), amqp_cstring_bytes(exchange_type_name(exchange_)), is_passive_, is_durable_, amqp_empty_table);
+    if (amqp_get_rpc_reply(l->state()).reply_type != AMQP_RESPONSE_NORMAL)
+      throw connection_error("Declaring exchange");
+
+    // the spool moves past what it replays only once it's confirmed
+    if (station::singleton().config.publish_batch_size > 0 || !station::singleton().config.spool_dir.empty()) {
+      amqp_confirm_select(l->state(), ch);
+      if (amqp_get_rpc_reply(l->state()).reply_type != AMQP_RESPONSE_NORMAL)
+        throw connection_error("Enabling publisher confirms");
+    }
+  }
+
+  void channel::confirm(uint64_t delivery_tag, bool multiple, comm_rc rc) {
+    scoped_lock lock(confirm_mtx_);
+
+    // the members of an envelope are all confirmed by its tag
+    std::pair<unconfirmed_t::iterator, unconfirmed_t::iterator> range = multiple
+      ? std::make_pair(unconfirmed_.begin(), unconfirmed_.upper_bound(delivery_tag))
+      : unconfirmed_.equal_range(delivery_tag);
+
+    if (range.first == range.second && !multiple)
+      return;
+
+    unconfirmed_t::iterator first = range.first, last = range.second;
+
+    for (unconfirmed_t::iterator i = first; i != last; ++i) {
+      if (i->second.sender_)
+        i->second.sender_->on_message_sent(i->second, rc);
+    }
+
+    unconfirmed_.erase(first, last);
+
+    if (unconfirmed_.empty())
+      confirm_cnd_.notify_all();
+  }
+
+  void channel::release(communicator* c) {
+    {
+      scoped_lock lock(outbound_mtx_);
+      for (auto& msg : outbound_)
+        if (msg.sender_ == c)
+          msg.sender_ = nullptr;
+    }
+
+    scoped_lock lock(confirm_mtx_);
+    for (auto& pair : unconfirmed_)
+      if (pair.second.sender_ == c)
+        pair.second.sender_ = nullptr;
   }
 
   void channel::open(int durable, int passive) {
@@ -77,32 +761,89 @@ namespace algol {
     is_durable_ = durable;
     is_passive_ = passive;
 
-    const char *host  = station::singleton().config.host.c_str();
-    int         port  = utility::convertTo<int>(station::singleton().config.port);
-    const char *un    = station::singleton().config.username.c_str();
-    const char *pw    = station::singleton().config.password.c_str();
-    const char *vhost = station::singleton().config.vhost.c_str();
+    loopback_ = station::singleton().config.loopback != "off";
+    loopback_only_ = station::singleton().config.loopback == "only";
 
-    conn_ = amqp_new_connection();
+    if (loopback_only_) {
+      log_->infoStream() << "open (loopback only)";
+      open_ = true;
+      return;
+    }
 
-    if ((socket_ = amqp_open_socket(host, port)) < 0)
-      throw connection_error("Opening socket with RabbitMQ broker");
+    link_ = station::singleton().acquire_link();
+    ch_ = link_->open_channel(this);
 
-    amqp_set_sockfd(conn_, socket_);
+    try {
+      declare(link_, ch_);
+    } catch (connection_error&) {
+      link_->close_channel(ch_);
+      link_ = nullptr;
+      throw;
+    }
 
-    if (amqp_login(conn_, vhost, 0, 131072, 0, AMQP_SASL_METHOD_PLAIN, un, pw).reply_type != AMQP_RESPONSE_NORMAL)
-      throw connection_error("Logging in to RabbitMQ");
+    confirming_ = station::singleton().config.publish_batch_size > 0;
+    enveloping_ = station::singleton().config.publish_envelopes;
+    envelope_threshold_ = station::singleton().config.envelope_threshold;
+    envelope_max_bytes_ = station::singleton().config.envelope_max_bytes;
 
-    // open the broker connection
-    amqp_channel_open(conn_, 1);
-    if (amqp_get_rpc_reply(conn_).reply_type != AMQP_RESPONSE_NORMAL)
-      throw connection_error("Opening channel " + id_);
+    if (confirming_ || enveloping_ || station::singleton().config.publish_async) {
+      string_t const& overflow = station::singleton().config.outbound_overflow;
+      outbound_capacity_ = station::singleton().config.outbound_capacity;
+      overflow_ =
+        overflow == "drop_oldest" ? overflow_t::drop_oldest :
+        overflow == "drop_newest" ? overflow_t::drop_newest :
+        overflow == "fail"        ? overflow_t::fail :
+                                    overflow_t::block;
 
-    amqp_exchange_declare(conn_, 1, amqp_cstring_bytes(id_.c_str()), amqp_cstring_bytes("direct"), passive, durable, amqp_empty_table);
-    if (amqp_get_rpc_reply(conn_).reply_type != AMQP_RESPONSE_NORMAL)
-      throw connection_error("Declaring exchange");
+      flushing_ = true;
+      flusher_ = boost::thread(boost::bind(&channel::flush_outbound, this));
+
+      if (confirming_)
+        log_->infoStream()
+          << "publishing in batches of " << station::singleton().config.publish_batch_size
+          << " (linger: " << station::singleton().config.publish_linger_ms << "ms)";
+      else
+        log_->infoStream() << "publishing asynchronously";
+
+      if (enveloping_)
+        log_->infoStream()
+          << "enveloping messages up to " << envelope_threshold_ << " bytes in envelopes of up to "
+          << envelope_max_bytes_ << " bytes";
+    }
+
+    // the broker numbers the messages of a new channel from 1
+    publish_seq_ = 1;
+
+    if (!station::singleton().config.spool_dir.empty()) {
+      spool_ = new spool(station::singleton().config.spool_dir, id_);
+
+      // everything published goes through the spool, so its replays have
+      // the channel's delivery tags to themselves
+      bool is_spooling = spool_->open([this](const message& msg, string_t const& queue, uint64_t sent_us, uint64_t& tag) -> bool {
+        scoped_lock lock(publishing_mtx_);
+        tag = publish_seq_;
+        if (transmit(msg, queue, sent_us ? sent_us : now_us()) != comm_rc::success)
+          return false;
 
-    log_->infoStream() << "open";
+        ++publish_seq_;
+        return true;
+      });
+
+      if (is_spooling) {
+        log_->infoStream() << "spooling to " << station::singleton().config.spool_dir;
+      } else {
+        log_->errorStream() << "unable to open the spool, publishing without it";
+        delete spool_;
+        spool_ = nullptr;
+      }
+    }
+
+    {
+      scoped_lock lock(recovery_mtx_);
+      recovery_enabled_ = true;
+    }
+
+    log_->infoStream() << "open on channel #" << ch_;
     open_ = true;
   }
 
@@ -113,10 +854,36 @@ namespace algol {
     }
 
     log_->infoStream() << "closing";
-    for (auto pair : subscribers_) {
-      pair.second.clear();
+
+    // nothing is reopened from here on
+    {
+      scoped_lock lock(recovery_mtx_);
+      recovery_enabled_ = false;
+      recovery_cnd_.notify_all();
+    }
+
+    if (recoverer_.joinable())
+      recoverer_.join();
+
+    // what it can't send now is sent by the next run; it's deleted once
+    // the link no longer routes its confirms to us
+    if (spool_)
+      spool_->close();
+
+    if (flushing_) {
+      {
+        scoped_lock lock(outbound_mtx_);
+        flushing_ = false;
+        outbound_cnd_.notify_one();
+        outbound_space_cnd_.notify_all();
+      }
+
+      flusher_.join();
+    }
+    {
+      scoped_lock lock(subscription_mtx_);
+      publish_subscribers(new subscribers_t());
     }
-    subscribers_.clear();
 
     while (!consumers_.empty()) {
       consumers_.back()->stop();
@@ -124,20 +891,115 @@ namespace algol {
       consumers_.pop_back();
     }
 
-    acceptors_.join_all();
+    if (link_) {
+      link_->close_channel(ch_);
+      link_ = nullptr;
+    }
 
-    amqp_channel_close(conn_, 1, AMQP_REPLY_SUCCESS);
-    amqp_connection_close(conn_, AMQP_REPLY_SUCCESS);
-    amqp_destroy_connection(conn_);
+    delete spool_;
+    spool_ = nullptr;
 
     open_ = false;
 
     log_->infoStream() << "closed";
   }
 
+  void channel::set_dispatch_priorities(queue_id_t const& queue, bool on) {
+    const atom_t queue_atom = atoms::intern(queue);
+
+    scoped_lock lock(subscription_mtx_);
+
+    if (on)
+      prioritized_.insert(queue_atom);
+    else
+      prioritized_.erase(queue_atom);
+
+    for (auto c : consumers_)
+      if (c->queue_atom() == queue_atom)
+        c->set_prioritized(on);
+  }
+
+  void channel::set_exclusive(queue_id_t const& queue) {
+    scoped_lock lock(subscription_mtx_);
+    exclusive_.insert(atoms::intern(queue));
+  }
+
+  void channel::set_shards(queue_id_t const& queue, size_t nr_shards) {
+    const atom_t queue_atom = atoms::intern(queue);
+    bool is_consumed = false;
+    {
+      scoped_lock lock(subscription_mtx_);
+
+      if (nr_shards > 1)
+        shards_[queue_atom] = nr_shards;
+      else
+        shards_.erase(queue_atom);
+
+      for (auto c : consumers_)
+        is_consumed = is_consumed || c->queue_atom() == queue_atom;
+    }
+
+    if (!is_consumed)
+      return;
+
+    try {
+      accept(queue);
+    } catch (connection_error &e) {
+      log_->errorStream() << "unable to add consumers to " << queue << "; cause: " << e.what();
+    }
+  }
+
   void channel::accept(const string_t &queue) {
-    consumers_.push_back(new consumer(this, queue));
-    acceptors_.create_thread(boost::bind(&channel::consumer::consume, consumers_.back()));
+    const atom_t queue_atom = atoms::intern(queue);
+
+    scoped_lock accept_lock(accept_mtx_);
+
+    size_t nr_shards = 1;
+    bool exclusive;
+    std::vector<link*> taken; // the shards are kept on separate connections while there are enough
+    {
+      scoped_lock lock(subscription_mtx_);
+
+      // the other connections couldn't consume an exclusive queue
+      exclusive = exclusive_.count(queue_atom) > 0;
+
+      std::map<atom_t, size_t>::const_iterator finder = shards_.find(queue_atom);
+      if (finder != shards_.end() && !exclusive)
+        nr_shards = finder->second;
+
+      for (auto c : consumers_)
+        if (c->queue_atom() == queue_atom)
+          taken.push_back(c->get_link());
+    }
+
+    for (size_t shard = taken.size(); shard < nr_shards; ++shard) {
+      consumer *c = new consumer(this, queue, shard);
+      c->set_exclusive(exclusive);
+      {
+        scoped_lock lock(subscription_mtx_);
+        c->set_prioritized(prioritized_.count(queue_atom) > 0);
+      }
+
+      try {
+        c->consume(taken);
+      } catch (connection_error& e) {
+        delete c;
+
+        // the queue is consumed as long as one of them is
+        if (shard == 0)
+          throw;
+
+        log_->errorStream() << "unable to start consumer #" << shard << " of " << queue << "; cause: " << e.what();
+        return;
+      }
+
+      taken.push_back(c->get_link());
+
+      // the priorities might have changed while it was starting
+      scoped_lock lock(subscription_mtx_);
+      c->set_prioritized(prioritized_.count(queue_atom) > 0);
+      consumers_.push_back(c);
+    }
   }
 
   bool channel::is_open() const {
@@ -145,79 +1007,210 @@ namespace algol {
   }
 
   bool channel::subscribe(queue_id_t const& queue, communicator* c) {
-    scoped_lock lock(subscription_mtx_);
+    const atom_t queue_atom = atoms::intern(queue);
+    bool first;
+    {
+      scoped_lock lock(subscription_mtx_);
 
-    if (is_subscribed(queue, c))
-      return false;
+      if (is_subscribed(queue, c))
+        return false;
 
-    if (subscribers_.find(queue) == subscribers_.end()) {
-      subscribers_.insert(std::make_pair(queue, queue_subscribers_t()));
-      accept(queue);
+      subscribers_t *table = new subscribers_t(*subscribers_.load());
+
+      first = table->find(queue_atom) == table->end();
+
+      queue_t& q = (*table)[queue_atom];
+      if (first) {
+        const string_t name = "messaging: " + id_ + "/" + queue;
+        monitor& m = monitor::singleton();
+        q.latency = &m.hist_stat(m.track_hist_stat(name + " latency (us)"));
+        q.handling = &m.hist_stat(m.track_hist_stat(name + " handling (us)"));
+      }
+      q.subscribers.push_back(c);
+
+      publish_subscribers(table);
     }
 
-    subscribers_.find(queue)->second.push_back(c);
+    if (!first || loopback_only_)
+      return true;
+
+    // the consumer is started without holding the lock; its RPCs wait on the
+    // link, whose reactor thread might be dispatching to us at the moment
+    try {
+      accept(queue);
+    } catch (connection_error &e) {
+      log_->errorStream() << "unable to consume " << queue << "; cause: " << e.what();
+
+      // others might have subscribed to the queue in the meantime
+      scoped_lock lock(subscription_mtx_);
+      subscribers_t *table = new subscribers_t(*subscribers_.load());
+      subscribers_t::iterator finder = table->find(queue_atom);
+      if (finder != table->end()) {
+        queue_subscribers_t& subs = finder->second.subscribers;
+        queue_subscribers_t::iterator self = std::find(subs.begin(), subs.end(), c);
+        if (self != subs.end())
+          subs.erase(self);
+
+        if (subs.empty())
+          table->erase(finder);
+      }
+      publish_subscribers(table);
+      return false;
+    }
 
     return true;
   }
 
   bool channel::unsubscribe(queue_id_t const& queue, communicator* c) {
-    scoped_lock lock(subscription_mtx_);
+    uint64_t retired_at;
+    {
+      scoped_lock lock(subscription_mtx_);
 
-    if (!is_subscribed(queue, c))
-      return false;
+      if (!is_subscribed(queue, c))
+        return false;
 
-    queue_subscribers_t& subs = subscribers_.find(queue)->second;
+      subscribers_t *table = new subscribers_t(*subscribers_.load());
+      queue_subscribers_t& subs = (*table)[atoms::intern(queue)].subscribers;
+      subs.erase(std::find(subs.begin(), subs.end(), c));
 
-    for (queue_subscribers_t::iterator i = subs.begin(); i != subs.end(); ++i)
-      if ((*i) == c) {
-        subs.erase(i);
-        return true;
-      }
+      retired_at = publish_subscribers(table);
+    }
 
-    return false;
+    // the handlers dispatching to it with the old table must be done before
+    // the caller can destroy it; that's waited for without the lock, since
+    // those handlers might be (un)subscribing themselves. A handler can't
+    // wait on the others, the old table is reclaimed later then
+    if (!readers_.synchronize(retired_at))
+      log_->debugStream() << "unsubscribed from a handler, not waiting for the other handlers";
+
+    scoped_lock lock(subscription_mtx_);
+    reclaim();
+
+    return true;
   }
 
   void channel::unsubscribe_all(communicator* c) {
-    // scoped_lock lock(subscription_mtx_);
+    uint64_t retired_at;
+    {
+      scoped_lock lock(subscription_mtx_);
+
+      subscribers_t *table = new subscribers_t(*subscribers_.load());
+      bool found = false;
+
+      for (auto& pair : *table) {
+        queue_subscribers_t& subs = pair.second.subscribers;
+        queue_subscribers_t::iterator finder = std::find(subs.begin(), subs.end(), c);
+        if (finder != subs.end()) {
+          subs.erase(finder);
+          found = true;
+        }
+      }
 
-    for (auto pair : subscribers_) {
-      unsubscribe(pair.first, c);
+      if (!found) {
+        delete table;
+        return;
+      }
+
+      retired_at = publish_subscribers(table);
     }
+
+    if (!readers_.synchronize(retired_at))
+      log_->debugStream() << "unsubscribed from a handler, not waiting for the other handlers";
+
+    scoped_lock lock(subscription_mtx_);
+    reclaim();
   }
 
   bool channel::is_subscribed(queue_id_t const& queue, communicator* c) const {
-    subscribers_t::const_iterator finder = subscribers_.find(queue);
-    if (finder == subscribers_.end())
+    subscribers_snapshot table(*this);
+
+    subscribers_t::const_iterator finder = table->find(atoms::intern(queue));
+    if (finder == table->end())
       return false;
 
-    for (auto s : finder->second)
+    for (auto s : finder->second.subscribers)
       if (s == c)
         return true;
 
     return false;
   }
 
+  uint64_t channel::publish_subscribers(subscribers_t* table) {
+    retired_t retired;
+    retired.routes = nullptr;
+
+    // fanout channels route to every queue, they only need the table
+    if (exchange_ == exchange_t::topic) {
+      routing_trie *routes = new routing_trie();
+      for (auto const& pair : *table)
+        routes->bind(atoms::name(pair.first), pair.first);
+      routes->compile();
+
+      retired.routes = routes_.exchange(routes);
+    }
+
+    retired.table = subscribers_.exchange(table);
+
+    // only the readers that pinned an older epoch can hold what was replaced
+    retired.epoch = readers_.advance();
+    retired_.push_back(retired);
+
+    reclaim();
+
+    return retired.epoch;
+  }
+
+  void channel::reclaim() {
+    std::vector<retired_t>::iterator kept = std::remove_if(retired_.begin(), retired_.end(),
+      [this](retired_t const& retired) -> bool {
+        if (!readers_.has_passed(retired.epoch))
+          return false;
+
+        delete retired.table;
+        delete retired.routes;
+        return true;
+      });
+
+    retired_.erase(kept, retired_.end());
+  }
+
   void channel::dispatch(const message& msg) {
-    scoped_lock lock(subscription_mtx_);
+    // the table is pinned, not locked, while the handlers run so that they
+    // can't block (or deadlock) subscription changes
+    subscribers_snapshot table(*this);
 
-    subscribers_t::iterator finder = subscribers_.find(msg.get_queue());
-    if (finder == subscribers_.end()) {
+    subscribers_t::const_iterator finder = table->find(msg.meta_.queue);
+    if (finder == table->end()) {
       log_->warnStream() << "no subscribers found for queue " << msg.get_queue() <<  ", discarding message";
       return;
     }
 
-    log_->debugStream() << "dispatching message to " << finder->second.size() << " subscribers";
-    for (auto s : finder->second) {
+    queue_t const& q = finder->second;
+
+    // locally routed messages carry their stamp in the meta, received ones in the header
+    uint64_t sent_us = msg.meta_.sent_us;
+    int64_t stamp;
+    if (!sent_us && msg.headers().get(message::sent_header, stamp) && stamp > 0)
+      sent_us = stamp;
+
+    const uint64_t dispatched_us = now_us();
+    if (sent_us)
+      q.latency->record(dispatched_us > sent_us ? dispatched_us - sent_us : 0);
+
+    log_->debugStream() << "dispatching message to " << q.subscribers.size() << " subscribers";
+    for (auto s : q.subscribers) {
       s->on_message_received(msg);
     }
     log_->debugStream() << "done!";
+
+    q.handling->record(now_us() - dispatched_us);
   }
 
   int channel::__socket() {
-    return socket_;
+    return link_ ? link_->socket() : -1;
   }
 
   amqp_connection_state_t& channel::__connection() {
-    return conn_;
+    return link_->state();
   }
 } // end of namespace algol
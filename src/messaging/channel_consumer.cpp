@@ -18,202 +18,480 @@
 #include "algol/messaging/channel.hpp"
 #include "algol/messaging/station.hpp"
 #include "algol/messaging/message.hpp"
+#include "algol/messaging/message_pool.hpp"
+#include "algol/messaging/message_view.hpp"
+#include "algol/messaging/envelope.hpp"
+#include "algol/messaging/dedup_filter.hpp"
+#include "algol/messaging/atoms.hpp"
 #include "algol/utility.hpp"
 
+#include <algorithm>
+
 namespace algol {
 
-  channel::consumer::consumer(channel* c, const string_t &queue)
-  : logger(string_t("Channel[" + c->id() + "][" + queue + "]").c_str()),
+  typedef boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> scoped_lock;
+  using boost::posix_time::microsec_clock;
+  using boost::posix_time::milliseconds;
+
+  TRACK_STAT(channel::consumer, stat_self_drops, "messaging: self messages dropped")
+  TRACK_STAT(channel::consumer, stat_misdirected_drops, "messaging: misdirected messages dropped")
+
+  channel::consumer::consumer(channel* c, const string_t &queue, size_t shard)
+  : logger(string_t("Channel[" + c->id() + "][" + queue + (shard ? "#" + utility::stringify(shard) : "") + "]").c_str()),
+    link_(nullptr),
+    ch_(0),
     c_(c),
-    queue_(queue)
+    queue_(queue),
+    queue_atom_(atoms::intern(queue)),
+    shard_(shard),
+    turnaround_(nullptr),
+    prioritized_(false),
+    exclusive_(false),
+    dedup_(station::singleton().config.dedup ? &station::singleton().dedup() : nullptr),
+    lost_(false),
+    state_(state_t::awaiting_method),
+    delivery_tag_(0),
+    props_(nullptr),
+    wanted_(false),
+    body_target_(0),
+    body_received_(0),
+    current_(nullptr),
+    routing_key_(amqp_empty_bytes),
+    pool_(std::make_shared<message_pool>(station::singleton().config.message_pool_size)),
+    manual_ack_(station::singleton().config.prefetch_count > 0),
+    ack_batch_size_(station::singleton().config.ack_batch_size),
+    last_tag_(0),
+    acked_tag_(0),
+    nr_in_flight_(0)
   {
+    // acknowledging in batches larger than the prefetch window would stall
+    // the consumer until the ack timer fires
+    if (manual_ack_) {
+      uint16_t window = station::singleton().config.prefetch_count;
+      if (ack_batch_size_ == 0 || ack_batch_size_ > window / 2)
+        ack_batch_size_ = std::max<uint16_t>(window / 2, 1);
+    }
+
+    monitor& m = monitor::singleton();
+    turnaround_ = &m.hist_stat(m.track_hist_stat(
+      "messaging: " + c->id() + "/" + queue + " shard " + utility::stringify(shard) + " turnaround (us)"));
+  }
+
+  channel::consumer::~consumer() {
+    // the dispatcher's tasks refer to us
+    {
+      scoped_lock lock(in_flight_mtx_);
+      while (nr_in_flight_ > 0)
+        in_flight_cnd_.wait(lock);
+    }
 
-    const char *host  = station::singleton().config.host.c_str();
-    int         port  = utility::convertTo<int>(station::singleton().config.port);
-    const char *un    = station::singleton().config.username.c_str();
-    const char *pw    = station::singleton().config.password.c_str();
-    const char *vhost = station::singleton().config.vhost.c_str();
+    if (current_)
+      current_->release();
+
+    c_ = nullptr;
+  }
+
+  atom_t channel::consumer::queue_atom() const {
+    return queue_atom_;
+  }
 
-    conn_ = amqp_new_connection();
+  size_t channel::consumer::shard() const {
+    return shard_;
+  }
 
-    if ((socket_ = amqp_open_socket(host, port)) < 0)
-      throw connection_error("Opening socket with RabbitMQ broker");
+  link* channel::consumer::get_link() const {
+    return link_;
+  }
 
-    amqp_set_sockfd(conn_, socket_);
+  void channel::consumer::set_prioritized(bool on) {
+    prioritized_ = on;
+  }
 
-    if (amqp_login(conn_, vhost, 0, 131072, 0, AMQP_SASL_METHOD_PLAIN, un, pw).reply_type != AMQP_RESPONSE_NORMAL)
-      throw connection_error("Logging in to RabbitMQ");
+  void channel::consumer::set_exclusive(bool on) {
+    exclusive_ = on;
+  }
 
-    // open the broker connection
-    amqp_channel_open(conn_, 1);
-    if (amqp_get_rpc_reply(conn_).reply_type != AMQP_RESPONSE_NORMAL)
-      throw connection_error("Opening channel " + c_->id());
+  void channel::consumer::dispatch(message* msg) {
+    executor& dispatcher = station::singleton().dispatcher();
+
+    if (!dispatcher.is_running()) {
+      // we're on the reactor, which must go on reading whatever the handlers do
+      try {
+        run(msg);
+      } catch (std::exception &e) {
+        log_->errorStream() << "handling a message from (" << msg->get_app_id() << ") failed: " << e.what();
+      } catch (...) {
+        log_->errorStream() << "handling a message failed with an unknown exception";
+      }
+      return;
+    }
 
-    amqp_exchange_declare(conn_, 1, amqp_cstring_bytes(c_->id().c_str()), amqp_cstring_bytes("direct"), c_->is_passive_, c_->is_durable_, amqp_empty_table);
-    if (amqp_get_rpc_reply(conn_).reply_type != AMQP_RESPONSE_NORMAL) {
-      std::ostringstream s;
-      s << "Declaring exchange [" << c_->id()
-        << "]: durable? " << c_->is_durable_
-        << ", passive?" << c_->is_passive_;
-      throw connection_error(s.str());
+    const uint64_t delivery_tag = msg->meta_.delivery_tag;
+    {
+      // delivery tags only grow, and enveloped members share theirs
+      scoped_lock lock(in_flight_mtx_);
+      if (!in_flight_.empty() && in_flight_.back().delivery_tag == delivery_tag)
+        ++in_flight_.back().pending;
+      else
+        in_flight_.push_back({ delivery_tag, 1 });
+      ++nr_in_flight_;
     }
 
+    const uint8_t priority = prioritized_ ? msg->get_priority() : 0;
+
+    // the shards of a queue are ordered independently, so that they don't
+    // all wait on the same lane of the dispatcher
+    const size_t key = channel::ordering_key(*msg) ^ (shard_ * 0x85EBCA6Bu);
+
+    // the task captures two pointers, which std::function stores without allocating
+    dispatcher.submit(key, priority, [this, msg]() -> void {
+      const uint64_t delivery_tag = msg->meta_.delivery_tag;
+
+      // the delivery must be accounted for even if a handler threw, or it
+      // would never be acknowledged and we'd never be destroyed; the
+      // dispatcher reports the exception
+      try {
+        run(msg);
+      } catch (...) {
+        handled(delivery_tag);
+        throw;
+      }
+
+      handled(delivery_tag);
+    });
   }
 
-  channel::consumer::~consumer() {
-    c_ = nullptr;
+  void channel::consumer::run(message* msg) {
+    const uint64_t received_us = msg->meta_.received_us;
+
+    try {
+      if (restore(*msg))
+        c_->dispatch(*msg);
+    } catch (...) {
+      turnaround_->record(channel::now_us() - received_us);
+      msg->release();
+      throw;
+    }
+
+    turnaround_->record(channel::now_us() - received_us);
+    msg->release();
+  }
+
+  bool channel::consumer::restore(message& msg) {
+    if (!msg.is_compressed())
+      return true;
+
+    if (!msg.decompress(station::singleton().config.max_decompressed_size)) {
+      log_->errorStream() << "dropping a message whose " << msg.get_content_encoding() << " content is corrupt";
+      return false;
+    }
+
+    return true;
+  }
+
+  void channel::consumer::handled(uint64_t delivery_tag) {
+    scoped_lock lock(in_flight_mtx_);
+
+    auto entry = std::lower_bound(in_flight_.begin(), in_flight_.end(), delivery_tag,
+      [](in_flight_t const& e, uint64_t tag) { return e.delivery_tag < tag; });
+    --entry->pending;
+
+    // the deliveries handled out of order are kept until those ahead of them are
+    while (!in_flight_.empty() && in_flight_.front().pending == 0)
+      in_flight_.pop_front();
+
+    if (--nr_in_flight_ == 0)
+      in_flight_cnd_.notify_all();
+  }
+
+  void channel::consumer::received(uint64_t delivery_tag) {
+    if (!manual_ack_)
+      return;
+
+    if (last_tag_ == acked_tag_)
+      ack_since_ = microsec_clock::universal_time();
+
+    last_tag_ = delivery_tag;
+
+    if (last_tag_ - acked_tag_ >= ack_batch_size_ ||
+        microsec_clock::universal_time() - ack_since_ >= milliseconds(station::singleton().config.ack_interval_ms))
+      ack();
+  }
+
+  void channel::consumer::ack() {
+    uint64_t upto = last_tag_;
+    {
+      // deliveries are acknowledged with multiple=true, so we can't go past
+      // one whose handlers are still running
+      scoped_lock lock(in_flight_mtx_);
+      if (!in_flight_.empty())
+        upto = in_flight_.front().delivery_tag - 1;
+    }
+
+    ack_since_ = microsec_clock::universal_time();
+
+    if (upto <= acked_tag_)
+      return;
+
+    int rc;
+    {
+      scoped_lock lock(link_->io_mutex());
+      rc = amqp_basic_ack(link_->state(), ch_, upto, 1);
+    }
+
+    if (rc < 0)
+      log_->errorStream() << "acknowledging deliveries up to #" << upto << " failed";
+
+    acked_tag_ = upto;
+  }
+
+  bool channel::consumer::is_lost() const {
+    return lost_;
+  }
+
+  void channel::consumer::on_link_lost() {
+    lost_ = true;
+    c_->schedule_recovery();
   }
 
   void channel::consumer::stop() {
-    amqp_channel_close(conn_, 1, AMQP_REPLY_SUCCESS);
-    amqp_connection_close(conn_, AMQP_REPLY_SUCCESS);
-    amqp_destroy_connection(conn_);
+    if (!link_)
+      return;
+
+    // once this returns, no more frames will be routed to us
+    link_->close_channel(ch_);
+    link_ = nullptr;
   }
 
-  void channel::consumer::consume() {
-    // acceptors_.create_thread([&]() -> void {
+  void channel::consumer::consume(std::vector<link*> const& avoid) {
+    link_ = station::singleton().acquire_link(avoid);
+    ch_ = link_->open_channel(this);
+
+    try {
+      scoped_lock lock(link_->io_mutex());
+      amqp_connection_state_t conn = link_->state();
       amqp_bytes_t queuename;
 
-      // declare the queue
+      // declare the queue; an exclusive one is ours to create, and goes away with the connection
       {
-        amqp_queue_declare_ok_t *r =
-          amqp_queue_declare(conn_, 1, amqp_cstring_bytes((queue_ + "_queue").c_str()), c_->is_passive_, c_->is_durable_, 0, 0, amqp_empty_table);
+        amqp_queue_declare_ok_t *r = exclusive_
+          ? amqp_queue_declare(conn, ch_, amqp_cstring_bytes((queue_ + "_queue").c_str()), 0, 0, 1, 1, amqp_empty_table)
+          : amqp_queue_declare(conn, ch_, amqp_cstring_bytes((queue_ + "_queue").c_str()), c_->is_passive_, c_->is_durable_, 0, 0, amqp_empty_table);
 
-        if (amqp_get_rpc_reply(conn_).reply_type != AMQP_RESPONSE_NORMAL)
+        if (amqp_get_rpc_reply(conn).reply_type != AMQP_RESPONSE_NORMAL)
           throw connection_error("Declaring queue");
 
         queuename = amqp_bytes_malloc_dup(r->queue);
       }
 
       // bind the queue
-      amqp_queue_bind(conn_, 1, queuename, amqp_cstring_bytes(c_->id().c_str()), amqp_cstring_bytes(queue_.c_str()), amqp_empty_table);
-      if (amqp_get_rpc_reply(conn_).reply_type != AMQP_RESPONSE_NORMAL)
+      amqp_queue_bind(conn, ch_, queuename, amqp_cstring_bytes(c_->id().c_str()), amqp_cstring_bytes(queue_.c_str()), amqp_empty_table);
+      if (amqp_get_rpc_reply(conn).reply_type != AMQP_RESPONSE_NORMAL) {
+        amqp_bytes_free(queuename);
         throw connection_error("Binding queue");
+      }
 
-      amqp_basic_consume(conn_, 1, queuename, amqp_empty_bytes, 0, 1, 0, amqp_empty_table);
-      if (amqp_get_rpc_reply(conn_).reply_type != AMQP_RESPONSE_NORMAL)
-        throw connection_error("Consuming");
+      if (manual_ack_) {
+        amqp_basic_qos(conn, ch_, 0, station::singleton().config.prefetch_count, 0);
+        if (amqp_get_rpc_reply(conn).reply_type != AMQP_RESPONSE_NORMAL) {
+          amqp_bytes_free(queuename);
+          throw connection_error("Setting the prefetch window");
+        }
+      }
 
+      amqp_basic_consume(conn, ch_, queuename, amqp_empty_bytes, 0, manual_ack_ ? 0 : 1, 0, amqp_empty_table);
       amqp_bytes_free(queuename);
+      if (amqp_get_rpc_reply(conn).reply_type != AMQP_RESPONSE_NORMAL)
+        throw connection_error("Consuming");
 
-      log_->infoStream() << "Consuming " << queue_;
-      {
-        amqp_frame_t frame;
-        int result;
-
-        amqp_basic_deliver_t *d;
-        amqp_basic_properties_t *p;
-        size_t body_target;
-        size_t body_received;
-        string_t body;
-
-        bool accepting = true;
-
-        while (accepting) {
-          // std::cout << "Wait #1\n";
-          amqp_maybe_release_buffers(conn_);
-          result = amqp_simple_wait_frame(conn_, &frame);
-          // printf("Result %d\n", result);
-          if (result < 0)
-            break;
-
-          // printf("Frame type %d, channel %d\n", frame.frame_type, frame.channel);
-          if (frame.frame_type != AMQP_FRAME_METHOD)
-            continue;
-
-          // printf("Method %s\n", amqp_method_name(frame.payload.method.id));
-          if (frame.payload.method.id == AMQP_CHANNEL_CLOSE_OK_METHOD) {
-            log_->infoStream() << "acceptor: channel seems to be closed";
-            amqp_channel_close_ok_t close_ok;
-            amqp_send_method(conn_, 0, AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok);
-            break;
-          }
-          else if (frame.payload.method.id == AMQP_CONNECTION_CLOSE_OK_METHOD) {
-            log_->infoStream() << "acceptor: connection seems to be closed, stopping";
-            accepting = false;
-            amqp_connection_close_ok_t close_ok;
-            amqp_send_method(conn_, 0, AMQP_CONNECTION_CLOSE_OK_METHOD, &close_ok);
-            break;
-          }
-          else if (frame.payload.method.id != AMQP_BASIC_DELIVER_METHOD)
-            continue;
-
-          d = (amqp_basic_deliver_t *) frame.payload.method.decoded;
-          // printf("Delivery %u, exchange %.*s routingkey %.*s\n",
-          //  (unsigned) d->delivery_tag,
-          //  (int) d->exchange.len, (char *) d->exchange.bytes,
-          //  (int) d->routing_key.len, (char *) d->routing_key.bytes);
-
-          // std::cout << "Wait #2\n";
-          result = amqp_simple_wait_frame(conn_, &frame);
-          if (result < 0)
-            break;
-
-          if (frame.frame_type != AMQP_FRAME_HEADER) {
-            fprintf(stderr, "Expected header!");
-            abort();
-          }
+      amqp_maybe_release_buffers_on_channel(conn, ch_);
+    } catch (connection_error&) {
+      stop();
+      throw;
+    }
 
-          p = (amqp_basic_properties_t *) frame.payload.properties.decoded;
-          if (p->_flags & AMQP_BASIC_CONTENT_TYPE_FLAG) {
-            // printf("Content-type: %.*s\n",
-            // (int) p->content_type.len, (char *) p->content_type.bytes);
-          }
-          // printf("----\n");
-
-          body_target = frame.payload.properties.body_size;
-          body_received = 0;
-          body.clear();
-
-          while (body_received < body_target) {
-            // std::cout << "Wait #3\n";
-            result = amqp_simple_wait_frame(conn_, &frame);
-            if (result < 0)
-              break;
-
-            if (frame.frame_type != AMQP_FRAME_BODY) {
-              fprintf(stderr, "Expected body!");
-              abort();
-            }
-
-            body_received += frame.payload.body_fragment.len;
-            body += string_t(reinterpret_cast<const char*>(frame.payload.body_fragment.bytes), frame.payload.body_fragment.len);
-            assert(body_received <= body_target);
-          }
+    log_->infoStream() << "Consuming " << queue_ << " on channel #" << ch_;
+  }
 
-          // log_->infoStream() << "Expected body size: " << body_target << ", actual: " << body_received;
-
-          string_t queue(reinterpret_cast<const char*>(d->routing_key.bytes), d->routing_key.len);
-          message msg(body);
-
-          msg.deserialize(p); // TODO: optimize, there's no need to deserialize the whole message if it's not for us (see below)
-
-          // we will only dispatch the message if it has no recipient, or the recipient is us
-          if ( msg.get_app_id() != algol_app().fqn &&
-              (msg.get_reply_to().empty() || msg.get_reply_to() == algol_app().fqn) )  {
-            msg.meta_.queue = queue_;
-            msg.channel_ = c_;
-            log_->infoStream() << "dispatching incoming message from (" << msg.get_app_id() << ")";
-            c_->dispatch(msg);
-          } else {
-            if (msg.get_app_id() == algol_app().fqn)
-              log_->infoStream() << "rejecting self message.";
-            else
-              log_->infoStream() << "rejecting message because it's not directed at us (recipient: " << msg.get_reply_to() << ")";
-          }
+  void channel::consumer::on_tick() {
+    // don't sit on handled deliveries while the queue is idle
+    if (last_tag_ > acked_tag_ &&
+        microsec_clock::universal_time() - ack_since_ >= milliseconds(station::singleton().config.ack_interval_ms))
+      ack();
+  }
+
+  void channel::consumer::on_frame(amqp_frame_t const& frame) {
+    switch (state_) {
+      case state_t::awaiting_method: {
+        if (frame.frame_type != AMQP_FRAME_METHOD)
+          break;
+
+        if (frame.payload.method.id == AMQP_CHANNEL_CLOSE_METHOD) {
+          log_->errorStream() << "consuming channel was closed by the broker";
+          on_link_lost();
+          break;
+        }
+        else if (frame.payload.method.id != AMQP_BASIC_DELIVER_METHOD)
+          break;
+
+        amqp_basic_deliver_t *d = (amqp_basic_deliver_t *) frame.payload.method.decoded;
+        delivery_tag_ = d->delivery_tag;
+        routing_key_ = d->routing_key;
+        state_ = state_t::awaiting_header;
+
+        // the delivery's frames are kept around until it's assembled
+        return;
+      }
+
+      case state_t::awaiting_header: {
+        if (frame.frame_type != AMQP_FRAME_HEADER) {
+          log_->errorStream() << "expected a content header for delivery #" << delivery_tag_ << ", discarding it";
+          state_ = state_t::awaiting_method;
+          break;
+        }
+
+        props_ = (amqp_basic_properties_t *) frame.payload.properties.decoded;
+
+        // we will only dispatch the message if it has no recipient, or the
+        // recipient is us; the decision is made on the raw properties so
+        // that dropped deliveries are never materialized
+        wanted_ = is_wanted(props_);
+
+        // the whole content is received into a single buffer that the
+        // message (and every copy of it) will share; the pooled messages
+        // keep theirs between deliveries
+        body_target_ = frame.payload.properties.body_size;
+        body_received_ = 0;
+        if (wanted_) {
+          current_ = pool_->acquire();
+          current_->body().resize(body_target_);
+        }
+
+        if (body_target_ > 0) {
+          state_ = state_t::awaiting_body;
+          return;
+        }
 
-          amqp_maybe_release_buffers(conn_);
+        deliver();
+        break;
+      }
 
-          if (body_received != body_target) {
-            /* Can only happen when amqp_simple_wait_frame returns <= 0 */
-            /* We break here to close the connection */
-            break;
+      case state_t::awaiting_body: {
+        if (frame.frame_type != AMQP_FRAME_BODY) {
+          log_->errorStream() << "expected a content body for delivery #" << delivery_tag_ << ", discarding it";
+          state_ = state_t::awaiting_method;
+          if (current_) {
+            current_->release();
+            current_ = nullptr;
           }
+          break;
         }
+
+        assert(body_received_ + frame.payload.body_fragment.len <= body_target_);
+        if (wanted_)
+          memcpy(&(*current_->body_)[body_received_], frame.payload.body_fragment.bytes, frame.payload.body_fragment.len);
+        body_received_ += frame.payload.body_fragment.len;
+
+        if (body_received_ < body_target_)
+          return;
+
+        deliver();
+        break;
       }
+    }
+
+    link_->release_buffers(ch_);
+  }
+
+  void channel::consumer::deliver() {
+    state_ = state_t::awaiting_method;
+
+    if (wanted_) {
+      message *msg = current_;
+      current_ = nullptr;
+
+      msg->deserialize(props_);
+      msg->meta_.queue = queue_atom_;
+      msg->meta_.delivery_tag = delivery_tag_;
+      msg->meta_.received_us = channel::now_us();
+      msg->routing_key_.assign(static_cast<const char*>(routing_key_.bytes), routing_key_.len);
+      msg->channel_ = c_;
+
+      if (msg->get_content_type() == envelope::content_type) {
+        unpack(*msg);
+        msg->release();
+      } else {
+        log_->infoStream() << "dispatching incoming message from (" << msg->get_app_id() << ")";
+        dispatch(msg);
+      }
+    }
+
+    received(delivery_tag_);
 
-    // }); // end of acceptor logic
+    props_ = nullptr;
   }
 
+  bool channel::consumer::is_wanted(amqp_basic_properties_t const* props) {
+    message_view view(props);
+
+    if (view.is_from(algol_app().fqn)) {
+      INC_STAT(stat_self_drops);
+      log_->debugStream() << "rejecting self message.";
+      return false;
+    }
+
+    if (!view.is_directed_at(algol_app().fqn)) {
+      INC_STAT(stat_misdirected_drops);
+      if (log_->isDebugEnabled())
+        log_->debugStream() << "rejecting message because it's not directed at us (recipient: "
+          << string_t(reinterpret_cast<const char*>(props->reply_to.bytes), props->reply_to.len) << ")";
+      return false;
+    }
+
+    if (dedup_ && (props->_flags & AMQP_BASIC_MESSAGE_ID_FLAG) && props->message_id.len > 0 &&
+        dedup_->check(queue_atom_, props->message_id.bytes, props->message_id.len)) {
+      if (log_->isDebugEnabled())
+        log_->debugStream() << "rejecting duplicate message "
+          << string_t(reinterpret_cast<const char*>(props->message_id.bytes), props->message_id.len);
+      return false;
+    }
+
+    return true;
+  }
+
+  void channel::consumer::unpack(message& packed) {
+    // envelopes are compressed as a whole, the members are only readable once it's restored
+    if (!restore(packed))
+      return;
+
+    message const& env = packed;
+    envelope::reader reader(env.body());
+    amqp_basic_properties_t *props;
+    amqp_bytes_t content;
+    size_t nr_members = 0;
+
+    while (reader.next(props, content)) {
+      if (!is_wanted(props))
+        continue;
+
+      message *msg = pool_->acquire();
+      msg->body().assign(static_cast<const char*>(content.bytes), content.len);
+      msg->deserialize(props);
+      msg->meta_.queue = queue_atom_;
+      msg->meta_.delivery_tag = delivery_tag_;
+      msg->meta_.received_us = packed.meta_.received_us;
+      msg->routing_key_ = packed.routing_key_;
+      msg->channel_ = c_;
+      dispatch(msg);
+      ++nr_members;
+    }
+
+    if (reader.is_corrupt()) {
+      INC_STAT(envelope::stat_corrupt);
+      log_->errorStream() << "envelope from (" << env.get_app_id() << ") is corrupt, dropped the rest of it";
+    }
+
+    log_->infoStream() << "dispatched " << nr_members << " enveloped messages from (" << env.get_app_id() << ")";
+  }
 
 } // end of namespace algol
@@ -0,0 +1,190 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "algol/messaging/codec.hpp"
+
+#include <algorithm>
+
+#include <zlib.h>
+#ifdef ALGOL_LZ4
+  #include <lz4.h>
+#endif
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace algol {
+
+  using boost::posix_time::microsec_clock;
+
+  TRACK_STAT(codec, stat_compressed, "messaging: compressed message bodies")
+  TRACK_STAT(codec, stat_incompressible, "messaging: incompressible message bodies")
+  TRACK_STAT(codec, stat_bytes_saved, "messaging: bytes saved by compression")
+  TRACK_STAT(codec, stat_compress_usecs, "messaging: compression time (us)")
+  TRACK_STAT(codec, stat_decompressed, "messaging: decompressed message bodies")
+  TRACK_STAT(codec, stat_decompress_usecs, "messaging: decompression time (us)")
+  TRACK_STAT(codec, stat_corrupt, "messaging: corrupt compressed message bodies")
+
+  /** the size of the original content prefix */
+  static const size_t prefix_size = 4;
+
+  /**
+   * the most a byte of compressed stream can restore to; a deflate stream
+   * expands at most 1032:1, and an LZ4 block about 255:1
+   */
+  static const uint64_t zlib_max_ratio = 1032;
+  static const uint64_t lz4_max_ratio = 255;
+
+  static const string_t no_encoding;
+  static const string_t zlib_encoding = "zlib";
+  static const string_t lz4_encoding = "lz4";
+
+  static void write_prefix(string_t& out, uint32_t size) {
+    out[0] = (char)((size >> 24) & 0xFF);
+    out[1] = (char)((size >> 16) & 0xFF);
+    out[2] = (char)((size >> 8) & 0xFF);
+    out[3] = (char)(size & 0xFF);
+  }
+
+  static uint32_t read_prefix(string_t const& in) {
+    const unsigned char *p = (const unsigned char*) in.data();
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+  }
+
+  bool codec::parse(string_t const& name, algorithm_t& algorithm) {
+    if (name == "off" || name == "none") {
+      algorithm = algorithm_t::none;
+      return true;
+    }
+    else if (name == "zlib") {
+      algorithm = algorithm_t::zlib;
+      return true;
+    }
+#ifdef ALGOL_LZ4
+    else if (name == "lz4") {
+      algorithm = algorithm_t::lz4;
+      return true;
+    }
+#endif
+
+    return false;
+  }
+
+  string_t const& codec::encoding(algorithm_t algorithm) {
+    switch (algorithm) {
+      case algorithm_t::zlib: return zlib_encoding;
+      case algorithm_t::lz4:  return lz4_encoding;
+      default:                return no_encoding;
+    }
+  }
+
+  bool codec::is_encoding(string_t const& encoding) {
+    return encoding == zlib_encoding || encoding == lz4_encoding;
+  }
+
+  bool codec::compress(algorithm_t algorithm, int level, string_t const& in, string_t& out) {
+    if (algorithm == algorithm_t::none || in.size() > max_content_size)
+      return false;
+
+    boost::posix_time::ptime started = microsec_clock::universal_time();
+    bool compressed = false;
+
+    if (algorithm == algorithm_t::zlib) {
+      uLongf size = compressBound(in.size());
+      out.resize(prefix_size + size);
+
+      compressed = compress2((Bytef*) &out[prefix_size], &size,
+        (const Bytef*) in.data(), in.size(),
+        level > 0 ? std::min(level, 9) : Z_DEFAULT_COMPRESSION) == Z_OK;
+
+      out.resize(prefix_size + size);
+    }
+#ifdef ALGOL_LZ4
+    else if (algorithm == algorithm_t::lz4) {
+      int bound = LZ4_compressBound(in.size());
+      out.resize(prefix_size + bound);
+
+      int size = LZ4_compress_fast(in.data(), &out[prefix_size], in.size(), bound, std::max(level, 1));
+      compressed = size > 0;
+
+      out.resize(prefix_size + std::max(size, 0));
+    }
+#endif
+
+    ADD_STAT(stat_compress_usecs, (microsec_clock::universal_time() - started).total_microseconds())
+
+    if (!compressed || out.size() >= in.size()) {
+      INC_STAT(stat_incompressible)
+      return false;
+    }
+
+    write_prefix(out, in.size());
+
+    INC_STAT(stat_compressed)
+    ADD_STAT(stat_bytes_saved, in.size() - out.size())
+
+    return true;
+  }
+
+  const uint32_t codec::max_content_size;
+
+  bool codec::decompress(string_t const& encoding, string_t const& in, string_t& out, size_t max_size) {
+    if (!is_encoding(encoding))
+      return false;
+
+    if (in.size() < prefix_size) {
+      INC_STAT(stat_corrupt)
+      return false;
+    }
+
+    // the prefix is checked before it's trusted with an allocation
+    const uint32_t expected = read_prefix(in);
+    const uint64_t max_ratio = encoding == zlib_encoding ? zlib_max_ratio : lz4_max_ratio;
+    if (expected > max_content_size || expected > max_size ||
+        expected > (uint64_t)(in.size() - prefix_size) * max_ratio) {
+      INC_STAT(stat_corrupt)
+      return false;
+    }
+
+    boost::posix_time::ptime started = microsec_clock::universal_time();
+    bool decompressed = false;
+
+    out.resize(expected);
+
+    if (encoding == zlib_encoding) {
+      uLongf size = expected;
+      decompressed = uncompress((Bytef*) &out[0], &size,
+        (const Bytef*) &in[prefix_size], in.size() - prefix_size) == Z_OK && size == expected;
+    }
+#ifdef ALGOL_LZ4
+    else if (encoding == lz4_encoding) {
+      int size = LZ4_decompress_safe(&in[prefix_size], &out[0], in.size() - prefix_size, expected);
+      decompressed = size >= 0 && (uint32_t) size == expected;
+    }
+#endif
+
+    ADD_STAT(stat_decompress_usecs, (microsec_clock::universal_time() - started).total_microseconds())
+
+    if (!decompressed) {
+      INC_STAT(stat_corrupt)
+      return false;
+    }
+
+    INC_STAT(stat_decompressed)
+    return true;
+  }
+
+} // end of namespace algol
@@ -18,6 +18,7 @@
 #include "algol/messaging/communicator.hpp"
 #include "algol/messaging/station.hpp"
 #include "algol/messaging/channel.hpp"
+#include "algol/messaging/requester.hpp"
 
 namespace algol {
 
@@ -45,6 +46,7 @@ namespace algol {
     std::list<channel*> channels(station::singleton().channels());
     for (auto c : channels) {
       c->unsubscribe_all(this);
+      c->release(this);
     }
   }
 
@@ -65,6 +67,39 @@ namespace algol {
     return true;
   }
 
+  bool communicator::subscribe(channel_id_t id, exchange_t exchange, int durable, int passive) {
+    channel *c = station::singleton().open_channel(id, durable, passive, exchange);
+
+    if (!c)
+      return false;
+
+    if (c->exchange_type() != exchange) {
+      ALGOL_LOG->errorStream() << "channel '" << id << "' is already open with another exchange type";
+      return false;
+    }
+
+    return true;
+  }
+
+  bool communicator::subscribe(channel_id_t id, queue_id_t queue, exchange_t exchange, int durable, int passive) {
+    if (!subscribe(id, exchange, durable, passive))
+      return false;
+
+    return subscribe(id, queue, durable, passive);
+  }
+
+  bool communicator::subscribe(channel_id_t id, queue_id_t queue, consumer_shards shards, int durable, int passive) {
+    channel *c = station::singleton().open_channel(id, durable, passive);
+
+    if (!c)
+      return false;
+
+    c->set_shards(queue, shards.count);
+    c->subscribe(queue, this);
+
+    return true;
+  }
+
   bool communicator::unsubscribe(channel_id_t id, queue_id_t queue) {
     channel *c = station::singleton().open_channel(id);
     if (!c)
@@ -81,18 +116,55 @@ namespace algol {
     return c->is_subscribed(queue, this);
   }
 
-  void communicator::send(const message& msg, channel* c, const string_t &queue) {
-    c->publish(this, msg, queue);
+  comm_rc communicator::send(const message& msg, channel* c, const string_t &queue) {
+    return c->publish(this, msg, queue);
+  }
+
+  comm_rc communicator::send(const message& msg, channel_handle const& handle, const string_t &queue) {
+    if (!handle.get()) {
+      ALGOL_LOG->errorStream() << "attempting to publish over an unresolved channel";
+      return comm_rc::link_unavailable;
+    }
+
+    return send(msg, handle.get(), queue);
   }
 
-  void communicator::send(const message& msg, const channel_id_t& id, const string_t &queue) {
+  comm_rc communicator::send(const message& msg, const channel_id_t& id, const string_t &queue) {
     channel* c = station::singleton().open_channel(id);
     if (!c) {
       ALGOL_LOG->errorStream() << "attempting to publish over an invalid channel '" << id << '\'';
-      return;
+      return comm_rc::link_unavailable;
+    }
+
+    return send(msg, c, queue);
+  }
+
+  std::future<message> communicator::request(const message& msg, channel* c, const string_t &queue, uint32_t timeout_ms) {
+    return station::singleton().requests().request(msg, c, queue, timeout_ms);
+  }
+
+  std::future<message> communicator::request(const message& msg, const channel_id_t& id, const string_t &queue, uint32_t timeout_ms) {
+    channel* c = station::singleton().open_channel(id);
+    if (!c)
+      ALGOL_LOG->errorStream() << "attempting to send a request over an invalid channel '" << id << '\'';
+
+    // fails the request if there's no channel
+    return request(msg, c, queue, timeout_ms);
+  }
+
+  bool communicator::reply(const message& request, const message& response) {
+    string_t queue;
+    if (!request.channel_ || !request.headers().get(requester::reply_queue_header, queue)) {
+      ALGOL_LOG->errorStream() << "attempting to reply to a message that is not a request";
+      return false;
     }
 
-    send(msg, c, queue);
+    message msg(response);
+    msg.set_correlation_id(request.get_message_id());
+    msg.set_reply_to(request.get_app_id());
+
+    comm_rc rc = send(msg, request.channel_, queue);
+    return rc == comm_rc::success || rc == comm_rc::queued || rc == comm_rc::spooled;
   }
 
   /*void communicator::bind(message_uid const& uid, std::function<void(const message&)> handler) {
@@ -0,0 +1,168 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "algol/messaging/dedup_filter.hpp"
+
+namespace algol {
+
+  typedef boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> scoped_lock;
+  using boost::posix_time::microsec_clock;
+  using boost::posix_time::ptime;
+
+  TRACK_STAT(dedup_filter, stat_lookups, "messaging: message IDs checked for duplicates")
+  TRACK_STAT(dedup_filter, stat_hits, "messaging: duplicate deliveries dropped")
+  TRACK_STAT(dedup_filter, stat_early_rotations, "messaging: dedup generations retired full")
+
+  /** FNV-1a, mixed with the queue so that the same ID sent to different queues isn't a duplicate */
+  static uint64_t hash_of(atom_t queue, const void* id, size_t length) {
+    uint64_t h = 14695981039346656037ULL ^ ((uint64_t) queue * 0x9E3779B97F4A7C15ULL);
+    const unsigned char *p = static_cast<const unsigned char*>(id);
+
+    for (size_t i = 0; i < length; ++i) {
+      h ^= p[i];
+      h *= 1099511628211ULL;
+    }
+
+    // FNV's low bits are weak, and they pick the bucket
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  dedup_filter::dedup_filter(uint32_t window, size_t capacity)
+  : window_(boost::posix_time::seconds(std::max<uint32_t>(window, 1))),
+    nr_buckets_(1)
+  {
+    // each generation of a shard holds its share of the capacity at a load of ~94%
+    const size_t per_shard = std::max<size_t>(capacity / nr_shards, 1);
+    while (nr_buckets_ * bucket_size * 15 / 16 < per_shard)
+      nr_buckets_ <<= 1;
+
+    const ptime now = microsec_clock::universal_time();
+    for (auto& shard : shards_) {
+      for (auto& generation : shard.generations) {
+        generation.slots.assign(nr_buckets_ * bucket_size, 0);
+      }
+
+      shard.current = 0;
+      shard.since = now;
+    }
+  }
+
+  dedup_filter::~dedup_filter() {
+  }
+
+  size_t dedup_filter::footprint() const {
+    return nr_shards * 2 * nr_buckets_ * bucket_size * sizeof(fingerprint_t);
+  }
+
+  bool dedup_filter::check(atom_t queue, const void* id, size_t length) {
+    INC_STAT(stat_lookups);
+
+    const uint64_t hash = hash_of(queue, id, length);
+    shard_t& shard = shards_[hash % nr_shards];
+    const size_t bucket = (hash >> 8) & (nr_buckets_ - 1);
+
+    fingerprint_t fp = (fingerprint_t)(hash >> 48);
+    if (fp == 0)
+      fp = 1;
+
+    const ptime now = microsec_clock::universal_time();
+    scoped_lock lock(shard.mtx);
+
+    if (now - shard.since >= window_) {
+      // after a quiet spell, the previous generation is stale too
+      if (now - shard.since >= window_ * 2)
+        rotate(shard, now);
+      rotate(shard, now);
+    }
+
+    for (auto const& generation : shard.generations) {
+      if (contains(generation, bucket, fp) || contains(generation, alternate(bucket, fp), fp)) {
+        INC_STAT(stat_hits);
+        return true;
+      }
+    }
+
+    if (!insert(shard.generations[shard.current], bucket, fp, hash)) {
+      INC_STAT(stat_early_rotations);
+      rotate(shard, now);
+      insert(shard.generations[shard.current], bucket, fp, hash);
+    }
+
+    return false;
+  }
+
+  bool dedup_filter::contains(generation_t const& generation, size_t bucket, fingerprint_t fp) const {
+    const fingerprint_t *slots = &generation.slots[bucket * bucket_size];
+    for (size_t i = 0; i < bucket_size; ++i) {
+      if (slots[i] == fp)
+        return true;
+    }
+
+    return false;
+  }
+
+  size_t dedup_filter::alternate(size_t bucket, fingerprint_t fp) const {
+    return (bucket ^ ((size_t) fp * 0x5BD1E995)) & (nr_buckets_ - 1);
+  }
+
+  bool dedup_filter::insert(generation_t& generation, size_t bucket, fingerprint_t fp, uint64_t hash) {
+    size_t candidates[2] = { bucket, alternate(bucket, fp) };
+
+    for (auto b : candidates) {
+      fingerprint_t *slots = &generation.slots[b * bucket_size];
+      for (size_t i = 0; i < bucket_size; ++i) {
+        if (slots[i] == 0) {
+          slots[i] = fp;
+          return true;
+        }
+      }
+    }
+
+    // evict fingerprints to their alternate buckets until one finds room
+    size_t b = candidates[hash & 1];
+    for (size_t kick = 0; kick < max_kicks; ++kick) {
+      fingerprint_t *slots = &generation.slots[b * bucket_size];
+      std::swap(fp, slots[(hash >> (kick % 32)) % bucket_size]);
+
+      b = alternate(b, fp);
+      slots = &generation.slots[b * bucket_size];
+      for (size_t i = 0; i < bucket_size; ++i) {
+        if (slots[i] == 0) {
+          slots[i] = fp;
+          return true;
+        }
+      }
+    }
+
+    // the last evicted fingerprint is lost; the generation is full anyway and
+    // is about to be retired
+    return false;
+  }
+
+  void dedup_filter::rotate(shard_t& shard, ptime const& now) {
+    shard.current ^= 1;
+
+    generation_t& generation = shard.generations[shard.current];
+    std::fill(generation.slots.begin(), generation.slots.end(), 0);
+
+    shard.since = now;
+  }
+
+} // end of namespace algol
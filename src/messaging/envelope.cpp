@@ -0,0 +1,202 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "algol/messaging/envelope.hpp"
+
+#include <algorithm>
+
+namespace algol {
+
+  const string_t envelope::content_type = "application/x-algol-envelope";
+
+  TRACK_STAT(envelope, stat_sealed, "messaging: envelopes sent")
+  TRACK_STAT(envelope, stat_packed, "messaging: messages sent in envelopes")
+  TRACK_STAT(envelope, stat_unpacked, "messaging: messages received in envelopes")
+  TRACK_STAT(envelope, stat_corrupt, "messaging: corrupt envelopes")
+
+  /** the size of the prefixes of the members' properties and contents */
+  static const size_t prefix_size = 4;
+
+  /** the room first tried for encoding a member's properties; it's doubled until they fit */
+  static const size_t properties_size_hint = 512;
+
+  /** members whose properties don't fit in this are refused */
+  static const size_t max_properties_size = 1 << 20;
+
+  static void write_size(string_t& out, size_t offset, uint32_t size) {
+    out[offset]     = (char)((size >> 24) & 0xFF);
+    out[offset + 1] = (char)((size >> 16) & 0xFF);
+    out[offset + 2] = (char)((size >> 8) & 0xFF);
+    out[offset + 3] = (char)(size & 0xFF);
+  }
+
+  static uint32_t read_size(string_t const& in, size_t offset) {
+    const unsigned char *p = (const unsigned char*) in.data() + offset;
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+  }
+
+  envelope::envelope()
+  : delivery_mode_(0),
+    priority_(0)
+  {
+  }
+
+  envelope::~envelope() {
+  }
+
+  bool envelope::add(const message& m, uint64_t sent_us) {
+    amqp_bytes_t body;
+    amqp_basic_properties_t props;
+    message::sent_stamp stamp(sent_us);
+    m.serialize(&body, &props, stamp);
+
+    const size_t offset = content_.size();
+    size_t capacity = properties_size_hint;
+    int encoded;
+    for (;;) {
+      content_.resize(offset + prefix_size + capacity);
+
+      amqp_bytes_t out;
+      out.len = capacity;
+      out.bytes = &content_[offset + prefix_size];
+
+      encoded = amqp_encode_properties(AMQP_BASIC_CLASS, &props, out);
+      if (encoded >= 0)
+        break;
+
+      if (capacity >= max_properties_size) {
+        content_.resize(offset);
+        return false;
+      }
+
+      capacity *= 2;
+    }
+
+    content_.resize(offset + prefix_size + encoded);
+    write_size(content_, offset, encoded);
+
+    content_.resize(content_.size() + prefix_size);
+    write_size(content_, content_.size() - prefix_size, body.len);
+    content_.append(static_cast<const char*>(body.bytes), body.len);
+
+    if (m.props_.flags & AMQP_BASIC_DELIVERY_MODE_FLAG)
+      delivery_mode_ = std::max(delivery_mode_, m.props_.delivery_mode);
+    if (m.props_.flags & AMQP_BASIC_PRIORITY_FLAG)
+      priority_ = std::max(priority_, m.props_.priority);
+
+    members_.push_back(m);
+    return true;
+  }
+
+  std::vector<message> const& envelope::members() const {
+    return members_;
+  }
+
+  size_t envelope::size() const {
+    return content_.size();
+  }
+
+  bool envelope::empty() const {
+    return members_.empty();
+  }
+
+  message envelope::seal() {
+    message m(std::make_shared<string_t>());
+    m.body_->swap(content_);
+    m.set_content_type(content_type);
+
+    if (delivery_mode_)
+      m.set_delivery_mode(delivery_mode_);
+    if (priority_)
+      m.set_priority(priority_);
+
+    if (!members_.empty()) {
+      m.meta_.queue = members_.front().meta_.queue;
+      m.meta_.sent_us = members_.front().meta_.sent_us;
+    }
+
+    INC_STAT(stat_sealed)
+    ADD_STAT(stat_packed, members_.size())
+
+    return m;
+  }
+
+  void envelope::clear() {
+    members_.clear();
+    content_.clear();
+    delivery_mode_ = 0;
+    priority_ = 0;
+  }
+
+  envelope::reader::reader(string_t const& content)
+  : content_(content),
+    offset_(0),
+    corrupt_(false)
+  {
+    init_amqp_pool(&pool_, 4096);
+  }
+
+  envelope::reader::~reader() {
+    empty_amqp_pool(&pool_);
+  }
+
+  bool envelope::reader::next(amqp_basic_properties_t*& props, amqp_bytes_t& body) {
+    if (corrupt_ || offset_ == content_.size())
+      return false;
+
+    recycle_amqp_pool(&pool_);
+
+    // the properties
+    if (content_.size() - offset_ < prefix_size ||
+        content_.size() - offset_ - prefix_size < read_size(content_, offset_)) {
+      corrupt_ = true;
+      return false;
+    }
+
+    amqp_bytes_t encoded;
+    encoded.len = read_size(content_, offset_);
+    encoded.bytes = const_cast<char*>(content_.data()) + offset_ + prefix_size;
+    offset_ += prefix_size + encoded.len;
+
+    void *decoded = nullptr;
+    if (amqp_decode_properties(AMQP_BASIC_CLASS, &pool_, encoded, &decoded) < 0) {
+      corrupt_ = true;
+      return false;
+    }
+
+    // and the content
+    if (content_.size() - offset_ < prefix_size ||
+        content_.size() - offset_ - prefix_size < read_size(content_, offset_)) {
+      corrupt_ = true;
+      return false;
+    }
+
+    body.len = read_size(content_, offset_);
+    body.bytes = const_cast<char*>(content_.data()) + offset_ + prefix_size;
+    offset_ += prefix_size + body.len;
+
+    props = static_cast<amqp_basic_properties_t*>(decoded);
+
+    INC_STAT(stat_unpacked)
+    return true;
+  }
+
+  bool envelope::reader::is_corrupt() const {
+    return corrupt_;
+  }
+
+} // end of namespace algol
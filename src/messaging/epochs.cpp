@@ -0,0 +1,180 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "algol/messaging/epochs.hpp"
+
+#include <cassert>
+#include <vector>
+#include <boost/thread.hpp>
+
+namespace algol {
+
+  struct epochs::slot_t {
+    std::atomic<uint64_t> epoch;  /// the pinned epoch, 0 while not reading
+    unsigned              depth;  /// nested guards, only touched by the owner
+    char                  pad[64 - sizeof(std::atomic<uint64_t>) - sizeof(unsigned)];
+  };
+
+  /**
+   * Hands out the index of every thread's slot; the indexes of the threads
+   * that exit are reused, so the slots stay as few as the threads alive.
+   */
+  class thread_index {
+  public:
+    static size_t current() {
+      size_t *index = indexes_.get();
+      if (!index) {
+        index = new size_t(acquire());
+        indexes_.reset(index);
+      }
+
+      return *index;
+    }
+
+  private:
+    static size_t acquire() {
+      boost::lock_guard<boost::mutex> lock(mtx());
+      std::vector<size_t>& free = free_indexes();
+
+      if (free.empty())
+        return next_index()++;
+
+      size_t index = free.back();
+      free.pop_back();
+      return index;
+    }
+
+    /** called when a thread exits, its slots are not pinned anymore */
+    static void release(size_t* index) {
+      {
+        boost::lock_guard<boost::mutex> lock(mtx());
+        free_indexes().push_back(*index);
+      }
+
+      delete index;
+    }
+
+    // function statics, so that they outlive the threads exiting at shutdown
+    static boost::mutex& mtx() { static boost::mutex *m = new boost::mutex(); return *m; }
+    static std::vector<size_t>& free_indexes() { static std::vector<size_t> *v = new std::vector<size_t>(); return *v; }
+    static size_t& next_index() { static size_t next = 0; return next; }
+
+    static boost::thread_specific_ptr<size_t> indexes_;
+  };
+
+  boost::thread_specific_ptr<size_t> thread_index::indexes_(&thread_index::release);
+
+  const size_t epochs::slots_per_chunk;
+  const size_t epochs::max_chunks;
+
+  epochs::epochs()
+  : epoch_(1),
+    nr_waiting_(0)
+  {
+    for (size_t i = 0; i < max_chunks; ++i)
+      chunks_[i] = nullptr;
+  }
+
+  epochs::~epochs() {
+    for (size_t i = 0; i < max_chunks; ++i)
+      delete[] chunks_[i].load();
+  }
+
+  epochs::slot_t* epochs::slot() const {
+    size_t index = thread_index::current();
+    size_t chunk = index / slots_per_chunk;
+    assert(chunk < max_chunks);
+
+    slot_t *slots = chunks_[chunk].load(std::memory_order_acquire);
+    if (!slots) {
+      slot_t *fresh = new slot_t[slots_per_chunk];
+      for (size_t i = 0; i < slots_per_chunk; ++i) {
+        fresh[i].epoch = 0;
+        fresh[i].depth = 0;
+      }
+
+      if (chunks_[chunk].compare_exchange_strong(slots, fresh))
+        slots = fresh;
+      else
+        delete[] fresh; // another thread of the chunk beat us to it
+    }
+
+    return &slots[index % slots_per_chunk];
+  }
+
+  epochs::guard::guard(epochs const& e)
+  : epochs_(e),
+    slot_(e.slot())
+  {
+    // the pin must be visible before the caller loads anything it protects,
+    // hence the sequentially consistent store
+    if (slot_->depth++ == 0)
+      slot_->epoch.store(e.epoch_.load());
+  }
+
+  epochs::guard::~guard() {
+    if (--slot_->depth > 0)
+      return;
+
+    // a waiter counts itself before it checks the pins, so either it sees
+    // ours gone or we see it waiting
+    slot_->epoch.store(0);
+    if (epochs_.nr_waiting_.load() > 0) {
+      boost::lock_guard<boost::mutex> lock(epochs_.wait_mtx_);
+      epochs_.released_cnd_.notify_all();
+    }
+  }
+
+  uint64_t epochs::advance() {
+    return ++epoch_;
+  }
+
+  bool epochs::has_passed(uint64_t epoch) const {
+    for (size_t i = 0; i < max_chunks; ++i) {
+      slot_t *slots = chunks_[i].load(std::memory_order_acquire);
+      if (!slots)
+        continue;
+
+      for (size_t j = 0; j < slots_per_chunk; ++j) {
+        uint64_t pinned = slots[j].epoch.load();
+        if (pinned && pinned < epoch)
+          return false;
+      }
+    }
+
+    return true;
+  }
+
+  bool epochs::synchronize(uint64_t epoch) const {
+    if (slot()->depth > 0)
+      return false;
+
+    if (has_passed(epoch))
+      return true;
+
+    ++nr_waiting_;
+    {
+      boost::unique_lock<boost::mutex> lock(wait_mtx_);
+      while (!has_passed(epoch))
+        released_cnd_.wait(lock);
+    }
+    --nr_waiting_;
+
+    return true;
+  }
+
+} // end of namespace algol
@@ -0,0 +1,274 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "algol/messaging/executor.hpp"
+
+#include <algorithm>
+
+namespace algol {
+
+  typedef boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> scoped_lock;
+
+  /** the number of lanes per worker; more lanes mean fewer unrelated keys sharing one */
+  static const size_t lanes_per_worker = 16;
+
+  /** tasks a worker runs from a lane before giving the other lanes a turn */
+  static const size_t lane_quantum = 8;
+
+  const uint8_t executor::nr_priorities;
+  const size_t executor::max_bypasses;
+
+  monitor::stat_id executor::stat_depth[executor::nr_priorities] = {
+    monitor::singleton().track_stat("messaging: dispatch queue depth (priority 0)"),
+    monitor::singleton().track_stat("messaging: dispatch queue depth (priority 1)"),
+    monitor::singleton().track_stat("messaging: dispatch queue depth (priority 2)"),
+    monitor::singleton().track_stat("messaging: dispatch queue depth (priority 3)"),
+    monitor::singleton().track_stat("messaging: dispatch queue depth (priority 4)"),
+    monitor::singleton().track_stat("messaging: dispatch queue depth (priority 5)"),
+    monitor::singleton().track_stat("messaging: dispatch queue depth (priority 6)"),
+    monitor::singleton().track_stat("messaging: dispatch queue depth (priority 7)"),
+    monitor::singleton().track_stat("messaging: dispatch queue depth (priority 8)"),
+    monitor::singleton().track_stat("messaging: dispatch queue depth (priority 9)")
+  };
+
+  executor::executor()
+  : logger("executor"),
+    running_(false),
+    nr_ready_(0)
+  {
+  }
+
+  executor::~executor() {
+    if (running_)
+      stop();
+  }
+
+  bool executor::is_running() const {
+    return running_;
+  }
+
+  void executor::start(size_t nr_workers) {
+    if (running_) {
+      log_->warnStream() << "attempting to start an already running executor!";
+      return;
+    }
+
+    nr_workers = std::max<size_t>(nr_workers, 1);
+
+    for (size_t i = 0; i < nr_workers * lanes_per_worker; ++i) {
+      lane_t *lane = new lane_t();
+      lane->size = 0;
+      lane->seq = 0;
+      lane->bypasses = 0;
+      lane->scheduled = false;
+      lanes_.push_back(lane);
+    }
+
+    for (size_t i = 0; i < nr_workers; ++i)
+      workers_.push_back(new worker_t());
+
+    running_ = true;
+
+    for (size_t i = 0; i < nr_workers; ++i)
+      threads_.create_thread(boost::bind(&executor::work, this, i));
+
+    log_->infoStream() << "dispatching with " << nr_workers << " workers";
+  }
+
+  void executor::stop() {
+    if (!running_)
+      return;
+
+    {
+      scoped_lock lock(idle_mtx_);
+      running_ = false;
+      idle_cnd_.notify_all();
+    }
+
+    threads_.join_all();
+
+    while (!lanes_.empty()) {
+      delete lanes_.back();
+      lanes_.pop_back();
+    }
+
+    while (!workers_.empty()) {
+      delete workers_.back();
+      workers_.pop_back();
+    }
+
+    log_->infoStream() << "stopped";
+  }
+
+  void executor::submit(string_t const& key, task_t task) {
+    submit(std::hash<string_t>()(key), task);
+  }
+
+  void executor::submit(size_t hash, task_t task) {
+    submit(hash, 0, task);
+  }
+
+  void executor::submit(size_t hash, uint8_t priority, task_t task) {
+    if (!running_) {
+      task();
+      return;
+    }
+
+    priority = std::min<uint8_t>(priority, nr_priorities - 1);
+    lane_t *lane = lanes_[hash % lanes_.size()];
+
+    {
+      scoped_lock lock(lane->mtx);
+
+      entry_t entry;
+      entry.task = task;
+      entry.seq = lane->seq++;
+      lane->tasks[priority].push_back(entry);
+      ++lane->size;
+      INC_STAT(stat_depth[priority])
+
+      // the lane is already in the hands of a worker, which will get to it
+      if (lane->scheduled)
+        return;
+
+      lane->scheduled = true;
+    }
+
+    schedule(lane, hash % workers_.size());
+  }
+
+  void executor::schedule(lane_t* lane, size_t worker) {
+    {
+      scoped_lock lock(workers_[worker]->mtx);
+      workers_[worker]->ready.push_back(lane);
+    }
+
+    scoped_lock lock(idle_mtx_);
+    ++nr_ready_;
+    idle_cnd_.notify_one();
+  }
+
+  executor::lane_t* executor::acquire(size_t id) {
+    // our own queue is served in FIFO order...
+    {
+      scoped_lock lock(workers_[id]->mtx);
+      if (!workers_[id]->ready.empty()) {
+        lane_t *lane = workers_[id]->ready.front();
+        workers_[id]->ready.pop_front();
+        return lane;
+      }
+    }
+
+    // ...while stealing takes the lanes the victim would get to last
+    for (size_t i = 1; i < workers_.size(); ++i) {
+      worker_t *victim = workers_[(id + i) % workers_.size()];
+
+      scoped_lock lock(victim->mtx);
+      if (!victim->ready.empty()) {
+        lane_t *lane = victim->ready.back();
+        victim->ready.pop_back();
+        return lane;
+      }
+    }
+
+    return nullptr;
+  }
+
+  executor::task_t executor::next(lane_t* lane) {
+    // the highest priority that has tasks, and the priority of the oldest task
+    int highest = -1, oldest = -1;
+    for (int i = nr_priorities - 1; i >= 0; --i) {
+      if (lane->tasks[i].empty())
+        continue;
+
+      if (highest < 0)
+        highest = i;
+      if (oldest < 0 || lane->tasks[i].front().seq < lane->tasks[oldest].front().seq)
+        oldest = i;
+    }
+
+    int priority = highest;
+    if (oldest == highest)
+      lane->bypasses = 0;
+    else if (++lane->bypasses > max_bypasses) {
+      priority = oldest;
+      lane->bypasses = 0;
+    }
+
+    task_t task;
+    task.swap(lane->tasks[priority].front().task);
+    lane->tasks[priority].pop_front();
+    --lane->size;
+    DEC_STAT(stat_depth[priority])
+
+    return task;
+  }
+
+  void executor::work(size_t id) {
+    for (;;) {
+      {
+        scoped_lock lock(idle_mtx_);
+
+        while (running_ && nr_ready_ == 0)
+          idle_cnd_.wait(lock);
+
+        // pending tasks are run even when stopping
+        if (nr_ready_ == 0)
+          break;
+
+        --nr_ready_;
+      }
+
+      // a lane is guaranteed to be waiting in one of the queues, although
+      // another worker might be in the middle of moving it
+      lane_t *lane = nullptr;
+      while (!(lane = acquire(id)))
+        boost::this_thread::yield();
+
+      for (size_t i = 0; i < lane_quantum; ++i) {
+        task_t task;
+        {
+          scoped_lock lock(lane->mtx);
+          if (lane->size == 0)
+            break;
+
+          task = next(lane);
+        }
+
+        try {
+          task();
+        } catch (std::exception &e) {
+          log_->errorStream() << "dispatching task failed: " << e.what();
+        } catch (...) {
+          log_->errorStream() << "dispatching task failed with an unknown exception";
+        }
+      }
+
+      {
+        scoped_lock lock(lane->mtx);
+        if (lane->size == 0) {
+          lane->scheduled = false;
+          continue;
+        }
+      }
+
+      // there's more work in the lane; go to the back of the line
+      schedule(lane, id);
+    }
+  }
+
+} // end of namespace algol
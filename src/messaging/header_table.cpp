@@ -0,0 +1,396 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "algol/messaging/header_table.hpp"
+
+#include <cstring>
+
+namespace algol {
+
+  /** every allocation is rounded up to this so that field values can be laid out in the arena */
+  static const size_t alignment = sizeof(void*) > sizeof(double) ? sizeof(void*) : sizeof(double);
+
+  const size_t header_table::block_size;
+
+  header_table::header_table()
+  {
+  }
+
+  header_table::header_table(const header_table& src)
+  {
+    assign(src.table());
+  }
+
+  header_table& header_table::operator=(const header_table& rhs) {
+    if (&rhs != this)
+      assign(rhs.table());
+
+    return *this;
+  }
+
+  header_table::~header_table() {
+    for (auto block : blocks_)
+      delete[] block.data;
+  }
+
+  void* header_table::allocate(size_t size) {
+    size = (size + alignment - 1) & ~(alignment - 1);
+
+    if (blocks_.empty() || blocks_.back().size - blocks_.back().used < size) {
+      block_t block = { nullptr, std::max(size, block_size), 0 };
+      block.data = new char[block.size];
+      blocks_.push_back(block);
+    }
+
+    void *p = blocks_.back().data + blocks_.back().used;
+    blocks_.back().used += size;
+
+    return p;
+  }
+
+  amqp_bytes_t header_table::copy_bytes(const void* data, size_t len) {
+    amqp_bytes_t bytes;
+    bytes.len = len;
+    bytes.bytes = len ? allocate(len) : nullptr;
+
+    if (len)
+      memcpy(bytes.bytes, data, len);
+
+    return bytes;
+  }
+
+  amqp_table_t header_table::copy_table(amqp_table_t const& src) {
+    amqp_table_t table;
+    table.num_entries = src.num_entries;
+    table.entries = nullptr;
+
+    if (src.num_entries > 0) {
+      table.entries = static_cast<amqp_table_entry_t*>(allocate(sizeof(amqp_table_entry_t) * src.num_entries));
+
+      for (int i = 0; i < src.num_entries; ++i) {
+        table.entries[i].key = copy_bytes(src.entries[i].key.bytes, src.entries[i].key.len);
+        table.entries[i].value = copy_value(src.entries[i].value);
+      }
+    }
+
+    return table;
+  }
+
+  amqp_field_value_t header_table::copy_value(amqp_field_value_t const& src) {
+    amqp_field_value_t value = src;
+
+    switch (src.kind) {
+      case AMQP_FIELD_KIND_UTF8:
+      case AMQP_FIELD_KIND_BYTES:
+        value.value.bytes = copy_bytes(src.value.bytes.bytes, src.value.bytes.len);
+        break;
+
+      case AMQP_FIELD_KIND_TABLE:
+        value.value.table = copy_table(src.value.table);
+        break;
+
+      case AMQP_FIELD_KIND_ARRAY:
+        value.value.array.entries = nullptr;
+        if (src.value.array.num_entries > 0) {
+          value.value.array.entries = static_cast<amqp_field_value_t*>(
+            allocate(sizeof(amqp_field_value_t) * src.value.array.num_entries));
+
+          for (int i = 0; i < src.value.array.num_entries; ++i)
+            value.value.array.entries[i] = copy_value(src.value.array.entries[i]);
+        }
+        break;
+
+      default:
+        // scalars are held by value
+        break;
+    }
+
+    return value;
+  }
+
+  void header_table::clear() {
+    entries_.clear();
+
+    // keep the first block around, it's likely to be enough the next time
+    while (blocks_.size() > 1) {
+      delete[] blocks_.back().data;
+      blocks_.pop_back();
+    }
+
+    if (!blocks_.empty())
+      blocks_.front().used = 0;
+  }
+
+  void header_table::assign(amqp_table_t const& src) {
+    clear();
+
+    entries_.reserve(src.num_entries);
+
+    for (int i = 0; i < src.num_entries; ++i) {
+      amqp_table_entry_t entry;
+      entry.key = copy_bytes(src.entries[i].key.bytes, src.entries[i].key.len);
+      entry.value = copy_value(src.entries[i].value);
+      entries_.push_back(entry);
+    }
+  }
+
+  amqp_table_entry_t& header_table::entry(string_t const& key) {
+    for (auto& e : entries_)
+      if (e.key.len == key.size() && memcmp(e.key.bytes, key.data(), key.size()) == 0)
+        return e;
+
+    amqp_table_entry_t e;
+    e.key = copy_bytes(key.data(), key.size());
+    e.value.kind = AMQP_FIELD_KIND_VOID;
+    entries_.push_back(e);
+
+    return entries_.back();
+  }
+
+  void header_table::set(string_t const& key, string_t const& value) {
+    amqp_field_value_t& v = entry(key).value;
+    v.kind = AMQP_FIELD_KIND_UTF8;
+    v.value.bytes = copy_bytes(value.data(), value.size());
+  }
+
+  void header_table::set(string_t const& key, const char* value) {
+    amqp_field_value_t& v = entry(key).value;
+    v.kind = AMQP_FIELD_KIND_UTF8;
+    v.value.bytes = copy_bytes(value, strlen(value));
+  }
+
+  void header_table::set(string_t const& key, bool value) {
+    amqp_field_value_t& v = entry(key).value;
+    v.kind = AMQP_FIELD_KIND_BOOLEAN;
+    v.value.boolean = value;
+  }
+
+  void header_table::set(string_t const& key, int32_t value) {
+    amqp_field_value_t& v = entry(key).value;
+    v.kind = AMQP_FIELD_KIND_I32;
+    v.value.i32 = value;
+  }
+
+  void header_table::set(string_t const& key, int64_t value) {
+    amqp_field_value_t& v = entry(key).value;
+    v.kind = AMQP_FIELD_KIND_I64;
+    v.value.i64 = value;
+  }
+
+  void header_table::set(string_t const& key, uint64_t value) {
+    amqp_field_value_t& v = entry(key).value;
+    v.kind = AMQP_FIELD_KIND_U64;
+    v.value.u64 = value;
+  }
+
+  void header_table::set(string_t const& key, double value) {
+    amqp_field_value_t& v = entry(key).value;
+    v.kind = AMQP_FIELD_KIND_F64;
+    v.value.f64 = value;
+  }
+
+  void header_table::set(string_t const& key, header_table const& value) {
+    // copied before the entry is looked up, the table might be ourselves
+    amqp_field_value_t nested;
+    nested.kind = AMQP_FIELD_KIND_TABLE;
+    nested.value.table = copy_table(value.table());
+
+    entry(key).value = nested;
+  }
+
+  void header_table::set_bytes(string_t const& key, const void* data, size_t len) {
+    amqp_field_value_t& v = entry(key).value;
+    v.kind = AMQP_FIELD_KIND_BYTES;
+    v.value.bytes = copy_bytes(data, len);
+  }
+
+  void header_table::set(string_t const& key, amqp_field_value_t const& value) {
+    amqp_field_value_t copy = copy_value(value);
+    entry(key).value = copy;
+  }
+
+  bool header_table::empty() const {
+    return entries_.empty();
+  }
+
+  size_t header_table::size() const {
+    return entries_.size();
+  }
+
+  amqp_field_value_t const* header_table::find(amqp_table_t const& table, const char* key, size_t len) {
+    for (int i = 0; i < table.num_entries; ++i) {
+      amqp_table_entry_t const& e = table.entries[i];
+      if (e.key.len == len && memcmp(e.key.bytes, key, len) == 0)
+        return &e.value;
+    }
+
+    return nullptr;
+  }
+
+  amqp_field_value_t const* header_table::find(const char* key, size_t len) const {
+    return find(table(), key, len);
+  }
+
+  amqp_field_value_t const* header_table::find(string_t const& key) const {
+    return find(key.data(), key.size());
+  }
+
+  bool header_table::has(string_t const& key) const {
+    return find(key) != nullptr;
+  }
+
+  bool header_table::get(string_t const& key, bool& out) const {
+    amqp_field_value_t const* v = find(key);
+    if (!v || v->kind != AMQP_FIELD_KIND_BOOLEAN)
+      return false;
+
+    out = v->value.boolean;
+    return true;
+  }
+
+  bool header_table::get(string_t const& key, int64_t& out) const {
+    amqp_field_value_t const* v = find(key);
+    if (!v)
+      return false;
+
+    switch (v->kind) {
+      case AMQP_FIELD_KIND_I8:  out = v->value.i8;  break;
+      case AMQP_FIELD_KIND_U8:  out = v->value.u8;  break;
+      case AMQP_FIELD_KIND_I16: out = v->value.i16; break;
+      case AMQP_FIELD_KIND_U16: out = v->value.u16; break;
+      case AMQP_FIELD_KIND_I32: out = v->value.i32; break;
+      case AMQP_FIELD_KIND_U32: out = v->value.u32; break;
+      case AMQP_FIELD_KIND_I64: out = v->value.i64; break;
+      case AMQP_FIELD_KIND_TIMESTAMP:
+      case AMQP_FIELD_KIND_U64: out = (int64_t) v->value.u64; break;
+      default:
+        return false;
+    }
+
+    return true;
+  }
+
+  bool header_table::get(string_t const& key, double& out) const {
+    amqp_field_value_t const* v = find(key);
+    if (!v)
+      return false;
+
+    if (v->kind == AMQP_FIELD_KIND_F64)
+      out = v->value.f64;
+    else if (v->kind == AMQP_FIELD_KIND_F32)
+      out = v->value.f32;
+    else {
+      int64_t i;
+      if (!get(key, i))
+        return false;
+
+      out = (double) i;
+    }
+
+    return true;
+  }
+
+  bool header_table::get(string_t const& key, amqp_bytes_t& out) const {
+    amqp_field_value_t const* v = find(key);
+    if (!v || (v->kind != AMQP_FIELD_KIND_UTF8 && v->kind != AMQP_FIELD_KIND_BYTES))
+      return false;
+
+    out = v->value.bytes;
+    return true;
+  }
+
+  bool header_table::get(string_t const& key, string_t& out) const {
+    amqp_bytes_t bytes;
+    if (!get(key, bytes))
+      return false;
+
+    out.assign(static_cast<const char*>(bytes.bytes), bytes.len);
+    return true;
+  }
+
+  bool header_table::get(string_t const& key, header_table& out) const {
+    amqp_field_value_t const* v = find(key);
+    if (!v || v->kind != AMQP_FIELD_KIND_TABLE)
+      return false;
+
+    out.assign(v->value.table);
+    return true;
+  }
+
+  amqp_table_t header_table::table() const {
+    amqp_table_t table;
+    table.num_entries = entries_.size();
+    table.entries = entries_.empty() ? nullptr : const_cast<amqp_table_entry_t*>(&entries_[0]);
+
+    return table;
+  }
+
+  void header_table::dump_value(std::ostream& s, amqp_field_value_t const& v) {
+    switch (v.kind) {
+      case AMQP_FIELD_KIND_BOOLEAN: s << (v.value.boolean ? "true" : "false"); break;
+      case AMQP_FIELD_KIND_I8:      s << (int) v.value.i8; break;
+      case AMQP_FIELD_KIND_U8:      s << (int) v.value.u8; break;
+      case AMQP_FIELD_KIND_I16:     s << v.value.i16; break;
+      case AMQP_FIELD_KIND_U16:     s << v.value.u16; break;
+      case AMQP_FIELD_KIND_I32:     s << v.value.i32; break;
+      case AMQP_FIELD_KIND_U32:     s << v.value.u32; break;
+      case AMQP_FIELD_KIND_I64:     s << v.value.i64; break;
+      case AMQP_FIELD_KIND_TIMESTAMP:
+      case AMQP_FIELD_KIND_U64:     s << v.value.u64; break;
+      case AMQP_FIELD_KIND_F32:     s << v.value.f32; break;
+      case AMQP_FIELD_KIND_F64:     s << v.value.f64; break;
+      case AMQP_FIELD_KIND_UTF8:
+        s.write(static_cast<const char*>(v.value.bytes.bytes), v.value.bytes.len);
+        break;
+      case AMQP_FIELD_KIND_BYTES:
+        s << "<" << v.value.bytes.len << " bytes>";
+        break;
+      case AMQP_FIELD_KIND_TABLE:
+        s << "{ ";
+        for (int i = 0; i < v.value.table.num_entries; ++i) {
+          amqp_table_entry_t const& e = v.value.table.entries[i];
+          s.write(static_cast<const char*>(e.key.bytes), e.key.len);
+          s << ": ";
+          dump_value(s, e.value);
+          s << (i + 1 < v.value.table.num_entries ? ", " : " ");
+        }
+        s << "}";
+        break;
+      case AMQP_FIELD_KIND_ARRAY:
+        s << "[ ";
+        for (int i = 0; i < v.value.array.num_entries; ++i) {
+          dump_value(s, v.value.array.entries[i]);
+          s << (i + 1 < v.value.array.num_entries ? ", " : " ");
+        }
+        s << "]";
+        break;
+      default:
+        s << "N/A";
+    }
+  }
+
+  void header_table::dump(std::ostream& s) const {
+    for (auto& e : entries_) {
+      s << "Header[";
+      s.write(static_cast<const char*>(e.key.bytes), e.key.len);
+      s << "]: ";
+      dump_value(s, e.value);
+      s << '\n';
+    }
+  }
+
+} // end of namespace algol
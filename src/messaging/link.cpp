@@ -0,0 +1,314 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "algol/messaging/link.hpp"
+#include "algol/messaging/station.hpp"
+#include "algol/utility.hpp"
+
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+namespace algol {
+
+  typedef boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> scoped_lock;
+  typedef boost::interprocess::scoped_lock<boost::interprocess::interprocess_recursive_mutex> scoped_recursive_lock;
+
+  /**
+   * The most frames routed per wakeup, so that a busy link does not starve
+   * the others sharing its reactor thread.
+   */
+  static const int max_frames_per_drain = 256;
+
+  TRACK_STAT(link, stat_heartbeat_timeouts, "messaging: heartbeat timeouts")
+
+  link::link(int id)
+  : logger(("Link[" + utility::stringify(id) + "]").c_str()),
+    id_(id),
+    open_(false),
+    lost_(false),
+    conn_(nullptr),
+    socket_(-1),
+    next_channel_(1),
+    nr_closing_(0)
+  {
+  }
+
+  link::~link() {
+    if (open_)
+      close();
+  }
+
+  void link::open() {
+    if (open_) {
+      log_->warnStream() << "attempting to open an already open link!";
+      return;
+    }
+
+    const char *host  = station::singleton().config.host.c_str();
+    int         port  = utility::convertTo<int>(station::singleton().config.port);
+    const char *un    = station::singleton().config.username.c_str();
+    const char *pw    = station::singleton().config.password.c_str();
+    const char *vhost = station::singleton().config.vhost.c_str();
+
+    conn_ = amqp_new_connection();
+
+    if ((socket_ = amqp_open_socket(host, port)) < 0) {
+      amqp_destroy_connection(conn_);
+      throw connection_error("Opening socket with RabbitMQ broker");
+    }
+
+    amqp_set_sockfd(conn_, socket_);
+
+    // these are upper bounds, the broker's tune lowers them to its own
+    int frame_max = (int) station::singleton().config.frame_max;
+    int heartbeat = station::singleton().config.heartbeat_s;
+
+    if (amqp_login(conn_, vhost, 0, frame_max, heartbeat, AMQP_SASL_METHOD_PLAIN, un, pw).reply_type != AMQP_RESPONSE_NORMAL) {
+      amqp_destroy_connection(conn_);
+      throw connection_error("Logging in to RabbitMQ");
+    }
+
+    open_ = true;
+    lost_ = false;
+    station::singleton().io_reactor().add(this);
+
+    log_->infoStream()
+      << "open, frame_max " << amqp_get_frame_max(conn_) << ", heartbeat " << amqp_get_heartbeat(conn_) << "s";
+  }
+
+  void link::close() {
+    if (!open_) {
+      log_->warnStream() << "attempting to close an already closed link!";
+      return;
+    }
+
+    // waits for the link to be done with whatever it's routing
+    station::singleton().io_reactor().remove(this);
+
+    {
+      scoped_lock lock(io_mtx_);
+      amqp_connection_close(conn_, AMQP_REPLY_SUCCESS);
+      amqp_destroy_connection(conn_);
+    }
+
+    conn_ = nullptr;
+    open_ = false;
+
+    log_->infoStream() << "closed";
+  }
+
+  bool link::is_open() const {
+    return open_ && !lost_;
+  }
+
+  amqp_channel_t link::open_channel(handler* h) {
+    amqp_channel_t ch;
+    {
+      scoped_recursive_lock lock(handlers_mtx_);
+
+      if (!free_channels_.empty()) {
+        ch = *free_channels_.begin();
+        free_channels_.erase(free_channels_.begin());
+      } else {
+        int channel_max = amqp_get_channel_max(conn_);
+        if (channel_max > 0 && next_channel_ > channel_max)
+          throw connection_error("No more channels available on link " + utility::stringify(id_));
+
+        ch = next_channel_++;
+      }
+
+      handlers_.insert(std::make_pair(ch, h));
+    }
+
+    bool opened;
+    {
+      scoped_lock lock(io_mtx_);
+      amqp_channel_open(conn_, ch);
+      opened = amqp_get_rpc_reply(conn_).reply_type == AMQP_RESPONSE_NORMAL;
+    }
+
+    if (!opened) {
+      scoped_recursive_lock lock(handlers_mtx_);
+      handlers_.erase(ch);
+      throw connection_error("Opening channel #" + utility::stringify(ch));
+    }
+
+    log_->debugStream() << "opened channel #" << ch;
+
+    return ch;
+  }
+
+  void link::close_channel(amqp_channel_t ch) {
+    bool is_closed;
+    {
+      // waits for the handler to return if a frame is being routed to it
+      scoped_recursive_lock lock(handlers_mtx_);
+      handlers_.erase(ch);
+      ++nr_closing_;
+
+      // there's nobody to close it with if the broker did, or is gone
+      is_closed = closed_by_broker_.erase(ch) > 0 || lost_;
+    }
+
+    {
+      scoped_lock lock(io_mtx_);
+      if (!is_closed)
+        amqp_channel_close(conn_, ch, AMQP_REPLY_SUCCESS);
+      amqp_maybe_release_buffers_on_channel(conn_, ch);
+    }
+
+    log_->debugStream() << "closed channel #" << ch;
+
+    // the link may be reaped once it's unused, see station::acquire_link()
+    scoped_recursive_lock lock(handlers_mtx_);
+    free_channels_.insert(ch);
+    --nr_closing_;
+  }
+
+  void link::release_buffers(amqp_channel_t ch) {
+    scoped_lock lock(io_mtx_);
+    amqp_maybe_release_buffers_on_channel(conn_, ch);
+  }
+
+  size_t link::nr_channels() {
+    scoped_recursive_lock lock(handlers_mtx_);
+    return handlers_.size() + nr_closing_;
+  }
+
+  amqp_connection_state_t& link::state() {
+    return conn_;
+  }
+
+  link::mutex_t& link::io_mutex() {
+    return io_mtx_;
+  }
+
+  int link::socket() const {
+    return socket_;
+  }
+
+  int link::fd() const {
+    return socket_;
+  }
+
+  bool link::on_readable() {
+    return drain();
+  }
+
+  bool link::on_tick() {
+    {
+      scoped_recursive_lock lock(handlers_mtx_);
+      for (auto pair : handlers_)
+        pair.second->on_tick();
+    }
+
+    // an RPC on another thread might have queued frames without the socket
+    // becoming readable again; waiting for frames is also when the client
+    // library sends the heartbeats that are due, and notices a silent broker
+    return drain();
+  }
+
+  bool link::has_buffered() {
+    scoped_lock lock(io_mtx_);
+
+    // drain() stopped at its cap with frames decoded, or bytes read off the
+    // socket, which epoll won't report again
+    return !lost_ && (amqp_frames_enqueued(conn_) || amqp_data_in_buffer(conn_));
+  }
+
+  bool link::drain() {
+    amqp_frame_t frame;
+    struct timeval no_wait = { 0, 0 };
+
+    for (int i = 0; i < max_frames_per_drain && !lost_; ++i) {
+      int result;
+      {
+        scoped_lock lock(io_mtx_);
+
+        result = amqp_simple_wait_frame_noblock(conn_, &frame, &no_wait);
+
+        if (result == AMQP_STATUS_TIMEOUT)
+          return true;
+
+        if (result >= 0 && frame.channel == 0 && frame.frame_type == AMQP_FRAME_METHOD &&
+            frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD) {
+          amqp_connection_close_t *m = (amqp_connection_close_t*) frame.payload.method.decoded;
+          log_->errorStream() << "connection closed by the broker: "
+            << string_t((const char*) m->reply_text.bytes, m->reply_text.len);
+
+          amqp_connection_close_ok_t close_ok;
+          amqp_send_method(conn_, 0, AMQP_CONNECTION_CLOSE_OK_METHOD, &close_ok);
+          result = -1;
+        }
+      }
+
+      if (result < 0) {
+        if (result == AMQP_STATUS_HEARTBEAT_TIMEOUT) {
+          INC_STAT(stat_heartbeat_timeouts);
+          log_->errorStream() << "lost connection with the broker: missed its heartbeats";
+        }
+        else
+          log_->errorStream() << "lost connection with the broker";
+        lost_ = true;
+        lost();
+        return false;
+      }
+
+      route(frame);
+    }
+
+    return !lost_;
+  }
+
+  void link::route(amqp_frame_t const& frame) {
+    if (frame.channel == 0)
+      return;
+
+    scoped_recursive_lock lock(handlers_mtx_);
+
+    handlers_t::iterator finder = handlers_.find(frame.channel);
+    if (finder == handlers_.end()) {
+      // the channel is closing, or closed
+      lock.unlock();
+      release_buffers(frame.channel);
+      return;
+    }
+
+    // the broker closed the channel on us, likely because of an error; it's
+    // acknowledged before the handler knows, since the handler might have it
+    // closed (and its number reused) by another thread right away
+    if (frame.frame_type == AMQP_FRAME_METHOD && frame.payload.method.id == AMQP_CHANNEL_CLOSE_METHOD) {
+      amqp_channel_close_t *m = (amqp_channel_close_t*) frame.payload.method.decoded;
+      log_->errorStream() << "channel #" << frame.channel << " closed by the broker: "
+        << string_t((const char*) m->reply_text.bytes, m->reply_text.len);
+
+      closed_by_broker_.insert(frame.channel);
+
+      scoped_lock io_lock(io_mtx_);
+      amqp_channel_close_ok_t close_ok;
+      amqp_send_method(conn_, frame.channel, AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok);
+    }
+
+    finder->second->on_frame(frame);
+  }
+
+  void link::lost() {
+    scoped_recursive_lock lock(handlers_mtx_);
+    for (auto pair : handlers_)
+      pair.second->on_link_lost();
+  }
+
+} // end of namespace algol
@@ -0,0 +1,171 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "algol/messaging/loopback.hpp"
+#include "algol/messaging/channel.hpp"
+#include "algol/messaging/station.hpp"
+
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+namespace algol {
+
+  typedef boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> scoped_lock;
+
+  TRACK_STAT(loopback, stat_deliveries, "messaging: loopback deliveries")
+  TRACK_STAT(loopback, stat_ring_full, "messaging: loopback ring full")
+
+  /** how long (in milliseconds) the pump sleeps before checking the ring again anyway */
+  static const int idle_ms = 100;
+
+  loopback::loopback()
+  : logger("loopback"),
+    ring_(nullptr),
+    running_(false),
+    sleeping_(false)
+  {
+  }
+
+  loopback::~loopback() {
+    if (running_)
+      stop();
+
+    delete ring_;
+  }
+
+  bool loopback::is_running() const {
+    return running_;
+  }
+
+  void loopback::start(size_t capacity) {
+    if (running_) {
+      log_->warnStream() << "attempting to start an already running loopback!";
+      return;
+    }
+
+    delete ring_;
+    ring_ = new mpmc_ring<message>(capacity);
+
+    running_ = true;
+    pump_ = boost::thread(boost::bind(&loopback::pump, this));
+
+    log_->infoStream() << "running with a ring of " << ring_->capacity() << " messages";
+  }
+
+  void loopback::stop() {
+    if (!running_) {
+      log_->warnStream() << "attempting to stop a loopback that is not running!";
+      return;
+    }
+
+    {
+      scoped_lock lock(wake_mtx_);
+      running_ = false;
+      wake_cnd_.notify_one();
+    }
+
+    pump_.join();
+
+    log_->infoStream() << "stopped";
+  }
+
+  bool loopback::deliver(const message& msg) {
+    if (!running_)
+      return false;
+
+    if (!ring_->push(msg)) {
+      INC_STAT(stat_ring_full);
+
+      // a handler called by the pump itself would be waiting for the only
+      // thread that drains the ring, its message skips the line instead
+      if (boost::this_thread::get_id() == pump_.get_id()) {
+        message inline_msg(msg);
+        dispatch(inline_msg);
+        return true;
+      }
+
+      // the pump is draining it, we won't be waiting long unless it's stopped
+      do {
+        if (!running_)
+          return false;
+
+        boost::this_thread::yield();
+      } while (!ring_->push(msg));
+    }
+
+    // the flag is raised before the pump re-checks the ring and goes to sleep,
+    // so either it sees our message or we see it sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_) {
+      scoped_lock lock(wake_mtx_);
+      wake_cnd_.notify_one();
+    }
+
+    return true;
+  }
+
+  void loopback::dispatch(message& msg) {
+    executor& dispatcher = station::singleton().dispatcher();
+    channel *c = msg.get_channel();
+
+    if (dispatcher.is_running()) {
+      dispatcher.submit(channel::ordering_key(msg), [c, msg]() -> void {
+        c->dispatch(msg);
+      });
+    }
+    else {
+      // the pump must go on whatever the handlers do
+      try {
+        c->dispatch(msg);
+      } catch (std::exception &e) {
+        log_->errorStream() << "handling a message failed: " << e.what();
+      } catch (...) {
+        log_->errorStream() << "handling a message failed with an unknown exception";
+      }
+    }
+  }
+
+  void loopback::pump() {
+    message msg;
+
+    for (;;) {
+      if (!ring_->pop(msg)) {
+        scoped_lock lock(wake_mtx_);
+
+        sleeping_ = true;
+        if (!ring_->pop(msg)) {
+          if (!running_) {
+            sleeping_ = false;
+            break;
+          }
+
+          wake_cnd_.timed_wait(lock,
+            boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(idle_ms));
+
+          sleeping_ = false;
+          continue;
+        }
+
+        sleeping_ = false;
+      }
+
+      INC_STAT(stat_deliveries);
+
+      dispatch(msg);
+    }
+  }
+
+} // end of namespace algol
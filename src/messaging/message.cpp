@@ -16,35 +16,55 @@
  */
 
 #include "algol/messaging/message.hpp"
+#include "algol/messaging/atoms.hpp"
 #include "algol/messaging/channel.hpp"
+#include "algol/messaging/message_pool.hpp"
 #include "algol/log_manager.hpp"
 #include "algol/utility.hpp"
 
 namespace algol {
 
+  const string_t message::sent_header = "x-sent-us";
   string_t message::app_id__ = "";
+  message::body_t message::empty_body__ = std::make_shared<string_t>();
+  header_table message::empty_headers__;
+
   void message::set_app_id(string_t const& id) {
     app_id__ = id;
   }
 
   message::message()
   : channel_(nullptr),
-    sender_(nullptr)
+    sender_(nullptr),
+    body_(empty_body__),
+    refs_(0)
   {
-    set_body("");
-    props_.flags = 0;
-    props_.delivery_mode = DELIVERY_MODE_TRANSIENT;
-    props_.timestamp = 0;
-    props_.priority = 0;
-    props_.app_id = app_id__;
+    reset();
   }
 
   message::message(const string_t &body)
   : channel_(nullptr),
-    sender_(nullptr)
+    sender_(nullptr),
+    refs_(0)
   {
     set_body(body);
+    reset();
+  }
 
+  message::message(body_t body)
+  : channel_(nullptr),
+    sender_(nullptr),
+    body_(body),
+    refs_(0)
+  {
+    reset();
+  }
+
+  void message::reset() {
+    meta_.queue = atoms::none;
+    meta_.sent_us = 0;
+    meta_.delivery_tag = 0;
+    meta_.received_us = 0;
     props_.flags = 0;
     props_.delivery_mode = DELIVERY_MODE_TRANSIENT;
     props_.timestamp = 0;
@@ -52,7 +72,9 @@ namespace algol {
     props_.app_id = app_id__;
   }
 
-  message::message(const message& src) {
+  message::message(const message& src)
+  : refs_(0)
+  {
     clone(src);
   }
 
@@ -78,6 +100,60 @@ namespace algol {
     props_.timestamp        = src.props_.timestamp;
     props_.user_id          = src.props_.user_id;
     props_.app_id           = src.props_.app_id;
+    meta_                   = src.meta_;
+    routing_key_            = src.routing_key_;
+    headers_                = src.headers_;
+  }
+
+  void message::recycle() {
+    channel_ = nullptr;
+    sender_ = nullptr;
+
+    // clear() keeps the strings' capacity
+    props_.content_type.clear();
+    props_.content_encoding.clear();
+    props_.correlation_id.clear();
+    props_.reply_to.clear();
+    props_.message_id.clear();
+    props_.user_id.clear();
+    routing_key_.clear();
+    reset();
+
+    if (body_.use_count() == 1)
+      body_->clear();
+    else
+      body_ = empty_body__;
+
+    if (headers_ && headers_.use_count() == 1)
+      headers_->clear();
+    else
+      headers_.reset();
+  }
+
+  message const* message::retain() const {
+    if (refs_.load(std::memory_order_relaxed) == 0) {
+      message *copy = new message(*this);
+      copy->refs_.store(1, std::memory_order_relaxed);
+      return copy;
+    }
+
+    refs_.fetch_add(1, std::memory_order_relaxed);
+    return this;
+  }
+
+  void message::release() const {
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+      return;
+
+    if (!pool_) {
+      delete this;
+      return;
+    }
+
+    // the pool may go away with our reference to it, and us along with it
+    std::shared_ptr<message_pool> pool;
+    pool.swap(pool_);
+    pool->recycle(const_cast<message*>(this));
   }
 
   message::~message() {
@@ -86,10 +162,10 @@ namespace algol {
   }
 
   void message::set_body(const string_t& in_body) {
-    body_ = in_body;
+    body_ = std::make_shared<string_t>(in_body);
   }
   void message::add_to_body(const string_t &str) {
-    body_ += str;
+    body() += str;
   }
 
   message& message::operator<<(const string_t& str) {
@@ -98,31 +174,72 @@ namespace algol {
   }
 
   string_t& message::body() {
-    return body_;
+    // copy-on-write: never modify a buffer another message can see
+    if (body_.use_count() != 1)
+      body_ = std::make_shared<string_t>(*body_);
+
+    return *body_;
   }
 
   string_t const& message::body() const {
-    return body_;
+    return *body_;
+  }
+
+  bool message::compress(codec::algorithm_t algorithm, int level) {
+    if (!props_.content_encoding.empty())
+      return false;
+
+    body_t compressed = std::make_shared<string_t>();
+    if (!codec::compress(algorithm, level, *body_, *compressed))
+      return false;
+
+    body_ = compressed;
+    set_content_encoding(codec::encoding(algorithm));
+    return true;
+  }
+
+  bool message::decompress(size_t max_size) {
+    if (!is_compressed())
+      return false;
+
+    body_t decompressed = std::make_shared<string_t>();
+    if (!codec::decompress(props_.content_encoding, *body_, *decompressed, max_size))
+      return false;
+
+    body_ = decompressed;
+    props_.flags &= ~AMQP_BASIC_CONTENT_ENCODING_FLAG;
+    props_.content_encoding.clear();
+    return true;
+  }
+
+  bool message::is_compressed() const {
+    return codec::is_encoding(props_.content_encoding);
   }
 
   channel* message::get_channel() {
     return channel_;
   }
   string_t const& message::get_queue() const {
-    return meta_.queue;
+    return atoms::name(meta_.queue);
   }
 
-  static string_t amqp_bytes_to_string(amqp_bytes_t* bytes) {
-    if (bytes == NULL || bytes->bytes == NULL || bytes->len == 0)
-      return "";
+  string_t const& message::get_routing_key() const {
+    return routing_key_;
+  }
 
-    return string_t(reinterpret_cast<const char*>(bytes->bytes), bytes->len);
+  /** assigns in place, so that a recycled message's strings keep their capacity */
+  static void assign_bytes(string_t& out, amqp_bytes_t const& bytes) {
+    if (bytes.bytes == NULL || bytes.len == 0)
+      out.clear();
+    else
+      out.assign(reinterpret_cast<const char*>(bytes.bytes), bytes.len);
   }
 
   void message::serialize(amqp_bytes_t* bytes, amqp_basic_properties_t* props) const {
 
     // serialize the body
-    *bytes                  = amqp_cstring_bytes(body_.c_str());
+    bytes->len              = body_->size();
+    bytes->bytes            = const_cast<char*>(body_->data());
 
     // the properties
     props->_flags           = props_.flags;
@@ -139,67 +256,89 @@ namespace algol {
     props->_flags           |= AMQP_BASIC_APP_ID_FLAG;
     props->app_id           = amqp_cstring_bytes(app_id__.c_str());
 
-    // serialize the headers
-    if (!headers_.empty()) {
-      amqp_table_entry_t *entries = new amqp_table_entry_t[headers_.size()];
-      amqp_table_t headers;
-      int hidx = -1;
-      for (auto h : headers_) {
-        entries[++hidx].key = amqp_cstring_bytes(h.key.c_str());
-        entries[hidx].value.kind = AMQP_FIELD_KIND_UTF8;
-        entries[hidx].value.value.bytes = amqp_cstring_bytes(h.value.c_str());
-      }
-      headers.num_entries = headers_.size();
-      headers.entries = entries;
-
-      ALGOL_LOG->debugStream() << "serialized " << headers_.size() << " headers";
-
-      props->headers  = headers;
+    // the headers are handed over as they are stored
+    if (headers_ && !headers_->empty()) {
+      props->headers  = headers_->table();
       props->_flags   |= AMQP_BASIC_HEADERS_FLAG;
     }
 
     return;
   }
 
+  message::sent_stamp::sent_stamp(uint64_t sent_us)
+  : sent_us_((int64_t) sent_us)
+  {
+  }
+
+  void message::serialize(amqp_bytes_t* bytes, amqp_basic_properties_t* props, sent_stamp& stamp) const {
+    serialize(bytes, props);
+
+    amqp_table_t const own = headers().table();
+    const size_t capacity = own.num_entries + 1;
+
+    amqp_table_entry_t *entries = stamp.inline_;
+    if (capacity > sent_stamp::inline_slots) {
+      stamp.spilled_.resize(capacity);
+      entries = &stamp.spilled_[0];
+    }
+
+    // the entries are copied shallowly, they keep pointing into our table
+    int nr_entries = 0;
+    for (int i = 0; i < own.num_entries; ++i) {
+      amqp_bytes_t const& key = own.entries[i].key;
+      if (key.len == sent_header.size() && !sent_header.compare(0, key.len, (const char*) key.bytes, key.len))
+        continue;
+
+      entries[nr_entries++] = own.entries[i];
+    }
+
+    amqp_table_entry_t& slot = entries[nr_entries++];
+    slot.key.len          = sent_header.size();
+    slot.key.bytes        = const_cast<char*>(sent_header.data());
+    slot.value.kind       = AMQP_FIELD_KIND_I64;
+    slot.value.value.i64  = stamp.sent_us_;
+
+    props->headers.num_entries  = nr_entries;
+    props->headers.entries      = entries;
+    props->_flags               |= AMQP_BASIC_HEADERS_FLAG;
+  }
+
   void message::deserialize(amqp_basic_properties_t* props) {
     props_.flags            = props->_flags;
     if (props->_flags & AMQP_BASIC_CONTENT_TYPE_FLAG)
-      props_.content_type     = amqp_bytes_to_string(&props->content_type);
+      assign_bytes(props_.content_type, props->content_type);
 
     if (props->_flags & AMQP_BASIC_CONTENT_ENCODING_FLAG)
-      props_.content_encoding = amqp_bytes_to_string(&props->content_encoding);
+      assign_bytes(props_.content_encoding, props->content_encoding);
 
     props_.delivery_mode    = props->delivery_mode;
-    props_.priority         = props->priority;
+
+    // the priority orders the dispatching, so garbage won't do
+    if (props->_flags & AMQP_BASIC_PRIORITY_FLAG)
+      props_.priority         = props->priority;
 
     if (props->_flags & AMQP_BASIC_CORRELATION_ID_FLAG)
-      props_.correlation_id   = amqp_bytes_to_string(&props->correlation_id);
+      assign_bytes(props_.correlation_id, props->correlation_id);
 
     if (props->_flags & AMQP_BASIC_REPLY_TO_FLAG)
-      props_.reply_to         = amqp_bytes_to_string(&props->reply_to);
+      assign_bytes(props_.reply_to, props->reply_to);
 
     if (props->_flags & AMQP_BASIC_MESSAGE_ID_FLAG)
-      props_.message_id       = amqp_bytes_to_string(&props->message_id);
+      assign_bytes(props_.message_id, props->message_id);
 
     props_.timestamp        = props->timestamp;
 
     if (props->_flags & AMQP_BASIC_USER_ID_FLAG)
-      props_.user_id          = amqp_bytes_to_string(&props->user_id);
+      assign_bytes(props_.user_id, props->user_id);
 
     if (props->_flags & AMQP_BASIC_APP_ID_FLAG)
-      props_.app_id           = amqp_bytes_to_string(&props->app_id);
-
-    if (props->_flags & AMQP_BASIC_HEADERS_FLAG) {
-      int nr_headers = props->headers.num_entries;
-      int hidx;
-      ALGOL_LOG->debugStream() << "deserializing " << nr_headers << " headers";
-      for (hidx = 0; hidx < nr_headers; ++hidx) {
-        // as we only support string headers, there's no need to type check
-        string_t key = amqp_bytes_to_string(&props->headers.entries[hidx].key);
-        string_t value = amqp_bytes_to_string(&props->headers.entries[hidx].value.value.bytes);
-
-        headers_.push_back({ key, value });
-      }
+      assign_bytes(props_.app_id, props->app_id);
+
+    if ((props->_flags & AMQP_BASIC_HEADERS_FLAG) && props->headers.num_entries > 0) {
+      // the decoded table lives in the frame's memory, copy it into our arena
+      if (!headers_ || headers_.use_count() != 1)
+        headers_ = std::make_shared<header_table>();
+      headers_->assign(props->headers);
     }
   }
 
@@ -292,10 +431,10 @@ namespace algol {
     };
 
     print_entry("Exchange", channel_ ? channel_->id() : "N/A");
-    print_entry("Queue", meta_.queue);
+    print_entry("Queue", get_queue());
     print_entry("--", "--");
 
-    print_entry("Body", body_);
+    print_entry("Body", *body_);
     print_entry("Content-Type", props_.content_type);
     print_entry("Content-Encoding", props_.content_encoding);
     print_entry_d("Delivery-Mode", props_.delivery_mode);
@@ -306,22 +445,55 @@ namespace algol {
     print_entry_d("Timestamp", props_.timestamp);
     print_entry("User-ID", props_.user_id);
     print_entry("App-ID", props_.app_id);
-    for (auto h : headers_)
-      print_entry("Header[" + h.key + "]", h.value);
+    if (headers_)
+      headers_->dump(s);
 
     return s.str();
   }
 
+  header_table& message::mutable_headers() {
+    if (!headers_)
+      headers_ = std::make_shared<header_table>();
+    else if (headers_.use_count() != 1)
+      headers_ = std::make_shared<header_table>(*headers_);
+
+    return *headers_;
+  }
+
+  header_table const& message::headers() const {
+    return headers_ ? *headers_ : empty_headers__;
+  }
+
+  bool message::has_header(string_t const& key) const {
+    return headers_ && headers_->has(key);
+  }
+
   void message::set_header(string_t const& key, string_t const& value) {
-    headers_.push_back({ key, value });
+    mutable_headers().set(key, value);
   }
 
-  // void message::set_header(string_t const& key, bool value) {
-  //   set_header(key, utility::stringify(value));
-  // }
+  void message::set_header(string_t const& key, const char* value) {
+    mutable_headers().set(key, value);
+  }
 
   void message::set_header(string_t const& key, int value) {
-    set_header(key, utility::stringify(value));
+    mutable_headers().set(key, (int32_t) value);
+  }
+
+  void message::set_header(string_t const& key, int64_t value) {
+    mutable_headers().set(key, value);
+  }
+
+  void message::set_header(string_t const& key, bool value) {
+    mutable_headers().set(key, value);
+  }
+
+  void message::set_header(string_t const& key, double value) {
+    mutable_headers().set(key, value);
+  }
+
+  void message::set_header(string_t const& key, header_table const& value) {
+    mutable_headers().set(key, value);
   }
 
 } // end of namespace algol
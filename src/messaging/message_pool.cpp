@@ -0,0 +1,62 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "algol/messaging/message_pool.hpp"
+
+namespace algol {
+
+  TRACK_STAT(message_pool, stat_allocated, "messaging: pooled messages allocated")
+  TRACK_STAT(message_pool, stat_recycled, "messaging: pooled messages recycled")
+
+  message_pool::message_pool(size_t capacity)
+  : idle_(std::max<size_t>(capacity, 1))
+  {
+  }
+
+  message_pool::~message_pool() {
+    message *msg;
+    while (idle_.pop(msg))
+      delete msg;
+  }
+
+  message* message_pool::acquire() {
+    message *msg;
+
+    if (idle_.pop(msg)) {
+      INC_STAT(stat_recycled);
+    } else {
+      INC_STAT(stat_allocated);
+      msg = new message();
+    }
+
+    msg->pool_ = shared_from_this();
+    msg->refs_.store(1, std::memory_order_relaxed);
+    return msg;
+  }
+
+  size_t message_pool::idle() const {
+    return idle_.size();
+  }
+
+  void message_pool::recycle(message* msg) {
+    msg->recycle();
+
+    if (!idle_.push(msg))
+      delete msg;
+  }
+
+} // end of namespace algol
@@ -0,0 +1,56 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "algol/messaging/message_view.hpp"
+
+namespace algol {
+
+  message_view::message_view(amqp_basic_properties_t const* props)
+  : props_(props)
+  {
+  }
+
+  bool message_view::equals(amqp_flags_t flag, amqp_bytes_t const& prop, string_t const& value) const {
+    if (!(props_->_flags & flag))
+      return false;
+
+    return prop.len == value.size() && memcmp(prop.bytes, value.data(), prop.len) == 0;
+  }
+
+  bool message_view::is_from(string_t const& app_id) const {
+    return equals(AMQP_BASIC_APP_ID_FLAG, props_->app_id, app_id);
+  }
+
+  bool message_view::is_directed_at(string_t const& app_id) const {
+    if (!(props_->_flags & AMQP_BASIC_REPLY_TO_FLAG) || props_->reply_to.len == 0)
+      return true;
+
+    return equals(AMQP_BASIC_REPLY_TO_FLAG, props_->reply_to, app_id);
+  }
+
+  amqp_field_value_t const* message_view::header(string_t const& key) const {
+    if (!(props_->_flags & AMQP_BASIC_HEADERS_FLAG))
+      return nullptr;
+
+    return header_table::find(props_->headers, key.data(), key.size());
+  }
+
+  amqp_basic_properties_t const* message_view::properties() const {
+    return props_;
+  }
+
+} // end of namespace algol
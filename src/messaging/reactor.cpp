@@ -0,0 +1,236 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "algol/messaging/reactor.hpp"
+
+#include <algorithm>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <cerrno>
+#include <cstring>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+namespace algol {
+
+  typedef boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> scoped_lock;
+  typedef boost::interprocess::scoped_lock<boost::interprocess::interprocess_recursive_mutex> scoped_recursive_lock;
+  using boost::posix_time::microsec_clock;
+  using boost::posix_time::milliseconds;
+
+  const int reactor::tick_ms;
+
+  /** the most events picked up by a single epoll_wait() */
+  static const int max_events = 64;
+
+  reactor::reactor()
+  : logger("reactor"),
+    running_(false)
+  {
+  }
+
+  reactor::~reactor() {
+    if (running_)
+      stop();
+  }
+
+  bool reactor::is_running() const {
+    return running_;
+  }
+
+  void reactor::start(size_t nr_threads, std::vector<int> const& cpus) {
+    if (running_) {
+      log_->warnStream() << "attempting to start an already running reactor!";
+      return;
+    }
+
+    nr_threads = std::max<size_t>(nr_threads, 1);
+
+    for (size_t i = 0; i < nr_threads; ++i) {
+      worker_t *worker = new worker_t();
+      worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+      if (worker->epoll_fd < 0) {
+        log_->errorStream() << "unable to create an epoll instance: " << strerror(errno);
+        delete worker;
+        break;
+      }
+
+      workers_.push_back(worker);
+    }
+
+    running_ = true;
+
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      boost::thread *thread = threads_.create_thread(boost::bind(&reactor::run, this, workers_[i]));
+
+      if (cpus.empty())
+        continue;
+
+      // the consumers of a queue are spread over the threads, pinning them
+      // keeps each one's frames in the caches of a single core
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpus[i % cpus.size()], &set);
+
+      int rc = pthread_setaffinity_np(thread->native_handle(), sizeof(set), &set);
+      if (rc != 0)
+        log_->warnStream() << "unable to pin thread #" << i << " to CPU " << cpus[i % cpus.size()] << ": " << strerror(rc);
+    }
+
+    log_->infoStream() << "running with " << workers_.size() << " threads";
+  }
+
+  void reactor::stop() {
+    if (!running_) {
+      log_->warnStream() << "attempting to stop a reactor that is not running!";
+      return;
+    }
+
+    // the threads wake up at least every tick
+    running_ = false;
+    threads_.join_all();
+
+    for (auto worker : workers_) {
+      close(worker->epoll_fd);
+      delete worker;
+    }
+
+    workers_.clear();
+
+    log_->infoStream() << "stopped";
+  }
+
+  void reactor::add(handler* h) {
+    worker_t *least_busy = nullptr;
+    size_t least_handlers = 0;
+
+    for (auto worker : workers_) {
+      scoped_lock lock(worker->mtx);
+      if (!least_busy || worker->handlers.size() < least_handlers) {
+        least_busy = worker;
+        least_handlers = worker->handlers.size();
+      }
+    }
+
+    if (!least_busy) {
+      log_->errorStream() << "attempting to watch a socket while the reactor is not running!";
+      return;
+    }
+
+    // only the handlers' mutex is taken: this may be called by a handler on
+    // another reactor thread, e.g. when it opens a new link
+    scoped_lock lock(least_busy->mtx);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = h;
+
+    if (epoll_ctl(least_busy->epoll_fd, EPOLL_CTL_ADD, h->fd(), &ev) < 0) {
+      log_->errorStream() << "unable to watch fd " << h->fd() << ": " << strerror(errno);
+      return;
+    }
+
+    least_busy->handlers.insert(h);
+  }
+
+  void reactor::remove(handler* h) {
+    for (auto worker : workers_) {
+      if (is_watched(worker, h)) {
+        // waits for the thread to be done with its handlers
+        scoped_recursive_lock lock(worker->dispatch_mtx);
+        unwatch(worker, h);
+        return;
+      }
+    }
+  }
+
+  bool reactor::is_watched(worker_t* worker, handler* h) {
+    scoped_lock lock(worker->mtx);
+    return worker->handlers.count(h) > 0;
+  }
+
+  void reactor::unwatch(worker_t* worker, handler* h) {
+    scoped_lock lock(worker->mtx);
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, h->fd(), nullptr);
+    worker->handlers.erase(h);
+  }
+
+  void reactor::read(worker_t* worker, handler* h, std::vector<handler*>& buffered) {
+    // it might have been removed by a handler called before it
+    if (!is_watched(worker, h))
+      return;
+
+    if (!h->on_readable())
+      unwatch(worker, h);
+    else if (h->has_buffered() && std::find(buffered.begin(), buffered.end(), h) == buffered.end())
+      buffered.push_back(h);
+  }
+
+  void reactor::run(worker_t* worker) {
+    struct epoll_event events[max_events];
+    boost::posix_time::ptime last_tick = microsec_clock::universal_time();
+
+    // the handlers that have frames left over from the last round, which
+    // their socket's readiness won't tell about
+    std::vector<handler*> buffered, leftovers;
+
+    while (running_) {
+      int nr_events = epoll_wait(worker->epoll_fd, events, max_events, buffered.empty() ? tick_ms : 0);
+
+      if (nr_events < 0 && errno != EINTR) {
+        log_->errorStream() << "epoll_wait failed: " << strerror(errno);
+        break;
+      }
+
+      scoped_recursive_lock lock(worker->dispatch_mtx);
+
+      leftovers.swap(buffered);
+      buffered.clear();
+
+      for (int i = 0; i < nr_events; ++i)
+        read(worker, static_cast<handler*>(events[i].data.ptr), buffered);
+
+      for (auto h : leftovers)
+        read(worker, h, buffered);
+
+      if (microsec_clock::universal_time() - last_tick >= milliseconds(tick_ms)) {
+        // handlers may remove themselves while being ticked
+        std::vector<handler*> handlers;
+        {
+          scoped_lock handlers_lock(worker->mtx);
+          handlers.assign(worker->handlers.begin(), worker->handlers.end());
+        }
+
+        for (auto h : handlers) {
+          if (!is_watched(worker, h))
+            continue;
+
+          if (!h->on_tick())
+            unwatch(worker, h);
+          else if (h->has_buffered() && std::find(buffered.begin(), buffered.end(), h) == buffered.end())
+            buffered.push_back(h);
+        }
+
+        last_tick = microsec_clock::universal_time();
+      }
+    }
+  }
+
+} // end of namespace algol
@@ -0,0 +1,243 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "algol/messaging/requester.hpp"
+#include "algol/messaging/channel.hpp"
+#include "algol/utility.hpp"
+
+#include <algorithm>
+#include <unistd.h>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+namespace algol {
+
+  typedef boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> scoped_lock;
+  using boost::posix_time::microsec_clock;
+  using boost::posix_time::milliseconds;
+
+  const string_t requester::reply_queue_header = "x-reply-queue";
+  const int requester::tick_ms;
+  const size_t requester::nr_slots;
+  const size_t requester::nr_shards;
+
+  TRACK_STAT(requester, stat_requests, "messaging: requests")
+  TRACK_STAT(requester, stat_replies, "messaging: replies")
+  TRACK_STAT(requester, stat_timeouts, "messaging: timed out requests")
+  TRACK_STAT(requester, stat_unmatched_replies, "messaging: unmatched replies")
+
+  requester::requester()
+  : logger("requester"),
+    wheel_(nr_slots),
+    tick_(0),
+    running_(false),
+    reply_queue_(algol_app().fqn + ".replies." + utility::stringify(getpid())),
+    seq_(0)
+  {
+  }
+
+  requester::~requester() {
+    stop();
+  }
+
+  string_t const& requester::reply_queue() const {
+    return reply_queue_;
+  }
+
+  std::future<message> requester::request(const message& m, channel* c, string_t const& queue, uint32_t timeout_ms) {
+    std::promise<message> promise;
+    std::future<message> reply = promise.get_future();
+
+    message msg(m);
+    if (msg.get_message_id().empty())
+      msg.set_message_id(reply_queue_ + '#' + utility::stringify(++seq_));
+
+    msg.set_header(reply_queue_header, reply_queue_);
+
+    const string_t id = msg.get_message_id();
+
+    if (!c || !listen(c)) {
+      promise.set_exception(std::make_exception_ptr(request_failed("Unable to consume the replies to request " + id)));
+      return reply;
+    }
+
+    {
+      // registered before sending, the reply might beat us to it
+      shard_t& shard = shard_of(id);
+      scoped_lock lock(shard.mtx);
+
+      if (shard.pending.count(id)) {
+        promise.set_exception(std::make_exception_ptr(request_failed("A request with the ID " + id + " is already pending")));
+        return reply;
+      }
+
+      shard.pending.insert(std::make_pair(id, std::move(promise)));
+    }
+
+    if (timeout_ms > 0) {
+      scoped_lock lock(wheel_mtx_);
+
+      if (!running_) {
+        running_ = true;
+        ticker_ = boost::thread(boost::bind(&requester::tick, this));
+      }
+
+      deadline_t timer;
+      timer.id = id;
+      timer.due = tick_ + std::max<uint64_t>((timeout_ms + tick_ms - 1) / tick_ms, 1);
+      wheel_[timer.due % nr_slots].push_back(timer);
+    }
+
+    INC_STAT(stat_requests)
+
+    // a request that can't be sent is failed through on_message_sent()
+    c->publish(this, msg, queue);
+
+    return reply;
+  }
+
+  void requester::stop() {
+    {
+      scoped_lock lock(wheel_mtx_);
+      running_ = false;
+    }
+
+    if (ticker_.joinable())
+      ticker_.join();
+
+    {
+      scoped_lock lock(wheel_mtx_);
+      for (auto& slot : wheel_)
+        slot.clear();
+    }
+
+    for (auto& shard : shards_) {
+      scoped_lock lock(shard.mtx);
+      for (auto& pair : shard.pending)
+        pair.second.set_exception(std::make_exception_ptr(request_failed("The messaging station was shut down")));
+
+      shard.pending.clear();
+    }
+  }
+
+  size_t requester::nr_pending() {
+    size_t count = 0;
+    for (auto& shard : shards_) {
+      scoped_lock lock(shard.mtx);
+      count += shard.pending.size();
+    }
+
+    return count;
+  }
+
+  requester::shard_t& requester::shard_of(string_t const& id) {
+    return shards_[std::hash<string_t>()(id) % nr_shards];
+  }
+
+  bool requester::take(string_t const& id, std::promise<message>& promise) {
+    shard_t& shard = shard_of(id);
+    scoped_lock lock(shard.mtx);
+
+    pending_t::iterator finder = shard.pending.find(id);
+    if (finder == shard.pending.end())
+      return false;
+
+    promise = std::move(finder->second);
+    shard.pending.erase(finder);
+    return true;
+  }
+
+  bool requester::listen(channel* c) {
+    scoped_lock lock(listening_mtx_);
+
+    if (listening_.count(c))
+      return true;
+
+    // the replies' queue is private to this process whatever the channel's flags
+    c->set_exclusive(reply_queue_);
+
+    if (!c->subscribe(reply_queue_, this))
+      return false;
+
+    listening_.insert(c);
+    return true;
+  }
+
+  void requester::on_message_received(const message& reply) {
+    std::promise<message> promise;
+
+    if (!take(reply.get_correlation_id(), promise)) {
+      INC_STAT(stat_unmatched_replies)
+      log_->debugStream() << "discarding a reply to an unknown request '" << reply.get_correlation_id() << "'";
+      return;
+    }
+
+    INC_STAT(stat_replies)
+    promise.set_value(reply);
+  }
+
+  void requester::on_message_sent(const message& msg, comm_rc rc) {
+    if (rc == comm_rc::success || rc == comm_rc::spooled)
+      return;
+
+    std::promise<message> promise;
+    if (take(msg.get_message_id(), promise))
+      promise.set_exception(std::make_exception_ptr(request_failed("Request " + msg.get_message_id() + " could not be sent")));
+  }
+
+  void requester::tick() {
+    const boost::posix_time::ptime started = microsec_clock::universal_time();
+    const uint64_t first_tick = tick_;
+
+    while (running_) {
+      boost::this_thread::sleep(milliseconds(tick_ms));
+
+      // catch up with the clock rather than count the wakeups, which drift
+      uint64_t now = first_tick + (microsec_clock::universal_time() - started).total_milliseconds() / tick_ms;
+
+      while (tick_ < now)
+        expire(tick_ + 1);
+    }
+  }
+
+  void requester::expire(uint64_t tick) {
+    std::vector<string_t> expired;
+    {
+      scoped_lock lock(wheel_mtx_);
+      tick_ = tick;
+
+      slot_t& slot = wheel_[tick % nr_slots];
+      slot_t::iterator due = std::partition(slot.begin(), slot.end(), [tick](deadline_t const& timer) -> bool {
+        return timer.due > tick;
+      });
+
+      for (slot_t::iterator timer = due; timer != slot.end(); ++timer)
+        expired.push_back(timer->id);
+
+      slot.erase(due, slot.end());
+    }
+
+    // requests that were replied to have left the pending table already
+    for (auto const& id : expired) {
+      std::promise<message> promise;
+      if (take(id, promise)) {
+        INC_STAT(stat_timeouts)
+        promise.set_exception(std::make_exception_ptr(request_timeout("Request " + id + " timed out")));
+      }
+    }
+  }
+
+} // end of namespace algol
@@ -0,0 +1,199 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "algol/messaging/routing_trie.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+namespace algol {
+
+  /** splits on the dots; an empty string has no words */
+  static void split(string_t const& s, std::vector<std::pair<size_t, size_t>>& words) {
+    if (s.empty())
+      return;
+
+    size_t start = 0;
+    for (;;) {
+      size_t dot = s.find('.', start);
+      if (dot == string_t::npos) {
+        words.push_back(std::make_pair(start, s.size() - start));
+        return;
+      }
+
+      words.push_back(std::make_pair(start, dot - start));
+      start = dot + 1;
+    }
+  }
+
+  routing_trie::routing_trie()
+  : builder_(1),
+    compiled_(false),
+    size_(0)
+  {
+  }
+
+  routing_trie::~routing_trie() {
+  }
+
+  void routing_trie::bind(string_t const& pattern, atom_t binding) {
+    assert(!compiled_);
+
+    std::vector<word_t> words;
+    split(pattern, words);
+
+    uint32_t node = 0;
+    bool after_hash = false;
+
+    for (auto const& w : words) {
+      const string_t word = pattern.substr(w.first, w.second);
+      uint32_t next;
+
+      if (word == "#") {
+        // "#.#" matches whatever "#" does, only slower
+        if (after_hash)
+          continue;
+
+        next = builder_[node].hash;
+        if (next == npos) {
+          next = builder_.size();
+          builder_[node].hash = next;
+          builder_.push_back(builder_node_t());
+        }
+      }
+      else if (word == "*") {
+        next = builder_[node].star;
+        if (next == npos) {
+          next = builder_.size();
+          builder_[node].star = next;
+          builder_.push_back(builder_node_t());
+        }
+      }
+      else {
+        auto finder = builder_[node].children.find(word);
+        if (finder == builder_[node].children.end()) {
+          next = builder_.size();
+          builder_[node].children.insert(std::make_pair(word, next));
+          builder_.push_back(builder_node_t());
+        } else {
+          next = finder->second;
+        }
+      }
+
+      after_hash = word == "#";
+      node = next;
+    }
+
+    builder_[node].bindings.push_back(binding);
+    ++size_;
+  }
+
+  void routing_trie::compile() {
+    assert(!compiled_);
+
+    // the node indices carry over, only the edges and bindings are flattened
+    nodes_.resize(builder_.size());
+
+    for (size_t i = 0; i < builder_.size(); ++i) {
+      builder_node_t const& from = builder_[i];
+      node_t& to = nodes_[i];
+
+      to.star = from.star;
+      to.hash = from.hash;
+
+      to.first_edge = edges_.size();
+      to.nr_edges = from.children.size();
+      for (auto const& child : from.children) {
+        edge_t edge;
+        edge.offset = words_.size();
+        edge.length = child.first.size();
+        edge.child = child.second;
+        edges_.push_back(edge);
+        words_ += child.first;
+      }
+
+      to.first_binding = bindings_.size();
+      to.nr_bindings = from.bindings.size();
+      bindings_.insert(bindings_.end(), from.bindings.begin(), from.bindings.end());
+    }
+
+    builder_.clear();
+    builder_.shrink_to_fit();
+    compiled_ = true;
+  }
+
+  size_t routing_trie::size() const {
+    return size_;
+  }
+
+  void routing_trie::match(string_t const& key, std::vector<atom_t>& bindings) const {
+    assert(compiled_);
+
+    std::vector<word_t> words;
+    split(key, words);
+
+    const size_t first = bindings.size();
+    walk(0, key, words, 0, bindings);
+
+    // patterns with a "#" can match the same key in more than one way
+    std::sort(bindings.begin() + first, bindings.end());
+    bindings.erase(std::unique(bindings.begin() + first, bindings.end()), bindings.end());
+  }
+
+  void routing_trie::walk(uint32_t index, string_t const& key, std::vector<word_t> const& words, size_t i, std::vector<atom_t>& bindings) const {
+    node_t const& node = nodes_[index];
+
+    if (node.hash != npos) {
+      for (size_t j = i; j <= words.size(); ++j)
+        walk(node.hash, key, words, j, bindings);
+    }
+
+    if (i == words.size()) {
+      bindings.insert(bindings.end(),
+        bindings_.begin() + node.first_binding,
+        bindings_.begin() + node.first_binding + node.nr_bindings);
+      return;
+    }
+
+    const uint32_t next = child(node, key.data() + words[i].first, words[i].second);
+    if (next != npos)
+      walk(next, key, words, i + 1, bindings);
+
+    if (node.star != npos)
+      walk(node.star, key, words, i + 1, bindings);
+  }
+
+  uint32_t routing_trie::child(node_t const& node, const char* word, size_t length) const {
+    const char* words = words_.data();
+
+    // the edges are in the order of std::map<string_t>, which compares like this
+    auto first = edges_.begin() + node.first_edge;
+    auto last = first + node.nr_edges;
+    auto finder = std::lower_bound(first, last, std::make_pair(word, length),
+      [words](edge_t const& edge, std::pair<const char*, size_t> const& w) -> bool {
+        int rc = memcmp(words + edge.offset, w.first, std::min<size_t>(edge.length, w.second));
+        return rc < 0 || (rc == 0 && edge.length < w.second);
+      });
+
+    if (finder == last || finder->length != length || memcmp(words + finder->offset, word, length) != 0)
+      return npos;
+
+    return finder->child;
+  }
+
+} // end of namespace algol
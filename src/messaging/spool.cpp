@@ -0,0 +1,803 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "algol/messaging/spool.hpp"
+#include "algol/messaging/station.hpp"
+#include "algol/messaging/envelope.hpp"
+#include "algol/utility.hpp"
+
+#include <algorithm>
+#include <map>
+#include <cctype>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace algol {
+
+  typedef boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> scoped_lock;
+  using boost::posix_time::microsec_clock;
+  using boost::posix_time::milliseconds;
+
+  TRACK_STAT(spool, stat_spooled, "messaging: messages spooled")
+  TRACK_STAT(spool, stat_replayed, "messaging: spooled messages replayed")
+  TRACK_STAT(spool, stat_rewinds, "messaging: spool rewinds")
+  TRACK_STAT(spool, stat_backlog, "messaging: spool backlog")
+  TRACK_STAT(spool, stat_refusals, "messaging: messages refused by full spools")
+  TRACK_STAT(spool, stat_corrupt, "messaging: corrupt spool records")
+  TRACK_HIST_STAT(spool, stat_commit_usecs, "messaging: spool commit time (us)")
+
+  static const char magic[] = "ALGOLSP1";
+  static const string_t extension = ".spool";
+  static const string_t lock_extension = ".lock";
+
+  /** magic, sequence number, replayed offset, and room to grow */
+  static const size_t header_size = 32;
+  static const size_t replayed_offset = 16;
+
+  /** the record's size and checksum */
+  static const size_t prefix_size = 8;
+
+  /** the bounds of the drainer's back-off while the broker isn't taking messages */
+  static const uint32_t min_retry_ms = 100;
+  static const uint32_t max_retry_ms = 5000;
+
+  /** the most replayed records awaiting their confirm */
+  static const size_t max_in_flight = 1024;
+
+  /** the tag of a record in the window that's not sent yet, past any the broker confirms */
+  static const uint64_t unassigned_tag = UINT64_MAX;
+
+  /** how long closing waits for the drainer to empty the spool */
+  static const uint32_t close_grace_ms = 1000;
+
+  static void write32(char* out, uint32_t value) {
+    out[0] = (char)((value >> 24) & 0xFF);
+    out[1] = (char)((value >> 16) & 0xFF);
+    out[2] = (char)((value >> 8) & 0xFF);
+    out[3] = (char)(value & 0xFF);
+  }
+
+  static uint32_t read32(const char* in) {
+    const unsigned char *p = (const unsigned char*) in;
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+  }
+
+  static uint32_t checksum(const char* data, size_t size) {
+    return crc32(crc32(0L, Z_NULL, 0), (const Bytef*) data, size);
+  }
+
+  spool::segment_t::segment_t()
+  : seq(0),
+    data(nullptr),
+    size(0),
+    end(0),
+    synced(0)
+  {
+  }
+
+  spool::segment_t::~segment_t() {
+    if (data)
+      munmap(data, size);
+  }
+
+  spool::spool(string_t const& directory, string_t const& name)
+  : logger(("Spool[" + name + "]").c_str()),
+    directory_(directory),
+    name_(name),
+    lock_fd_(-1),
+    running_(false),
+    closing_(false),
+    resumed_(false),
+    segment_bytes_(station::singleton().config.spool_segment_bytes),
+    max_bytes_(station::singleton().config.spool_max_bytes),
+    commit_ms_(std::max<uint32_t>(station::singleton().config.spool_commit_ms, 1)),
+    durable_(station::singleton().config.spool_durable),
+    backlog_(0),
+    backlog_bytes_(0),
+    appended_(0),
+    committed_(0),
+    next_seq_(1),
+    sending_offset_(0),
+    rewinds_(0),
+    is_sending_(false),
+    early_confirmed_upto_(0)
+  {
+    // the name ends up in file names
+    for (auto& c : name_)
+      if (!isalnum((unsigned char) c) && c != '-' && c != '_')
+        c = '_';
+  }
+
+  spool::~spool() {
+    close();
+  }
+
+  bool spool::is_open() const {
+    return running_;
+  }
+
+  uint64_t& spool::replayed(segment_t& segment) {
+    return *reinterpret_cast<uint64_t*>(segment.data + replayed_offset);
+  }
+
+  bool spool::open(sink_t sink) {
+    using namespace boost::filesystem;
+
+    if (running_) {
+      log_->warnStream() << "attempting to open an already open spool!";
+      return true;
+    }
+
+    // the segments left by the last run, in the order they were written
+    std::map<uint64_t, string_t> found;
+    try {
+      create_directories(path(directory_));
+
+      // the segments are ours alone to recover and append to
+      if (!lock())
+        return false;
+
+      const string_t prefix = name_ + ".";
+      directory_iterator end_it;
+      for (directory_iterator it(directory_); it != end_it; ++it) {
+        const string_t file = it->path().filename().string();
+        if (it->path().extension() != extension || file.compare(0, prefix.size(), prefix) != 0)
+          continue;
+
+        const string_t seq = file.substr(prefix.size(), file.size() - prefix.size() - extension.size());
+        if (seq.empty() || seq.find_first_not_of("0123456789") != string_t::npos)
+          continue;
+
+        found.insert(std::make_pair(utility::convertTo<uint64_t>(seq), it->path().string()));
+      }
+    } catch (filesystem_error &e) {
+      log_->errorStream() << "unable to list the spool directory " << directory_ << "; cause: " << e.what();
+      unlock();
+      return false;
+    }
+
+    for (auto pair : found) {
+      next_seq_ = pair.first + 1;
+
+      size_t nr_pending = 0, pending_bytes = 0;
+      segment_ptr segment = recover_segment(pair.second, pair.first, nr_pending, pending_bytes);
+      if (!segment) {
+        log_->warnStream() << "skipping " << pair.second << ", it's not a spool segment";
+        continue;
+      }
+
+      if (nr_pending == 0) {
+        discard(*segment);
+        continue;
+      }
+
+      segments_.push_back(segment);
+      backlog_ += nr_pending;
+      backlog_bytes_ += pending_bytes;
+    }
+
+    if (backlog_ > 0) {
+      log_->infoStream() << "recovered " << backlog_ << " messages from " << segments_.size() << " segments";
+      ADD_STAT(stat_backlog, backlog_)
+    }
+
+    // we never append to the segments of another run; their tail might be torn
+    segment_ptr segment = create_segment(0);
+    if (!segment) {
+      segments_.clear();
+      SUB_STAT(stat_backlog, backlog_)
+      backlog_ = 0;
+      backlog_bytes_ = 0;
+      unlock();
+      return false;
+    }
+
+    segments_.push_back(segment);
+
+    sink_ = sink;
+    running_ = true;
+    closing_ = false;
+    committer_ = boost::thread(boost::bind(&spool::commit, this));
+    drainer_ = boost::thread(boost::bind(&spool::drain, this));
+
+    return true;
+  }
+
+  void spool::close() {
+    {
+      scoped_lock lock(mtx_);
+      if (!running_)
+        return;
+
+      // give the drainer a chance to send what's left
+      closing_ = true;
+      boost::posix_time::ptime deadline = microsec_clock::universal_time() + milliseconds(close_grace_ms);
+      while (backlog_ > 0) {
+        if (!drained_cnd_.timed_wait(lock, deadline))
+          break;
+      }
+
+      running_ = false;
+      appended_cnd_.notify_all();
+      committed_cnd_.notify_all();
+      commit_cnd_.notify_all();
+    }
+
+    drainer_.join();
+    committer_.join();
+
+    if (backlog_ > 0)
+      log_->infoStream() << "closed with " << backlog_ << " messages left to replay";
+
+    // the segments that were replayed entirely won't be needed by the next
+    // run; those awaiting confirms are replayed by it again
+    {
+      scoped_lock replay_lock(replay_mtx_);
+      in_flight_.clear();
+      sending_.reset();
+
+      while (!segments_.empty()) {
+        if (replayed(*segments_.front()) >= segments_.front()->end)
+          discard(*segments_.front());
+
+        segments_.pop_front();
+      }
+    }
+
+    SUB_STAT(stat_backlog, backlog_)
+    backlog_ = 0;
+    backlog_bytes_ = 0;
+
+    unlock();
+  }
+
+  bool spool::lock() {
+    const string_t path = directory_ + "/" + name_ + lock_extension;
+
+    // the spool that releases the lock deletes the file first; if that's the
+    // one we locked, it's not the lock anymore and we try again
+    for (;;) {
+      int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+      if (fd < 0) {
+        log_->errorStream() << "unable to create the spool's lock file " << path << "; cause: " << strerror(errno);
+        return false;
+      }
+
+      if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        if (errno == EWOULDBLOCK)
+          log_->errorStream() << "the spool is open elsewhere, " << path << " is locked";
+        else
+          log_->errorStream() << "unable to lock " << path << "; cause: " << strerror(errno);
+        ::close(fd);
+        return false;
+      }
+
+      struct stat locked, current;
+      if (fstat(fd, &locked) == 0 && ::stat(path.c_str(), &current) == 0 &&
+          locked.st_dev == current.st_dev && locked.st_ino == current.st_ino) {
+        lock_fd_ = fd;
+        return true;
+      }
+
+      ::close(fd);
+    }
+  }
+
+  void spool::unlock() {
+    if (lock_fd_ < 0)
+      return;
+
+    // deleted while it's still locked, see lock()
+    unlink((directory_ + "/" + name_ + lock_extension).c_str());
+    ::close(lock_fd_);
+    lock_fd_ = -1;
+  }
+
+  size_t spool::backlog() const {
+    scoped_lock lock(mtx_);
+    return backlog_;
+  }
+
+  spool::segment_ptr spool::create_segment(size_t record_size) {
+    segment_ptr segment = std::make_shared<segment_t>();
+    segment->seq = next_seq_++;
+    segment->path = directory_ + "/" + name_ + "." + utility::stringify(segment->seq) + extension;
+    segment->size = std::max(segment_bytes_, header_size + record_size);
+
+    int fd = ::open(segment->path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      log_->errorStream() << "unable to create spool segment " << segment->path << "; cause: " << strerror(errno);
+      return segment_ptr();
+    }
+
+    // the blocks are allocated up-front; running out of disk space while
+    // writing to the mapping would kill the process
+    int rc = posix_fallocate(fd, 0, segment->size);
+    if (rc != 0) {
+      log_->errorStream() << "unable to allocate spool segment " << segment->path << "; cause: " << strerror(rc);
+      ::close(fd);
+      unlink(segment->path.c_str());
+      return segment_ptr();
+    }
+
+    void *data = mmap(nullptr, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (data == MAP_FAILED) {
+      log_->errorStream() << "unable to map spool segment " << segment->path << "; cause: " << strerror(errno);
+      unlink(segment->path.c_str());
+      return segment_ptr();
+    }
+
+    segment->data = static_cast<char*>(data);
+    memcpy(segment->data, magic, sizeof(magic) - 1);
+    memcpy(segment->data + sizeof(magic) - 1, &segment->seq, sizeof(uint64_t));
+    replayed(*segment) = header_size;
+    segment->end = header_size;
+
+    log_->debugStream() << "spooling to " << segment->path;
+    return segment;
+  }
+
+  spool::segment_ptr spool::recover_segment(string_t const& path, uint64_t seq, size_t& nr_pending, size_t& pending_bytes) {
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0)
+      return segment_ptr();
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < header_size) {
+      ::close(fd);
+      return segment_ptr();
+    }
+
+    void *data = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (data == MAP_FAILED)
+      return segment_ptr();
+
+    segment_ptr segment = std::make_shared<segment_t>();
+    segment->seq = seq;
+    segment->path = path;
+    segment->data = static_cast<char*>(data);
+    segment->size = st.st_size;
+
+    if (memcmp(segment->data, magic, sizeof(magic) - 1) != 0)
+      return segment_ptr();
+
+    // the records go on until the zeroes that follow the last one, unless
+    // the process died in the middle of writing it
+    const uint64_t from = replayed(*segment);
+    size_t offset = header_size;
+    while (segment->size - offset >= prefix_size) {
+      const char *record = segment->data + offset;
+      const uint32_t size = read32(record);
+      if (size == 0)
+        break;
+
+      if (size > segment->size - offset - prefix_size || checksum(record + prefix_size, size) != read32(record + 4)) {
+        log_->warnStream() << "the records of " << path << " are torn at offset " << offset << ", dropping the rest";
+        INC_STAT(stat_corrupt)
+        break;
+      }
+
+      if (offset >= from) {
+        ++nr_pending;
+        pending_bytes += prefix_size + size;
+      }
+
+      offset += prefix_size + size;
+    }
+
+    segment->end = segment->synced = offset;
+    replayed(*segment) = std::min<uint64_t>(std::max<uint64_t>(from, header_size), offset);
+
+    return segment;
+  }
+
+  void spool::discard(segment_t& segment) {
+    if (unlink(segment.path.c_str()) != 0)
+      log_->warnStream() << "unable to delete spool segment " << segment.path << "; cause: " << strerror(errno);
+  }
+
+  comm_rc spool::append(const message& m, string_t const& queue, uint64_t sent_us) {
+    // the message is encoded before the lock is taken...
+    envelope packed;
+    if (!packed.add(m, sent_us)) {
+      log_->errorStream() << "unable to encode a message to " << queue << " for spooling";
+      return comm_rc::spool_failed;
+    }
+
+    const message member = packed.seal();
+    string_t const& encoded = member.body();
+
+    const uint16_t queue_size = std::min<size_t>(queue.size(), 0xFFFF);
+    const uint32_t size = 2 + queue_size + encoded.size();
+
+    char queue_prefix[2] = { (char)(queue_size >> 8), (char)(queue_size & 0xFF) };
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, (const Bytef*) queue_prefix, 2);
+    crc = crc32(crc, (const Bytef*) queue.data(), queue_size);
+    crc = crc32(crc, (const Bytef*) encoded.data(), encoded.size());
+
+    // ...so that appending is just a copy
+    uint64_t ticket;
+    {
+      scoped_lock lock(mtx_);
+
+      if (!running_)
+        return comm_rc::spool_failed;
+
+      if (max_bytes_ > 0 && backlog_bytes_ + prefix_size + size > max_bytes_) {
+        INC_STAT(stat_refusals)
+        return comm_rc::queue_full;
+      }
+
+      segment_ptr segment = segments_.back();
+      if (segment->size - segment->end < prefix_size + size) {
+        segment = create_segment(prefix_size + size);
+        if (!segment)
+          return comm_rc::spool_failed;
+
+        segments_.push_back(segment);
+      }
+
+      char *record = segment->data + segment->end;
+      write32(record + 4, crc);
+      memcpy(record + prefix_size, queue_prefix, 2);
+      memcpy(record + prefix_size + 2, queue.data(), queue_size);
+      memcpy(record + prefix_size + 2 + queue_size, encoded.data(), encoded.size());
+      write32(record, size);
+
+      segment->end += prefix_size + size;
+      ++backlog_;
+      backlog_bytes_ += prefix_size + size;
+      ticket = ++appended_;
+
+      appended_cnd_.notify_one();
+
+      if (durable_) {
+        commit_cnd_.notify_one();
+        while (running_ && committed_ < ticket)
+          committed_cnd_.wait(lock);
+      }
+    }
+
+    INC_STAT(stat_spooled)
+    INC_STAT(stat_backlog)
+    return comm_rc::spooled;
+  }
+
+  void spool::commit() {
+    for (;;) {
+      bool stopping;
+      {
+        scoped_lock lock(mtx_);
+        if (running_)
+          commit_cnd_.timed_wait(lock, microsec_clock::universal_time() + milliseconds(commit_ms_));
+
+        stopping = !running_;
+      }
+
+      sync();
+
+      if (stopping)
+        break;
+    }
+  }
+
+  void spool::sync() {
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+
+    struct range_t {
+      segment_ptr segment;
+      size_t      from;
+      size_t      to;
+    };
+
+    // the ranges are picked under the lock, and flushed without it
+    std::vector<range_t> ranges;
+    uint64_t target;
+    {
+      scoped_lock lock(mtx_);
+      target = appended_;
+
+      for (auto& segment : segments_) {
+        // the header of the segment being replayed records the progress
+        if (segment == segments_.front()) {
+          range_t header = { segment, 0, header_size };
+          ranges.push_back(header);
+        }
+
+        if (segment->synced < segment->end) {
+          range_t range = { segment, segment->synced, segment->end };
+          ranges.push_back(range);
+          segment->synced = segment->end;
+        }
+      }
+    }
+
+    boost::posix_time::ptime started = microsec_clock::universal_time();
+
+    for (auto const& range : ranges) {
+      const size_t from = range.from & ~(page_size - 1);
+      if (msync(range.segment->data + from, range.to - from, MS_SYNC) != 0)
+        log_->errorStream() << "unable to commit spool segment " << range.segment->path << "; cause: " << strerror(errno);
+    }
+
+    HIST_STAT(stat_commit_usecs, (microsec_clock::universal_time() - started).total_microseconds())
+
+    scoped_lock lock(mtx_);
+    committed_ = std::max(committed_, target);
+    committed_cnd_.notify_all();
+  }
+
+  void spool::drain() {
+    uint32_t retry_ms = 0;
+
+    for (;;) {
+      segment_ptr segment;
+      uint64_t offset;
+      {
+        scoped_lock lock(mtx_);
+
+        for (;;) {
+          if (!running_)
+            return;
+
+          scoped_lock replay_lock(replay_mtx_);
+
+          // a segment is done with once it's confirmed and no longer written
+          while (segments_.size() > 1 && replayed(*segments_.front()) >= segments_.front()->end) {
+            if (sending_ == segments_.front())
+              sending_.reset();
+
+            discard(*segments_.front());
+            segments_.pop_front();
+          }
+
+          // resumes from the last confirmed record after a rewind
+          if (!sending_) {
+            sending_ = segments_.front();
+            sending_offset_ = replayed(*sending_);
+          }
+
+          if (sending_offset_ >= sending_->end && sending_ != segments_.back()) {
+            sending_ = *(std::find(segments_.begin(), segments_.end(), sending_) + 1);
+            sending_offset_ = replayed(*sending_);
+            continue;
+          }
+
+          if (sending_offset_ < sending_->end && in_flight_.size() < max_in_flight)
+            break;
+
+          replay_lock.unlock();
+
+          if (closing_ && backlog_ == 0)
+            drained_cnd_.notify_all();
+
+          appended_cnd_.wait(lock);
+        }
+
+        segment = sending_;
+        offset = sending_offset_;
+      }
+
+      // records are never modified once appended, they're read without the lock
+      const char *record = segment->data + offset;
+      const uint32_t size = read32(record);
+
+      message msg;
+      string_t queue;
+      uint64_t sent_us = 0;
+      bool is_valid = decode(record + prefix_size, size, msg, queue, sent_us);
+
+      in_flight_t entry = { segment, offset + prefix_size + size, prefix_size + size, unassigned_tag, !is_valid };
+      uint64_t rewinds;
+      size_t nr_settled = 0, settled_bytes = 0;
+      {
+        scoped_lock replay_lock(replay_mtx_);
+
+        // it was rewound while we were decoding
+        if (sending_ != segment || sending_offset_ != offset)
+          continue;
+
+        // the record takes its place in the window before it's sent, so that
+        // the lock isn't held while sending, see confirm()
+        in_flight_.push_back(entry);
+        sending_offset_ = entry.end;
+        rewinds = rewinds_;
+        is_sending_ = is_valid;
+
+        settle(nr_settled, settled_bytes);
+      }
+
+      if (!is_valid) {
+        settled(nr_settled, settled_bytes);
+        continue;
+      }
+
+      uint64_t tag = 0;
+      const bool is_sent = sink_(msg, queue, sent_us, tag);
+      {
+        scoped_lock replay_lock(replay_mtx_);
+
+        // the window it was in is gone if it was rewound meanwhile; it's sent again
+        if (is_sent && rewinds == rewinds_) {
+          in_flight_t& sent = in_flight_.back();
+          sent.tag = tag;
+          sent.confirmed = tag <= early_confirmed_upto_ ||
+            std::find(early_confirmed_.begin(), early_confirmed_.end(), tag) != early_confirmed_.end();
+
+          settle(nr_settled, settled_bytes);
+        }
+
+        is_sending_ = false;
+        early_confirmed_upto_ = 0;
+        early_confirmed_.clear();
+      }
+
+      settled(nr_settled, settled_bytes);
+
+      if (is_sent) {
+        retry_ms = 0;
+        continue;
+      }
+
+      // whatever was sent after the last confirm is sent again
+      rewind();
+
+      retry_ms = std::min(std::max(retry_ms * 2, min_retry_ms), max_retry_ms);
+      log_->warnStream() << "unable to replay a spooled message, retrying in " << retry_ms << "ms";
+
+      scoped_lock lock(mtx_);
+      if (closing_) {
+        drained_cnd_.notify_all();
+        return;
+      }
+
+      boost::posix_time::ptime deadline = microsec_clock::universal_time() + milliseconds(retry_ms);
+      while (running_ && !resumed_ && appended_cnd_.timed_wait(lock, deadline))
+        ;
+
+      resumed_ = false;
+    }
+  }
+
+  void spool::confirm(uint64_t delivery_tag, bool multiple) {
+    size_t nr_settled = 0, settled_bytes = 0;
+    {
+      scoped_lock replay_lock(replay_mtx_);
+
+      // the tags of the records sent before a rewind match none, and the
+      // record being sent has none yet
+      for (auto& entry : in_flight_) {
+        if (entry.tag > delivery_tag)
+          break;
+
+        if (multiple || entry.tag == delivery_tag)
+          entry.confirmed = true;
+      }
+
+      // the broker can confirm the record being sent before the drainer is
+      // back with its tag; it's checked against what was confirmed meanwhile
+      if (is_sending_) {
+        if (multiple)
+          early_confirmed_upto_ = std::max(early_confirmed_upto_, delivery_tag);
+        else
+          early_confirmed_.push_back(delivery_tag);
+      }
+
+      settle(nr_settled, settled_bytes);
+    }
+
+    settled(nr_settled, settled_bytes);
+  }
+
+  void spool::rewind() {
+    {
+      scoped_lock replay_lock(replay_mtx_);
+
+      if (in_flight_.empty() && !sending_)
+        return;
+
+      in_flight_.clear();
+      sending_.reset();
+      ++rewinds_;
+    }
+
+    INC_STAT(stat_rewinds)
+
+    // the drainer might be waiting for room in the window
+    scoped_lock lock(mtx_);
+    appended_cnd_.notify_one();
+  }
+
+  void spool::resume() {
+    scoped_lock lock(mtx_);
+    resumed_ = true;
+    appended_cnd_.notify_all();
+  }
+
+  void spool::settle(size_t& nr, size_t& bytes) {
+    while (!in_flight_.empty() && in_flight_.front().confirmed) {
+      in_flight_t const& entry = in_flight_.front();
+      replayed(*entry.segment) = entry.end;
+      ++nr;
+      bytes += entry.bytes;
+      in_flight_.pop_front();
+    }
+  }
+
+  void spool::settled(size_t nr, size_t bytes) {
+    if (nr == 0)
+      return;
+
+    {
+      scoped_lock lock(mtx_);
+      backlog_ -= nr;
+      backlog_bytes_ -= bytes;
+
+      // there's room in the window for the drainer, or nothing left for close()
+      appended_cnd_.notify_one();
+      if (closing_ && backlog_ == 0)
+        drained_cnd_.notify_all();
+    }
+
+    ADD_STAT(stat_replayed, nr)
+    SUB_STAT(stat_backlog, nr)
+  }
+
+  bool spool::decode(const char* record, size_t size, message& msg, string_t& queue, uint64_t& sent_us) {
+    const uint16_t queue_size = ((uint16_t)(unsigned char) record[0] << 8) | (unsigned char) record[1];
+    if (size < 2u + queue_size) {
+      INC_STAT(stat_corrupt)
+      return false;
+    }
+
+    queue.assign(record + 2, queue_size);
+    const string_t encoded(record + 2 + queue_size, size - 2 - queue_size);
+
+    envelope::reader reader(encoded);
+    amqp_basic_properties_t *props;
+    amqp_bytes_t content;
+    if (!reader.next(props, content)) {
+      log_->errorStream() << "dropping a spooled message to " << queue << " that can't be decoded";
+      INC_STAT(stat_corrupt)
+      return false;
+    }
+
+    msg = message(string_t(static_cast<const char*>(content.bytes), content.len));
+    msg.deserialize(props);
+
+    int64_t stamp = 0;
+    msg.headers().get(message::sent_header, stamp);
+    sent_us = stamp > 0 ? stamp : 0;
+
+    return true;
+  }
+
+} // end of namespace algol
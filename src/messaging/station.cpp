@@ -19,19 +19,103 @@
 #include "algol/messaging/message.hpp"
 #include "algol/utility.hpp"
 
+#include <algorithm>
+#include <cstdlib>
+#include <sched.h>
+
 namespace algol {
 
+  typedef boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> scoped_lock;
+
   station* station::__instance = 0;
 
+  /**
+   * Parses a list of CPUs like "0,2,4-7".
+   *
+   * @return false if it's malformed
+   */
+  static bool parse_cpus(string_t const& list, std::vector<int>& cpus) {
+    std::vector<int> parsed;
+    size_t start = 0;
+
+    while (start < list.size()) {
+      size_t comma = list.find(',', start);
+      if (comma == string_t::npos)
+        comma = list.size();
+
+      const string_t item = list.substr(start, comma - start);
+      const size_t dash = item.find('-');
+
+      char *end;
+      long first = strtol(item.c_str(), &end, 10);
+      if (end == item.c_str() || first < 0 || first >= CPU_SETSIZE)
+        return false;
+
+      long last = first;
+      if (dash != string_t::npos) {
+        const char *from = item.c_str() + dash + 1;
+        last = strtol(from, &end, 10);
+        if (end == from || last < first || last >= CPU_SETSIZE)
+          return false;
+      }
+
+      if (*end != '\0')
+        return false;
+
+      for (long cpu = first; cpu <= last; ++cpu)
+        parsed.push_back(cpu);
+
+      start = comma + 1;
+    }
+
+    cpus.swap(parsed);
+    return true;
+  }
+
   station::station()
   : configurable({"messaging"}),
-    logger("station")
+    logger("station"),
+    requester_(nullptr),
+    dedup_(nullptr),
+    nr_links_opened_(0)
   {
     config.host = "localhost";
     config.port = "5672";
     config.username = "guest";
     config.password = "guest";
     config.vhost = "/";
+    config.publish_batch_size = 0;
+    config.publish_linger_ms = 5;
+    config.prefetch_count = 0;
+    config.dedup = false;
+    config.dedup_window_s = 60;
+    config.dedup_capacity = 1000000;
+    config.message_pool_size = 256;
+    config.ack_batch_size = 32;
+    config.ack_interval_ms = 100;
+    config.publish_async = false;
+    config.outbound_capacity = 0;
+    config.outbound_overflow = "block";
+    config.publish_envelopes = false;
+    config.envelope_threshold = 1024;
+    config.envelope_max_bytes = 65536;
+    config.envelope_linger_ms = 2;
+    config.spool_segment_bytes = 64 * 1024 * 1024;
+    config.spool_max_bytes = 0;
+    config.spool_commit_ms = 5;
+    config.spool_durable = false;
+    config.dispatch_threads = std::max<size_t>(boost::thread::hardware_concurrency(), 1);
+    config.reactor_threads = 1;
+    config.dispatch_ordering = "queue";
+    config.connections = 1;
+    config.frame_max = 131072;
+    config.heartbeat_s = 30;
+    config.loopback = "off";
+    config.loopback_capacity = 4096;
+    config.compression = "off";
+    config.compression_level = 0;
+    config.compression_threshold = 16384;
+    config.max_decompressed_size = 64 * 1024 * 1024;
 
     message::set_app_id(algol_app().fqn);
   }
@@ -63,35 +147,219 @@ namespace algol {
     }else if (key == "password") {
       config.password = value;
     }
+    else if (key == "publish_batch_size") {
+      config.publish_batch_size = utility::convertTo<size_t>(value);
+    }
+    else if (key == "publish_linger_ms") {
+      config.publish_linger_ms = utility::convertTo<uint32_t>(value);
+    }
+    else if (key == "prefetch_count") {
+      config.prefetch_count = utility::convertTo<uint16_t>(value);
+    }
+    else if (key == "ack_batch_size") {
+      config.ack_batch_size = utility::convertTo<uint16_t>(value);
+    }
+    else if (key == "ack_interval_ms") {
+      config.ack_interval_ms = utility::convertTo<uint32_t>(value);
+    }
+    else if (key == "publish_async") {
+      if (value == "on" || value == "off")
+        config.publish_async = value == "on";
+      else
+        log_->warnStream() << "invalid publish_async value '" << value << "', expected 'on' or 'off'";
+    }
+    else if (key == "outbound_capacity") {
+      config.outbound_capacity = utility::convertTo<size_t>(value);
+    }
+    else if (key == "outbound_overflow") {
+      if (value == "block" || value == "drop_oldest" || value == "drop_newest" || value == "fail")
+        config.outbound_overflow = value;
+      else
+        log_->warnStream() << "unknown outbound overflow policy '" << value << "', falling back to 'block'";
+    }
+    else if (key == "publish_envelopes") {
+      if (value == "on" || value == "off")
+        config.publish_envelopes = value == "on";
+      else
+        log_->warnStream() << "invalid publish_envelopes value '" << value << "', expected 'on' or 'off'";
+    }
+    else if (key == "envelope_threshold") {
+      config.envelope_threshold = utility::convertTo<size_t>(value);
+    }
+    else if (key == "envelope_max_bytes") {
+      config.envelope_max_bytes = utility::convertTo<size_t>(value);
+    }
+    else if (key == "envelope_linger_ms") {
+      config.envelope_linger_ms = utility::convertTo<uint32_t>(value);
+    }
+    else if (key == "spool_dir") {
+      config.spool_dir = value;
+    }
+    else if (key == "spool_segment_bytes") {
+      config.spool_segment_bytes = std::max<size_t>(utility::convertTo<size_t>(value), 4096);
+    }
+    else if (key == "spool_max_bytes") {
+      config.spool_max_bytes = utility::convertTo<size_t>(value);
+    }
+    else if (key == "spool_commit_ms") {
+      config.spool_commit_ms = std::max<uint32_t>(utility::convertTo<uint32_t>(value), 1);
+    }
+    else if (key == "spool_durable") {
+      if (value == "on" || value == "off")
+        config.spool_durable = value == "on";
+      else
+        log_->warnStream() << "invalid spool_durable value '" << value << "', expected 'on' or 'off'";
+    }
+    else if (key == "dedup") {
+      if (value == "on" || value == "off")
+        config.dedup = value == "on";
+      else
+        log_->warnStream() << "invalid dedup value '" << value << "', expected 'on' or 'off'";
+    }
+    else if (key == "dedup_window_s") {
+      config.dedup_window_s = std::max<uint32_t>(utility::convertTo<uint32_t>(value), 1);
+    }
+    else if (key == "dedup_capacity") {
+      config.dedup_capacity = std::max<size_t>(utility::convertTo<size_t>(value), 1);
+    }
+    else if (key == "message_pool_size") {
+      config.message_pool_size = utility::convertTo<size_t>(value);
+    }
+    else if (key == "dispatch_threads") {
+      config.dispatch_threads = utility::convertTo<size_t>(value);
+      if (config.dispatch_threads == 0)
+        log_->warnStream() << "dispatching on the reactor threads, handlers must neither block nor wait on replies";
+    }
+    else if (key == "reactor_threads") {
+      config.reactor_threads = std::max<size_t>(utility::convertTo<size_t>(value), 1);
+    }
+    else if (key == "reactor_cpus") {
+      std::vector<int> cpus;
+      if (parse_cpus(value, cpus))
+        config.reactor_cpus = value;
+      else
+        log_->warnStream() << "invalid reactor_cpus value '" << value << "', expected a list like '0,2,4-7'";
+    }
+    else if (key == "connections") {
+      config.connections = std::max<size_t>(utility::convertTo<size_t>(value), 1);
+    }
+    else if (key == "frame_max") {
+      config.frame_max = std::max<size_t>(utility::convertTo<size_t>(value), AMQP_FRAME_MIN_SIZE);
+    }
+    else if (key == "heartbeat_s") {
+      config.heartbeat_s = std::max(utility::convertTo<int>(value), 0);
+    }
+    else if (key == "loopback") {
+      if (value == "off" || value == "on" || value == "only")
+        config.loopback = value;
+      else
+        log_->warnStream() << "unknown loopback mode '" << value << "', falling back to 'off'";
+    }
+    else if (key == "loopback_capacity") {
+      config.loopback_capacity = std::max<size_t>(utility::convertTo<size_t>(value), 2);
+    }
+    else if (key == "compression") {
+      codec::algorithm_t algorithm;
+      if (codec::parse(value, algorithm))
+        config.compression = value;
+      else
+        log_->warnStream() << "unknown or unavailable codec '" << value << "', compression is left " << config.compression;
+    }
+    else if (key == "compression_level") {
+      config.compression_level = utility::convertTo<int>(value);
+    }
+    else if (key == "compression_threshold") {
+      config.compression_threshold = utility::convertTo<size_t>(value);
+    }
+    else if (key == "max_decompressed_size") {
+      config.max_decompressed_size = utility::convertTo<size_t>(value);
+    }
+    else if (key == "dispatch_ordering") {
+      if (value == "queue" || value == "correlation_id")
+        config.dispatch_ordering = value;
+      else
+        log_->warnStream() << "unknown dispatch ordering '" << value << "', falling back to 'queue'";
+    }
     else {
       std::cerr << "unknown station config setting '" << key << "' => '" << value << "', discarding";
     }
   }
 
+  const size_t station::nr_registry_shards;
+
+  station::registry_shard_t& station::shard_of(channel_id_t const& id) {
+    return registry_[std::hash<channel_id_t>()(id) % nr_registry_shards];
+  }
+
   channel* station::get_channel(channel_id_t const& id) {
-    channels_t::iterator finder = channels_.find(id);
-    return finder == channels_.end() ? nullptr : finder->second;
+    registry_shard_t& shard = shard_of(id);
+    scoped_lock lock(shard.mtx);
+
+    channels_t::iterator finder = shard.channels.find(id);
+    return finder == shard.channels.end() ? nullptr : finder->second;
   }
 
-  channel* station::open_channel(channel_id_t const& id, int durable, int passive) {
-    channel *c = get_channel(id);
-    if (!c) {
-      try {
-        c = new channel(id);
-        // TODO: error handling
-        c->open(durable, passive);
-      } catch (connection_error &e) {
-        log_->errorStream() << "channel '" << id << "' could not be opened; cause: " << e.what();
-
-        return nullptr;
+  void station::start_services() {
+    scoped_lock lock(services_mtx_);
+
+    if (config.dispatch_threads > 0 && !dispatcher_.is_running())
+      dispatcher_.start(config.dispatch_threads);
+
+    if (config.loopback != "off" && !loopback_.is_running())
+      loopback_.start(config.loopback_capacity);
+  }
+
+  channel* station::open_channel(channel_id_t const& id, int durable, int passive, exchange_t exchange) {
+    registry_shard_t& shard = shard_of(id);
+    {
+      scoped_lock lock(shard.mtx);
+
+      channels_t::iterator finder;
+      while ((finder = shard.channels.find(id)) != shard.channels.end()) {
+        if (finder->second)
+          return finder->second;
+
+        // another thread is opening it
+        shard.opened_cnd.wait(lock);
       }
+
+      // claim it; the channel is opened without holding the lock
+      shard.channels.insert(std::make_pair(id, nullptr));
+    }
+
+    start_services();
+
+    channel *c = nullptr;
+    try {
+      c = new channel(id, exchange);
+      // TODO: error handling
+      c->open(durable, passive);
+    } catch (connection_error &e) {
+      log_->errorStream() << "channel '" << id << "' could not be opened; cause: " << e.what();
+
+      delete c;
+      c = nullptr;
     }
 
-    channels_.insert(std::make_pair(id, c));
+    {
+      scoped_lock lock(shard.mtx);
+
+      // the waiters will try to open it themselves if it failed
+      if (c)
+        shard.channels[id] = c;
+      else
+        shard.channels.erase(id);
+
+      shard.opened_cnd.notify_all();
+    }
 
     return c;
   }
 
+  channel_handle station::resolve(channel_id_t const& id, int durable, int passive, exchange_t exchange) {
+    return channel_handle(open_channel(id, durable, passive, exchange));
+  }
+
   bool station::is_channel_open(channel_id_t const& id) {
     channel* c = get_channel(id);
 
@@ -114,19 +382,189 @@ namespace algol {
   }
 
   void station::shutdown() {
-    // log_->infoStream() << "shutting down " << channels_.size() << " channels";
-    for (auto pair : channels_) {
-      close_channel(pair.second->id());
-      delete pair.second;
+    {
+      // fails the requests in flight, and drops its subscriptions to the
+      // reply queues while the channels are still around
+      scoped_lock lock(requester_mtx_);
+      delete requester_;
+      requester_ = nullptr;
+    }
+
+    std::list<channel*> open_channels(channels());
+
+    for (auto c : open_channels) {
+      close_channel(c->id());
+    }
+
+    // pending dispatches still refer to their channels; the loopback goes
+    // first as it feeds the dispatcher
+    if (loopback_.is_running())
+      loopback_.stop();
+
+    dispatcher_.stop();
+
+    for (auto& shard : registry_) {
+      scoped_lock lock(shard.mtx);
+      shard.channels.clear();
+    }
+
+    for (auto c : open_channels) {
+      delete c;
+    }
+
+    scoped_lock lock(links_mtx_);
+    links_.insert(links_.end(), lost_links_.begin(), lost_links_.end());
+    lost_links_.clear();
+
+    while (!links_.empty()) {
+      if (links_.back()->is_open())
+        links_.back()->close();
+
+      delete links_.back();
+      links_.pop_back();
+    }
+
+    if (reactor_.is_running())
+      reactor_.stop();
+
+    scoped_lock dedup_lock(dedup_mtx_);
+    delete dedup_;
+    dedup_ = nullptr;
+  }
+
+  executor& station::dispatcher() {
+    return dispatcher_;
+  }
+
+  loopback& station::local_transport() {
+    return loopback_;
+  }
+
+  reactor& station::io_reactor() {
+    return reactor_;
+  }
+
+  requester& station::requests() {
+    scoped_lock lock(requester_mtx_);
+
+    if (!requester_)
+      requester_ = new requester();
+
+    return *requester_;
+  }
+
+  dedup_filter& station::dedup() {
+    scoped_lock lock(dedup_mtx_);
+
+    if (!dedup_)
+      dedup_ = new dedup_filter(config.dedup_window_s, config.dedup_capacity);
+
+    return *dedup_;
+  }
+
+  station::links_t station::reap_links() {
+    for (links_t::iterator it = links_.begin(); it != links_.end();) {
+      if ((*it)->is_open()) {
+        ++it;
+        continue;
+      }
+
+      lost_links_.push_back(*it);
+      it = links_.erase(it);
     }
 
-    channels_.clear();
+    links_t unused;
+    for (links_t::iterator it = lost_links_.begin(); it != lost_links_.end();) {
+      if ((*it)->nr_channels() > 0) {
+        ++it;
+        continue;
+      }
+
+      unused.push_back(*it);
+      it = lost_links_.erase(it);
+    }
+
+    return unused;
+  }
+
+  link* station::acquire_link(std::vector<link*> const& avoid) {
+    links_t unused;
+    {
+      scoped_lock lock(links_mtx_);
+      unused = reap_links();
+    }
+
+    // closing them waits for the reactor thread that noticed the loss, which
+    // might still be notifying their former channels; not with the lock held
+    for (auto l : unused)
+      delete l;
+
+    scoped_lock lock(links_mtx_);
+
+    link *least_busy = nullptr;
+    size_t least_channels = 0;
+
+    // the least busy one, avoided or not
+    link *fallback = nullptr;
+    size_t fallback_channels = 0;
+
+    for (auto l : links_) {
+      if (!l->is_open())
+        continue;
+
+      size_t nr_channels = l->nr_channels();
+      if (!fallback || nr_channels < fallback_channels) {
+        fallback = l;
+        fallback_channels = nr_channels;
+      }
+
+      if (std::find(avoid.begin(), avoid.end(), l) != avoid.end())
+        continue;
+
+      if (!least_busy || nr_channels < least_channels) {
+        least_busy = l;
+        least_channels = nr_channels;
+      }
+    }
+
+    // an idle connection is as good as a new one
+    if (least_busy && (least_channels == 0 || links_.size() >= config.connections))
+      return least_busy;
+
+    if (!least_busy && fallback && links_.size() >= config.connections)
+      return fallback;
+
+    if (!reactor_.is_running()) {
+      std::vector<int> cpus;
+      parse_cpus(config.reactor_cpus, cpus);
+      reactor_.start(config.reactor_threads, cpus);
+    }
+
+    link *l = new link(nr_links_opened_++);
+    try {
+      l->open();
+    } catch (connection_error &e) {
+      delete l;
+
+      if (least_busy || fallback)
+        return least_busy ? least_busy : fallback;
+
+      throw;
+    }
+
+    links_.push_back(l);
+
+    return l;
   }
 
   std::list<channel*> station::channels() {
     std::list<channel*> ret;
-    for (auto pair : channels_) {
-      ret.push_back(pair.second);
+    for (auto& shard : registry_) {
+      scoped_lock lock(shard.mtx);
+      for (auto pair : shard.channels) {
+        if (pair.second)
+          ret.push_back(pair.second);
+      }
     }
     return ret;
   }
@@ -23,8 +23,12 @@
   #define UINT64_MAX 18446744073709551615u
 #endif
 
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
 namespace algol {
 
+  typedef boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> scoped_lock;
+
   monitor* monitor::__instance = 0;
   uint32_t monitor::__guid = 0;
 
@@ -44,6 +48,9 @@ namespace algol {
       }
     }
 
+    for (auto pair : histograms_)
+      delete pair.second;
+
   }
 
   monitor& monitor::singleton() {
@@ -61,11 +68,16 @@ namespace algol {
   {
     return avg_stats_;
   }
+  monitor::histograms_t const& monitor::histograms() const
+  {
+    return histograms_;
+  }
 
   monitor::stat_val monitor::stat(stat_id id)
   {
     if (stats_.find(id) != stats_.end()) return stats_[id];
     if (avg_stats_.find(id) != avg_stats_.end()) return avg_stats_[id].back()->val;
+    if (histograms_.find(id) != histograms_.end()) return histograms_[id]->count();
 
     throw std::runtime_error(
     "algol::monitor::stat(): requested stat '" + utility::stringify(id) + "' does not exist!");
@@ -81,6 +93,8 @@ namespace algol {
 
   monitor::stat_id monitor::track_stat(string_t const& name)
   {
+    scoped_lock lock(mtx_);
+
     for (auto pair : stat_names_)
     {
       if (pair.second == name)
@@ -95,6 +109,8 @@ namespace algol {
 
   monitor::stat_id monitor::track_avg_stat(string_t const& name)
   {
+    scoped_lock lock(mtx_);
+
     for (auto pair : stat_names_)
     {
       if (pair.second == name)
@@ -115,6 +131,44 @@ namespace algol {
     return id;
   }
 
+  monitor::stat_id monitor::track_hist_stat(string_t const& name)
+  {
+    scoped_lock lock(mtx_);
+
+    for (auto pair : stat_names_)
+    {
+      if (pair.second != name)
+        continue;
+
+      if (histograms_.count(pair.first))
+        return pair.first;
+
+      throw std::runtime_error(
+      "algol::monitor::track_hist_stat(): stat '" + name + "' is not a histogram!");
+    }
+
+    stat_id id = ++__guid;
+    histograms_.insert(std::make_pair(id, new histogram()));
+    stat_names_.insert(std::make_pair(id, name));
+    return id;
+  }
+
+  histogram& monitor::hist_stat(stat_id id)
+  {
+    scoped_lock lock(mtx_);
+
+    histograms_t::iterator finder = histograms_.find(id);
+    if (finder != histograms_.end()) return *finder->second;
+
+    throw std::runtime_error(
+    "algol::monitor::hist_stat(): requested histogram '" + utility::stringify(id) + "' does not exist!");
+  }
+
+  monitor::stat_val monitor::percentile(stat_id id, double percentage)
+  {
+    return hist_stat(id).percentile(percentage);
+  }
+
   string_t const& monitor::to_string(stat_id id)
   {
     return stat_names_[id];
@@ -122,16 +176,32 @@ namespace algol {
 
   void monitor::inc_stat(stat_id id)
   {
+    scoped_lock lock(mtx_);
     stats_[id] += 1;
   }
 
   void monitor::dec_stat(stat_id id)
   {
+    scoped_lock lock(mtx_);
     stats_[id] -= 1;
   }
 
+  void monitor::add_stat(stat_id id, stat_val amount)
+  {
+    scoped_lock lock(mtx_);
+    stats_[id] += amount;
+  }
+
+  void monitor::sub_stat(stat_id id, stat_val amount)
+  {
+    scoped_lock lock(mtx_);
+    stats_[id] -= amount;
+  }
+
   void monitor::avg_stat(stat_id id, uint64_t entry)
   {
+    scoped_lock lock(mtx_);
+
     cavg_t* avg = avg_stats_[id].back();
     assert(avg);
 
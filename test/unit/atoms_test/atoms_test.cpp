@@ -0,0 +1,127 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "atoms_test/atoms_test.hpp"
+#include "algol/messaging/atoms.hpp"
+#include "algol/utility.hpp"
+
+#include <atomic>
+#include <vector>
+#include <stdexcept>
+#include <boost/thread.hpp>
+
+namespace algol {
+
+  static const int nr_writers = 8;
+  static const int nr_readers = 4;
+  static const int nr_names = 4096; /// a power of two, so an odd stride visits every name
+
+  atoms_test::atoms_test() : test("atoms") {
+  }
+
+  atoms_test::~atoms_test() {
+  }
+
+  static string_t name_of(int i) {
+    return "atoms_test #" + utility::stringify(i);
+  }
+
+  int atoms_test::run(int, char**) {
+    result_ = passed;
+
+    // interning
+    {
+      const atom_t queue = atoms::intern("atoms_test_queue");
+      const atom_t other_queue = atoms::intern("atoms_test_other_queue");
+
+      soft_assert("a name is given an atom", queue != atoms::none);
+      soft_assert("a name keeps its atom", atoms::intern("atoms_test_queue") == queue);
+      soft_assert("distinct names are given distinct atoms", other_queue != queue);
+      soft_assert("an atom's name is looked up", atoms::name(queue) == "atoms_test_queue");
+      soft_assert("atoms::none has no name", atoms::name(atoms::none).empty());
+      soft_assert("an atom that wasn't handed out has no name", atoms::name(atoms::size() + 1).empty());
+    }
+
+    // concurrent interning, while the names are being looked up
+    {
+      std::vector<std::vector<atom_t> > interned(nr_writers, std::vector<atom_t>(nr_names));
+      std::atomic<int> nr_writing(nr_writers);
+      std::atomic<bool> is_named(true);
+
+      boost::thread_group threads;
+
+      for (int w = 0; w < nr_writers; ++w) {
+        threads.create_thread([&, w]() -> void {
+          // every writer interns the same names, in an order of its own
+          for (int i = 0; i < nr_names; ++i) {
+            const int n = (i * (2 * w + 1) + w) % nr_names;
+            interned[w][n] = atoms::intern(name_of(n));
+          }
+
+          --nr_writing;
+        });
+      }
+
+      for (int r = 0; r < nr_readers; ++r) {
+        threads.create_thread([&]() -> void {
+          // an atom that's been handed out always has its name in place
+          while (nr_writing > 0) {
+            const atom_t latest = atoms::size();
+            if (latest != atoms::none && atoms::name(latest).empty())
+              is_named = false;
+          }
+        });
+      }
+
+      threads.join_all();
+
+      bool is_agreed = true, is_resolved = true;
+      for (int n = 0; n < nr_names; ++n) {
+        for (int w = 1; w < nr_writers; ++w)
+          is_agreed = is_agreed && interned[w][n] == interned[0][n];
+
+        is_resolved = is_resolved && atoms::name(interned[0][n]) == name_of(n);
+      }
+
+      soft_assert("the writers agree on the atoms", is_agreed);
+      soft_assert("the atoms resolve to their names", is_resolved);
+      soft_assert("the handed out atoms are named while interning goes on", is_named);
+    }
+
+    // a full table; last, since there's no emptying it. It takes a few
+    // hundred megabytes to fill
+    {
+      const atom_t queue = atoms::intern("atoms_test_queue");
+
+      bool is_full = false;
+      try {
+        for (int i = 0; atoms::size() < atoms::capacity; ++i)
+          atoms::intern("atoms_test filler #" + utility::stringify(i));
+      } catch (std::length_error&) {
+        is_full = true;
+      }
+
+      soft_assert("a full table refuses new names", is_full);
+      soft_assert("a full table holds capacity - 1 names: " + utility::stringify(atoms::size()), atoms::size() == atoms::capacity - 1);
+      soft_assert("a full table still interns the names it has", atoms::intern("atoms_test_queue") == queue);
+      soft_assert("a full table still looks names up", atoms::name(queue) == "atoms_test_queue");
+    }
+
+    return result_;
+  }
+
+}
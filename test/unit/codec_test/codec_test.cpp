@@ -0,0 +1,87 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "codec_test/codec_test.hpp"
+#include "algol/messaging/codec.hpp"
+
+#include <cstdlib>
+
+namespace algol {
+
+  codec_test::codec_test() : test("codec") {
+  }
+
+  codec_test::~codec_test() {
+  }
+
+  int codec_test::run(int, char**) {
+    result_ = passed;
+
+    std::vector<codec::algorithm_t> algorithms;
+    algorithms.push_back(codec::algorithm_t::zlib);
+#ifdef ALGOL_LZ4
+    algorithms.push_back(codec::algorithm_t::lz4);
+#endif
+
+    // repetitive text compresses well
+    string_t text;
+    while (text.size() < 64 * 1024)
+      text += "the quick brown fox jumps over the lazy dog; ";
+
+    // random bytes don't
+    string_t noise(64 * 1024, '\0');
+    srand(42);
+    for (auto& c : noise)
+      c = (char) (rand() & 0xFF);
+
+    codec::algorithm_t parsed;
+    soft_assert("'off' parses", codec::parse("off", parsed) && parsed == codec::algorithm_t::none);
+    soft_assert("unknown codecs don't parse", !codec::parse("brotli", parsed));
+    string_t uncompressed;
+    soft_assert("nothing is compressed with no codec", !codec::compress(codec::algorithm_t::none, 0, text, uncompressed));
+
+    for (auto algorithm : algorithms) {
+      string_t const& encoding = codec::encoding(algorithm);
+
+      string_t compressed, restored;
+      soft_assert(encoding + " compresses text", codec::compress(algorithm, 0, text, compressed) && compressed.size() < text.size());
+      soft_assert(encoding + " restores text", codec::decompress(encoding, compressed, restored) && restored == text);
+
+      string_t incompressible;
+      soft_assert(encoding + " leaves incompressible content alone", !codec::compress(algorithm, 0, noise, incompressible));
+
+      // the size prefix can't be trusted with an allocation
+      string_t bad_prefix = compressed;
+      bad_prefix[0] = (char) 0x7F;
+      soft_assert(encoding + " rejects an oversized prefix", !codec::decompress(encoding, bad_prefix, restored));
+
+      bad_prefix = compressed;
+      bad_prefix[3] = (char) (bad_prefix[3] + 1);
+      soft_assert(encoding + " rejects a prefix that's off by one", !codec::decompress(encoding, bad_prefix, restored));
+
+      soft_assert(encoding + " rejects a prefix over the limit", !codec::decompress(encoding, compressed, restored, text.size() - 1));
+      soft_assert(encoding + " rejects a truncated prefix", !codec::decompress(encoding, compressed.substr(0, 3), restored));
+      soft_assert(encoding + " rejects a truncated stream", !codec::decompress(encoding, compressed.substr(0, compressed.size() / 2), restored));
+    }
+
+    string_t restored;
+    soft_assert("unknown encodings are not decompressed", !codec::decompress("gzip", text, restored));
+
+    return result_;
+  }
+
+}
@@ -0,0 +1,94 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dedup_filter_test/dedup_filter_test.hpp"
+#include "algol/messaging/dedup_filter.hpp"
+#include "algol/messaging/atoms.hpp"
+#include "algol/utility.hpp"
+
+#include <boost/thread.hpp>
+
+namespace algol {
+
+  dedup_filter_test::dedup_filter_test() : test("dedup_filter") {
+  }
+
+  dedup_filter_test::~dedup_filter_test() {
+  }
+
+  static bool check(dedup_filter& filter, atom_t queue, string_t const& id) {
+    return filter.check(queue, id.data(), id.size());
+  }
+
+  static void wait_ms(int ms) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(ms));
+  }
+
+  int dedup_filter_test::run(int, char**) {
+    result_ = passed;
+
+    const atom_t queue = atoms::intern("dedup_filter_test_queue");
+    const atom_t other_queue = atoms::intern("dedup_filter_test_other_queue");
+
+    // within the window
+    {
+      dedup_filter filter(1, 1000);
+
+      soft_assert("a fresh ID isn't a duplicate", !check(filter, queue, "first"));
+      soft_assert("a repeated ID is a duplicate", check(filter, queue, "first"));
+      soft_assert("the queues are kept apart", !check(filter, other_queue, "first"));
+
+      // past one window, the ID is in the previous generation
+      wait_ms(1100);
+      soft_assert("an ID is remembered for a window at least", check(filter, queue, "first"));
+    }
+
+    // past two windows
+    {
+      dedup_filter filter(1, 1000);
+      const size_t footprint = filter.footprint();
+
+      check(filter, queue, "expiring");
+      wait_ms(2100);
+      soft_assert("an ID is forgotten after two windows", !check(filter, queue, "expiring"));
+      soft_assert("a forgotten ID is remembered again", check(filter, queue, "expiring"));
+
+      // more IDs than expected retire the generations early, but don't grow them
+      for (int i = 0; i < 10000; ++i)
+        check(filter, queue, "flood #" + utility::stringify(i));
+
+      soft_assert("the filter doesn't grow", filter.footprint() == footprint);
+      soft_assert("the latest IDs are still remembered", check(filter, queue, "flood #9999"));
+    }
+
+    // fresh IDs are rarely mistaken for duplicates
+    {
+      dedup_filter filter(60, 100000);
+
+      int nr_false_hits = 0;
+      for (int i = 0; i < 20000; ++i) {
+        if (check(filter, queue, "fresh #" + utility::stringify(i)))
+          ++nr_false_hits;
+      }
+
+      soft_assert("fresh IDs are rarely mistaken for duplicates: " + utility::stringify(nr_false_hits), nr_false_hits <= 20);
+    }
+
+    return result_;
+  }
+
+}
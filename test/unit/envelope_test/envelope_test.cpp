@@ -0,0 +1,127 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "envelope_test/envelope_test.hpp"
+#include "algol/messaging/envelope.hpp"
+#include "algol/messaging/message.hpp"
+#include "algol/messaging/header_table.hpp"
+#include "algol/utility.hpp"
+
+namespace algol {
+
+  envelope_test::envelope_test() : test("envelope") {
+  }
+
+  envelope_test::~envelope_test() {
+  }
+
+  int envelope_test::run(int, char**) {
+    result_ = passed;
+
+    const int nr_members = 5;
+
+    envelope packed;
+    soft_assert("a new envelope is empty", packed.empty() && packed.size() == 0);
+
+    for (int i = 0; i < nr_members; ++i) {
+      message m(string_t(i * 7, 'a' + i));
+      m.set_message_id("id" + utility::stringify(i));
+      m.set_priority(i);
+      if (i == 2)
+        m.set_delivery_mode(message::DELIVERY_MODE_PERSISTENT);
+
+      soft_assert("a member is packed", packed.add(m, 1000 + i));
+    }
+
+    soft_assert("every member is kept", packed.members().size() == nr_members);
+
+    message sealed = packed.seal();
+    string_t const& content = static_cast<message const&>(sealed).body();
+
+    soft_assert("the envelope says what it is", sealed.get_content_type() == envelope::content_type);
+    soft_assert("the envelope takes the highest priority", sealed.get_priority() == nr_members - 1);
+    soft_assert("the envelope is persistent if a member is", sealed.get_delivery_mode() == message::DELIVERY_MODE_PERSISTENT);
+
+    // the members come out as they went in
+    {
+      envelope::reader reader(content);
+      amqp_basic_properties_t *props;
+      amqp_bytes_t body;
+
+      int i = 0;
+      while (reader.next(props, body)) {
+        const string_t id((const char*) props->message_id.bytes, props->message_id.len);
+        soft_assert("a member keeps its message ID", id == "id" + utility::stringify(i));
+        soft_assert("a member keeps its priority", props->priority == i);
+        soft_assert("a member keeps its content", string_t((const char*) body.bytes, body.len) == string_t(i * 7, 'a' + i));
+
+        amqp_field_value_t const* stamp = (props->_flags & AMQP_BASIC_HEADERS_FLAG)
+          ? header_table::find(props->headers, message::sent_header.c_str(), message::sent_header.size())
+          : nullptr;
+        soft_assert("a member is stamped with its send time", stamp && stamp->kind == AMQP_FIELD_KIND_I64 && stamp->value.i64 == 1000 + i);
+
+        ++i;
+      }
+
+      soft_assert("every member is read", i == nr_members);
+      soft_assert("an intact envelope isn't corrupt", !reader.is_corrupt());
+    }
+
+    // a truncated envelope yields its whole members, then stops
+    {
+      const string_t truncated = content.substr(0, content.size() - 3);
+      envelope::reader reader(truncated);
+      amqp_basic_properties_t *props;
+      amqp_bytes_t body;
+
+      int nr_read = 0;
+      while (reader.next(props, body))
+        ++nr_read;
+
+      soft_assert("a truncated envelope yields its whole members", nr_read == nr_members - 1);
+      soft_assert("a truncated envelope is corrupt", reader.is_corrupt());
+      soft_assert("a corrupt reader stays stopped", !reader.next(props, body));
+    }
+
+    // a size that runs past the end
+    {
+      string_t corrupt = content;
+      corrupt[0] = (char) 0x7F;
+      envelope::reader reader(corrupt);
+      amqp_basic_properties_t *props;
+      amqp_bytes_t body;
+
+      soft_assert("an oversized member isn't read", !reader.next(props, body));
+      soft_assert("an oversized member is corrupt", reader.is_corrupt());
+    }
+
+    {
+      const string_t empty;
+      envelope::reader reader(empty);
+      amqp_basic_properties_t *props;
+      amqp_bytes_t body;
+
+      soft_assert("an empty envelope has no members", !reader.next(props, body) && !reader.is_corrupt());
+    }
+
+    packed.clear();
+    soft_assert("a cleared envelope is empty", packed.empty() && packed.size() == 0 && packed.members().empty());
+
+    return result_;
+  }
+
+}
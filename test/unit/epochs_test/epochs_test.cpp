@@ -0,0 +1,169 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "epochs_test/epochs_test.hpp"
+#include "algol/messaging/epochs.hpp"
+
+#include <atomic>
+#include <boost/thread.hpp>
+
+namespace algol {
+
+  static const int timeout_ms = 5000;
+
+  epochs_test::epochs_test() : test("epochs") {
+  }
+
+  epochs_test::~epochs_test() {
+  }
+
+  static void wait_ms(int ms) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(ms));
+  }
+
+  static bool join(boost::thread& thread) {
+    return thread.timed_join(boost::posix_time::milliseconds(timeout_ms));
+  }
+
+  int epochs_test::run(int, char**) {
+    result_ = passed;
+
+    // pins
+    {
+      epochs readers;
+
+      uint64_t retired_at = readers.advance();
+      soft_assert("nothing holds back an epoch without readers", readers.has_passed(retired_at));
+
+      boost::barrier pinned(2), done(2);
+      boost::thread reader([&]() -> void {
+        epochs::guard outer(readers);
+        {
+          epochs::guard inner(readers);
+        }
+        pinned.wait();
+        done.wait();
+      });
+
+      pinned.wait();
+      retired_at = readers.advance();
+      soft_assert("a reader holds back the epochs after its pin", !readers.has_passed(retired_at));
+
+      done.wait();
+      soft_assert("the reader is joined", join(reader));
+      soft_assert("the epoch is passed once the reader is done", readers.has_passed(retired_at));
+
+      epochs::guard late(readers);
+      soft_assert("a pin taken after the epoch doesn't hold it back", readers.has_passed(retired_at));
+    }
+
+    // waiting for the readers
+    {
+      epochs readers;
+
+      boost::barrier pinned(2);
+      std::atomic<bool> releasing(false), synchronized(false);
+
+      boost::thread reader([&]() -> void {
+        epochs::guard pin(readers);
+        pinned.wait();
+        while (!releasing)
+          wait_ms(1);
+      });
+
+      pinned.wait();
+      const uint64_t retired_at = readers.advance();
+
+      boost::thread writer([&]() -> void {
+        synchronized = readers.synchronize(retired_at);
+      });
+
+      wait_ms(100);
+      soft_assert("synchronizing waits for the reader", !synchronized);
+
+      releasing = true;
+      soft_assert("synchronizing returns once the reader is done", join(writer) && synchronized);
+      soft_assert("the reader is joined", join(reader));
+    }
+
+    // a pinned thread can't wait for the others
+    {
+      epochs readers;
+      epochs::guard pin(readers);
+      soft_assert("synchronizing is refused while pinned", !readers.synchronize(readers.advance()));
+    }
+
+    // two handlers unsubscribing at once, each pinned while it waits for the other
+    {
+      epochs readers;
+
+      boost::barrier pinned(2), unpinning(3);
+      std::atomic<int> nr_refused(0);
+
+      auto handler = [&]() -> void {
+        {
+          epochs::guard pin(readers);
+          pinned.wait();
+
+          if (!readers.synchronize(readers.advance()))
+            ++nr_refused;
+        }
+        unpinning.wait();
+      };
+
+      boost::thread first(handler), second(handler);
+      unpinning.wait();
+
+      soft_assert("the handlers don't wait for each other", join(first) && join(second));
+      soft_assert("both are refused", nr_refused == 2);
+      soft_assert("the epochs are passed once both are done", readers.has_passed(readers.advance()));
+    }
+
+    // readers coming and going while a writer waits on them over and over
+    {
+      epochs readers;
+
+      const int nr_readers = 4;
+      std::atomic<bool> running(true);
+      std::atomic<int> nr_synchronized(0);
+
+      boost::thread_group group;
+      for (int i = 0; i < nr_readers; ++i) {
+        group.create_thread([&]() -> void {
+          while (running) {
+            epochs::guard pin(readers);
+            boost::this_thread::yield();
+          }
+        });
+      }
+
+      boost::thread writer([&]() -> void {
+        for (int i = 0; i < 1000; ++i)
+          if (readers.synchronize(readers.advance()))
+            ++nr_synchronized;
+      });
+
+      soft_assert("the writer keeps up with the readers", join(writer));
+      soft_assert("every wait succeeds", nr_synchronized == 1000);
+
+      running = false;
+      group.join_all();
+    }
+
+    return result_;
+  }
+
+}
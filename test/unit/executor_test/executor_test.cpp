@@ -0,0 +1,214 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "executor_test/executor_test.hpp"
+#include "algol/messaging/executor.hpp"
+#include "algol/utility.hpp"
+
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include <stdexcept>
+#include <boost/thread.hpp>
+
+namespace algol {
+
+  static const int timeout_ms = 5000;
+
+  executor_test::executor_test() : test("executor") {
+  }
+
+  executor_test::~executor_test() {
+  }
+
+  static void wait_ms(int ms) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(ms));
+  }
+
+  /** holds a lane with a task that waits until it's opened, so the tasks behind it pile up */
+  class gate {
+  public:
+    gate() : is_entered_(false), is_open_(false) {}
+
+    void hold(executor& pool, size_t key) {
+      pool.submit(key, [this]() -> void {
+        is_entered_ = true;
+        while (!is_open_)
+          wait_ms(1);
+      });
+
+      for (int i = 0; i < timeout_ms && !is_entered_; ++i)
+        wait_ms(1);
+    }
+
+    void open() {
+      is_open_ = true;
+    }
+
+    bool is_entered() const {
+      return is_entered_;
+    }
+
+  private:
+    std::atomic<bool> is_entered_;
+    std::atomic<bool> is_open_;
+  };
+
+  /** the tasks that ran, in the order they ran in */
+  class journal {
+  public:
+    void record(int id) {
+      boost::mutex::scoped_lock lock(mtx_);
+      ids_.push_back(id);
+    }
+
+    std::vector<int> ids() {
+      boost::mutex::scoped_lock lock(mtx_);
+      return ids_;
+    }
+
+  private:
+    boost::mutex      mtx_;
+    std::vector<int>  ids_;
+  };
+
+  int executor_test::run(int, char**) {
+    result_ = passed;
+
+    // the tasks of a key run one at a time, in order
+    {
+      const size_t nr_keys = 8;
+      const int nr_tasks = 2000;
+
+      std::vector<std::vector<int> > runs(nr_keys);
+      std::atomic<int> in_flight[nr_keys];
+      std::atomic<bool> is_overlapping(false);
+      for (size_t key = 0; key < nr_keys; ++key)
+        in_flight[key] = 0;
+
+      executor pool;
+      pool.start(4);
+
+      for (int i = 0; i < nr_tasks; ++i) {
+        for (size_t key = 0; key < nr_keys; ++key) {
+          pool.submit(key, [&, key, i]() -> void {
+            if (++in_flight[key] > 1)
+              is_overlapping = true;
+
+            runs[key].push_back(i);
+            --in_flight[key];
+          });
+        }
+      }
+
+      pool.stop();
+
+      bool is_ordered = true;
+      for (size_t key = 0; key < nr_keys; ++key) {
+        if (runs[key].size() != size_t(nr_tasks)) {
+          is_ordered = false;
+          continue;
+        }
+
+        for (int i = 0; i < nr_tasks; ++i)
+          is_ordered = is_ordered && runs[key][i] == i;
+      }
+
+      soft_assert("the tasks of a key don't overlap", !is_overlapping);
+      soft_assert("the tasks of a key run in the order they're submitted", is_ordered);
+    }
+
+    // a lane runs its higher-priority tasks first, and those of a priority in order
+    {
+      journal ran;
+      gate blocker;
+
+      executor pool;
+      pool.start(1);
+
+      blocker.hold(pool, 0);
+      soft_assert("the lane is held", blocker.is_entered());
+
+      pool.submit(0, 0, [&ran]() -> void { ran.record(1); });
+      pool.submit(0, 5, [&ran]() -> void { ran.record(2); });
+      pool.submit(0, 9, [&ran]() -> void { ran.record(3); });
+      pool.submit(0, 5, [&ran]() -> void { ran.record(4); });
+      pool.submit(0, 42, [&ran]() -> void { ran.record(5); });
+
+      blocker.open();
+      pool.stop();
+
+      const int expected[] = { 3, 5, 2, 4, 1 };
+      soft_assert("the tasks run by priority, then by submission",
+        ran.ids() == std::vector<int>(expected, expected + 5));
+    }
+
+    // the oldest task isn't bypassed forever
+    {
+      const int nr_urgent = 3 * executor::max_bypasses;
+
+      journal ran;
+      gate blocker;
+
+      executor pool;
+      pool.start(1);
+
+      blocker.hold(pool, 0);
+      soft_assert("the lane is held", blocker.is_entered());
+
+      pool.submit(0, 0, [&ran]() -> void { ran.record(-1); });
+      for (int i = 0; i < nr_urgent; ++i)
+        pool.submit(0, 9, [&ran, i]() -> void { ran.record(i); });
+
+      blocker.open();
+      pool.stop();
+
+      const std::vector<int> ids = ran.ids();
+      const std::vector<int>::const_iterator bulk = std::find(ids.begin(), ids.end(), -1);
+
+      soft_assert("every task is run", ids.size() == size_t(nr_urgent + 1));
+      soft_assert("the bulk task runs once it's been bypassed max_bypasses times: " + utility::stringify(bulk - ids.begin()),
+        bulk - ids.begin() == int(executor::max_bypasses));
+    }
+
+    // tasks that throw don't take their worker, or the tasks behind them, down
+    {
+      std::atomic<int> nr_run(0);
+
+      executor pool;
+      pool.start(2);
+
+      for (int i = 0; i < 300; ++i) {
+        pool.submit(i % 3, [&nr_run, i]() -> void {
+          ++nr_run;
+
+          if (i % 3 == 0)
+            throw std::runtime_error("failing task #" + utility::stringify(i));
+          if (i % 3 == 1)
+            throw i;
+        });
+      }
+
+      boost::thread stopper([&pool]() -> void { pool.stop(); });
+      soft_assert("the executor stops", stopper.timed_join(boost::posix_time::milliseconds(timeout_ms)));
+      soft_assert("every task is run: " + utility::stringify(nr_run.load()), nr_run == 300);
+    }
+
+    return result_;
+  }
+
+}
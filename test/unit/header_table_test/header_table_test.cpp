@@ -0,0 +1,90 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "header_table_test/header_table_test.hpp"
+#include "algol/messaging/header_table.hpp"
+
+namespace algol {
+
+  header_table_test::header_table_test() : test("header_table") {
+  }
+
+  header_table_test::~header_table_test() {
+  }
+
+  int header_table_test::run(int, char**) {
+    result_ = passed;
+
+    header_table headers;
+    soft_assert("a new table is empty", headers.empty() && headers.table().num_entries == 0);
+
+    headers.set("name", "algol");
+    headers.set("count", (int32_t) 1);
+    headers.set("ratio", 0.5);
+    soft_assert("every key is set once", headers.size() == 3);
+
+    string_t name;
+    int64_t count = 0;
+    double ratio = 0;
+    soft_assert("a string reads back", headers.get("name", name) && name == "algol");
+    soft_assert("an int32 reads back as an int64", headers.get("count", count) && count == 1);
+    soft_assert("a double reads back", headers.get("ratio", ratio) && ratio == 0.5);
+    soft_assert("a missing key isn't found", !headers.has("missing") && !headers.get("missing", name));
+    soft_assert("a string doesn't read as a number", !headers.get("name", count));
+
+    // replacing keeps a single entry, whatever the type of the new value
+    headers.set("name", string_t(1000, 'x'));
+    headers.set("count", (int64_t) 1 << 40);
+    headers.set("ratio", true);
+    soft_assert("replacing doesn't add entries", headers.size() == 3 && headers.table().num_entries == 3);
+    soft_assert("a replaced string reads back", headers.get("name", name) && name == string_t(1000, 'x'));
+    soft_assert("a replaced number reads back", headers.get("count", count) && count == (int64_t) 1 << 40);
+
+    bool flag = false;
+    soft_assert("a value replaced with another type reads as the new one",
+      headers.get("ratio", flag) && flag && !headers.get("ratio", ratio));
+
+    // nested tables are copied in
+    header_table nested;
+    nested.set("inner", "value");
+    headers.set("nested", nested);
+    nested.set("inner", "changed");
+
+    header_table out;
+    string_t inner;
+    soft_assert("a nested table is copied", headers.get("nested", out) && out.get("inner", inner) && inner == "value");
+
+    // copies and assignments don't share the arena
+    header_table copy(headers);
+    headers.set("name", "other");
+    soft_assert("a copy has every key", copy.size() == headers.size());
+    soft_assert("a copy isn't changed by the original", copy.get("name", name) && name == string_t(1000, 'x'));
+
+    header_table assigned;
+    assigned.assign(copy.table());
+    soft_assert("a decoded table is assigned as is", assigned.size() == copy.size() && assigned.get("count", count) && count == (int64_t) 1 << 40);
+
+    headers.clear();
+    soft_assert("a cleared table is empty", headers.empty() && !headers.has("name"));
+
+    headers.set("name", "again");
+    soft_assert("a cleared table is reusable", headers.size() == 1 && headers.get("name", name) && name == "again");
+
+    return result_;
+  }
+
+}
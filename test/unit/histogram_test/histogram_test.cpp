@@ -0,0 +1,91 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "histogram_test/histogram_test.hpp"
+#include "algol/histogram.hpp"
+#include "algol/utility.hpp"
+
+namespace algol {
+
+  histogram_test::histogram_test() : test("histogram") {
+  }
+
+  histogram_test::~histogram_test() {
+  }
+
+  int histogram_test::run(int, char**) {
+    result_ = passed;
+
+    const uint64_t sub_buckets = 1ull << histogram::precision_bits;
+
+    // the first two octaves are exact
+    for (uint64_t v = 0; v < 2 * sub_buckets; ++v)
+      soft_assert("small values have a bucket of their own: " + utility::stringify(v),
+        histogram::index_of(v) == v && histogram::highest_in(v) == v);
+
+    // around every octave boundary, a value lands in the bucket whose range
+    // covers it, and the buckets are contiguous
+    for (unsigned bits = histogram::precision_bits + 1; bits < 40; ++bits) {
+      const uint64_t boundary = 1ull << bits;
+      for (uint64_t v = boundary - 2; v <= boundary + 2; ++v) {
+        const size_t index = histogram::index_of(v);
+        const uint64_t highest = histogram::highest_in(index);
+
+        soft_assert("a value is within its bucket: " + utility::stringify(v),
+          highest >= v && histogram::highest_in(index - 1) < v);
+        soft_assert("a value is reported within the error bound: " + utility::stringify(v),
+          highest - v <= v / sub_buckets);
+        soft_assert("the next bucket starts past this one: " + utility::stringify(v),
+          histogram::index_of(highest + 1) == index + 1);
+      }
+
+      soft_assert("an octave starts a bucket: " + utility::stringify(boundary),
+        histogram::index_of(boundary) == histogram::index_of(boundary - 1) + 1);
+    }
+
+    soft_assert("the largest value has the last bucket",
+      histogram::highest_in(histogram::index_of(histogram::max_value)) == histogram::max_value);
+
+    histogram h;
+    soft_assert("an empty histogram reports zeroes", h.count() == 0 && h.min() == 0 && h.percentile(50) == 0);
+
+    for (uint64_t v = 1; v <= 1000; ++v)
+      h.record(v);
+
+    soft_assert("every value is counted", h.count() == 1000);
+    soft_assert("the extremes are exact", h.min() == 1 && h.max() == 1000);
+    soft_assert("the mean is exact", h.mean() == 500.5);
+
+    const uint64_t median = h.percentile(50);
+    soft_assert("the median is within the error bound", median >= 500 && median - 500 <= 500 / sub_buckets);
+
+    const uint64_t p99 = h.percentile(99);
+    soft_assert("the 99th percentile is within the error bound", p99 >= 990 && p99 - 990 <= 990 / sub_buckets);
+
+    soft_assert("the 0th percentile is the smallest value", h.percentile(0) == 1);
+    soft_assert("the 100th percentile is the largest value", h.percentile(100) == 1000);
+
+    h.record(histogram::max_value + 1);
+    soft_assert("values past the largest are counted as the largest", h.max() == histogram::max_value && h.percentile(100) == histogram::max_value);
+
+    h.reset();
+    soft_assert("a reset histogram is empty", h.count() == 0 && h.max() == 0 && h.percentile(99) == 0);
+
+    return result_;
+  }
+
+}
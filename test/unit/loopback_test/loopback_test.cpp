@@ -0,0 +1,111 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "loopback_test/loopback_test.hpp"
+#include "algol/messaging/station.hpp"
+#include "algol/messaging/communicator.hpp"
+#include "algol/messaging/loopback.hpp"
+#include "algol/utility.hpp"
+
+#include <atomic>
+#include <boost/thread.hpp>
+
+namespace algol {
+
+  static const int timeout_ms = 10000;
+  static const int nr_producers = 4;
+  static const int nr_messages = 500; /// per producer
+  static const string_t exchange = "loopback_test_exchange";
+
+  loopback_test::loopback_test() : test("loopback") {
+  }
+
+  loopback_test::~loopback_test() {
+  }
+
+  static bool wait_for(std::atomic<int> const& counter, int expected) {
+    for (int i = 0; i < timeout_ms / 10 && counter < expected; ++i)
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+
+    return counter >= expected;
+  }
+
+  /** passes every inbound message on to the outbound queue, from the handler */
+  class relay : public communicator {
+  public:
+    std::atomic<int> nr_inbound;
+    std::atomic<int> nr_outbound;
+
+    relay() : nr_inbound(0), nr_outbound(0) {}
+
+  protected:
+    virtual void on_message_received(const message& msg) {
+      if (msg.get_queue() == "outbound") {
+        ++nr_outbound;
+        return;
+      }
+
+      ++nr_inbound;
+      send(message(msg.body()), exchange, "outbound");
+    }
+  };
+
+  int loopback_test::run(int, char**) {
+    result_ = passed;
+
+    // no broker; the handlers run on the pump, and a tiny ring is full most of the time
+    station::singleton().set_option("loopback", "only");
+    station::singleton().set_option("loopback_capacity", "2");
+    station::singleton().set_option("dispatch_threads", "0");
+
+    const uint64_t nr_ring_full = monitor::singleton().stat(loopback::stat_ring_full);
+
+    relay r;
+    soft_assert("subscribing to the inbound queue", r.subscribe(exchange, "inbound", 0, 0));
+    soft_assert("subscribing to the outbound queue", r.subscribe(exchange, "outbound", 0, 0));
+
+    boost::thread_group producers;
+    for (int p = 0; p < nr_producers; ++p) {
+      producers.create_thread([&r, p]() -> void {
+        for (int i = 0; i < nr_messages; ++i)
+          r.send(message(utility::stringify(p) + "#" + utility::stringify(i)), exchange, "inbound");
+      });
+    }
+
+    producers.join_all();
+
+    // a relayed message would wait for the pump to drain the ring, were it not the pump itself
+    soft_assert("every message is received", wait_for(r.nr_inbound, nr_producers * nr_messages));
+    soft_assert("every message is relayed from the pump", wait_for(r.nr_outbound, nr_producers * nr_messages));
+    soft_assert("the ring filled up", monitor::singleton().stat(loopback::stat_ring_full) > nr_ring_full);
+
+    soft_assert("unsubscribing from the inbound queue", r.unsubscribe(exchange, "inbound"));
+    soft_assert("unsubscribing from the outbound queue", r.unsubscribe(exchange, "outbound"));
+
+    boost::thread shutdown([]() -> void { station::singleton().shutdown(); });
+    const bool is_shut_down = shutdown.timed_join(boost::posix_time::milliseconds(timeout_ms));
+    soft_assert("the station shuts down", is_shut_down);
+
+    if (!is_shut_down) {
+      shutdown.detach();
+      return failed;
+    }
+
+    return result_;
+  }
+
+}
@@ -0,0 +1,153 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "message_pool_test/message_pool_test.hpp"
+#include "algol/messaging/message_pool.hpp"
+
+#include <memory>
+#include <vector>
+#include <boost/thread.hpp>
+
+namespace algol {
+
+  static const int nr_threads = 4;
+  static const int nr_retains = 10000; /// per thread
+
+  message_pool_test::message_pool_test() : test("message_pool") {
+  }
+
+  message_pool_test::~message_pool_test() {
+  }
+
+  static monitor::stat_val stat(monitor::stat_id id) {
+    return monitor::singleton().stat(id);
+  }
+
+  int message_pool_test::run(int, char**) {
+    result_ = passed;
+
+    // recycling
+    {
+      std::shared_ptr<message_pool> pool = std::make_shared<message_pool>(4);
+      const monitor::stat_val nr_allocated = stat(message_pool::stat_allocated);
+      const monitor::stat_val nr_recycled = stat(message_pool::stat_recycled);
+
+      message *msg = pool->acquire();
+      soft_assert("an empty pool allocates", stat(message_pool::stat_allocated) == nr_allocated + 1);
+
+      msg->body().assign(4096, 'x');
+      msg->set_message_id("message_pool_test");
+      msg->release();
+      soft_assert("a released message goes back to its pool", pool->idle() == 1);
+
+      message *recycled = pool->acquire();
+      soft_assert("an idle message is recycled", recycled == msg && stat(message_pool::stat_recycled) == nr_recycled + 1);
+      soft_assert("a recycled message is blank", recycled->body().empty() && recycled->get_message_id().empty());
+      soft_assert("a recycled message keeps its buffers", recycled->body().capacity() >= 4096);
+      soft_assert("an acquired message leaves the pool", pool->idle() == 0);
+
+      recycled->release();
+    }
+
+    // retaining
+    {
+      std::shared_ptr<message_pool> pool = std::make_shared<message_pool>(4);
+
+      message *msg = pool->acquire();
+      msg->body() = "retained";
+
+      message const* retained = msg->retain();
+      soft_assert("retaining a pooled message references it", retained == msg);
+
+      msg->release();
+      soft_assert("a retained message stays out of the pool", pool->idle() == 0 && retained->body() == "retained");
+
+      retained->release();
+      soft_assert("the last release recycles it", pool->idle() == 1);
+
+      message unpooled("unpooled");
+      message const* copy = unpooled.retain();
+      soft_assert("retaining a message that isn't pooled copies it", copy != &unpooled && copy->body() == "unpooled");
+      copy->release();
+    }
+
+    // copies share the content, recycling the original doesn't take it from them
+    {
+      std::shared_ptr<message_pool> pool = std::make_shared<message_pool>(4);
+
+      message *msg = pool->acquire();
+      msg->body() = "shared";
+      message copy(*msg);
+
+      msg->release();
+      soft_assert("a copy keeps the content of a recycled message", copy.body() == "shared");
+    }
+
+    // the pool keeps capacity idle messages at most
+    {
+      std::shared_ptr<message_pool> pool = std::make_shared<message_pool>(2);
+
+      std::vector<message*> msgs;
+      for (int i = 0; i < 3; ++i)
+        msgs.push_back(pool->acquire());
+      for (auto msg : msgs)
+        msg->release();
+
+      soft_assert("the messages beyond the capacity are freed", pool->idle() == 2);
+    }
+
+    // a message outliving its pool's owner
+    {
+      std::shared_ptr<message_pool> pool = std::make_shared<message_pool>(4);
+      std::weak_ptr<message_pool> observer(pool);
+
+      message *msg = pool->acquire();
+      pool.reset();
+      soft_assert("a message out keeps its pool alive", !observer.expired());
+
+      msg->release();
+      soft_assert("the pool goes away with its last message", observer.expired());
+    }
+
+    // references dropped from several threads at once
+    {
+      std::shared_ptr<message_pool> pool = std::make_shared<message_pool>(4);
+
+      message *msg = pool->acquire();
+      std::vector<message const*> retained;
+      for (int i = 0; i < nr_threads * nr_retains; ++i)
+        retained.push_back(msg->retain());
+
+      msg->release();
+
+      boost::thread_group threads;
+      for (int t = 0; t < nr_threads; ++t) {
+        threads.create_thread([&retained, t]() -> void {
+          for (int i = t * nr_retains; i < (t + 1) * nr_retains; ++i)
+            retained[i]->release();
+        });
+      }
+
+      threads.join_all();
+
+      soft_assert("a message released from several threads is recycled once", pool->idle() == 1);
+    }
+
+    return result_;
+  }
+
+}
@@ -0,0 +1,613 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "messaging_bench/amqp_standin.hpp"
+#include "algol/utility.hpp"
+
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+namespace algol {
+
+  typedef boost::lock_guard<boost::mutex> lock_guard;
+
+  /**
+   * The largest frame we offer, well above what the station asks for by
+   * default so that its frame_max setting is what decides.
+   */
+  static const uint32_t offered_frame_max = 4 * 1024 * 1024;
+
+  /** the heartbeat interval (in seconds) we offer, RabbitMQ's default */
+  static const uint16_t offered_heartbeat = 60;
+
+  /** type, channel, and size */
+  static const size_t frame_header_size = 7;
+
+  amqp_standin::amqp_standin(int port)
+  : logger("amqp_standin"),
+    port_(port),
+    listener_(-1),
+    running_(false),
+    nr_routed_(0),
+    nr_consumers_(0)
+  {
+  }
+
+  amqp_standin::~amqp_standin() {
+    if (running_)
+      stop();
+  }
+
+  int amqp_standin::port() const {
+    return port_;
+  }
+
+  uint64_t amqp_standin::nr_routed() const {
+    return nr_routed_;
+  }
+
+  bool amqp_standin::start() {
+    listener_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (listener_ < 0)
+      return false;
+
+    int on = 1;
+    setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port_);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(listener_, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(listener_, 64) < 0) {
+      log_->errorStream() << "unable to listen on 127.0.0.1:" << port_ << ": " << strerror(errno);
+      ::close(listener_);
+      listener_ = -1;
+      return false;
+    }
+
+    running_ = true;
+    acceptor_ = boost::thread(boost::bind(&amqp_standin::accept, this));
+    heartbeater_ = boost::thread(boost::bind(&amqp_standin::beat, this));
+
+    log_->infoStream() << "listening on 127.0.0.1:" << port_;
+
+    return true;
+  }
+
+  void amqp_standin::stop() {
+    running_ = false;
+
+    // unblocks accept()
+    shutdown(listener_, SHUT_RDWR);
+    ::close(listener_);
+    acceptor_.join();
+    heartbeater_.join();
+
+    {
+      lock_guard lock(state_mtx_);
+      for (auto conn : connections_)
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+
+    servers_.join_all();
+
+    for (auto conn : connections_) {
+      ::close(conn->fd);
+      delete conn;
+    }
+
+    connections_.clear();
+    queues_.clear();
+    bindings_.clear();
+
+    log_->infoStream() << "stopped, " << nr_routed_ << " messages routed";
+  }
+
+  void amqp_standin::drop_connections() {
+    {
+      // their consumers are forgotten right away, so that nothing routed
+      // from now on is written to a dead connection
+      lock_guard lock(state_mtx_);
+      for (auto& pair : queues_)
+        pair.second.consumers.clear();
+
+      for (auto conn : connections_)
+        if (conn->open)
+          shutdown(conn->fd, SHUT_RDWR);
+    }
+
+    log_->infoStream() << "dropped every connection";
+  }
+
+  void amqp_standin::accept() {
+    while (running_) {
+      int fd = ::accept(listener_, nullptr, nullptr);
+      if (fd < 0)
+        break;
+
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+      connection_t *conn = new connection_t();
+      conn->fd = fd;
+      conn->open = true;
+      conn->frame_max = offered_frame_max;
+      conn->heartbeat = 0;
+
+      {
+        lock_guard lock(state_mtx_);
+        connections_.push_back(conn);
+      }
+
+      servers_.create_thread(boost::bind(&amqp_standin::serve, this, conn));
+    }
+  }
+
+  bool amqp_standin::read_all(int fd, char* buf, size_t len) {
+    while (len > 0) {
+      ssize_t n = recv(fd, buf, len, 0);
+      if (n <= 0)
+        return false;
+
+      buf += n;
+      len -= n;
+    }
+
+    return true;
+  }
+
+  bool amqp_standin::write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+      ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+      if (n <= 0)
+        return false;
+
+      buf += n;
+      len -= n;
+    }
+
+    return true;
+  }
+
+  void amqp_standin::append_frame(string_t& out, uint8_t type, amqp_channel_t channel, const char* payload, size_t len) {
+    char header[frame_header_size];
+    uint16_t ch = htons(channel);
+    uint32_t size = htonl(len);
+
+    header[0] = type;
+    memcpy(header + 1, &ch, 2);
+    memcpy(header + 3, &size, 4);
+
+    out.append(header, frame_header_size);
+    out.append(payload, len);
+    out.push_back((char) AMQP_FRAME_END);
+  }
+
+  bool amqp_standin::send_method(connection_t* conn, amqp_channel_t channel, amqp_method_number_t id, void* decoded) {
+    char payload[4096];
+    uint32_t method_id = htonl(id);
+    memcpy(payload, &method_id, 4);
+
+    amqp_bytes_t args;
+    args.len = sizeof(payload) - 4;
+    args.bytes = payload + 4;
+
+    int len = amqp_encode_method(id, decoded, args);
+    if (len < 0) {
+      log_->errorStream() << "unable to encode " << amqp_method_name(id);
+      return false;
+    }
+
+    string_t frame;
+    append_frame(frame, AMQP_FRAME_METHOD, channel, payload, len + 4);
+
+    lock_guard lock(conn->write_mtx);
+    return write_all(conn->fd, frame.data(), frame.size());
+  }
+
+  void amqp_standin::serve(connection_t* conn) {
+    char protocol_header[8];
+    if (!read_all(conn->fd, protocol_header, sizeof(protocol_header)) || memcmp(protocol_header, "AMQP", 4) != 0) {
+      log_->errorStream() << "not an AMQP client, disconnecting";
+      conn->open = false;
+      return;
+    }
+
+    amqp_connection_start_t start;
+    start.version_major = AMQP_PROTOCOL_VERSION_MAJOR;
+    start.version_minor = AMQP_PROTOCOL_VERSION_MINOR;
+    start.server_properties = amqp_empty_table;
+    start.mechanisms = amqp_cstring_bytes("PLAIN");
+    start.locales = amqp_cstring_bytes("en_US");
+    send_method(conn, 0, AMQP_CONNECTION_START_METHOD, &start);
+
+    amqp_pool_t pool;
+    init_amqp_pool(&pool, 4096);
+
+    // messages being received, by channel
+    std::map<amqp_channel_t, content_t> pending;
+    std::map<amqp_channel_t, uint64_t> body_sizes;
+    std::vector<char> payload;
+
+    for (;;) {
+      char header[frame_header_size];
+      if (!read_all(conn->fd, header, sizeof(header)))
+        break;
+
+      uint8_t type = header[0];
+      uint16_t channel;
+      uint32_t size;
+      memcpy(&channel, header + 1, 2);
+      memcpy(&size, header + 3, 4);
+      channel = ntohs(channel);
+      size = ntohl(size);
+
+      payload.resize(size + 1);
+      if (!read_all(conn->fd, &payload[0], size + 1))
+        break;
+
+      if ((uint8_t) payload[size] != AMQP_FRAME_END) {
+        log_->errorStream() << "bad frame end, disconnecting";
+        break;
+      }
+
+      bool complete = false;
+
+      if (type == AMQP_FRAME_METHOD) {
+        uint32_t id;
+        memcpy(&id, &payload[0], 4);
+        id = ntohl(id);
+
+        amqp_bytes_t args;
+        args.len = size - 4;
+        args.bytes = &payload[4];
+
+        if (id == AMQP_BASIC_PUBLISH_METHOD) {
+          amqp_basic_publish_t *m;
+          if (amqp_decode_method(id, &pool, args, (void**) &m) < 0)
+            break;
+
+          content_t& content = pending[channel];
+          content.exchange.assign((const char*) m->exchange.bytes, m->exchange.len);
+          content.routing_key.assign((const char*) m->routing_key.bytes, m->routing_key.len);
+        }
+        else if (!handle_method(conn, channel, id, args, &pool))
+          break;
+
+        recycle_amqp_pool(&pool);
+      }
+      else if (type == AMQP_FRAME_HEADER) {
+        // class id, weight, and the 64-bit body size
+        uint64_t body_size = 0;
+        for (int i = 4; i < 12; ++i)
+          body_size = (body_size << 8) | (uint8_t) payload[i];
+
+        content_t& content = pending[channel];
+        content.header.assign(&payload[0], size);
+        content.body.clear();
+        content.body.reserve(body_size);
+        body_sizes[channel] = body_size;
+
+        complete = body_size == 0;
+      }
+      else if (type == AMQP_FRAME_BODY) {
+        content_t& content = pending[channel];
+        content.body.append(&payload[0], size);
+
+        complete = content.body.size() >= body_sizes[channel];
+      }
+
+      if (!complete)
+        continue;
+
+      route(pending[channel]);
+
+      if (conn->confirming.count(channel)) {
+        amqp_basic_ack_t ack;
+        ack.delivery_tag = ++conn->publish_seqs[channel];
+        ack.multiple = 0;
+        send_method(conn, channel, AMQP_BASIC_ACK_METHOD, &ack);
+      }
+    }
+
+    empty_amqp_pool(&pool);
+    forget(conn);
+    conn->open = false;
+  }
+
+  bool amqp_standin::handle_method(connection_t* conn, amqp_channel_t channel, amqp_method_number_t id, amqp_bytes_t args, amqp_pool_t* pool) {
+    void *decoded = nullptr;
+    if (amqp_decode_method(id, pool, args, &decoded) < 0) {
+      log_->errorStream() << "unable to decode " << amqp_method_name(id);
+      return false;
+    }
+
+    switch (id) {
+      case AMQP_CONNECTION_START_OK_METHOD: {
+        amqp_connection_tune_t tune;
+        tune.channel_max = 2047;
+        tune.frame_max = offered_frame_max;
+        tune.heartbeat = offered_heartbeat;
+        return send_method(conn, 0, AMQP_CONNECTION_TUNE_METHOD, &tune);
+      }
+
+      case AMQP_CONNECTION_TUNE_OK_METHOD: {
+        amqp_connection_tune_ok_t *m = (amqp_connection_tune_ok_t*) decoded;
+        if (m->frame_max > 0)
+          conn->frame_max = std::min<uint32_t>(m->frame_max, offered_frame_max);
+        conn->next_heartbeat = boost::get_system_time() + boost::posix_time::seconds(m->heartbeat);
+        conn->heartbeat = m->heartbeat;
+        return true;
+      }
+
+      case AMQP_CONNECTION_OPEN_METHOD: {
+        amqp_connection_open_ok_t open_ok;
+        open_ok.known_hosts = amqp_empty_bytes;
+        return send_method(conn, 0, AMQP_CONNECTION_OPEN_OK_METHOD, &open_ok);
+      }
+
+      case AMQP_CONNECTION_CLOSE_METHOD: {
+        amqp_connection_close_ok_t close_ok;
+        send_method(conn, 0, AMQP_CONNECTION_CLOSE_OK_METHOD, &close_ok);
+        return false;
+      }
+
+      case AMQP_CONNECTION_CLOSE_OK_METHOD:
+        return false;
+
+      case AMQP_CHANNEL_OPEN_METHOD: {
+        amqp_channel_open_ok_t open_ok;
+        open_ok.channel_id = amqp_empty_bytes;
+        return send_method(conn, channel, AMQP_CHANNEL_OPEN_OK_METHOD, &open_ok);
+      }
+
+      case AMQP_CHANNEL_CLOSE_METHOD: {
+        forget(conn, channel);
+        conn->confirming.erase(channel);
+        conn->publish_seqs.erase(channel);
+
+        amqp_channel_close_ok_t close_ok;
+        return send_method(conn, channel, AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok);
+      }
+
+      case AMQP_CHANNEL_CLOSE_OK_METHOD:
+        return true;
+
+      case AMQP_EXCHANGE_DECLARE_METHOD: {
+        amqp_exchange_declare_ok_t declare_ok;
+        return send_method(conn, channel, AMQP_EXCHANGE_DECLARE_OK_METHOD, &declare_ok);
+      }
+
+      case AMQP_QUEUE_DECLARE_METHOD: {
+        amqp_queue_declare_t *m = (amqp_queue_declare_t*) decoded;
+        string_t name((const char*) m->queue.bytes, m->queue.len);
+
+        amqp_queue_declare_ok_t declare_ok;
+
+        lock_guard lock(state_mtx_);
+        if (name.empty())
+          name = "amq.gen-" + utility::stringify(queues_.size());
+
+        queue_t& q = queues_[name];
+        declare_ok.queue = amqp_cstring_bytes(name.c_str());
+        declare_ok.message_count = q.backlog.size();
+        declare_ok.consumer_count = q.consumers.size();
+        return send_method(conn, channel, AMQP_QUEUE_DECLARE_OK_METHOD, &declare_ok);
+      }
+
+      case AMQP_QUEUE_BIND_METHOD: {
+        amqp_queue_bind_t *m = (amqp_queue_bind_t*) decoded;
+        string_t queue((const char*) m->queue.bytes, m->queue.len);
+        string_t key = string_t((const char*) m->exchange.bytes, m->exchange.len) + '/' +
+                       string_t((const char*) m->routing_key.bytes, m->routing_key.len);
+
+        {
+          lock_guard lock(state_mtx_);
+
+          bool bound = false;
+          auto range = bindings_.equal_range(key);
+          for (auto i = range.first; i != range.second && !bound; ++i)
+            bound = i->second == queue;
+
+          if (!bound)
+            bindings_.insert(std::make_pair(key, queue));
+        }
+
+        amqp_queue_bind_ok_t bind_ok;
+        return send_method(conn, channel, AMQP_QUEUE_BIND_OK_METHOD, &bind_ok);
+      }
+
+      case AMQP_BASIC_QOS_METHOD: {
+        amqp_basic_qos_ok_t qos_ok;
+        return send_method(conn, channel, AMQP_BASIC_QOS_OK_METHOD, &qos_ok);
+      }
+
+      case AMQP_BASIC_CONSUME_METHOD: {
+        amqp_basic_consume_t *m = (amqp_basic_consume_t*) decoded;
+        string_t queue((const char*) m->queue.bytes, m->queue.len);
+
+        consumer_t consumer;
+        consumer.conn = conn;
+        consumer.channel = channel;
+        consumer.tag.assign((const char*) m->consumer_tag.bytes, m->consumer_tag.len);
+
+        // the reply must go out before any delivery to the new consumer
+        lock_guard lock(state_mtx_);
+        if (consumer.tag.empty())
+          consumer.tag = "ctag-" + utility::stringify(++nr_consumers_);
+
+        queue_t& q = queues_[queue];
+        q.consumers.push_back(consumer);
+
+        amqp_basic_consume_ok_t consume_ok;
+        consume_ok.consumer_tag = amqp_cstring_bytes(consumer.tag.c_str());
+        if (!send_method(conn, channel, AMQP_BASIC_CONSUME_OK_METHOD, &consume_ok))
+          return false;
+
+        while (!q.backlog.empty()) {
+          deliver(q, q.backlog.front());
+          q.backlog.pop_front();
+        }
+
+        return true;
+      }
+
+      case AMQP_BASIC_CANCEL_METHOD: {
+        amqp_basic_cancel_t *m = (amqp_basic_cancel_t*) decoded;
+        string_t tag((const char*) m->consumer_tag.bytes, m->consumer_tag.len);
+
+        {
+          lock_guard lock(state_mtx_);
+          for (auto& pair : queues_) {
+            std::vector<consumer_t>& consumers = pair.second.consumers;
+            for (auto i = consumers.begin(); i != consumers.end(); ++i)
+              if (i->conn == conn && i->tag == tag) {
+                consumers.erase(i);
+                break;
+              }
+          }
+        }
+
+        amqp_basic_cancel_ok_t cancel_ok;
+        cancel_ok.consumer_tag = m->consumer_tag;
+        return send_method(conn, channel, AMQP_BASIC_CANCEL_OK_METHOD, &cancel_ok);
+      }
+
+      case AMQP_CONFIRM_SELECT_METHOD: {
+        conn->confirming.insert(channel);
+        conn->publish_seqs[channel] = 0;
+
+        amqp_confirm_select_ok_t select_ok;
+        return send_method(conn, channel, AMQP_CONFIRM_SELECT_OK_METHOD, &select_ok);
+      }
+
+      case AMQP_BASIC_ACK_METHOD:
+      case AMQP_BASIC_NACK_METHOD:
+      case AMQP_BASIC_REJECT_METHOD:
+        return true;
+
+      default:
+        log_->warnStream() << "ignoring " << amqp_method_name(id) << " on channel #" << channel;
+        return true;
+    }
+  }
+
+  void amqp_standin::route(content_t const& content) {
+    lock_guard lock(state_mtx_);
+
+    bool routed = false;
+    auto range = bindings_.equal_range(content.exchange + '/' + content.routing_key);
+
+    for (auto i = range.first; i != range.second; ++i) {
+      queue_t& q = queues_[i->second];
+
+      if (q.consumers.empty())
+        q.backlog.push_back(content);
+      else
+        deliver(q, content);
+
+      routed = true;
+    }
+
+    if (routed)
+      ++nr_routed_;
+  }
+
+  bool amqp_standin::deliver(queue_t& q, content_t const& content) {
+    consumer_t& consumer = q.consumers[q.next++ % q.consumers.size()];
+    connection_t *conn = consumer.conn;
+
+    amqp_basic_deliver_t deliver;
+    deliver.consumer_tag = amqp_cstring_bytes(consumer.tag.c_str());
+    deliver.delivery_tag = ++conn->delivery_tags[consumer.channel];
+    deliver.redelivered = 0;
+    deliver.exchange.len = content.exchange.size();
+    deliver.exchange.bytes = const_cast<char*>(content.exchange.data());
+    deliver.routing_key.len = content.routing_key.size();
+    deliver.routing_key.bytes = const_cast<char*>(content.routing_key.data());
+
+    char method[4096];
+    uint32_t method_id = htonl(AMQP_BASIC_DELIVER_METHOD);
+    memcpy(method, &method_id, 4);
+
+    amqp_bytes_t args;
+    args.len = sizeof(method) - 4;
+    args.bytes = method + 4;
+
+    int len = amqp_encode_method(AMQP_BASIC_DELIVER_METHOD, &deliver, args);
+    if (len < 0)
+      return false;
+
+    // the whole delivery goes out in a single write
+    string_t out;
+    out.reserve(len + content.header.size() + content.body.size() + 64);
+    append_frame(out, AMQP_FRAME_METHOD, consumer.channel, method, len + 4);
+    append_frame(out, AMQP_FRAME_HEADER, consumer.channel, content.header.data(), content.header.size());
+
+    const size_t max_fragment = conn->frame_max - frame_header_size - 1;
+    for (size_t offset = 0; offset < content.body.size(); offset += max_fragment)
+      append_frame(out, AMQP_FRAME_BODY, consumer.channel,
+        content.body.data() + offset, std::min(max_fragment, content.body.size() - offset));
+
+    lock_guard lock(conn->write_mtx);
+    return write_all(conn->fd, out.data(), out.size());
+  }
+
+  void amqp_standin::beat() {
+    while (running_) {
+      boost::this_thread::sleep(boost::posix_time::milliseconds(250));
+
+      boost::system_time now = boost::get_system_time();
+      string_t frame;
+      append_frame(frame, AMQP_FRAME_HEARTBEAT, 0, "", 0);
+
+      lock_guard lock(state_mtx_);
+      for (auto conn : connections_) {
+        if (!conn->open || conn->heartbeat == 0 || now < conn->next_heartbeat)
+          continue;
+
+        // twice per interval, the client gives up on us after two silent ones
+        conn->next_heartbeat = now + boost::posix_time::milliseconds(conn->heartbeat * 500);
+
+        lock_guard write_lock(conn->write_mtx);
+        write_all(conn->fd, frame.data(), frame.size());
+      }
+    }
+  }
+
+  void amqp_standin::forget(connection_t* conn, amqp_channel_t channel) {
+    lock_guard lock(state_mtx_);
+
+    for (auto& pair : queues_) {
+      std::vector<consumer_t>& consumers = pair.second.consumers;
+
+      for (auto i = consumers.begin(); i != consumers.end(); ) {
+        if (i->conn == conn && (channel == 0 || i->channel == channel))
+          i = consumers.erase(i);
+        else
+          ++i;
+      }
+    }
+  }
+
+} // end of namespace algol
@@ -0,0 +1,148 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_AMQP_STANDIN_H
+#define H_ALGOL_AMQP_STANDIN_H
+
+#include "algol/algol.hpp"
+#include "algol/logger.hpp"
+#include "algol/messaging/types.hpp"
+
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <boost/thread.hpp>
+
+namespace algol {
+
+  /**
+   * A scripted, in-memory stand-in for an AMQP 0-9-1 broker, listening on the
+   * loopback interface; just enough of one for the messaging components to
+   * run against without RabbitMQ.
+   *
+   * It answers the handshake and the RPCs the station issues (channels,
+   * direct exchanges, queue declarations and bindings, qos, consume, and
+   * publisher confirms), routes published content to the consumers of the
+   * bound queues round-robin, and buffers it while a queue has none.
+   *
+   * Every client connection is served by a thread of its own. Deliveries are
+   * split into body frames no larger than the frame_max the client tuned
+   * to, and heartbeats are sent at the interval it tuned to. Consumer acks
+   * are accepted and ignored; so are qos limits and the client's heartbeats.
+   */
+  class amqp_standin : public logger {
+  public:
+    explicit amqp_standin(int port);
+    amqp_standin(const amqp_standin&) = delete;
+    amqp_standin& operator=(const amqp_standin&) = delete;
+    virtual ~amqp_standin();
+
+    /** binds to 127.0.0.1:port and starts accepting connections */
+    bool start();
+
+    /** disconnects every client and joins the serving threads */
+    void stop();
+
+    /**
+     * Disconnects every client but keeps listening, and keeps the queues,
+     * their bindings and their backlogs; like a broker that's restarted.
+     */
+    void drop_connections();
+
+    int port() const;
+
+    /** number of messages routed to at least one queue */
+    uint64_t nr_routed() const;
+
+  private:
+    struct connection_t {
+      int                 fd;
+      bool                open;
+      boost::mutex        write_mtx;
+      uint32_t            frame_max;       /// as tuned by the client
+      uint16_t            heartbeat;       /// as tuned by the client, 0 if off
+      boost::system_time  next_heartbeat;
+      std::set<amqp_channel_t> confirming; /// channels in confirm mode
+      std::map<amqp_channel_t, uint64_t> publish_seqs;
+      std::map<amqp_channel_t, uint64_t> delivery_tags;
+    };
+
+    struct consumer_t {
+      connection_t        *conn;
+      amqp_channel_t      channel;
+      string_t            tag;
+    };
+
+    /** a message as it was published: its encoded content header and body */
+    struct content_t {
+      string_t            exchange;
+      string_t            routing_key;
+      string_t            header;
+      string_t            body;
+    };
+
+    struct queue_t {
+      std::vector<consumer_t> consumers;
+      size_t                  next;    /// the consumer that gets the next message
+      std::deque<content_t>   backlog; /// messages received while there were no consumers
+
+      queue_t() : next(0) {}
+    };
+
+    void accept();
+    void serve(connection_t*);
+
+    /** sends the heartbeats that are due on every connection */
+    void beat();
+
+    /** handles a method frame; returns false if the connection is closing */
+    bool handle_method(connection_t*, amqp_channel_t, amqp_method_number_t, amqp_bytes_t args, amqp_pool_t*);
+
+    /** routes a fully received message to the bound queues */
+    void route(content_t const&);
+
+    /** writes the message to one of the queue's consumers, must be called with state_mtx_ held */
+    bool deliver(queue_t&, content_t const&);
+
+    /** drops the consumers of a closed connection or channel */
+    void forget(connection_t*, amqp_channel_t channel = 0);
+
+    bool send_method(connection_t*, amqp_channel_t, amqp_method_number_t, void* decoded);
+
+    static void append_frame(string_t& out, uint8_t type, amqp_channel_t, const char* payload, size_t len);
+    static bool write_all(int fd, const char*, size_t);
+    static bool read_all(int fd, char*, size_t);
+
+    int                 port_;
+    int                 listener_;
+    bool                running_;
+    boost::thread       acceptor_;
+    boost::thread       heartbeater_;
+    boost::thread_group servers_;
+
+    std::vector<connection_t*>              connections_;
+    std::map<string_t, queue_t>             queues_;
+    std::multimap<string_t, string_t>       bindings_; /// "exchange/routing_key" => queue
+    uint64_t                                nr_routed_;
+    uint64_t                                nr_consumers_;
+    boost::mutex                            state_mtx_;
+  };
+
+} // end of namespace algol
+
+#endif
@@ -0,0 +1,245 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "messaging_bench/messaging_bench.hpp"
+#include "messaging_bench/amqp_standin.hpp"
+#include "algol/messaging/station.hpp"
+#include "algol/messaging/message.hpp"
+#include "algol/utility.hpp"
+
+#include <atomic>
+#include <algorithm>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+namespace algol {
+
+  static int       nr_messages = 10000;
+  static size_t    msg_size = 256;
+  static int       nr_queues = 1;
+  static int       nr_subscribers = 1; // per queue
+  static int       nr_shards = 1;      // competing consumers per queue
+  static int       nr_publishers = 1;
+  static int       port = 56720;
+  static int       timeout_sec = 30;
+  static bool      use_broker = false;
+  static string_t  exchange = "bench_exchange";
+  static string_t  ts_header = "bench-ts";
+
+  static std::atomic<int>       nr_received(0);
+  static std::atomic<int>       nr_failed(0);
+  static std::atomic<int64_t>   last_received_us(0);
+  static std::vector<uint32_t>  latencies_us;
+
+  static int64_t now_us() {
+    static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+    return (boost::posix_time::microsec_clock::universal_time() - epoch).total_microseconds();
+  }
+
+  /** records the publish-to-dispatch latency of every message it receives */
+  class bench_subscriber : public communicator {
+  protected:
+    virtual void on_message_received(const message& msg) {
+      int64_t now = now_us();
+      int64_t sent_at = 0;
+      msg.headers().get(ts_header, sent_at);
+
+      int idx = nr_received++;
+      if (idx < (int) latencies_us.size())
+        latencies_us[idx] = (uint32_t) std::max<int64_t>(now - sent_at, 0);
+
+      last_received_us = now;
+    }
+  };
+
+  messaging_bench::messaging_bench()
+  : test("messaging_bench"),
+    communicator()
+  {
+  }
+
+  messaging_bench::~messaging_bench() {
+  }
+
+  int messaging_bench::run(int argc, char** argv) {
+
+    for (int i = 1; i < argc; ++i) {
+      string_t arg(argv[i]);
+      bool has_value = i + 1 < argc;
+
+      if (arg == "--broker") {
+        use_broker = true;
+      }
+      else if (!has_value) {
+        log_->errorStream() << "invalid argument '" << arg << "', missing parameter";
+        return failed;
+      }
+      else if (arg == "-n") {
+        nr_messages = std::max(utility::convertTo<int>(argv[++i]), 1);
+      }
+      else if (arg == "-s") {
+        msg_size = utility::convertTo<size_t>(argv[++i]);
+      }
+      else if (arg == "-q") {
+        nr_queues = std::max(utility::convertTo<int>(argv[++i]), 1);
+      }
+      else if (arg == "--subscribers") {
+        nr_subscribers = std::max(utility::convertTo<int>(argv[++i]), 1);
+      }
+      else if (arg == "--shards") {
+        nr_shards = std::max(utility::convertTo<int>(argv[++i]), 1);
+      }
+      else if (arg == "--frame-max") {
+        // e.g. -s 4194304 --frame-max 4096, then 131072, then 1048576
+        station::singleton().set_option("frame_max", argv[++i]);
+      }
+      else if (arg == "-c") {
+        nr_publishers = std::max(utility::convertTo<int>(argv[++i]), 1);
+      }
+      else if (arg == "-p") {
+        port = utility::convertTo<int>(argv[++i]);
+      }
+      else if (arg == "-t") {
+        timeout_sec = std::max(utility::convertTo<int>(argv[++i]), 1);
+      }
+      else if (arg == "--set") {
+        // any station option, e.g. --set publish_batch_size=64
+        string_t option(argv[++i]);
+        size_t sep = option.find('=');
+        if (sep == string_t::npos) {
+          log_->errorStream() << "invalid argument '--set', expected key=value";
+          return failed;
+        }
+
+        station::singleton().set_option(option.substr(0, sep), option.substr(sep + 1));
+      }
+      else {
+        log_->errorStream() << "unknown argument '" << arg << "'";
+        return failed;
+      }
+    }
+
+    amqp_standin standin(port);
+    if (!use_broker) {
+      if (!standin.start())
+        return failed;
+
+      station::singleton().set_option("host", "127.0.0.1");
+      station::singleton().set_option("port", utility::stringify(port));
+    }
+
+    // our consumers drop the messages we publish under our own app id
+    message::set_app_id("messaging_bench");
+
+    int nr_expected = nr_messages * nr_subscribers;
+    latencies_us.assign(nr_expected, 0);
+
+    std::vector<bench_subscriber*> subscribers;
+    for (int q = 0; q < nr_queues; ++q) {
+      for (int s = 0; s < nr_subscribers; ++s) {
+        subscribers.push_back(new bench_subscriber());
+        string_t queue = "bench_" + utility::stringify(q);
+        bool subscribed = nr_shards > 1
+          ? subscribers.back()->subscribe(exchange, queue, consumer_shards(nr_shards), 0, 0)
+          : subscribers.back()->subscribe(exchange, queue, 0, 0);
+        if (!subscribed) {
+          log_->errorStream() << "unable to subscribe to bench_" << q;
+          return failed;
+        }
+      }
+    }
+
+    // resolved once, the publishers skip the channel lookups
+    channel_handle bench_channel = station::singleton().resolve(exchange);
+    if (!bench_channel)
+      return failed;
+
+    log_->infoStream()
+      << nr_messages << " messages of " << msg_size << " bytes over " << nr_queues << " queues with "
+      << nr_subscribers << " subscribers each, " << nr_shards << " shards, " << nr_publishers << " publishers";
+
+    message prototype(string_t(msg_size, 'x'));
+    prototype.set_content_type("application/octet-stream");
+
+    int64_t started_us = now_us();
+
+    boost::thread_group publishers;
+    for (int p = 0; p < nr_publishers; ++p) {
+      publishers.create_thread([&, p]() -> void {
+        for (int x = p; x < nr_messages; x += nr_publishers) {
+          message m(prototype);
+          m.set_header(ts_header, (int64_t) now_us());
+          send(m, bench_channel, "bench_" + utility::stringify(x % nr_queues));
+        }
+      });
+    }
+
+    publishers.join_all();
+    int64_t published_us = now_us();
+
+    for (int i = 0; i < timeout_sec * 100 && nr_received + nr_failed < nr_expected; ++i)
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+
+    int received = std::min<int>(nr_received, nr_expected);
+    double publish_sec = std::max<int64_t>(published_us - started_us, 1) / 1e6;
+    double elapsed_sec = std::max<int64_t>(last_received_us - started_us, 1) / 1e6;
+
+    std::sort(latencies_us.begin(), latencies_us.begin() + received);
+    auto percentile = [&](double p) -> uint32_t {
+      return received ? latencies_us[std::min<int>(received - 1, (int) (received * p))] : 0;
+    };
+
+    std::cout
+      << "published: " << nr_messages << " in " << publish_sec << "s ("
+      << (uint64_t) (nr_messages / publish_sec) << " msgs/sec)\n"
+      << "received:  " << received << "/" << nr_expected << " in " << elapsed_sec << "s ("
+      << (uint64_t) (received / elapsed_sec) << " msgs/sec, "
+      << (received * msg_size) / elapsed_sec / (1024 * 1024) << " MB/sec)\n"
+      << "latency:   p50 " << percentile(0.5) << "us, p99 " << percentile(0.99)
+      << "us, p999 " << percentile(0.999) << "us, max " << (received ? latencies_us[received - 1] : 0) << "us\n";
+
+    // the stand-in agrees to the frame_max we ask for, a broker may lower it
+    size_t frame_max = station::singleton().config.frame_max;
+    size_t max_fragment = frame_max - 8;
+    std::cout
+      << "frames:    " << std::max<size_t>((msg_size + max_fragment - 1) / max_fragment, 1)
+      << " body frames per message, frame_max " << frame_max << "\n";
+
+    if (nr_failed)
+      std::cout << "failed:    " << nr_failed << "\n";
+
+    for (auto s : subscribers)
+      delete s;
+
+    // the stand-in must outlive the connections
+    station::singleton().shutdown();
+
+    if (!use_broker)
+      standin.stop();
+
+    return received == nr_expected && nr_failed == 0 ? passed : failed;
+  }
+
+  void messaging_bench::on_message_received(const message&) {
+  }
+
+  void messaging_bench::on_message_sent(const message&, comm_rc rc) {
+    if (rc != comm_rc::success)
+      nr_failed += nr_subscribers;
+  }
+
+}
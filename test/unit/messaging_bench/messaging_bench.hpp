@@ -0,0 +1,47 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_ALGOL_messaging_bench_H
+#define H_ALGOL_messaging_bench_H
+
+#include "test.hpp"
+#include "algol/algol.hpp"
+#include "algol/messaging/communicator.hpp"
+
+namespace algol {
+
+  /**
+   * Measures the messaging hot path: the publishing throughput and the
+   * latency from communicator::send() to the subscribers' handlers.
+   *
+   * Runs against a local amqp_standin unless --broker is given, in which
+   * case the station's configured broker is used.
+   */
+  class messaging_bench : public test, public communicator {
+  public:
+    messaging_bench();
+    virtual ~messaging_bench();
+
+    int run(int argc, char** argv);
+
+  protected:
+    virtual void on_message_received(const message&);
+    virtual void on_message_sent(const message&, comm_rc);
+  };
+
+}
+#endif
@@ -0,0 +1,197 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "messaging_recovery_test/messaging_recovery_test.hpp"
+#include "messaging_bench/amqp_standin.hpp"
+#include "algol/messaging/station.hpp"
+#include "algol/messaging/communicator.hpp"
+#include "algol/messaging/message.hpp"
+#include "algol/utility.hpp"
+
+#include <set>
+#include <atomic>
+#include <stdexcept>
+#include <boost/thread.hpp>
+#include <boost/filesystem.hpp>
+
+namespace algol {
+
+  static const int    port = 56721;
+  static const string_t exchange = "recovery_exchange";
+  static const string_t spooled_exchange = "recovery_spooled_exchange";
+  static const string_t looped_exchange = "recovery_looped_exchange";
+  static const int    nr_messages = 30;
+  static const int    timeout_ms = 10000;
+
+  /** waits for the counter to reach the expected value, or the timeout */
+  static bool wait_for(std::atomic<int> const& counter, int expected) {
+    for (int i = 0; i < timeout_ms / 10 && counter < expected; ++i)
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+
+    return counter >= expected;
+  }
+
+  /** fails the handling of most of the messages it's given, in every way it can */
+  class throwing_subscriber : public communicator {
+  public:
+    std::atomic<int> nr_handled;
+
+    throwing_subscriber() : nr_handled(0) {}
+
+  protected:
+    virtual void on_message_received(const message&) {
+      const int n = ++nr_handled;
+
+      if (n % 3 == 1)
+        throw std::runtime_error("handler failure");
+      else if (n % 3 == 2)
+        throw n;
+    }
+  };
+
+  /** counts the distinct messages it's given, a message can be delivered more than once */
+  class counting_subscriber : public communicator {
+  public:
+    std::atomic<int> nr_received;
+    std::atomic<int> nr_distinct;
+
+    counting_subscriber() : nr_received(0), nr_distinct(0) {}
+
+  protected:
+    virtual void on_message_received(const message& msg) {
+      ++nr_received;
+
+      boost::mutex::scoped_lock lock(mtx_);
+      if (seen_.insert(msg.body()).second)
+        ++nr_distinct;
+    }
+
+  private:
+    boost::mutex        mtx_;
+    std::set<string_t>  seen_;
+  };
+
+  messaging_recovery_test::messaging_recovery_test() : test("messaging_recovery") {
+  }
+
+  messaging_recovery_test::~messaging_recovery_test() {
+  }
+
+  int messaging_recovery_test::run(int, char**) {
+    using namespace boost::filesystem;
+
+    result_ = passed;
+
+    amqp_standin standin(port);
+    if (!standin.start())
+      return failed;
+
+    station::singleton().set_option("host", "127.0.0.1");
+    station::singleton().set_option("port", utility::stringify(port));
+    station::singleton().set_option("dispatch_threads", "2");
+    station::singleton().set_option("prefetch_count", "8");
+
+    // our consumers drop the messages we publish under our own app id
+    message::set_app_id("messaging_recovery_test");
+
+    throwing_handlers();
+    local_delivery(standin);
+
+    const string_t spool_dir = (temp_directory_path() / unique_path("algol-recovery-test-%%%%-%%%%")).string();
+    link_loss(standin, spool_dir);
+
+    // the consumers wait for their deliveries to be handled before they go
+    boost::thread shutdown([]() -> void { station::singleton().shutdown(); });
+    const bool is_shut_down = shutdown.timed_join(boost::posix_time::milliseconds(timeout_ms));
+    soft_assert("the station shuts down", is_shut_down);
+
+    if (!is_shut_down) {
+      shutdown.detach();
+      return failed;
+    }
+
+    standin.stop();
+    remove_all(spool_dir);
+
+    return result_;
+  }
+
+  void messaging_recovery_test::throwing_handlers() {
+    throwing_subscriber subscriber;
+    soft_assert("subscribing", subscriber.subscribe(exchange, "throwing", 0, 0));
+
+    for (int i = 0; i < nr_messages; ++i)
+      subscriber.send(message("payload " + utility::stringify(i)), exchange, "throwing");
+
+    // the prefetch window would be used up by the deliveries whose handlers
+    // threw if they weren't accounted for
+    soft_assert("every message is handled", wait_for(subscriber.nr_handled, nr_messages));
+    soft_assert("no message is handled twice", subscriber.nr_handled == nr_messages);
+
+    soft_assert("unsubscribing", subscriber.unsubscribe(exchange, "throwing"));
+  }
+
+  void messaging_recovery_test::local_delivery(amqp_standin& standin) {
+    // the channels opened from now on deliver to the local subscribers in-process
+    station::singleton().set_option("loopback", "on");
+
+    counting_subscriber subscriber;
+    soft_assert("subscribing", subscriber.subscribe(looped_exchange, "looped", 0, 0));
+
+    const uint64_t nr_routed = standin.nr_routed();
+
+    for (int i = 0; i < nr_messages; ++i)
+      subscriber.send(message("looped #" + utility::stringify(i)), looped_exchange, "looped");
+
+    soft_assert("the messages are received in-process", wait_for(subscriber.nr_distinct, nr_messages));
+
+    // a copy going through the broker would be dropped by our own consumer, if at all
+    boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+    soft_assert("the messages are received once", subscriber.nr_received == nr_messages);
+    soft_assert("the messages delivered locally don't reach the broker", standin.nr_routed() == nr_routed);
+
+    soft_assert("unsubscribing", subscriber.unsubscribe(looped_exchange, "looped"));
+
+    station::singleton().set_option("loopback", "off");
+  }
+
+  void messaging_recovery_test::link_loss(amqp_standin& standin, string_t const& spool_dir) {
+    // the channels opened from now on publish through a spool
+    station::singleton().set_option("spool_dir", spool_dir);
+
+    counting_subscriber subscriber;
+    soft_assert("subscribing", subscriber.subscribe(spooled_exchange, "spooled", 0, 0));
+
+    for (int i = 0; i < nr_messages; ++i)
+      subscriber.send(message("before #" + utility::stringify(i)), spooled_exchange, "spooled");
+
+    soft_assert("the messages sent before the loss are received", wait_for(subscriber.nr_distinct, nr_messages));
+
+    standin.drop_connections();
+
+    // spooled while the links are down, and replayed once they're reopened
+    for (int i = 0; i < nr_messages; ++i)
+      subscriber.send(message("after #" + utility::stringify(i)), spooled_exchange, "spooled");
+
+    soft_assert("the spool drains once the channel is reopened, and consumed once the consumer is restarted",
+      wait_for(subscriber.nr_distinct, 2 * nr_messages));
+
+    soft_assert("unsubscribing", subscriber.unsubscribe(spooled_exchange, "spooled"));
+
+    station::singleton().set_option("spool_dir", "");
+  }
+
+}
@@ -0,0 +1,53 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef H_ALGOL_messaging_recovery_test_H
+#define H_ALGOL_messaging_recovery_test_H
+
+#include "test.hpp"
+#include "algol/algol.hpp"
+
+namespace algol {
+
+  class amqp_standin;
+
+  /**
+   * Runs the station against a local amqp_standin, and checks that it keeps
+   * going through the failures it's expected to survive.
+   */
+	class messaging_recovery_test : public test {
+	public:
+		messaging_recovery_test();
+		virtual ~messaging_recovery_test();
+
+    int run(int argc, char** argv);
+
+	protected:
+    /** handlers that throw must not stall their consumer, nor its shutdown */
+    void throwing_handlers();
+
+    /** with the loopback on, a direct queue's local subscribers must get its messages once */
+    void local_delivery(amqp_standin&);
+
+    /**
+     * the channel and its consumer must be reopened on new connections once
+     * theirs are lost, and the spool must drain through them
+     */
+    void link_loss(amqp_standin&, string_t const& spool_dir);
+	};
+
+}
+#endif
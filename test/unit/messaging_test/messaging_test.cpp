@@ -18,9 +18,11 @@
 #include "messaging_test/messaging_test.hpp"
 #include "algol/messaging/station.hpp"
 #include "algol/messaging/message.hpp"
+#include "algol/messaging/requester.hpp"
 #include "algol/utility.hpp"
 #include "algol/file_manager.hpp"
 #include <boost/thread.hpp>
+#include <atomic>
 
 namespace algol {
 
@@ -33,6 +35,10 @@ namespace algol {
   static string_t  msg = "Hello World!";
   static string_t  data_path = "";
   static bool      accepting = true;
+  static bool      is_loopback = false;
+  static std::atomic<int> nr_received(0);
+  static bool      is_rpc = false;
+  static std::atomic<int> nr_replies(0);
   static string_t  app_id = algol_app().fqn;
 
   messaging_test::messaging_test()
@@ -55,6 +61,15 @@ namespace algol {
           is_listener = true;
           log_->infoStream() << "will be listening to queue 'test_queue' on exchange 'test_exchange'";
         }
+        else if (arg == "--loopback") {
+          // send to ourselves without a broker
+          is_loopback = true;
+          station::singleton().set_option("loopback", "only");
+        }
+        else if (arg == "--rpc") {
+          // send requests and wait for their replies; listeners reply to them
+          is_rpc = true;
+        }
         else if (arg == "--batch") {
           if (argc == i) {
             log_->errorStream() << "invalid argument '--batch', missing parameter (number of requests)";
@@ -150,7 +165,11 @@ namespace algol {
         }
       }
 
-      subscribe(exchange);
+      if (is_loopback) {
+        if (!subscribe(exchange, queue))
+          return failed;
+      } else
+        subscribe(exchange);
 
       boost::thread_group workers;
 
@@ -175,6 +194,23 @@ namespace algol {
         workers.create_thread([&, i, nr_requests_per_thread]() -> void {
           log_->infoStream() << "Worker[" << i << "]: sending " << nr_requests_per_thread << " requests.";
           log_->debugStream() << "Message dump:";
+          if (is_rpc) {
+            // keep them all in flight at once
+            std::vector<std::future<message> > replies;
+            for (int x = 0; x < nr_requests_per_thread; ++x)
+              replies.push_back(request(m, exchange, queue, sleep_sec * 1000));
+
+            for (auto& reply : replies) {
+              try {
+                if (reply.get().body() == m.body())
+                  ++nr_replies;
+              } catch (std::exception& e) {
+                log_->errorStream() << "Worker[" << i << "]: " << e.what();
+              }
+            }
+            return;
+          }
+
           for (int x = 0; x < nr_requests_per_thread; ++x) {
             send(m, exchange, queue);
           }
@@ -185,6 +221,20 @@ namespace algol {
 
       workers.join_all();
 
+      if (is_rpc) {
+        int nr_expected = nr_requests_per_thread * nr_threads;
+        log_->infoStream() << "received " << nr_replies << "/" << nr_expected << " replies";
+        result_ = nr_replies == nr_expected ? passed : failed;
+      }
+      else if (is_loopback) {
+        int nr_expected = nr_requests_per_thread * nr_threads;
+        for (int i = 0; i < sleep_sec * 10 && nr_received < nr_expected; ++i)
+          sleep(100 / 1000.0);
+
+        log_->infoStream() << "received " << nr_received << "/" << nr_expected << " messages over the loopback";
+        result_ = nr_received == nr_expected ? passed : failed;
+      }
+
     } else {
       log_->infoStream() << "Accepting messages for " << sleep_sec << " seconds";
       if (!subscribe(exchange, queue))
@@ -205,6 +255,16 @@ namespace algol {
   }
 
   void messaging_test::on_message_received(const message& msg) {
+    if (is_rpc && msg.has_header(requester::reply_queue_header)) {
+      reply(msg, message(msg.body()));
+      return;
+    }
+
+    if (is_loopback) {
+      ++nr_received;
+      return;
+    }
+
     if (msg.body() == "quit") {
       log_->infoStream() << "quitting";
       accepting = false;
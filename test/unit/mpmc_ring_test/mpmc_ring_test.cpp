@@ -0,0 +1,167 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mpmc_ring_test/mpmc_ring_test.hpp"
+#include "algol/messaging/mpmc_ring.hpp"
+#include "algol/utility.hpp"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <boost/thread.hpp>
+
+namespace algol {
+
+  static const int nr_producers = 4;
+  static const int nr_consumers = 4;
+  static const uint64_t nr_values = 100000; /// per producer
+
+  mpmc_ring_test::mpmc_ring_test() : test("mpmc_ring") {
+  }
+
+  mpmc_ring_test::~mpmc_ring_test() {
+  }
+
+  /** a value tagged with its producer, so the consumers can tell the producers apart */
+  static uint64_t tag(int producer, uint64_t i) {
+    return (uint64_t(producer) << 32) | i;
+  }
+
+  int mpmc_ring_test::run(int, char**) {
+    result_ = passed;
+
+    // the capacity is a power of two
+    {
+      mpmc_ring<int> ring(5);
+      soft_assert("the capacity is rounded up", ring.capacity() == 8);
+      soft_assert("a new ring is empty", ring.size() == 0);
+    }
+
+    // full and empty, over and over so the positions wrap around the slots
+    {
+      mpmc_ring<int> ring(8);
+      bool is_filled = true, is_refused = true, is_drained = true, is_ordered = true, is_empty = true;
+
+      for (int lap = 0; lap < 100; ++lap) {
+        for (int i = 0; i < 8; ++i)
+          is_filled = ring.push(lap * 8 + i) && is_filled;
+
+        is_refused = !ring.push(-1) && ring.size() == 8 && is_refused;
+
+        for (int i = 0; i < 8; ++i) {
+          int value = -1;
+          is_drained = ring.pop(value) && is_drained;
+          is_ordered = value == lap * 8 + i && is_ordered;
+        }
+
+        int value;
+        is_empty = !ring.pop(value) && ring.size() == 0 && is_empty;
+
+        // and half-way, so the next lap starts in the middle of the slots
+        for (int i = 0; i < 3; ++i)
+          ring.push(i);
+        for (int i = 0; i < 3; ++i)
+          ring.pop(value);
+      }
+
+      soft_assert("a ring holds as many values as its capacity", is_filled);
+      soft_assert("a full ring refuses values", is_refused);
+      soft_assert("every value is popped", is_drained);
+      soft_assert("the values are popped in order", is_ordered);
+      soft_assert("a drained ring is empty", is_empty);
+    }
+
+    // popped values aren't held on to by their slot
+    {
+      mpmc_ring<std::shared_ptr<int> > ring(2);
+      std::shared_ptr<int> value(new int(42)), popped;
+
+      ring.push(value);
+      ring.pop(popped);
+      popped.reset();
+
+      soft_assert("the slot lets go of a popped value", value.use_count() == 1);
+    }
+
+    // any number of producers and consumers, on a ring that's often full
+    {
+      mpmc_ring<uint64_t> ring(64);
+      std::atomic<uint64_t> nr_popped(0);
+      std::atomic<bool> is_ordered(true);
+      std::vector<std::atomic<uint64_t>*> counts; /// the times each value was popped, per producer
+
+      for (int p = 0; p < nr_producers; ++p) {
+        counts.push_back(new std::atomic<uint64_t>[nr_values]);
+        for (uint64_t i = 0; i < nr_values; ++i)
+          counts[p][i] = 0;
+      }
+
+      boost::thread_group threads;
+
+      for (int p = 0; p < nr_producers; ++p) {
+        threads.create_thread([&ring, p]() -> void {
+          for (uint64_t i = 0; i < nr_values; ++i) {
+            while (!ring.push(tag(p, i)))
+              boost::this_thread::yield();
+          }
+        });
+      }
+
+      for (int c = 0; c < nr_consumers; ++c) {
+        threads.create_thread([&]() -> void {
+          // a consumer pops the values of a producer in the order they were pushed
+          std::vector<int64_t> last(nr_producers, -1);
+
+          while (nr_popped < nr_producers * nr_values) {
+            uint64_t value;
+            if (!ring.pop(value)) {
+              boost::this_thread::yield();
+              continue;
+            }
+
+            const int p = value >> 32;
+            const int64_t i = value & 0xffffffff;
+            if (i <= last[p])
+              is_ordered = false;
+            last[p] = i;
+
+            ++counts[p][i];
+            ++nr_popped;
+          }
+        });
+      }
+
+      threads.join_all();
+
+      bool is_exactly_once = true;
+      for (int p = 0; p < nr_producers; ++p) {
+        for (uint64_t i = 0; i < nr_values; ++i)
+          is_exactly_once = is_exactly_once && counts[p][i] == 1;
+
+        delete [] counts[p];
+      }
+
+      soft_assert("every value is popped: " + utility::stringify(nr_popped.load()), nr_popped == nr_producers * nr_values);
+      soft_assert("every value is popped once", is_exactly_once);
+      soft_assert("a consumer gets a producer's values in order", is_ordered);
+      soft_assert("the ring is left empty", ring.size() == 0);
+    }
+
+    return result_;
+  }
+
+}
@@ -0,0 +1,136 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "requester_test/requester_test.hpp"
+#include "algol/messaging/station.hpp"
+#include "algol/messaging/communicator.hpp"
+#include "algol/exception.hpp"
+#include "algol/utility.hpp"
+
+#include <chrono>
+#include <vector>
+#include <boost/thread.hpp>
+
+namespace algol {
+
+  static const string_t exchange = "requester_test_exchange";
+  static const int nr_requests = 1000;
+
+  requester_test::requester_test() : test("requester") {
+  }
+
+  requester_test::~requester_test() {
+  }
+
+  /** replies to the requests on the "answered" queue, and leaves the others be */
+  class responder : public communicator {
+  protected:
+    virtual void on_message_received(const message& msg) {
+      if (msg.get_queue() == "answered")
+        reply(msg, message(msg.body()));
+    }
+  };
+
+  /** @return whether the future throws an exception of the given type */
+  template <typename E>
+  static bool throws(std::future<message>& reply) {
+    try {
+      reply.get();
+    } catch (E&) {
+      return true;
+    } catch (...) {
+    }
+
+    return false;
+  }
+
+  static bool is_ready(std::future<message>& reply, int within_ms) {
+    return reply.wait_for(std::chrono::milliseconds(within_ms)) == std::future_status::ready;
+  }
+
+  static uint64_t timeouts() {
+    return monitor::singleton().stat(requester::stat_timeouts);
+  }
+
+  int requester_test::run(int, char**) {
+    result_ = passed;
+
+    // no broker; the requests and their replies go through the loopback
+    station::singleton().set_option("loopback", "only");
+
+    responder r;
+    soft_assert("subscribing to the answered queue", r.subscribe(exchange, "answered", 0, 0));
+    soft_assert("subscribing to the ignored queue", r.subscribe(exchange, "ignored", 0, 0));
+
+    // a reply settles the request before its deadline, which then goes by quietly
+    {
+      const uint64_t nr_timeouts = timeouts();
+
+      std::future<message> reply = r.request(message("ping"), exchange, "answered", 200);
+      soft_assert("the reply arrives", is_ready(reply, 2000) && reply.get().body() == "ping");
+
+      boost::this_thread::sleep(boost::posix_time::milliseconds(400));
+      soft_assert("a replied request doesn't time out", timeouts() == nr_timeouts);
+    }
+
+    // a request times out, but not before its deadline
+    {
+      std::future<message> reply = r.request(message("ping"), exchange, "ignored", 300);
+
+      soft_assert("a request is pending until its deadline", !is_ready(reply, 200));
+      soft_assert("a request times out past its deadline", is_ready(reply, 2000) && throws<request_timeout>(reply));
+    }
+
+    // every one of many deadlines, spread over the slots of the wheel, is met
+    {
+      std::vector<std::future<message> > replies;
+      for (int i = 0; i < nr_requests; ++i)
+        replies.push_back(r.request(message("ping"), exchange, "ignored", 10 + (i * 7) % 1000));
+
+      bool is_expired = true;
+      for (auto& reply : replies)
+        is_expired = is_ready(reply, 3000) && throws<request_timeout>(reply) && is_expired;
+
+      soft_assert("every request times out", is_expired);
+      soft_assert("the timed out requests are forgotten", station::singleton().requests().nr_pending() == 0);
+    }
+
+    // a deadline further away than a lap of the wheel (512 ticks) goes around it
+    {
+      const int timeout_ms = 512 * requester::tick_ms + 1000;
+
+      std::future<message> reply = r.request(message("ping"), exchange, "ignored", timeout_ms);
+
+      soft_assert("a request is pending when its slot first comes around", !is_ready(reply, 2000));
+      soft_assert("a request times out on the lap of its deadline", is_ready(reply, timeout_ms) && throws<request_timeout>(reply));
+    }
+
+    // a request without a deadline waits for as long as it takes
+    std::future<message> forever = r.request(message("ping"), exchange, "ignored", 0);
+    soft_assert("a request without a timeout doesn't expire", !is_ready(forever, 500));
+
+    soft_assert("unsubscribing from the answered queue", r.unsubscribe(exchange, "answered"));
+    soft_assert("unsubscribing from the ignored queue", r.unsubscribe(exchange, "ignored"));
+
+    station::singleton().shutdown();
+
+    soft_assert("shutting down fails the pending requests", is_ready(forever, 0) && throws<request_failed>(forever));
+
+    return result_;
+  }
+
+}
@@ -0,0 +1,124 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "routing_trie_test/routing_trie_test.hpp"
+#include "algol/messaging/routing_trie.hpp"
+
+#include <algorithm>
+
+namespace algol {
+
+  routing_trie_test::routing_trie_test() : test("routing_trie") {
+  }
+
+  routing_trie_test::~routing_trie_test() {
+  }
+
+  /** the patterns, bound to their position + 1 */
+  static const char* patterns[] = {
+    "orders.us.eu",
+    "orders.*.eu",
+    "orders.#",
+    "#.eu",
+    "*.*",
+    "a.#.b",
+    "*",
+    "#"
+  };
+
+  static const size_t nr_patterns = sizeof(patterns) / sizeof(patterns[0]);
+
+  /** the patterns that match the key */
+  static std::vector<string_t> match(routing_trie const& trie, string_t const& key) {
+    std::vector<atom_t> bindings;
+    trie.match(key, bindings);
+
+    std::vector<string_t> matched;
+    for (auto binding : bindings)
+      matched.push_back(patterns[binding - 1]);
+
+    std::sort(matched.begin(), matched.end());
+    return matched;
+  }
+
+  static std::vector<string_t> expect(std::vector<string_t> matched) {
+    std::sort(matched.begin(), matched.end());
+    return matched;
+  }
+
+  int routing_trie_test::run(int, char**) {
+    result_ = passed;
+
+    routing_trie trie;
+    for (size_t i = 0; i < nr_patterns; ++i)
+      trie.bind(patterns[i], i + 1);
+    trie.compile();
+
+    soft_assert("every binding is kept", trie.size() == nr_patterns);
+
+    soft_assert("literal words match themselves, '*' one word, '#' any",
+      match(trie, "orders.us.eu") == expect({ "orders.us.eu", "orders.*.eu", "orders.#", "#.eu", "#" }));
+
+    soft_assert("'*' doesn't match zero words",
+      match(trie, "orders.eu") == expect({ "orders.#", "#.eu", "*.*", "#" }));
+
+    soft_assert("'*' doesn't match two words",
+      match(trie, "orders.us.west.eu") == expect({ "orders.#", "#.eu", "#" }));
+
+    soft_assert("'#' matches zero words",
+      match(trie, "orders") == expect({ "orders.#", "*", "#" }));
+
+    soft_assert("'#' matches many words in the middle",
+      match(trie, "a.x.y.z.b") == expect({ "a.#.b", "#" }));
+
+    soft_assert("'#' matches no word in the middle",
+      match(trie, "a.b") == expect({ "a.#.b", "*.*", "#" }));
+
+    soft_assert("words are matched whole",
+      match(trie, "order.us.eu") == expect({ "#.eu", "#" }));
+
+    soft_assert("only '#' matches an empty key", match(trie, "") == expect({ "#" }));
+
+    // a binding is reported once, however many of its patterns match
+    {
+      routing_trie shared;
+      shared.bind("x.#", 1);
+      shared.bind("*.y", 1);
+      shared.bind("x.y", 1);
+      shared.bind("#", 2);
+      shared.compile();
+
+      std::vector<atom_t> bindings;
+      shared.match("x.y", bindings);
+      std::sort(bindings.begin(), bindings.end());
+
+      soft_assert("bindings are reported once", bindings == std::vector<atom_t>({ 1, 2 }));
+    }
+
+    {
+      routing_trie empty;
+      empty.compile();
+
+      std::vector<atom_t> bindings;
+      empty.match("orders.us.eu", bindings);
+      soft_assert("an empty trie matches nothing", bindings.empty() && empty.size() == 0);
+    }
+
+    return result_;
+  }
+
+}
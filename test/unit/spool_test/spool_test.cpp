@@ -0,0 +1,248 @@
+/* libalgol - a collection of plug-ins for developing back-end C++ web tools
+ * Copyright (c) 2013 Algol Labs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spool_test/spool_test.hpp"
+#include "algol/messaging/spool.hpp"
+#include "algol/messaging/station.hpp"
+#include "algol/utility.hpp"
+
+#include <fstream>
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+namespace algol {
+
+  /** the layout of a segment, see spool.cpp */
+  static const size_t header_size = 32;
+  static const size_t prefix_size = 8;
+
+  static const int nr_messages = 10;
+
+  /** what a sink was handed, in order */
+  struct replayed_t {
+    std::vector<string_t> ids;
+    uint64_t last_tag;
+    boost::mutex mtx;
+
+    replayed_t() : last_tag(0) {}
+
+    size_t size() {
+      boost::mutex::scoped_lock lock(mtx);
+      return ids.size();
+    }
+  };
+
+  /** reads a segment file, and finds where its records start */
+  static bool read_segment(string_t const& directory, string_t& path, string_t& data, std::vector<size_t>& records) {
+    using namespace boost::filesystem;
+
+    for (directory_iterator it(directory), end_it; it != end_it; ++it) {
+      if (it->path().extension() == ".spool")
+        path = it->path().string();
+    }
+
+    if (path.empty())
+      return false;
+
+    std::ifstream in(path.c_str(), std::ios::binary);
+    data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+    size_t offset = header_size;
+    while (data.size() - offset >= prefix_size) {
+      const unsigned char *p = (const unsigned char*) data.data() + offset;
+      const uint32_t size = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+      if (size == 0)
+        break;
+
+      records.push_back(offset);
+      offset += prefix_size + size;
+    }
+
+    return true;
+  }
+
+  spool_test::spool_test() : test("spool") {
+  }
+
+  spool_test::~spool_test() {
+  }
+
+  bool spool_test::fill(string_t const& directory) {
+    spool s(directory, "spool_test");
+
+    // nothing is replayed, it's all left for the next run
+    if (!s.open([](const message&, string_t const&, uint64_t, uint64_t&) { return false; }))
+      return false;
+
+    for (int i = 0; i < nr_messages; ++i) {
+      message m("message #" + utility::stringify(i));
+      m.set_message_id("m" + utility::stringify(i));
+      if (s.append(m, "spool_test_queue", 1000 + i) != comm_rc::spooled)
+        return false;
+    }
+
+    bool filled = s.backlog() == nr_messages;
+    s.close();
+    return filled;
+  }
+
+  size_t spool_test::replay(string_t const& directory, size_t expected) {
+    replayed_t replayed;
+    spool s(directory, "spool_test");
+
+    s.open([&](const message& msg, string_t const& queue, uint64_t sent_us, uint64_t& tag) {
+      message m(msg);
+      boost::mutex::scoped_lock lock(replayed.mtx);
+
+      soft_assert("a replayed message goes to its queue", queue == "spool_test_queue");
+      soft_assert("a replayed message keeps its send time", sent_us == 1000 + replayed.ids.size());
+
+      replayed.ids.push_back(m.get_message_id());
+      tag = ++replayed.last_tag;
+      return true;
+    });
+
+    const size_t recovered = s.backlog();
+    soft_assert("the recovered messages are awaiting replay", recovered == expected);
+
+    for (int i = 0; i < 500 && replayed.size() < expected; ++i)
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+
+    {
+      boost::mutex::scoped_lock lock(replayed.mtx);
+      soft_assert("every recovered message is replayed once", replayed.ids.size() == expected);
+      for (size_t i = 0; i < replayed.ids.size(); ++i)
+        soft_assert("the messages are replayed in order", replayed.ids[i] == "m" + utility::stringify(i));
+
+      // the spool moves past them once they're confirmed
+      s.confirm(replayed.last_tag, true);
+    }
+
+    for (int i = 0; i < 500 && s.backlog() > 0; ++i)
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+
+    soft_assert("the confirmed messages leave the backlog", s.backlog() == 0);
+
+    s.close();
+    return recovered;
+  }
+
+  int spool_test::run(int, char**) {
+    using namespace boost::filesystem;
+
+    result_ = passed;
+
+    station::config_t& config = station::singleton().config;
+    config.spool_segment_bytes = 64 * 1024;
+    config.spool_max_bytes = 0;
+    config.spool_commit_ms = 5;
+    config.spool_durable = false;
+
+    const string_t directory = (temp_directory_path() / unique_path("algol-spool-test-%%%%-%%%%")).string();
+
+    // a record that was being written when the process died
+    {
+      if (!fill(directory)) {
+        log_->errorStream() << "unable to fill the spool at " << directory;
+        return failed;
+      }
+
+      string_t path, data;
+      std::vector<size_t> records;
+      soft_assert("the spool is written to a segment", read_segment(directory, path, data, records));
+      soft_assert("every message is written", records.size() == nr_messages);
+
+      if (records.size() == nr_messages) {
+        resize_file(path, records.back() + prefix_size + 4);
+        replay(directory, nr_messages - 1);
+      }
+
+      soft_assert("the replayed segments are deleted", is_empty(directory));
+    }
+
+    // a record whose checksum doesn't match when it's read back
+    {
+      if (!fill(directory)) {
+        log_->errorStream() << "unable to fill the spool at " << directory;
+        return failed;
+      }
+
+      string_t path, data;
+      std::vector<size_t> records;
+      read_segment(directory, path, data, records);
+
+      if (records.size() == nr_messages) {
+        std::fstream file(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(records[5] + prefix_size + 3);
+        file.put(~data[records[5] + prefix_size + 3]);
+        file.close();
+
+        // the rest of the segment can't be trusted past it
+        replay(directory, 5);
+      }
+
+      soft_assert("the replayed segments are deleted", is_empty(directory));
+    }
+
+    // confirms that arrive while the sink is still sending, as they do on the
+    // reactor thread while the drainer is blocked on a busy connection
+    {
+      if (!fill(directory)) {
+        log_->errorStream() << "unable to fill the spool at " << directory;
+        return failed;
+      }
+
+      spool s(directory, "spool_test");
+      uint64_t last_tag = 0;
+
+      s.open([&](const message&, string_t const&, uint64_t, uint64_t& tag) {
+        tag = ++last_tag;
+
+        boost::thread reactor([&s, tag]() -> void { s.confirm(tag, tag % 2 == 0); });
+        return reactor.timed_join(boost::posix_time::milliseconds(1000));
+      });
+
+      for (int i = 0; i < 500 && s.backlog() > 0; ++i)
+        boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+
+      soft_assert("the messages confirmed before their tag was known leave the backlog", s.backlog() == 0);
+      s.close();
+
+      soft_assert("the replayed segments are deleted", is_empty(directory));
+    }
+
+    // a spool is held by a single owner at a time
+    {
+      auto sink = [](const message&, string_t const&, uint64_t, uint64_t&) { return false; };
+      spool owner(directory, "spool_test"), other(directory, "spool_test");
+
+      soft_assert("the spool opens", owner.open(sink));
+      soft_assert("a spool of the same name can't be opened meanwhile", !other.open(sink));
+
+      owner.close();
+      soft_assert("it can once the owner is closed", other.open(sink));
+      other.close();
+
+      soft_assert("the lock is deleted on closing", is_empty(directory));
+    }
+
+    remove_all(directory);
+
+    return result_;
+  }
+
+}
@@ -101,8 +101,12 @@ namespace algol {
      *
      * If the condition is false, the test will NOT abort.
      */
-    void soft_assert(string_t, bool) {
+    void soft_assert(string_t state, bool condition) {
       // TODO: track state
+      if (!condition) {
+        log_->errorStream() << "assertion failed: " << state;
+        result_ = failed;
+      }
     }
 
     /**